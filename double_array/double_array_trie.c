@@ -134,8 +134,34 @@ static int da_find_base(da_trie_t *da, da_index_t parent, const uint8_t *codes,
         if (codes[i] > maxc) maxc = codes[i];
     }
 
-    /* 1 からスキャン: 低いインデックスを詰めた方が RAM/ROM に有利 */
-    for (da_index_t b = 1; b > 0; b++) {
+    /*
+     * 1 からスキャン: 低いインデックスを詰めた方が RAM/ROM に有利
+     *
+     * free_hint より前は使用中なので、b + minc < free_hint となる b は、そのスロットが
+     * この親の子（old_base + 子コード 以上）でない限り使えない。その範囲を飛ばしても
+     * 見つかる base は 1 から走査した場合と同じ。
+     */
+    uint8_t minc = 0xFFu;
+    for (size_t i = 0; i < n; i++) {
+        if (codes[i] < minc) minc = codes[i];
+    }
+    while (da->free_hint < da->capacity && (da->free_hint == 0 || da->check[da->free_hint] != 0)) {
+        da->free_hint++;
+    }
+    size_t start = (da->free_hint > (size_t)minc) ? da->free_hint - (size_t)minc : 1u;
+    da_index_t old_base = da->base[parent];
+    if (old_base > 0) {
+        uint8_t codes_old[DA_ALPHABET_SIZE];
+        size_t n_old = da_collect_children_codes(da, parent, codes_old);
+        if (n_old > 0) {
+            size_t own = (size_t)old_base + (size_t)codes_old[0];
+            own = (own > (size_t)minc) ? own - (size_t)minc : 1u;
+            if (own < start) start = own;
+        }
+    }
+    if (start < 1u) start = 1u;
+
+    for (da_index_t b = (da_index_t)start; b > 0; b++) {
         size_t need = (size_t)b + (size_t)maxc + 1u;
         int rc = da_reserve(da, need);
         if (rc != DA_OK) return rc;
@@ -189,6 +215,7 @@ static int da_relocate_children(da_trie_t *da, da_index_t parent, da_index_t new
         size_t o = (size_t)old_idx[i];
         da->base[o] = 0;
         da->check[o] = 0;
+        if (o < da->free_hint) da->free_hint = o;
     }
 
     /* 新スロットに書き込み */
@@ -364,6 +391,7 @@ int da_trie_clear(da_trie_t *da) {
     /* ルートは占有済みにする */
     da->base[DA_ROOT] = 1;
     da->check[DA_ROOT] = DA_ROOT;
+    da->free_hint = 0;
 
     return DA_OK;
 }
@@ -56,6 +56,9 @@ typedef struct {
     da_index_t *check;   /* CHECK 配列 */
     size_t capacity;     /* エントリ数（容量） */
 
+    /* これより前のスロットはすべて使用中（da_find_base の探索開始位置、構築時のみ使用） */
+    size_t free_hint;
+
     /* 非ゼロの場合、このインスタンスがメモリを所有し、malloc/calloc で拡張可能 */
     int dynamic;
 } da_trie_t;
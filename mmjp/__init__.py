@@ -6,10 +6,11 @@ Example:
     >>> import mmjp
     >>> m = mmjp.Model("model.bin")
     >>> m.tokenize("東京都に住んでいます")
+    >>> m.encode("東京都に住んでいます")  # array('H') of piece IDs
 """
 
-from ._mmjp import Model  # noqa: F401
+from ._mmjp import Model, UNK_ID  # noqa: F401
 
-__all__ = ["Model"]
+__all__ = ["Model", "UNK_ID"]
 
 __version__ = "0.1.1"
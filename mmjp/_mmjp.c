@@ -6,7 +6,13 @@
 #include <string.h>
 #include <time.h>
 
+#ifndef MMJP_NO_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
 #include "../tools/mmjp_model.h"
+#include "../tools/mmjp_cache.h"
 #include "../npycrf_lite/npycrf_lite.h"
 
 /* ------------------------------
@@ -31,6 +37,33 @@ static uint32_t default_seed(void) {
   return s;
 }
 
+static int text_as_utf8(PyObject *text_obj, const uint8_t **utf8, Py_ssize_t *len) {
+  if (PyUnicode_Check(text_obj)) {
+    *utf8 = (const uint8_t *)PyUnicode_AsUTF8AndSize(text_obj, len);
+    if (!*utf8) return -1;
+    return 0;
+  }
+  if (PyBytes_Check(text_obj)) {
+    *utf8 = (const uint8_t *)PyBytes_AS_STRING(text_obj);
+    *len = PyBytes_GET_SIZE(text_obj);
+    return 0;
+  }
+  PyErr_SetString(PyExc_TypeError, "text must be str or bytes");
+  return -1;
+}
+
+/* acquire self->lock without holding the GIL while we wait */
+#define MMJP_LOCK(self)                                   \
+  do {                                                    \
+    if (!PyThread_acquire_lock((self)->lock, NOWAIT_LOCK)) { \
+      Py_BEGIN_ALLOW_THREADS                              \
+      PyThread_acquire_lock((self)->lock, WAIT_LOCK);     \
+      Py_END_ALLOW_THREADS                                \
+    }                                                     \
+  } while (0)
+
+#define MMJP_UNLOCK(self) PyThread_release_lock((self)->lock)
+
 /* ------------------------------
  * Python object
  * ------------------------------ */
@@ -40,6 +73,13 @@ typedef struct {
   mmjp_loaded_model_t model;
   int model_loaded;
 
+  /*
+   * Guards the per-object buffers below. The decode itself runs with the
+   * GIL released, so concurrent calls on one Model serialize here instead
+   * of racing on self->wk.
+   */
+  PyThread_type_lock lock;
+
   uint16_t max_n_cp;
 
   /* work */
@@ -66,9 +106,19 @@ typedef struct {
   npycrf_score_t *score_arr;
   size_t score_cap;
   uint16_t nbest_last;
+
+  /* 1-best result cache (cache_size=0 disables it); locks internally */
+  mmjp_cache_t cache;
+
+  /* decoder counters of earlier work generations and finished batches (NPYCRF_STATS) */
+  npycrf_stats_t stats;
 } PyMMJPModel;
 
 static void PyMMJPModel_dealloc(PyMMJPModel *self) {
+  if (self->lock) {
+    PyThread_free_lock(self->lock);
+    self->lock = NULL;
+  }
   if (self->model_loaded) {
     mmjp_model_free(&self->model);
     self->model_loaded = 0;
@@ -81,6 +131,7 @@ static void PyMMJPModel_dealloc(PyMMJPModel *self) {
   free(self->b_cp_flat);
   free(self->bcount_arr);
   free(self->score_arr);
+  mmjp_cache_free(&self->cache);
   Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
@@ -136,7 +187,13 @@ static int ensure_work(PyMMJPModel *self, Py_ssize_t utf8_len) {
   self->b_bytes = new_bbytes;
   self->b_cap = new_bcap;
 
-  /* init work */
+  /* init work (clears the decoder counters, so keep them first) */
+  if (self->max_n_cp && self->workbuf) {
+    npycrf_stats_t cur;
+    npycrf_stats_get(&self->wk, &cur);
+    npycrf_stats_add(&self->stats, &cur);
+    self->stats.regrows++;
+  }
   int rc = npycrf_work_init(&self->wk,
                            self->workbuf,
                            self->workcap,
@@ -173,21 +230,10 @@ static int ensure_samplebuf(PyMMJPModel *self) {
   return 0;
 }
 
-static int ensure_nbest(PyMMJPModel *self, uint16_t nbest) {
-  if (nbest == 0) nbest = 1;
-  size_t need = npycrf_nbestbuf_size(self->max_n_cp, self->model.m.max_word_len, nbest);
-  if (!self->nbestbuf || self->nbestcap < need) {
-    uint8_t *p = (uint8_t *)realloc(self->nbestbuf, need);
-    if (!p) {
-      PyErr_NoMemory();
-      return -1;
-    }
-    self->nbestbuf = p;
-    self->nbestcap = need;
-  }
-
+/* flat output for n candidates (n-best / multi-sample) */
+static int ensure_flat(PyMMJPModel *self, size_t n) {
   size_t out_b_cap = (size_t)self->max_n_cp + 1u;
-  size_t flat_need = out_b_cap * (size_t)nbest;
+  size_t flat_need = out_b_cap * n;
   if (!self->b_cp_flat || self->bcp_flat_cap < flat_need) {
     uint16_t *p = (uint16_t *)realloc(self->b_cp_flat, flat_need * sizeof(uint16_t));
     if (!p) {
@@ -197,25 +243,40 @@ static int ensure_nbest(PyMMJPModel *self, uint16_t nbest) {
     self->b_cp_flat = p;
     self->bcp_flat_cap = flat_need;
   }
-  if (!self->bcount_arr || self->bcount_cap < (size_t)nbest) {
-    size_t *p = (size_t *)realloc(self->bcount_arr, (size_t)nbest * sizeof(size_t));
+  if (!self->bcount_arr || self->bcount_cap < n) {
+    size_t *p = (size_t *)realloc(self->bcount_arr, n * sizeof(size_t));
     if (!p) {
       PyErr_NoMemory();
       return -1;
     }
     self->bcount_arr = p;
-    self->bcount_cap = (size_t)nbest;
+    self->bcount_cap = n;
   }
-  if (!self->score_arr || self->score_cap < (size_t)nbest) {
-    npycrf_score_t *p = (npycrf_score_t *)realloc(self->score_arr, (size_t)nbest * sizeof(npycrf_score_t));
+  if (!self->score_arr || self->score_cap < n) {
+    npycrf_score_t *p = (npycrf_score_t *)realloc(self->score_arr, n * sizeof(npycrf_score_t));
     if (!p) {
       PyErr_NoMemory();
       return -1;
     }
     self->score_arr = p;
-    self->score_cap = (size_t)nbest;
+    self->score_cap = n;
   }
+  return 0;
+}
 
+static int ensure_nbest(PyMMJPModel *self, uint16_t nbest) {
+  if (nbest == 0) nbest = 1;
+  size_t need = npycrf_nbestbuf_size(self->max_n_cp, self->model.m.max_word_len, nbest);
+  if (!self->nbestbuf || self->nbestcap < need) {
+    uint8_t *p = (uint8_t *)realloc(self->nbestbuf, need);
+    if (!p) {
+      PyErr_NoMemory();
+      return -1;
+    }
+    self->nbestbuf = p;
+    self->nbestcap = need;
+  }
+  if (ensure_flat(self, nbest) != 0) return -1;
   self->nbest_last = nbest;
   return 0;
 }
@@ -247,6 +308,18 @@ static PyObject *tokens_from_bbytes(const uint8_t *utf8, Py_ssize_t len,
   return out;
 }
 
+/* array.array type, imported at module init for encode() */
+static PyObject *array_type = NULL;
+
+/* array('H', ...) from n piece IDs */
+static PyObject *ids_to_array(const npycrf_id_t *ids, size_t n) {
+  PyObject *raw = PyBytes_FromStringAndSize((const char *)ids, (Py_ssize_t)(n * sizeof(npycrf_id_t)));
+  if (!raw) return NULL;
+  PyObject *arr = PyObject_CallFunction(array_type, "sO", "H", raw);
+  Py_DECREF(raw);
+  return arr;
+}
+
 static PyObject *tokens_with_offsets_from_bounds(const uint8_t *utf8, Py_ssize_t len,
                                                 const uint16_t *b_cp,
                                                 const uint16_t *b_bytes,
@@ -292,6 +365,157 @@ static PyObject *tokens_with_offsets_from_bounds(const uint8_t *utf8, Py_ssize_t
 }
 
 
+/* ------------------------------
+ * Batch decode
+ *  - texts are converted to UTF-8 up front (GIL held)
+ *  - workers decode with their own workspaces (GIL released)
+ *  - Python lists are built only after all workers finish
+ * ------------------------------ */
+
+/* items claimed per lock acquisition */
+#define MMJP_BATCH_CHUNK 8u
+
+typedef struct {
+  const uint8_t *utf8;
+  size_t len;
+  int worker;   /* which worker's bnd[] holds the result */
+  size_t off;   /* offset into that bnd[] */
+  size_t count; /* boundary count */
+  int rc;
+} batch_item_t;
+
+typedef struct {
+  const npycrf_model_t *m;
+  mmjp_cache_t *cache;
+  batch_item_t *items;
+  size_t n_items;
+  size_t next;
+#ifndef MMJP_NO_THREADS
+  pthread_mutex_t mu;
+#endif
+} batch_shared_t;
+
+typedef struct {
+  batch_shared_t *sh;
+  int id;
+
+  npycrf_work_t wk;
+  uint8_t *workbuf;
+  size_t workcap;
+  uint16_t max_n_cp;
+  uint16_t *b_cp;
+  size_t b_cap;
+
+  /* byte boundaries of every item this worker decoded */
+  uint16_t *bnd;
+  size_t bnd_len;
+  size_t bnd_cap;
+
+  /* counters of earlier wk generations */
+  npycrf_stats_t stats;
+} batch_worker_t;
+
+static void batch_worker_free(batch_worker_t *w) {
+  free(w->workbuf);
+  free(w->b_cp);
+  free(w->bnd);
+}
+
+/* same sizing policy as ensure_work(), without touching Python state */
+static int batch_worker_reserve(batch_worker_t *w, size_t utf8_len) {
+  const npycrf_model_t *m = w->sh->m;
+  uint32_t need_cp32 = (utf8_len > 0) ? (uint32_t)((utf8_len > 60000u) ? 60000u : utf8_len) : 1u;
+  uint16_t need_cp = (uint16_t)need_cp32;
+  if (need_cp < 64u) need_cp = 64u;
+  if (w->workbuf && w->max_n_cp >= need_cp) return 0;
+
+  uint16_t new_max = w->max_n_cp ? w->max_n_cp : 1024u;
+  while (new_max < need_cp && new_max < 60000u) {
+    uint32_t doubled = (uint32_t)new_max * 2u;
+    new_max = (doubled > 60000u) ? 60000u : (uint16_t)doubled;
+  }
+  if (new_max < need_cp) new_max = need_cp;
+
+  size_t need_work = npycrf_workbuf_size(new_max, m->max_word_len);
+  uint8_t *nw = (uint8_t *)realloc(w->workbuf, need_work);
+  if (!nw) return -1;
+  w->workbuf = nw;
+  w->workcap = need_work;
+
+  size_t new_bcap = (size_t)new_max + 1u;
+  uint16_t *nb = (uint16_t *)realloc(w->b_cp, new_bcap * sizeof(uint16_t));
+  if (!nb) return -1;
+  w->b_cp = nb;
+  w->b_cap = new_bcap;
+
+  if (w->max_n_cp) {
+    npycrf_stats_t cur;
+    npycrf_stats_get(&w->wk, &cur);
+    npycrf_stats_add(&w->stats, &cur);
+    w->stats.regrows++;
+  }
+  if (npycrf_work_init(&w->wk, w->workbuf, w->workcap, new_max, m->max_word_len) != 0) return -1;
+  w->max_n_cp = new_max;
+  return 0;
+}
+
+static void batch_decode_item(batch_worker_t *w, batch_item_t *it) {
+  it->worker = w->id;
+  it->off = w->bnd_len;
+  it->count = 0;
+  if (batch_worker_reserve(w, it->len) != 0) {
+    it->rc = -2;
+    return;
+  }
+
+  /* room for the worst case (one boundary per codepoint) before decoding into bnd[] */
+  if (w->bnd_len + w->b_cap > w->bnd_cap) {
+    size_t nc = w->bnd_cap ? w->bnd_cap : 1024u;
+    while (nc < w->bnd_len + w->b_cap) nc *= 2u;
+    uint16_t *nb = (uint16_t *)realloc(w->bnd, nc * sizeof(uint16_t));
+    if (!nb) {
+      it->rc = -2;
+      return;
+    }
+    w->bnd = nb;
+    w->bnd_cap = nc;
+  }
+  size_t b_count = 0;
+  it->rc = mmjp_cache_decode(w->sh->cache, MMJP_CACHE_BOUNDS, w->sh->m, it->utf8, it->len, &w->wk,
+                             w->b_cp, w->b_cap, w->bnd + w->bnd_len, w->bnd_cap - w->bnd_len, &b_count);
+  if (it->rc != 0) return;
+  w->bnd_len += b_count;
+  it->count = b_count;
+}
+
+static void *batch_worker_main(void *arg) {
+  batch_worker_t *w = (batch_worker_t *)arg;
+  batch_shared_t *sh = w->sh;
+  for (;;) {
+#ifndef MMJP_NO_THREADS
+    pthread_mutex_lock(&sh->mu);
+#endif
+    size_t start = sh->next;
+    sh->next = (start + MMJP_BATCH_CHUNK < sh->n_items) ? (start + MMJP_BATCH_CHUNK) : sh->n_items;
+    size_t end = sh->next;
+#ifndef MMJP_NO_THREADS
+    pthread_mutex_unlock(&sh->mu);
+#endif
+    if (start >= end) break;
+    for (size_t i = start; i < end; i++) batch_decode_item(w, &sh->items[i]);
+  }
+  return NULL;
+}
+
+static unsigned default_num_threads(void) {
+#ifndef MMJP_NO_THREADS
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > 0) return (unsigned)n;
+#endif
+  return 1u;
+}
+
+
 /* ------------------------------
  * Methods
  * ------------------------------ */
@@ -299,18 +523,40 @@ static PyObject *tokens_with_offsets_from_bounds(const uint8_t *utf8, Py_ssize_t
 static int PyMMJPModel_init(PyMMJPModel *self, PyObject *args, PyObject *kwargs) {
   const char *path = NULL;
   unsigned int max_n_cp = 1024u;
+  Py_ssize_t cache_size = 0;
 
-  static char *kwlist[] = {"model_path", "max_n_cp", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|I", kwlist, &path, &max_n_cp)) {
+  static char *kwlist[] = {"model_path", "max_n_cp", "cache_size", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|In", kwlist, &path, &max_n_cp, &cache_size)) {
+    return -1;
+  }
+  if (cache_size < 0) {
+    PyErr_SetString(PyExc_ValueError, "cache_size must be >= 0");
+    return -1;
+  }
+  /*
+   * Decode calls (and tokenize_batch workers, which do not take self->lock)
+   * use the mapping and buffers with the GIL released; replacing them under
+   * a running call is not safe, so a loaded Model cannot be re-initialized.
+   */
+  if (self->model_loaded) {
+    PyErr_SetString(PyExc_RuntimeError, "Model is already initialized; create a new Model instead");
     return -1;
   }
 
+  if (!self->lock) {
+    self->lock = PyThread_allocate_lock();
+    if (!self->lock) {
+      PyErr_SetString(PyExc_MemoryError, "failed to allocate lock");
+      return -1;
+    }
+  }
+
   memset(&self->model, 0, sizeof(self->model));
   self->model_loaded = 0;
 
-  int rc = mmjp_model_load_bin(path, &self->model);
+  int rc = mmjp_model_map_bin(path, &self->model);
   if (rc != 0) {
-    PyErr_Format(PyExc_RuntimeError, "mmjp_model_load_bin failed rc=%d", rc);
+    PyErr_Format(PyExc_RuntimeError, "mmjp_model_map_bin failed rc=%d", rc);
     return -1;
   }
   self->model_loaded = 1;
@@ -338,6 +584,12 @@ static int PyMMJPModel_init(PyMMJPModel *self, PyObject *args, PyObject *kwargs)
     return -1;
   }
 
+  mmjp_cache_free(&self->cache);
+  if (mmjp_cache_init(&self->cache, (size_t)cache_size, 0, 0) != 0) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
   return 0;
 }
 
@@ -359,34 +611,87 @@ static PyObject *PyMMJPModel_tokenize(PyMMJPModel *self, PyObject *args, PyObjec
 
   const uint8_t *utf8 = NULL;
   Py_ssize_t len = 0;
-  if (PyUnicode_Check(text_obj)) {
-    utf8 = (const uint8_t *)PyUnicode_AsUTF8AndSize(text_obj, &len);
-    if (!utf8) return NULL;
-  } else if (PyBytes_Check(text_obj)) {
-    utf8 = (const uint8_t *)PyBytes_AS_STRING(text_obj);
-    len = PyBytes_GET_SIZE(text_obj);
-  } else {
-    PyErr_SetString(PyExc_TypeError, "text must be str or bytes");
-    return NULL;
-  }
+  if (text_as_utf8(text_obj, &utf8, &len) != 0) return NULL;
 
-  if (ensure_work(self, len) != 0) return NULL;
+  PyObject *res = NULL;
+  MMJP_LOCK(self);
+  if (ensure_work(self, len) != 0) goto done;
 
   size_t b_count = 0;
-  npycrf_score_t score = 0;
-  int rc = npycrf_decode(&self->model.m, utf8, (size_t)len,
+  int rc;
+  Py_BEGIN_ALLOW_THREADS
+  rc = mmjp_cache_decode(&self->cache, MMJP_CACHE_BOUNDS, &self->model.m, utf8, (size_t)len,
                          &self->wk,
                          self->b_cp, self->b_cap,
-                         &b_count,
-                         &score);
+                         self->b_bytes, self->b_cap,
+                         &b_count);
+  Py_END_ALLOW_THREADS
   if (rc != 0) {
     PyErr_Format(PyExc_RuntimeError, "npycrf_decode failed rc=%d", rc);
+    goto done;
+  }
+
+  res = tokens_from_bbytes(utf8, len, self->b_bytes, b_count);
+done:
+  MMJP_UNLOCK(self);
+  return res;
+}
+
+static PyObject *PyMMJPModel_encode(PyMMJPModel *self, PyObject *args, PyObject *kwargs) {
+  PyObject *text_obj = NULL;
+  static char *kwlist[] = {"text", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &text_obj)) {
     return NULL;
   }
 
-  npycrf_boundaries_cp_to_bytes(self->wk.cp_off, self->b_cp, b_count, self->b_bytes);
+  const uint8_t *utf8 = NULL;
+  Py_ssize_t len = 0;
+  if (text_as_utf8(text_obj, &utf8, &len) != 0) return NULL;
+
+  PyObject *res = NULL;
+  MMJP_LOCK(self);
+  if (ensure_work(self, len) != 0) goto done;
 
-  return tokens_from_bbytes(utf8, len, self->b_bytes, b_count);
+  /* the IDs go into b_bytes (b_cap >= token count), no per-token strings */
+  size_t n_ids = 0;
+  int rc;
+  Py_BEGIN_ALLOW_THREADS
+  rc = mmjp_cache_decode(&self->cache, MMJP_CACHE_IDS, &self->model.m, utf8, (size_t)len,
+                         &self->wk,
+                         self->b_cp, self->b_cap,
+                         self->b_bytes, self->b_cap,
+                         &n_ids);
+  Py_END_ALLOW_THREADS
+  if (rc != 0) {
+    PyErr_Format(PyExc_RuntimeError, "npycrf_decode_ids failed rc=%d", rc);
+    goto done;
+  }
+
+  res = ids_to_array((const npycrf_id_t *)self->b_bytes, n_ids);
+done:
+  MMJP_UNLOCK(self);
+  return res;
+}
+
+static PyObject *PyMMJPModel_piece_to_id(PyMMJPModel *self, PyObject *args, PyObject *kwargs) {
+  PyObject *text_obj = NULL;
+  static char *kwlist[] = {"piece", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &text_obj)) {
+    return NULL;
+  }
+  if (!self->model_loaded) {
+    PyErr_SetString(PyExc_RuntimeError, "model not loaded");
+    return NULL;
+  }
+
+  const uint8_t *utf8 = NULL;
+  Py_ssize_t len = 0;
+  if (text_as_utf8(text_obj, &utf8, &len) != 0) return NULL;
+
+  /* the model is read-only after load, no lock needed */
+  npycrf_id_t id = NPYCRF_ID_UNK;
+  if (!npycrf_lm_lookup(&self->model.m.lm, utf8, (size_t)len, &id)) id = NPYCRF_ID_UNK;
+  return PyLong_FromUnsignedLong((unsigned long)id);
 }
 
 static PyObject *PyMMJPModel_tokenize_with_offsets(PyMMJPModel *self, PyObject *args, PyObject *kwargs) {
@@ -409,88 +714,165 @@ static PyObject *PyMMJPModel_tokenize_with_offsets(PyMMJPModel *self, PyObject *
 
   const uint8_t *utf8 = NULL;
   Py_ssize_t len = 0;
-  if (PyUnicode_Check(text_obj)) {
-    utf8 = (const uint8_t *)PyUnicode_AsUTF8AndSize(text_obj, &len);
-    if (!utf8) return NULL;
-  } else if (PyBytes_Check(text_obj)) {
-    utf8 = (const uint8_t *)PyBytes_AS_STRING(text_obj);
-    len = PyBytes_GET_SIZE(text_obj);
-  } else {
-    PyErr_SetString(PyExc_TypeError, "text must be str or bytes");
-    return NULL;
-  }
+  if (text_as_utf8(text_obj, &utf8, &len) != 0) return NULL;
 
-  if (ensure_work(self, len) != 0) return NULL;
+  PyObject *res = NULL;
+  MMJP_LOCK(self);
+  if (ensure_work(self, len) != 0) goto done;
 
   size_t b_count = 0;
   npycrf_score_t score = 0;
-  int rc = npycrf_decode(&self->model.m, utf8, (size_t)len,
-                         &self->wk,
-                         self->b_cp, self->b_cap,
-                         &b_count,
-                         &score);
+  int rc;
+  Py_BEGIN_ALLOW_THREADS
+  rc = npycrf_decode(&self->model.m, utf8, (size_t)len,
+                     &self->wk,
+                     self->b_cp, self->b_cap,
+                     &b_count,
+                     &score);
+  if (rc == 0) npycrf_boundaries_cp_to_bytes(self->wk.cp_off, self->b_cp, b_count, self->b_bytes);
+  Py_END_ALLOW_THREADS
   if (rc != 0) {
     PyErr_Format(PyExc_RuntimeError, "npycrf_decode failed rc=%d", rc);
-    return NULL;
+    goto done;
   }
 
-  npycrf_boundaries_cp_to_bytes(self->wk.cp_off, self->b_cp, b_count, self->b_bytes);
-
-  return tokens_with_offsets_from_bounds(utf8, len, self->b_cp, self->b_bytes, b_count, unit_char);
+  res = tokens_with_offsets_from_bounds(utf8, len, self->b_cp, self->b_bytes, b_count, unit_char);
+done:
+  MMJP_UNLOCK(self);
+  return res;
 }
 
 
 static PyObject *PyMMJPModel_sample(PyMMJPModel *self, PyObject *args, PyObject *kwargs) {
   PyObject *text_obj = NULL;
-  double temperature = 1.0;
+  PyObject *temp_obj = NULL;
   PyObject *seed_obj = Py_None;
-  static char *kwlist[] = {"text", "temperature", "seed", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|dO", kwlist, &text_obj, &temperature, &seed_obj)) {
+  PyObject *n_obj = Py_None;
+  static char *kwlist[] = {"text", "temperature", "seed", "n", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOO", kwlist, &text_obj, &temp_obj, &seed_obj, &n_obj)) {
     return NULL;
   }
 
+  /* n=None: one sample as list[str]; n=N: N samples from one forward pass */
+  size_t n = 1;
+  if (n_obj != Py_None) {
+    size_t v = PyLong_AsSize_t(n_obj);
+    if (PyErr_Occurred()) return NULL;
+    if (v == 0 || v > 0xFFFFu) {
+      PyErr_SetString(PyExc_ValueError, "n must be in 1..65535");
+      return NULL;
+    }
+    n = v;
+  }
+
+  /* temperature: a float, or one per sample (n required) */
+  double temperature = 1.0;
+  PyObject *temp_seq = NULL;
+  if (temp_obj && PyNumber_Check(temp_obj)) {
+    temperature = PyFloat_AsDouble(temp_obj);
+    if (PyErr_Occurred()) return NULL;
+  } else if (temp_obj) {
+    if (n_obj == Py_None) {
+      PyErr_SetString(PyExc_TypeError, "a per-sample temperature sequence needs n");
+      return NULL;
+    }
+    temp_seq = PySequence_Fast(temp_obj, "temperature must be a float or a sequence of floats");
+    if (!temp_seq) return NULL;
+    if ((size_t)PySequence_Fast_GET_SIZE(temp_seq) != n) {
+      Py_DECREF(temp_seq);
+      PyErr_SetString(PyExc_ValueError, "len(temperature) must equal n");
+      return NULL;
+    }
+  }
+
   const uint8_t *utf8 = NULL;
   Py_ssize_t len = 0;
-  if (PyUnicode_Check(text_obj)) {
-    utf8 = (const uint8_t *)PyUnicode_AsUTF8AndSize(text_obj, &len);
-    if (!utf8) return NULL;
-  } else if (PyBytes_Check(text_obj)) {
-    utf8 = (const uint8_t *)PyBytes_AS_STRING(text_obj);
-    len = PyBytes_GET_SIZE(text_obj);
-  } else {
-    PyErr_SetString(PyExc_TypeError, "text must be str or bytes");
+  if (text_as_utf8(text_obj, &utf8, &len) != 0) {
+    Py_XDECREF(temp_seq);
     return NULL;
   }
 
-  if (ensure_work(self, len) != 0) return NULL;
-  if (ensure_samplebuf(self) != 0) return NULL;
-
   uint32_t seed = 0u;
   if (seed_obj == Py_None) {
     seed = default_seed();
   } else {
-    unsigned long long s = PyLong_AsUnsignedLongLong(seed_obj);
-    if (PyErr_Occurred()) return NULL;
-    seed = (uint32_t)s;
+    unsigned long long sv = PyLong_AsUnsignedLongLong(seed_obj);
+    if (PyErr_Occurred()) {
+      Py_XDECREF(temp_seq);
+      return NULL;
+    }
+    seed = (uint32_t)sv;
     if (seed == 0u) seed = 1u;
   }
 
-  size_t b_count = 0;
-  npycrf_score_t score = 0;
-  int rc = npycrf_decode_sample(&self->model.m, utf8, (size_t)len,
-                                &self->wk,
-                                self->samplebuf, self->samplecap,
-                                temperature,
-                                seed,
-                                self->b_cp, self->b_cap,
-                                &b_count,
-                                &score);
+  /* sample i uses the i-th xs32 step of seed (as mmjp_tokenize --nsamples) */
+  uint32_t *seeds = (uint32_t *)PyMem_Malloc(n * sizeof(uint32_t));
+  double *temps = temp_seq ? (double *)PyMem_Malloc(n * sizeof(double)) : NULL;
+  if (!seeds || (temp_seq && !temps)) {
+    PyMem_Free(seeds);
+    PyMem_Free(temps);
+    Py_XDECREF(temp_seq);
+    return PyErr_NoMemory();
+  }
+  for (size_t i = 0; i < n; i++) {
+    seeds[i] = seed;
+    seed = xs32(&seed);
+    if (temps) {
+      temps[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(temp_seq, (Py_ssize_t)i));
+      if (PyErr_Occurred()) {
+        PyMem_Free(seeds);
+        PyMem_Free(temps);
+        Py_DECREF(temp_seq);
+        return NULL;
+      }
+    }
+  }
+  Py_XDECREF(temp_seq);
+
+  PyObject *res = NULL;
+  MMJP_LOCK(self);
+  if (ensure_work(self, len) != 0) goto done;
+  if (ensure_samplebuf(self) != 0) goto done;
+  if (ensure_flat(self, n) != 0) goto done;
+
+  size_t per = (size_t)self->max_n_cp + 1u;
+  int rc;
+  Py_BEGIN_ALLOW_THREADS
+  rc = npycrf_decode_sample_multi(&self->model.m, utf8, (size_t)len,
+                                  &self->wk,
+                                  self->samplebuf, self->samplecap,
+                                  n, seeds, temps, temperature,
+                                  self->b_cp_flat, per,
+                                  self->bcount_arr,
+                                  self->score_arr);
+  Py_END_ALLOW_THREADS
   if (rc != 0) {
     PyErr_Format(PyExc_RuntimeError, "npycrf_decode_sample failed rc=%d", rc);
-    return NULL;
+    goto done;
+  }
+
+  if (n_obj == Py_None) {
+    npycrf_boundaries_cp_to_bytes(self->wk.cp_off, self->b_cp_flat, self->bcount_arr[0], self->b_bytes);
+    res = tokens_from_bbytes(utf8, len, self->b_bytes, self->bcount_arr[0]);
+    goto done;
+  }
+  res = PyList_New((Py_ssize_t)n);
+  if (!res) goto done;
+  for (size_t i = 0; i < n; i++) {
+    size_t bcnt = self->bcount_arr[i];
+    npycrf_boundaries_cp_to_bytes(self->wk.cp_off, self->b_cp_flat + i * per, bcnt, self->b_bytes);
+    PyObject *tokens = tokens_from_bbytes(utf8, len, self->b_bytes, bcnt);
+    if (!tokens) {
+      Py_CLEAR(res);
+      goto done;
+    }
+    PyList_SET_ITEM(res, (Py_ssize_t)i, tokens);
   }
-  npycrf_boundaries_cp_to_bytes(self->wk.cp_off, self->b_cp, b_count, self->b_bytes);
-  return tokens_from_bbytes(utf8, len, self->b_bytes, b_count);
+done:
+  MMJP_UNLOCK(self);
+  PyMem_Free(seeds);
+  PyMem_Free(temps);
+  return res;
 }
 
 static PyObject *PyMMJPModel_nbest(PyMMJPModel *self, PyObject *args, PyObject *kwargs) {
@@ -501,43 +883,39 @@ static PyObject *PyMMJPModel_nbest(PyMMJPModel *self, PyObject *args, PyObject *
     return NULL;
   }
   if (nbest == 0u) nbest = 1u;
-  if (nbest > 64u) {
-    PyErr_SetString(PyExc_ValueError, "nbest too large (max 64)");
+  if (nbest > 0xFFFFu) {
+    PyErr_SetString(PyExc_ValueError, "nbest too large (max 65535)");
     return NULL;
   }
 
   const uint8_t *utf8 = NULL;
   Py_ssize_t len = 0;
-  if (PyUnicode_Check(text_obj)) {
-    utf8 = (const uint8_t *)PyUnicode_AsUTF8AndSize(text_obj, &len);
-    if (!utf8) return NULL;
-  } else if (PyBytes_Check(text_obj)) {
-    utf8 = (const uint8_t *)PyBytes_AS_STRING(text_obj);
-    len = PyBytes_GET_SIZE(text_obj);
-  } else {
-    PyErr_SetString(PyExc_TypeError, "text must be str or bytes");
-    return NULL;
-  }
-
-  if (ensure_work(self, len) != 0) return NULL;
-  if (ensure_nbest(self, (uint16_t)nbest) != 0) return NULL;
-
-  int rc = npycrf_decode_nbest(&self->model.m,
-                              utf8, (size_t)len,
-                              &self->wk,
-                              self->nbestbuf, self->nbestcap,
-                              (uint16_t)nbest,
-                              self->b_cp_flat, (size_t)self->max_n_cp + 1u,
-                              self->bcount_arr,
-                              self->score_arr);
+  if (text_as_utf8(text_obj, &utf8, &len) != 0) return NULL;
+
+  PyObject *outer = NULL;
+  MMJP_LOCK(self);
+  if (ensure_work(self, len) != 0) goto done;
+  if (ensure_nbest(self, (uint16_t)nbest) != 0) goto done;
+
+  int rc;
+  Py_BEGIN_ALLOW_THREADS
+  rc = npycrf_decode_nbest(&self->model.m,
+                           utf8, (size_t)len,
+                           &self->wk,
+                           self->nbestbuf, self->nbestcap,
+                           (uint16_t)nbest,
+                           self->b_cp_flat, (size_t)self->max_n_cp + 1u,
+                           self->bcount_arr,
+                           self->score_arr);
+  Py_END_ALLOW_THREADS
   if (rc < 0) {
     PyErr_Format(PyExc_RuntimeError, "npycrf_decode_nbest failed rc=%d", rc);
-    return NULL;
+    goto done;
   }
   size_t out_count = (size_t)rc;
 
-  PyObject *outer = PyList_New((Py_ssize_t)out_count);
-  if (!outer) return NULL;
+  outer = PyList_New((Py_ssize_t)out_count);
+  if (!outer) goto done;
 
   for (size_t i = 0; i < out_count; i++) {
     const uint16_t *bcp = self->b_cp_flat + i * ((size_t)self->max_n_cp + 1u);
@@ -545,24 +923,219 @@ static PyObject *PyMMJPModel_nbest(PyMMJPModel *self, PyObject *args, PyObject *
     npycrf_boundaries_cp_to_bytes(self->wk.cp_off, bcp, bcnt, self->b_bytes);
     PyObject *tokens = tokens_from_bbytes(utf8, len, self->b_bytes, bcnt);
     if (!tokens) {
-      Py_DECREF(outer);
-      return NULL;
+      Py_CLEAR(outer);
+      goto done;
     }
     PyList_SET_ITEM(outer, (Py_ssize_t)i, tokens);
   }
 
+done:
+  MMJP_UNLOCK(self);
+  return outer;
+}
+
+static PyObject *PyMMJPModel_tokenize_batch(PyMMJPModel *self, PyObject *args, PyObject *kwargs) {
+  PyObject *texts_obj = NULL;
+  int num_threads = 0;
+  static char *kwlist[] = {"texts", "num_threads", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", kwlist, &texts_obj, &num_threads)) {
+    return NULL;
+  }
+  if (!self->model_loaded) {
+    PyErr_SetString(PyExc_RuntimeError, "model not loaded");
+    return NULL;
+  }
+
+  /*
+   * The decode reads the item buffers with the GIL released, so take an owned
+   * tuple snapshot: for a list, PySequence_Fast would return the list itself and
+   * another thread could replace (and free) items while the workers run.
+   */
+  PyObject *seq = PySequence_Tuple(texts_obj);
+  if (!seq) {
+    if (PyErr_ExceptionMatches(PyExc_TypeError)) {
+      PyErr_SetString(PyExc_TypeError, "texts must be a sequence of str or bytes");
+    }
+    return NULL;
+  }
+  Py_ssize_t n = PyTuple_GET_SIZE(seq);
+
+  batch_item_t *items = (batch_item_t *)calloc((size_t)(n > 0 ? n : 1), sizeof(batch_item_t));
+  if (!items) {
+    Py_DECREF(seq);
+    return PyErr_NoMemory();
+  }
+  for (Py_ssize_t i = 0; i < n; i++) {
+    const uint8_t *utf8 = NULL;
+    Py_ssize_t len = 0;
+    if (text_as_utf8(PyTuple_GET_ITEM(seq, i), &utf8, &len) != 0) {
+      free(items);
+      Py_DECREF(seq);
+      return NULL;
+    }
+    items[i].utf8 = utf8;
+    items[i].len = (size_t)len;
+  }
+
+  unsigned nt = (num_threads > 0) ? (unsigned)num_threads : default_num_threads();
+  if (nt > 256u) nt = 256u;
+  if ((Py_ssize_t)nt > n) nt = (n > 0) ? (unsigned)n : 1u;
+#ifdef MMJP_NO_THREADS
+  nt = 1u;
+#endif
+
+  batch_shared_t sh;
+  memset(&sh, 0, sizeof(sh));
+  sh.m = &self->model.m;
+  sh.cache = &self->cache;
+  sh.items = items;
+  sh.n_items = (size_t)n;
+
+  batch_worker_t *workers = (batch_worker_t *)calloc(nt, sizeof(batch_worker_t));
+  if (!workers) {
+    free(items);
+    Py_DECREF(seq);
+    return PyErr_NoMemory();
+  }
+  for (unsigned t = 0; t < nt; t++) {
+    workers[t].sh = &sh;
+    workers[t].id = (int)t;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+#ifndef MMJP_NO_THREADS
+  pthread_mutex_init(&sh.mu, NULL);
+  pthread_t *tids = (nt > 1u) ? (pthread_t *)calloc(nt, sizeof(pthread_t)) : NULL;
+  unsigned started = 0;
+  if (tids) {
+    /* worker 0 runs on the calling thread */
+    for (started = 1; started < nt; started++) {
+      if (pthread_create(&tids[started], NULL, batch_worker_main, &workers[started]) != 0) break;
+    }
+  }
+  batch_worker_main(&workers[0]);
+  for (unsigned t = 1; t < started; t++) pthread_join(tids[t], NULL);
+  free(tids);
+  pthread_mutex_destroy(&sh.mu);
+#else
+  batch_worker_main(&workers[0]);
+#endif
+  Py_END_ALLOW_THREADS
+
+  PyObject *outer = PyList_New(n);
+  for (Py_ssize_t i = 0; outer && i < n; i++) {
+    const batch_item_t *it = &items[i];
+    if (it->rc != 0) {
+      if (it->rc == -2) {
+        PyErr_NoMemory();
+      } else {
+        PyErr_Format(PyExc_RuntimeError, "npycrf_decode failed rc=%d (index %zd)", it->rc, i);
+      }
+      Py_CLEAR(outer);
+      break;
+    }
+    PyObject *tokens = tokens_from_bbytes(it->utf8, (Py_ssize_t)it->len,
+                                          workers[it->worker].bnd + it->off, it->count);
+    if (!tokens) {
+      Py_CLEAR(outer);
+      break;
+    }
+    PyList_SET_ITEM(outer, i, tokens);
+  }
+
+  for (unsigned t = 0; t < nt; t++) {
+    npycrf_stats_t cur;
+    npycrf_stats_get(&workers[t].wk, &cur);
+    npycrf_stats_add(&self->stats, &workers[t].stats);
+    if (workers[t].max_n_cp) npycrf_stats_add(&self->stats, &cur);
+    batch_worker_free(&workers[t]);
+  }
+  free(workers);
+  free(items);
+  Py_DECREF(seq);
   return outer;
 }
 
+static PyObject *PyMMJPModel_cache_info(PyMMJPModel *self, PyObject *Py_UNUSED(ignored)) {
+  mmjp_cache_stats_t st;
+  mmjp_cache_get_stats(&self->cache, &st);
+  return Py_BuildValue("{s:K,s:K,s:K,s:K,s:n,s:n}",
+                       "hits", (unsigned long long)st.hits,
+                       "misses", (unsigned long long)st.misses,
+                       "inserts", (unsigned long long)st.inserts,
+                       "evictions", (unsigned long long)st.evictions,
+                       "entries", (Py_ssize_t)st.entries,
+                       "bytes", (Py_ssize_t)st.bytes);
+}
+
+static PyObject *PyMMJPModel_stats(PyMMJPModel *self, PyObject *Py_UNUSED(ignored)) {
+  npycrf_stats_t st, cur;
+  MMJP_LOCK(self);
+  st = self->stats;
+  if (self->workbuf) {
+    npycrf_stats_get(&self->wk, &cur);
+    npycrf_stats_add(&st, &cur);
+  }
+  MMJP_UNLOCK(self);
+  return Py_BuildValue("{s:O,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+                       "enabled", npycrf_stats_enabled() ? Py_True : Py_False,
+                       "lattices", (unsigned long long)st.lattices,
+                       "codepoints", (unsigned long long)st.codepoints,
+                       "trie_steps", (unsigned long long)st.trie_steps,
+                       "spans", (unsigned long long)st.spans,
+                       "span_hits", (unsigned long long)st.span_hits,
+                       "bigram_lookups", (unsigned long long)st.bigram_lookups,
+                       "bigram_hits", (unsigned long long)st.bigram_hits,
+                       "dp_states", (unsigned long long)st.dp_states,
+                       "dp_neg_inf", (unsigned long long)st.dp_neg_inf,
+                       "regrows", (unsigned long long)st.regrows);
+}
+
+static PyObject *PyMMJPModel_stats_reset(PyMMJPModel *self, PyObject *Py_UNUSED(ignored)) {
+  MMJP_LOCK(self);
+  memset(&self->stats, 0, sizeof(self->stats));
+  if (self->workbuf) npycrf_stats_reset(&self->wk);
+  MMJP_UNLOCK(self);
+  Py_RETURN_NONE;
+}
+
+static PyObject *PyMMJPModel_cache_clear(PyMMJPModel *self, PyObject *Py_UNUSED(ignored)) {
+  mmjp_cache_clear(&self->cache);
+  Py_RETURN_NONE;
+}
+
 static PyMethodDef PyMMJPModel_methods[] = {
   {"tokenize", (PyCFunction)PyMMJPModel_tokenize, METH_VARARGS | METH_KEYWORDS,
    "tokenize(text) -> list[str]"},
+  {"encode", (PyCFunction)PyMMJPModel_encode, METH_VARARGS | METH_KEYWORDS,
+   "encode(text) -> array('H')\n"
+   "Piece IDs of the 1-best segmentation (UNK_ID for pieces not in the vocabulary).\n"
+   "The array supports the buffer protocol, e.g. numpy.frombuffer(a, numpy.uint16)."},
+  {"piece_to_id", (PyCFunction)PyMMJPModel_piece_to_id, METH_VARARGS | METH_KEYWORDS,
+   "piece_to_id(piece) -> int (UNK_ID if not in the vocabulary)"},
   {"tokenize_with_offsets", (PyCFunction)PyMMJPModel_tokenize_with_offsets, METH_VARARGS | METH_KEYWORDS,
    "tokenize_with_offsets(text, unit='char') -> list[tuple[str,int,int]]"},
+  {"tokenize_batch", (PyCFunction)PyMMJPModel_tokenize_batch, METH_VARARGS | METH_KEYWORDS,
+   "tokenize_batch(texts, num_threads=0) -> list[list[str]]\n"
+   "Decode many texts in C worker threads without holding the GIL.\n"
+   "num_threads=0 uses the number of online CPUs."},
   {"sample", (PyCFunction)PyMMJPModel_sample, METH_VARARGS | METH_KEYWORDS,
-   "sample(text, temperature=1.0, seed=None) -> list[str]"},
+   "sample(text, temperature=1.0, seed=None, n=None) -> list[str]\n"
+   "With n=N, returns N samples (list[list[str]]) drawn from one forward pass;\n"
+   "temperature may then be a float or a sequence of N floats."},
   {"nbest", (PyCFunction)PyMMJPModel_nbest, METH_VARARGS | METH_KEYWORDS,
    "nbest(text, nbest=8) -> list[list[str]]"},
+  {"cache_info", (PyCFunction)PyMMJPModel_cache_info, METH_NOARGS,
+   "cache_info() -> dict (hits, misses, inserts, evictions, entries, bytes)\n"
+   "Counters of the 1-best result cache enabled by Model(..., cache_size=N)."},
+  {"stats", (PyCFunction)PyMMJPModel_stats, METH_NOARGS,
+   "stats() -> dict of decoder counters (trie steps, span hits, bigram hits, DP states, ...)\n"
+   "The decoder counters are zero unless the extension is built with MMJP_STATS=1\n"
+   "(defines NPYCRF_STATS); 'enabled' tells which. regrows counts workspace growth."},
+  {"stats_reset", (PyCFunction)PyMMJPModel_stats_reset, METH_NOARGS,
+   "stats_reset() -> None"},
+  {"cache_clear", (PyCFunction)PyMMJPModel_cache_clear, METH_NOARGS,
+   "cache_clear() -> None (drop all cached results, counters are kept)"},
   {NULL, NULL, 0, NULL},
 };
 
@@ -600,9 +1173,21 @@ PyMODINIT_FUNC PyInit__mmjp(void) {
   if (PyType_Ready(&PyMMJPModelType) < 0) {
     return NULL;
   }
+  if (!array_type) {
+    PyObject *array_mod = PyImport_ImportModule("array");
+    if (!array_mod) return NULL;
+    array_type = PyObject_GetAttrString(array_mod, "array");
+    Py_DECREF(array_mod);
+    if (!array_type) return NULL;
+  }
   PyObject *m = PyModule_Create(&moduledef);
   if (!m) return NULL;
 
+  if (PyModule_AddIntConstant(m, "UNK_ID", (long)NPYCRF_ID_UNK) < 0) {
+    Py_DECREF(m);
+    return NULL;
+  }
+
   Py_INCREF(&PyMMJPModelType);
   if (PyModule_AddObject(m, "Model", (PyObject *)&PyMMJPModelType) < 0) {
     Py_DECREF(&PyMMJPModelType);
@@ -238,6 +238,94 @@ size_t mmjp_lossless_decode(const uint8_t *src, size_t src_len,
   return out_len;
 }
 
+/* enc[0..n) を出力（入力位置 from に対応づける）。収まらない分は書かない */
+static void prep_put(uint8_t *dst, size_t dst_cap, uint32_t *src_off, size_t out_len,
+                     const uint8_t *enc, size_t n, size_t from) {
+  if (!dst || out_len + n > dst_cap) return;
+  memcpy(dst + out_len, enc, n);
+  if (src_off) {
+    for (size_t i = 0; i < n; i++) src_off[out_len + i] = (uint32_t)from;
+  }
+}
+
+/*
+ * 入力前処理（lossless + 正規化の1パス版）
+ */
+size_t mmjp_lossless_prepare(const uint8_t *src, size_t src_len,
+                             uint8_t *dst, size_t dst_cap,
+                             unsigned flags, uint32_t fallback_cp,
+                             uint32_t *src_off) {
+  if (!src && src_len > 0) return 0;
+
+  const int lossless = (flags & MMJP_PREP_LOSSLESS) != 0;
+  const int newlines = lossless && (flags & MMJP_PREP_NEWLINES) != 0;
+  const int normalize = (flags & MMJP_PREP_NORMALIZE) != 0;
+
+  uint8_t fb[4];
+  size_t fb_len = utf8_encode_cp(fallback_cp, fb);
+
+  size_t pos = 0;
+  size_t out_len = 0;
+
+  while (pos < src_len) {
+    uint32_t cp = 0;
+    size_t adv = 0;
+    uint8_t enc[8];
+    size_t enc_len = 0;
+
+    if (!utf8_decode_cp(src, src_len, pos, &cp, &adv)) {
+      /* 無効なUTF-8: 正規化なら置換、でなければそのままコピー */
+      if (normalize) {
+        prep_put(dst, dst_cap, src_off, out_len, fb, fb_len, pos);
+        out_len += fb_len;
+      } else {
+        prep_put(dst, dst_cap, src_off, out_len, src + pos, 1, pos);
+        out_len++;
+      }
+      pos++;
+      continue;
+    }
+
+    if (lossless && cp == ' ') {
+      enc_len = utf8_encode_cp(MMJP_LOSSLESS_SPACE, enc);
+    } else if (lossless && cp == '\t') {
+      enc_len = utf8_encode_cp(MMJP_LOSSLESS_TAB, enc);
+    } else if (newlines && cp == '\n') {
+      enc_len = utf8_encode_cp(MMJP_LOSSLESS_LF, enc);
+    } else if (newlines && cp == '\r') {
+      enc_len = utf8_encode_cp(MMJP_LOSSLESS_CR, enc);
+    } else if (lossless && is_meta_char(cp)) {
+      enc_len = utf8_encode_cp(MMJP_LOSSLESS_ESCAPE, enc);
+      enc_len += utf8_encode_cp(cp, enc + enc_len);
+    } else if (!normalize) {
+      /* その他はそのままコピー */
+      prep_put(dst, dst_cap, src_off, out_len, src + pos, adv, pos);
+      out_len += adv;
+      pos += adv;
+      continue;
+    } else if (cp > 0x10FFFFu || (cp >= 0xD800u && cp <= 0xDFFFu)) {
+      /* Unicode スカラー値でない → 置換 */
+      memcpy(enc, fb, fb_len);
+      enc_len = fb_len;
+    } else {
+      /* 正準形で再エンコード（冗長な符号化もここで直る） */
+      enc_len = utf8_encode_cp(cp, enc);
+    }
+
+    prep_put(dst, dst_cap, src_off, out_len, enc, enc_len, pos);
+    out_len += enc_len;
+    pos += adv;
+  }
+
+  /* NUL終端 */
+  if (dst && out_len < dst_cap) {
+    dst[out_len] = '\0';
+    if (src_off) src_off[out_len] = (uint32_t)src_len;
+  }
+
+  return out_len;
+}
+
 /*
  * detokenize用ヘルパー
  */
@@ -77,6 +77,43 @@ size_t mmjp_lossless_encode(const uint8_t *src, size_t src_len,
 size_t mmjp_lossless_decode(const uint8_t *src, size_t src_len,
                             uint8_t *dst, size_t dst_cap);
 
+/* mmjp_lossless_prepare() の flags */
+#define MMJP_PREP_LOSSLESS  1u  /* 空白/タブをメタ文字へ（mmjp_lossless_encode と同じ規則） */
+#define MMJP_PREP_NEWLINES  2u  /* LF/CR もメタ文字へ（MMJP_PREP_LOSSLESS と併用） */
+#define MMJP_PREP_NORMALIZE 4u  /* 正準 UTF-8 へ再エンコード、無効バイト/スカラーは fallback_cp */
+
+/* mmjp_lossless_prepare() の出力長の上限（NUL 終端を含む） */
+#define MMJP_PREP_MAX_LEN(src_len) (4u * (size_t)(src_len) + 1u)
+
+/*
+ * 入力前処理（lossless エンコード + UTF-8 正規化）を1パスで行う
+ *
+ * mmjp_lossless_encode() の出力を正規化したものと同じバイト列を、
+ * 中間バッファなしで dst に書く。flags に MMJP_PREP_NORMALIZE がなければ
+ * mmjp_lossless_encode() と同じ出力（MMJP_PREP_LOSSLESS もなければ単なるコピー）。
+ *
+ * 正規化の規則:
+ *   - 冗長（overlong）な符号化は最短形へ
+ *   - 無効な UTF-8 は1バイトごとに fallback_cp へ
+ *   - サロゲート・U+10FFFF 超は fallback_cp へ
+ *
+ * @param src      入力バイト列
+ * @param src_len  入力バイト長
+ * @param dst      出力バッファ（NULLの場合は必要サイズを計算）
+ * @param dst_cap  出力バッファ容量（MMJP_PREP_MAX_LEN(src_len) あれば必ず足りる）
+ * @param flags    MMJP_PREP_*
+ * @param fallback_cp  MMJP_PREP_NORMALIZE 時の置換文字
+ * @param src_off  NULL または [dst_cap]: 出力バイト i の元になった入力バイト位置。
+ *                 末尾 src_off[戻り値] には src_len（容量があれば）。
+ *                 出力の文字境界 → 入力のバイト範囲の対応に使う。
+ * @return 出力バイト数（NUL終端を含まない）。dst_cap が足りなくても必要数を返し、
+ *         収まる範囲だけ書く
+ */
+size_t mmjp_lossless_prepare(const uint8_t *src, size_t src_len,
+                             uint8_t *dst, size_t dst_cap,
+                             unsigned flags, uint32_t fallback_cp,
+                             uint32_t *src_off);
+
 /*
  * detokenize用ヘルパー
  *
@@ -358,6 +358,51 @@ static int16_t crf_emit_pos(const npycrf_crf_t *crf, uint8_t label,
   return (int16_t)sum;
 }
 
+/*
+ * 文字クラスを密テーブルの添字に変換（範囲外は-1）
+ */
+static inline int emit_dense_index(uint8_t c, uint8_t n_class) {
+  if (c < n_class) return (int)c;
+  if (c == CC_BOS) return (int)n_class;
+  if (c == CC_EOS) return (int)n_class + 1;
+  return -1;
+}
+
+size_t npycrf_emit_table_size(uint8_t n_class) {
+  if (n_class == 0 || n_class > NPYCRF_EMIT_NCLS_MAX) return 0;
+  size_t d = (size_t)n_class + 2u;
+  return 2u * d * d * d * sizeof(int16_t);
+}
+
+int npycrf_crf_compile_emit(npycrf_crf_t *crf, int16_t *table, size_t table_size, uint8_t n_class) {
+  if (!crf || !table) return -1;
+  size_t need = npycrf_emit_table_size(n_class);
+  if (need == 0) return -1;
+  if (table_size < need) return -2;
+
+  /* 添字 → クラスID の逆引き（末尾2つが BOS/EOS） */
+  uint8_t cls[NPYCRF_EMIT_NCLS_MAX + 2u];
+  uint32_t d = (uint32_t)n_class + 2u;
+  for (uint32_t i = 0; i < n_class; i++) cls[i] = (uint8_t)i;
+  cls[n_class] = CC_BOS;
+  cls[n_class + 1u] = CC_EOS;
+
+  size_t k = 0;
+  for (uint8_t label = 0; label < 2u; label++) {
+    for (uint32_t p = 0; p < d; p++) {
+      for (uint32_t c = 0; c < d; c++) {
+        for (uint32_t n = 0; n < d; n++) {
+          table[k++] = crf_emit_pos(crf, label, cls[p], cls[c], cls[n]);
+        }
+      }
+    }
+  }
+
+  crf->emit_tab = table;
+  crf->emit_ncls = n_class;
+  return 0;
+}
+
 /* ======================================================================
  * ダブル配列トライ値ヘルパー
  * ====================================================================== */
@@ -381,6 +426,71 @@ static da_index_t da_next_ro_local(const da_trie_ro_t *da, da_index_t cur, uint8
   return 0;
 }
 
+/* BASE/CHECK の参照（コンパクト形式なら trie16 の組） */
+static inline da_index_t lm_base(const npycrf_lm_t *lm, size_t i) {
+  return lm->trie16 ? (da_index_t)lm->trie16[2u * i] : lm->trie.base[i];
+}
+
+static inline da_index_t lm_check(const npycrf_lm_t *lm, size_t i) {
+  return lm->trie16 ? (da_index_t)lm->trie16[2u * i + 1u] : lm->trie.check[i];
+}
+
+/* デコードで辿れるトライがあるか（コードポイント単位ならアルファベット表も必要） */
+static inline int lm_has_trie(const npycrf_lm_t *lm) {
+  if (!lm->trie16 && (!lm->trie.base || !lm->trie.check)) return 0;
+  return lm->trie.capacity > 1u && (!lm->cp_page || lm->cp_code);
+}
+
+/*
+ * トライ遷移（デコード内側ループ用）
+ *
+ * 呼び出し側で lm_has_trie() と cur < capacity を保証すること。
+ */
+static inline da_index_t trie_next(const npycrf_lm_t *lm, da_index_t cur, uint32_t code) {
+  da_index_t b = lm_base(lm, (size_t)cur);
+  if (b <= 0) return 0;  /* 負のBASEは終端値 */
+  size_t idx = (size_t)b + (size_t)code;
+  if (idx >= lm->trie.capacity) return 0;
+  return (lm_check(lm, idx) == cur) ? (da_index_t)idx : 0;
+}
+
+/*
+ * コードポイント単位トライの遷移コード（0=アルファベット外）
+ */
+static inline uint32_t lm_cp_code(const npycrf_lm_t *lm, uint32_t cp) {
+  uint32_t pg = cp >> 8;
+  if (pg >= NPYCRF_CP_PAGES) return 0;
+  return lm->cp_code[((size_t)lm->cp_page[pg] << 8) | (size_t)(cp & 0xFFu)];
+}
+
+/*
+ * 走査ノード v を1文字進める
+ *
+ * コードポイント単位トライなら code（lm_cp_code の値）で1遷移、
+ * バイト単位トライなら UTF-8 バイト列 b[0..nb) で nb 遷移。
+ */
+static inline da_index_t trie_advance(const npycrf_lm_t *lm, da_index_t v,
+                                      uint32_t code, const uint8_t *b, size_t nb) {
+  if (lm->cp_page) return (code != 0) ? trie_next(lm, v, code) : 0;
+  for (size_t i = 0; i < nb && v != 0; i++) v = trie_next(lm, v, b[i]);
+  return v;
+}
+
+/*
+ * ノード node で終わる単語のIDを取得（無ければ NPYCRF_ID_NONE）
+ *
+ * lm.term_id があれば1回の配列参照、なければヌル文字遷移を辿る。
+ */
+static inline npycrf_id_t trie_term(const npycrf_lm_t *lm, da_index_t node) {
+  if (lm->term_id) return lm->term_id[node];
+  da_index_t term = trie_next(lm, node, 0u);
+  if (term == 0) return NPYCRF_ID_NONE;
+  da_index_t v = lm_base(lm, (size_t)term);
+  if (v >= 0) return NPYCRF_ID_NONE;
+  uint32_t id = (uint32_t)(-v - 1);
+  return (id <= 0xFFFFu) ? (npycrf_id_t)id : NPYCRF_ID_NONE;
+}
+
 /*
  * 終端値（単語ID）を取得
  */
@@ -410,6 +520,33 @@ int npycrf_da_ro_get_term_value(const da_trie_ro_t *da, const uint8_t *key, size
   return 1;
 }
 
+size_t npycrf_cp_map_count(uint32_t n_pages) {
+  return (size_t)NPYCRF_CP_PAGES + ((size_t)n_pages + 1u) * 256u;
+}
+
+int npycrf_lm_lookup(const npycrf_lm_t *lm, const uint8_t *utf8, size_t len, npycrf_id_t *out_id) {
+  if (!lm || !utf8 || !out_id || len == 0) return 0;
+  if (!lm->cp_page && !lm->trie16) return npycrf_da_ro_get_term_value(&lm->trie, utf8, len, out_id);
+  if (!lm_has_trie(lm)) return 0;
+
+  da_index_t node = 1;  /* ルートノード */
+  if (!lm->cp_page) {
+    node = trie_advance(lm, node, 0u, utf8, len);
+    if (node == 0) return 0;
+  }
+  size_t i = 0;
+  while (lm->cp_page && i < len) {
+    uint32_t cp = 0;
+    if (!utf8_decode1(utf8, len, &i, &cp)) return 0;
+    node = trie_advance(lm, node, lm_cp_code(lm, cp), NULL, 0);
+    if (node == 0) return 0;
+  }
+  npycrf_id_t id = trie_term(lm, node);
+  if (id == NPYCRF_ID_NONE) return 0;
+  *out_id = id;
+  return 1;
+}
+
 /*
  * 終端値（単語ID）を設定
  */
@@ -563,6 +700,11 @@ int npycrf_work_init(npycrf_work_t *w, void *buf, size_t buf_size,
  * 言語モデルヘルパー
  * ====================================================================== */
 
+/* 8bit 量子化値を Q8.8 に戻す（生成時に int16 に収まる q だけを使う） */
+static inline int16_t q8_value(npycrf_q8_t q, uint8_t v) {
+  return (int16_t)((int32_t)q.off + (int32_t)v * (int32_t)q.scale);
+}
+
 /*
  * ユニグラム対数確率を取得
  *
@@ -577,9 +719,9 @@ static int16_t lm_unigram_logp(const npycrf_lm_t *lm, npycrf_id_t id, uint16_t l
   if (!lm) return 0;
 
   /* 既知語の場合はテーブルから取得 */
-  if (id != NPYCRF_ID_NONE && id != NPYCRF_ID_BOS &&
-      (uint32_t)id < lm->vocab_size && lm->logp_uni) {
-    return lm->logp_uni[id];
+  if (id != NPYCRF_ID_NONE && id != NPYCRF_ID_BOS && (uint32_t)id < lm->vocab_size) {
+    if (lm->logp_uni_q8) return q8_value(lm->uni_q8, lm->logp_uni_q8[id]);
+    if (lm->logp_uni) return lm->logp_uni[id];
   }
 
   /* 未知語ペナルティを計算 */
@@ -589,6 +731,99 @@ static int16_t lm_unigram_logp(const npycrf_lm_t *lm, npycrf_id_t id, uint16_t l
   return (int16_t)v;
 }
 
+/* バイグラム表があるか（通常形式またはコンパクト形式） */
+static inline int lm_has_bigram(const npycrf_lm_t *lm) {
+  if (lm->bigram_size == 0) return 0;
+  if (lm->bigram_blk) return lm->bigram_delta && lm->logp_bi_q8 && lm->bigram_nblk > 0;
+  return lm->bigram_key && lm->logp_bi;
+}
+
+/* LEB128 可変長整数を1つ読む */
+static inline uint32_t varint_read(const uint8_t **pp) {
+  const uint8_t *p = *pp;
+  uint32_t v = 0;
+  unsigned sh = 0;
+  uint8_t c;
+  do {
+    c = *p++;
+    v |= (uint32_t)(c & 0x7Fu) << sh;
+    sh += 7u;
+  } while ((c & 0x80u) && sh < 35u);
+  *pp = p;
+  return v;
+}
+
+/* コンパクト形式: ブロック索引を二分探索し、ブロック内を差分を足しながら線形走査 */
+static int lm_bigram_find_blk(const npycrf_lm_t *lm, uint32_t key, int16_t *out) {
+  uint32_t lo = 0;
+  uint32_t hi = lm->bigram_nblk;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2u;
+    if (lm->bigram_blk[2u * mid] <= key) lo = mid + 1u;
+    else hi = mid;
+  }
+  if (lo == 0) return 0;
+
+  uint32_t b = lo - 1u;
+  uint32_t k = lm->bigram_blk[2u * b];
+  const uint8_t *p = lm->bigram_delta + lm->bigram_blk[2u * b + 1u];
+  uint32_t i = b * NPYCRF_BIGRAM_BLOCK;
+  uint32_t end = (i + NPYCRF_BIGRAM_BLOCK < lm->bigram_size) ? i + NPYCRF_BIGRAM_BLOCK : lm->bigram_size;
+  for (;;) {
+    if (k == key) {
+      *out = q8_value(lm->bi_q8, lm->logp_bi_q8[i]);
+      return 1;
+    }
+    if (k > key || ++i >= end) return 0;
+    k += varint_read(&p);
+  }
+}
+
+/* バイグラム表を探索: 1=発見（*out に対数確率）, 0=未発見, -1=表を引かなかった */
+static int lm_bigram_find(const npycrf_lm_t *lm, npycrf_id_t prev, npycrf_id_t curr, int16_t *out) {
+  if (!lm) return -1;
+  if (!lm_has_bigram(lm)) return -1;
+  if (prev == NPYCRF_ID_NONE || curr == NPYCRF_ID_NONE) return -1;
+
+  /* キー構築: (prev_id << 16) | curr_id */
+  uint32_t key = ((uint32_t)prev << 16) | (uint32_t)curr;
+  if (lm->bigram_blk) return lm_bigram_find_blk(lm, key, out);
+
+  uint32_t lo = 0;
+  uint32_t hi = lm->bigram_size;
+  if (lm->bigram_row && (uint32_t)prev < lm->bigram_rows) {
+    /* 行インデックスで前IDの区間に絞る */
+    lo = lm->bigram_row[prev];
+    hi = lm->bigram_row[(uint32_t)prev + 1u];
+
+    /* 短い行は線形走査 */
+    if (hi - lo <= 8u) {
+      for (uint32_t i = lo; i < hi; i++) {
+        uint32_t k = lm->bigram_key[i];
+        if (k == key) {
+          *out = lm->logp_bi[i];
+          return 1;
+        }
+        if (k > key) break;
+      }
+      return 0;
+    }
+  }
+
+  /* 二分探索 */
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2u;
+    uint32_t k = lm->bigram_key[mid];
+    if (k == key) {
+      *out = lm->logp_bi[mid];
+      return 1;
+    }
+    if (k < key) lo = mid + 1u;
+    else hi = mid;
+  }
+  return 0;
+}
+
 /*
  * バイグラム対数確率を取得（バックオフ付き）
  *
@@ -601,24 +836,286 @@ static int16_t lm_unigram_logp(const npycrf_lm_t *lm, npycrf_id_t id, uint16_t l
  * バイグラムテーブルにない場合はcurr_backoffを返す
  */
 static int16_t lm_bigram_logp(const npycrf_lm_t *lm, npycrf_id_t prev, npycrf_id_t curr, int16_t curr_backoff) {
-  if (!lm) return curr_backoff;
-  if (!lm->bigram_key || !lm->logp_bi || lm->bigram_size == 0) return curr_backoff;
-  if (prev == NPYCRF_ID_NONE || curr == NPYCRF_ID_NONE) return curr_backoff;
+  int16_t v;
+  return (lm_bigram_find(lm, prev, curr, &v) > 0) ? v : curr_backoff;  /* 未発見→バックオフ */
+}
 
-  /* キー構築: (prev_id << 16) | curr_id */
-  uint32_t key = ((uint32_t)prev << 16) | (uint32_t)curr;
+#ifdef NPYCRF_STATS
+static int16_t lm_bigram_logp_counted(npycrf_stats_t *st, const npycrf_lm_t *lm,
+                                      npycrf_id_t prev, npycrf_id_t curr, int16_t curr_backoff) {
+  int16_t v;
+  int r = lm_bigram_find(lm, prev, curr, &v);
+  if (r >= 0) st->bigram_lookups++;
+  if (r > 0) {
+    st->bigram_hits++;
+    return v;
+  }
+  return curr_backoff;
+}
+/* ワーク付きの呼び出し元はこちらを使う（統計ビルドで探索回数・ヒット数を数える） */
+#define LM_BIGRAM(w, lm, prev, curr, backoff) lm_bigram_logp_counted(&(w)->stats, lm, prev, curr, backoff)
+#define STAT_ADD(w, field, v) ((w)->stats.field += (uint64_t)(v))
+#else
+#define LM_BIGRAM(w, lm, prev, curr, backoff) lm_bigram_logp(lm, prev, curr, backoff)
+#define STAT_ADD(w, field, v) ((void)0)
+#endif
+
+int npycrf_stats_enabled(void) {
+#ifdef NPYCRF_STATS
+  return 1;
+#else
+  return 0;
+#endif
+}
 
-  /* 二分探索 */
-  uint32_t lo = 0;
-  uint32_t hi = lm->bigram_size;
-  while (lo < hi) {
-    uint32_t mid = lo + (hi - lo) / 2u;
-    uint32_t k = lm->bigram_key[mid];
-    if (k == key) return lm->logp_bi[mid];
-    if (k < key) lo = mid + 1u;
-    else hi = mid;
+void npycrf_stats_get(const npycrf_work_t *w, npycrf_stats_t *out) {
+  if (!out) return;
+  memset(out, 0, sizeof(*out));
+#ifdef NPYCRF_STATS
+  if (w) *out = w->stats;
+#else
+  (void)w;
+#endif
+}
+
+void npycrf_stats_reset(npycrf_work_t *w) {
+#ifdef NPYCRF_STATS
+  if (w) memset(&w->stats, 0, sizeof(w->stats));
+#else
+  (void)w;
+#endif
+}
+
+void npycrf_stats_add(npycrf_stats_t *dst, const npycrf_stats_t *src) {
+  if (!dst || !src) return;
+  dst->lattices += src->lattices;
+  dst->codepoints += src->codepoints;
+  dst->trie_steps += src->trie_steps;
+  dst->spans += src->spans;
+  dst->span_hits += src->span_hits;
+  dst->bigram_lookups += src->bigram_lookups;
+  dst->bigram_hits += src->bigram_hits;
+  dst->dp_states += src->dp_states;
+  dst->dp_neg_inf += src->dp_neg_inf;
+  dst->regrows += src->regrows;
+}
+
+size_t npycrf_bigram_index_size(const npycrf_lm_t *lm) {
+  if (!lm || !lm->bigram_key || lm->bigram_size == 0 || lm->vocab_size == 0) return 0;
+  return ((size_t)lm->vocab_size + 1u) * sizeof(uint32_t);
+}
+
+int npycrf_lm_build_bigram_index(npycrf_lm_t *lm, uint32_t *row, size_t row_size) {
+  if (!lm || !row) return -1;
+  size_t need = npycrf_bigram_index_size(lm);
+  if (need == 0) return -1;
+  if (row_size < need) return -2;
+
+  uint32_t rows = lm->vocab_size;
+  uint32_t i = 0;
+  for (uint32_t p = 0; p <= rows; p++) {
+    /* row[p] = prev_id >= p となる最初のエントリ */
+    while (i < lm->bigram_size && (lm->bigram_key[i] >> 16) < p) {
+      if (i > 0 && lm->bigram_key[i - 1] > lm->bigram_key[i]) return -3;
+      i++;
+    }
+    row[p] = i;
+  }
+  /* 残り（BOS等）のソート確認 */
+  for (; i < lm->bigram_size; i++) {
+    if (i > 0 && lm->bigram_key[i - 1] > lm->bigram_key[i]) return -3;
+  }
+
+  lm->bigram_row = row;
+  lm->bigram_rows = rows;
+  return 0;
+}
+
+size_t npycrf_term_index_size(const npycrf_lm_t *lm) {
+  if (!lm || (!lm->trie16 && (!lm->trie.base || !lm->trie.check)) || lm->trie.capacity < 2u) return 0;
+  return lm->trie.capacity * sizeof(npycrf_id_t);
+}
+
+int npycrf_lm_build_term_index(npycrf_lm_t *lm, npycrf_id_t *term_id, size_t term_size) {
+  if (!lm || !term_id) return -1;
+  size_t need = npycrf_term_index_size(lm);
+  if (need == 0) return -1;
+  if (term_size < need) return -2;
+
+  size_t cap = lm->trie.capacity;
+  for (size_t i = 0; i < cap; i++) term_id[i] = NPYCRF_ID_NONE;
+
+  /* 終端ノード t（BASE<0）の親 p が base[p]+0 == t なら p はヌル文字遷移を持つ */
+  for (size_t t = 1; t < cap; t++) {
+    da_index_t v = lm_base(lm, t);
+    if (v >= 0) continue;
+    da_index_t p = lm_check(lm, t);
+    if (p <= 0 || (size_t)p >= cap) continue;
+    da_index_t bp = lm_base(lm, (size_t)p);
+    if (bp <= 0 || (size_t)bp != t) continue;
+    uint32_t id = (uint32_t)(-v - 1);
+    if (id <= 0xFFFFu) term_id[p] = (npycrf_id_t)id;
+  }
+
+  lm->term_id = term_id;
+  return 0;
+}
+
+/* ======================================================================
+ * コンパクト形式
+ * ====================================================================== */
+
+/* 使用中の最大ノード+1（これ以降の BASE/CHECK は全て0） */
+static size_t trie_used_capacity(const da_trie_ro_t *da) {
+  size_t cap = da->capacity;
+  while (cap > 2u && da->base[cap - 1u] == 0 && da->check[cap - 1u] == 0) cap--;
+  return cap;
+}
+
+static int trie_fits_i16(const da_trie_ro_t *da, size_t cap) {
+  for (size_t i = 0; i < cap; i++) {
+    if (da->base[i] < -32768 || da->base[i] > 32767) return 0;
+    if (da->check[i] < -32768 || da->check[i] > 32767) return 0;
+  }
+  return 1;
+}
+
+static size_t varint_len(uint32_t v) {
+  size_t n = 1;
+  while (v >= 0x80u) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static uint8_t *varint_write(uint8_t *p, uint32_t v) {
+  while (v >= 0x80u) {
+    *p++ = (uint8_t)(v | 0x80u);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+/* バイグラムキー差分の合計バイト数（ブロック先頭は索引に入るので数えない） */
+static size_t bigram_delta_bytes(const npycrf_lm_t *lm) {
+  size_t n = 0;
+  for (uint32_t i = 1; i < lm->bigram_size; i++) {
+    if (i % NPYCRF_BIGRAM_BLOCK == 0) continue;
+    n += varint_len(lm->bigram_key[i] - lm->bigram_key[i - 1u]);
+  }
+  return n;
+}
+
+/* a[0..n) の最小値を off、255段で最大値まで届く幅を scale とする */
+static npycrf_q8_t q8_fit(const int16_t *a, size_t n) {
+  npycrf_q8_t q = {0, 1};
+  if (n == 0) return q;
+  int32_t lo = a[0], hi = a[0];
+  for (size_t i = 1; i < n; i++) {
+    if (a[i] < lo) lo = a[i];
+    if (a[i] > hi) hi = a[i];
+  }
+  int32_t scale = (hi - lo + 254) / 255;
+  q.off = (int16_t)lo;
+  q.scale = (uint16_t)(scale > 0 ? scale : 1);
+  return q;
+}
+
+static uint8_t q8_encode(npycrf_q8_t q, int16_t v) {
+  int32_t x = ((int32_t)v - (int32_t)q.off + (int32_t)q.scale / 2) / (int32_t)q.scale;
+  if (x > 255) x = 255;
+  while (x > 0 && (int32_t)q.off + x * (int32_t)q.scale > 32767) x--;
+  return (uint8_t)x;
+}
+
+size_t npycrf_lm_compact_size(const npycrf_lm_t *lm) {
+  if (!lm || lm->trie16 || lm->logp_uni_q8 || lm->bigram_blk) return 0;
+  if (!lm->trie.base || !lm->trie.check || lm->trie.capacity < 2u) return 0;
+  if (!lm->logp_uni || lm->vocab_size == 0) return 0;
+
+  size_t bytes = 0;
+  if (lm->bigram_key && lm->logp_bi && lm->bigram_size > 0) {
+    size_t nblk = ((size_t)lm->bigram_size + NPYCRF_BIGRAM_BLOCK - 1u) / NPYCRF_BIGRAM_BLOCK;
+    bytes += nblk * 2u * sizeof(uint32_t);
+    bytes += (size_t)lm->bigram_size + bigram_delta_bytes(lm);
+  }
+  size_t cap = trie_used_capacity(&lm->trie);
+  if (trie_fits_i16(&lm->trie, cap)) bytes += cap * 2u * sizeof(int16_t);
+  bytes += lm->vocab_size;
+  return bytes;
+}
+
+int npycrf_lm_compact(const npycrf_lm_t *src, npycrf_lm_t *dst, void *buf, size_t buf_size) {
+  if (!src || !dst || !buf || src == dst) return -1;
+  size_t need = npycrf_lm_compact_size(src);
+  if (need == 0) return -1;
+  if (buf_size < need) return -2;
+
+  int has_bi = (src->bigram_key && src->logp_bi && src->bigram_size > 0);
+  for (uint32_t i = 1; has_bi && i < src->bigram_size; i++) {
+    if (src->bigram_key[i - 1u] > src->bigram_key[i]) return -3;
   }
-  return curr_backoff;  /* 未発見→バックオフ */
+
+  size_t cap = trie_used_capacity(&src->trie);
+  *dst = *src;
+  dst->trie.capacity = cap;
+  dst->logp_uni = NULL;
+  dst->logp_bi = NULL;
+  dst->bigram_key = NULL;
+  dst->bigram_row = NULL;
+  dst->bigram_rows = 0;
+
+  /* 整列の厳しい順に配置: ブロック索引(u32) → トライ(i16) → 8bit 表と差分 */
+  uint8_t *p = (uint8_t *)buf;
+  uint32_t *blk = NULL;
+  if (has_bi) {
+    uint32_t nblk = (src->bigram_size + NPYCRF_BIGRAM_BLOCK - 1u) / NPYCRF_BIGRAM_BLOCK;
+    blk = (uint32_t *)(void *)p;
+    p += (size_t)nblk * 2u * sizeof(uint32_t);
+    dst->bigram_blk = blk;
+    dst->bigram_nblk = nblk;
+    dst->bi_q8 = q8_fit(src->logp_bi, src->bigram_size);
+    uint8_t *q = p;
+    p += src->bigram_size;
+    dst->logp_bi_q8 = q;
+    for (uint32_t i = 0; i < src->bigram_size; i++) q[i] = q8_encode(dst->bi_q8, src->logp_bi[i]);
+    /* 差分列は末尾（トライ・ユニグラムの後ろ）に置く */
+  }
+
+  if (trie_fits_i16(&src->trie, cap)) {
+    int16_t *t16 = (int16_t *)(void *)p;
+    p += cap * 2u * sizeof(int16_t);
+    for (size_t i = 0; i < cap; i++) {
+      t16[2u * i] = (int16_t)src->trie.base[i];
+      t16[2u * i + 1u] = (int16_t)src->trie.check[i];
+    }
+    dst->trie16 = t16;
+    dst->trie.base = NULL;
+    dst->trie.check = NULL;
+  }
+
+  uint8_t *uq = p;
+  p += src->vocab_size;
+  dst->uni_q8 = q8_fit(src->logp_uni, src->vocab_size);
+  for (uint32_t i = 0; i < src->vocab_size; i++) uq[i] = q8_encode(dst->uni_q8, src->logp_uni[i]);
+  dst->logp_uni_q8 = uq;
+
+  if (has_bi) {
+    uint8_t *d = p;
+    dst->bigram_delta = d;
+    for (uint32_t i = 0; i < src->bigram_size; i++) {
+      if (i % NPYCRF_BIGRAM_BLOCK == 0) {
+        blk[2u * (i / NPYCRF_BIGRAM_BLOCK)] = src->bigram_key[i];
+        blk[2u * (i / NPYCRF_BIGRAM_BLOCK) + 1u] = (uint32_t)(p - d);
+      } else {
+        p = varint_write(p, src->bigram_key[i] - src->bigram_key[i - 1u]);
+      }
+    }
+    dst->bigram_delta_bytes = (uint32_t)(p - d);
+  }
+  return 0;
 }
 
 /*
@@ -635,138 +1132,123 @@ static inline size_t span_index(uint16_t end_pos, uint16_t len, uint16_t L) {
  * ====================================================================== */
 
 /*
- * CRF放射スコアを事前計算
+ * ラベル0/1の放射スコアを求める
  *
- * 各位置でラベル0/1の放射スコアを計算し、
- * emit0の累積和も計算（区間和の高速計算用）
+ * crf.emit_tab があれば1回の表参照、なければ素性の二分探索。
  */
-static int precompute_emissions(const npycrf_model_t *m,
-                                const uint8_t *utf8, size_t len,
-                                const uint16_t *off, uint16_t n_cp,
-                                npycrf_work_t *w) {
-  if (!m || !utf8 || !off || !w) return -1;
-
-  /* 各位置の文字クラスと放射スコアを計算 */
-  for (uint16_t i = 0; i < n_cp; i++) {
-    size_t pos = off[i];
-    size_t end = off[i + 1];
-    (void)end;
-
-    /* 現在位置のコードポイントをデコード */
-    uint32_t cp = 0;
-    size_t tmp = pos;
-    if (!utf8_decode1(utf8, len, &tmp, &cp)) return -2;
-
-    uint8_t cur = char_class(cp);
-
-    /* 前位置の文字クラス（先頭ならBOS） */
-    uint8_t prev = CC_BOS;
-    if (i > 0) {
-      size_t ppos = off[i - 1];
-      uint32_t pcp = 0;
-      size_t t2 = ppos;
-      if (!utf8_decode1(utf8, len, &t2, &pcp)) return -2;
-      prev = char_class(pcp);
-    }
-
-    /* 次位置の文字クラス（末尾ならEOS） */
-    uint8_t next = CC_EOS;
-    if (i + 1 < n_cp) {
-      size_t npos = off[i + 1];
-      uint32_t ncpv = 0;
-      size_t t3 = npos;
-      if (!utf8_decode1(utf8, len, &t3, &ncpv)) return -2;
-      next = char_class(ncpv);
+static inline void crf_emit_pair(const npycrf_crf_t *crf,
+                                 uint8_t prev, uint8_t cur, uint8_t next,
+                                 int16_t *out_e0, int16_t *out_e1) {
+  uint8_t ncls = crf->emit_ncls;
+  if (crf->emit_tab && ncls > 0 && ncls <= NPYCRF_EMIT_NCLS_MAX) {
+    int ip = emit_dense_index(prev, ncls);
+    int ic = emit_dense_index(cur, ncls);
+    int in = emit_dense_index(next, ncls);
+    if (ip >= 0 && ic >= 0 && in >= 0) {
+      size_t d = (size_t)ncls + 2u;
+      size_t k = ((size_t)ip * d + (size_t)ic) * d + (size_t)in;
+      *out_e0 = crf->emit_tab[k];
+      *out_e1 = crf->emit_tab[d * d * d + k];  /* label 1 は後半 */
+      return;
     }
-
-    /* ラベル0/1の放射スコアを計算 */
-    w->emit0[i] = crf_emit_pos(&m->crf, 0u, prev, cur, next);
-    w->emit1[i] = crf_emit_pos(&m->crf, 1u, prev, cur, next);
-  }
-
-  /* emit0の累積和を計算（区間[s+1, t)の和 = pref[t] - pref[s+1]） */
-  w->pref_emit0[0] = 0;
-  for (uint16_t i = 0; i < n_cp; i++) {
-    w->pref_emit0[i + 1] = (int32_t)w->pref_emit0[i] + (int32_t)w->emit0[i];
   }
+  *out_e0 = crf_emit_pos(crf, 0u, prev, cur, next);
+  *out_e1 = crf_emit_pos(crf, 1u, prev, cur, next);
+}
 
-  return 0;
+/*
+ * 位置 i の放射を確定し、emit0の累積和 pref[i+1] を更新
+ *
+ * 区間[s+1, t)の和 = pref[t] - pref[s+1]
+ */
+static inline void lattice_emit(const npycrf_model_t *m, npycrf_work_t *w, size_t i,
+                                uint8_t prev, uint8_t cur, uint8_t next) {
+  crf_emit_pair(&m->crf, prev, cur, next, &w->emit0[i], &w->emit1[i]);
+  w->pref_emit0[i + 1u] = (int32_t)w->pref_emit0[i] + (int32_t)w->emit0[i];
 }
 
 /*
- * スパン情報を事前計算
+ * UTF-8デコード・放射・スパン情報を1パスで事前計算
  *
- * 全(終了位置, 長さ)ペアについて:
- *  - 辞書トライから単語IDを検索
- *  - ユニグラム/未知語対数確率を計算
+ * 各コードポイントを1回だけデコードし、同じループで以下を進める:
+ *  - cp_off の構築
+ *  - 文字クラス（前・現在・次を順送りで保持し、次の文字を読んだ時点で放射を確定）
+ *  - トライ走査（開始位置ごとの走査ノードを L 個保持し、新しい文字で一斉に進める。
+ *    コードポイント単位トライなら1文字1遷移）
+ *  - 終了位置 c+1 のスパン行（有効な長さ 1..min(c+1, L) のセルだけ初期化・確定）
+ *
+ * 走査ノードは DP 初期化前の dp_ring を一時領域として使う。
+ * bp_prevlen は DP が読む前に必ず書くため初期化しない。
+ *
+ * @return コードポイント数（0=無効なUTF-8、容量不足、空入力）
  */
-static int precompute_spans(const npycrf_model_t *m,
-                            const uint8_t *utf8, size_t len,
-                            const uint16_t *off, uint16_t n_cp,
-                            npycrf_work_t *w) {
-  if (!m || !utf8 || !off || !w) return -1;
+static size_t precompute_lattice(const npycrf_model_t *m,
+                                 const uint8_t *utf8, size_t len,
+                                 npycrf_work_t *w) {
   uint16_t L = m->max_word_len;
-  if (L == 0) return -1;
-
-  if (n_cp > w->max_n_cp || L > w->max_word_len) return -2;
-
-  size_t ncp1 = (size_t)n_cp + 1u;
   size_t L1 = (size_t)L + 1u;
-  size_t spanN = ncp1 * L1;
-
-  /* スパンテーブルを初期化 */
-  for (size_t i = 0; i < spanN; i++) {
-    w->span_id[i] = NPYCRF_ID_NONE;
-    w->span_luni[i] = 0;
-    w->bp_prevlen[i] = 0;
-  }
+  int walk = lm_has_trie(&m->lm);
+  da_index_t *node = (da_index_t *)w->dp_ring;  /* [L]、開始位置 s は node[s % L] */
 
   /* BOS状態（位置0、長さ0）を設定 */
-  w->span_id[span_index(0, 0, L)] = NPYCRF_ID_BOS;
-  w->span_luni[span_index(0, 0, L)] = 0;
-
-  /* 各開始位置からトライを辿って既知語IDを設定 */
-  for (uint16_t start_cp = 0; start_cp < n_cp; start_cp++) {
-    da_index_t node = 1;  /* トライルート */
-    uint16_t max_l = (uint16_t)((start_cp + L <= n_cp) ? L : (n_cp - start_cp));
-
-    for (uint16_t l = 1; l <= max_l; l++) {
-      /* start_cp + l - 1 位置のコードポイントのバイトを消費 */
-      uint16_t cp_i = (uint16_t)(start_cp + l - 1);
-      size_t b0 = off[cp_i];
-      size_t b1 = off[cp_i + 1];
-      for (size_t bi = b0; bi < b1; bi++) {
-        node = da_next_ro_local(&m->lm.trie, node, utf8[bi]);
-        if (node == 0) break;  /* 遷移失敗 */
-      }
-      if (node == 0) break;
-
-      /* ヌル文字で終端チェック */
-      da_index_t term = da_next_ro_local(&m->lm.trie, node, 0u);
-      if (term != 0) {
-        da_index_t v = m->lm.trie.base[term];
-        if (v < 0) {
-          uint32_t id = (uint32_t)(-v - 1);
-          if (id <= 0xFFFFu) {
-            uint16_t end_cp = (uint16_t)(start_cp + l);
-            w->span_id[span_index(end_cp, l, L)] = (npycrf_id_t)id;
-          }
-        }
+  w->span_id[0] = NPYCRF_ID_BOS;
+  w->span_luni[0] = 0;
+  w->pref_emit0[0] = 0;
+
+  uint8_t prev = CC_BOS;
+  uint8_t cur = CC_EOS;
+  size_t n = 0;
+  size_t i = 0;
+  while (i < len) {
+    if (n >= w->max_n_cp) return 0;  /* 容量不足 */
+    size_t b0 = i;
+    uint32_t cp = 0;
+    if (!utf8_decode1(utf8, len, &i, &cp)) return 0;  /* 無効なUTF-8 */
+    w->cp_off[n] = (uint16_t)b0;
+
+    uint8_t cls = char_class(cp);
+    uint32_t code = m->lm.cp_page ? lm_cp_code(&m->lm, cp) : 0u;
+    if (n > 0) {
+      lattice_emit(m, w, n - 1u, prev, cur, cls);
+      prev = cur;
+    }
+    cur = cls;
+
+    /* 終了位置 end = n+1 のスパン行 */
+    size_t end = n + 1u;
+    size_t max_l = (end < (size_t)L) ? end : (size_t)L;
+    npycrf_id_t *sid = w->span_id + end * L1;
+    int16_t *slu = w->span_luni + end * L1;
+    for (size_t l = 1; l <= max_l; l++) sid[l] = NPYCRF_ID_NONE;
+
+    if (walk) {
+      /* 開始位置 n の走査をルートから始める（n-L の走査は不要になる） */
+      node[n % L] = 1;
+      for (size_t l = 1; l <= max_l; l++) {
+        da_index_t *nd = &node[(end - l) % L];
+        da_index_t v = *nd;
+        if (v == 0) continue;  /* この開始位置の走査は既に失敗 */
+        v = trie_advance(&m->lm, v, code, utf8 + b0, i - b0);
+        STAT_ADD(w, trie_steps, 1);
+        *nd = v;
+        if (v != 0) sid[l] = trie_term(&m->lm, v);
       }
     }
-  }
 
-  /* 全スパン(長さ>=1)のユニグラム/OOV対数確率を計算 */
-  for (uint16_t end_cp = 1; end_cp <= n_cp; end_cp++) {
-    uint16_t max_l = (uint16_t)((end_cp <= L) ? end_cp : L);
-    for (uint16_t l = 1; l <= max_l; l++) {
-      size_t idx = span_index(end_cp, l, L);
-      npycrf_id_t id = w->span_id[idx];
-      w->span_luni[idx] = lm_unigram_logp(&m->lm, id, l);
+    for (size_t l = 1; l <= max_l; l++) {
+      slu[l] = lm_unigram_logp(&m->lm, sid[l], (uint16_t)l);
+      STAT_ADD(w, span_hits, sid[l] != NPYCRF_ID_NONE);
     }
+    STAT_ADD(w, spans, max_l);
+    n++;
   }
+  if (n == 0) return 0;
+  STAT_ADD(w, lattices, 1);
+  STAT_ADD(w, codepoints, n);
 
-  return 0;
+  w->cp_off[n] = (uint16_t)len;  /* 終端オフセット */
+  lattice_emit(m, w, n - 1u, prev, cur, CC_EOS);
+  return n;
 }
 
 /* ======================================================================
@@ -814,61 +1296,73 @@ static inline npycrf_score_t crf_seg_score(const npycrf_model_t *m, const npycrf
   return score;
 }
 
+/* ======================================================================
+ * ステージ計測（NPYCRF_PROFILE）
+ * ====================================================================== */
+
+#ifdef NPYCRF_PROFILE
+static uint64_t (*g_prof_now)(void) = NULL;
+
+void npycrf_profile_set_clock(uint64_t (*now)(void)) {
+  g_prof_now = now;
+}
+
+#define PROF_NOW() (g_prof_now ? g_prof_now() : 0u)
+/* 直前の区切りからの経過時間を field に加算し、区切りを更新 */
+#define PROF_MARK(w, field, t)           \
+  do {                                   \
+    uint64_t t1_ = PROF_NOW();           \
+    (w)->prof.field += t1_ - (t);        \
+    (t) = t1_;                           \
+  } while (0)
+#else
+#define PROF_MARK(w, field, t) ((void)0)
+#endif
+
 /* ======================================================================
  * ビタビデコード
  * ====================================================================== */
 
 /*
- * 半マルコフラティス上のビタビアルゴリズム
+ * 半マルコフラティス上のビタビアルゴリズム（事前計算済みのラティスに対して）
  *
  * 状態: (位置, 最後の単語長)
  * 遷移: 長さkの単語を追加して位置を進める
  *
  * DPリングバッファ:
  *  - メモリ効率のため、位置を (L+1) でmod
- *  - 過去L+1位置分のスコアのみ保持
+ *  - 過去L+1位置分のスコアのみ保持（各行は書く直前にクリアするので、
+ *    初期化は位置0の行だけでよい）
  *
  * バックポインタ:
  *  - 各(位置, 長さ)での最適な前単語長を記録
  *  - 最後にバックトラックして境界を復元
  */
-int npycrf_decode(const npycrf_model_t *model,
-                  const uint8_t *utf8, size_t len,
-                  npycrf_work_t *work,
-                  uint16_t *out_b_cp, size_t out_b_cap,
-                  size_t *out_b_count,
-                  npycrf_score_t *out_best_score) {
-  if (!model || !utf8 || !work || !out_b_cp || !out_b_count) return -1;
-  if (model->max_word_len == 0) return -1;
-
-  /* 1) コードポイントオフセットを構築 */
-  if (!work->cp_off || work->max_n_cp == 0) return -2;
-  size_t n_cp_sz = npycrf_utf8_make_offsets(utf8, len, work->cp_off, (size_t)work->max_n_cp + 1u);
-  if (n_cp_sz == 0) return -3;
-  if (n_cp_sz > work->max_n_cp) return -3;
-
-  uint16_t n_cp = (uint16_t)n_cp_sz;
+static int viterbi_decode(const npycrf_model_t *model, npycrf_work_t *work, uint16_t n_cp,
+                          uint16_t *out_b_cp, size_t out_b_cap,
+                          size_t *out_b_count,
+                          npycrf_score_t *out_best_score) {
   uint16_t L = model->max_word_len;
-  if (L > work->max_word_len) return -4;
-
-  /* 最低2境界スロット必要（0とn） */
-  if (out_b_cap < 2u) return -5;
-
-  /* 2) 放射スコアとスパン情報を事前計算 */
-  int rc = precompute_emissions(model, utf8, len, work->cp_off, n_cp, work);
-  if (rc != 0) return -10;
-  rc = precompute_spans(model, utf8, len, work->cp_off, n_cp, work);
-  if (rc != 0) return -11;
-
-  /* 3) 半マルコフラティス上のビタビDP */
   size_t L1 = (size_t)L + 1u;
 
-  /* DPリングバッファを負の無限大で初期化 */
-  for (size_t i = 0; i < L1 * L1; i++) work->dp_ring[i] = NPYCRF_SCORE_NEG_INF;
+#ifdef NPYCRF_PROFILE
+  uint64_t prof_t = PROF_NOW();
+#endif
 
   /* 初期状態: dp[0][0] = bos_to1 */
+  for (size_t k = 0; k < L1; k++) work->dp_ring[k] = NPYCRF_SCORE_NEG_INF;
   work->dp_ring[0 * L1 + 0] = (npycrf_score_t)model->crf.bos_to1;
 
+  /*
+   * ユニグラムのみ（バイグラム表なし）の場合、LM 項は前単語に依存しないので
+   * 前状態の選択は「前位置の行の最大値」だけで決まる。
+   * 各位置の行を埋めた直後に最大値と最初の argmax を求め、
+   * 行のスロット0（pos>0 では未使用）と bp_prevlen の k=0（未使用）に置いておく。
+   * j ループが O(L) から O(1) になり、比較順も同じなので結果はスカラー版と一致する。
+   */
+  const npycrf_lm_t *lmp = &model->lm;
+  int uni_only = !lm_has_bigram(lmp);
+
   /* 前向きDP */
   for (uint16_t pos = 1; pos <= n_cp; pos++) {
     /* この位置のリング行をクリア */
@@ -898,11 +1392,25 @@ int npycrf_decode(const npycrf_model_t *model,
       uint16_t prev_pos = start;
       uint16_t prev_row = (uint16_t)(prev_pos % (L + 1u));
 
+      if (uni_only && prev_pos > 0) {
+        npycrf_score_t prev_best = work->dp_ring[(size_t)prev_row * L1 + 0];
+        if (prev_best != NPYCRF_SCORE_NEG_INF) {
+          npycrf_score_t add = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)curr_luni);
+          best = prev_best + seg + add;
+          best_j = work->bp_prevlen[span_index(prev_pos, 0, L)];
+        }
+        work->dp_ring[(size_t)row * L1 + k] = best;
+        work->bp_prevlen[span_index(pos, k, L)] = best_j;
+        STAT_ADD(work, dp_states, 1);
+        STAT_ADD(work, dp_neg_inf, best == NPYCRF_SCORE_NEG_INF);
+        continue;
+      }
+
       /* j=0（BOS）は prev_pos==0 の場合のみ有効 */
       if (prev_pos == 0) {
         npycrf_score_t prev_score = work->dp_ring[(size_t)prev_row * L1 + 0];
         if (prev_score != NPYCRF_SCORE_NEG_INF) {
-          int16_t lm = lm_bigram_logp(&model->lm, NPYCRF_ID_BOS, curr_id, curr_luni);
+          int16_t lm = LM_BIGRAM(work, &model->lm, NPYCRF_ID_BOS, curr_id, curr_luni);
           npycrf_score_t add = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
           npycrf_score_t cand = prev_score + seg + add;
           best = cand;
@@ -920,7 +1428,7 @@ int npycrf_decode(const npycrf_model_t *model,
         npycrf_id_t prev_id = work->span_id[idx_prev];
 
         /* バイグラムLMスコア */
-        int16_t lm = lm_bigram_logp(&model->lm, prev_id, curr_id, curr_luni);
+        int16_t lm = LM_BIGRAM(work, &model->lm, prev_id, curr_id, curr_luni);
         npycrf_score_t add = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
 
         npycrf_score_t cand = prev_score + seg + add;
@@ -932,10 +1440,27 @@ int npycrf_decode(const npycrf_model_t *model,
 
       work->dp_ring[(size_t)row * L1 + k] = best;
       work->bp_prevlen[span_index(pos, k, L)] = best_j;
+      STAT_ADD(work, dp_states, 1);
+      STAT_ADD(work, dp_neg_inf, best == NPYCRF_SCORE_NEG_INF);
+    }
+
+    if (uni_only) {
+      /* この行の最大値と最初の argmax（すべて -inf なら argmax=0） */
+      npycrf_score_t rbest = NPYCRF_SCORE_NEG_INF;
+      uint8_t rarg = 0;
+      for (uint16_t k = 1; k <= kmax; k++) {
+        npycrf_score_t v = work->dp_ring[(size_t)row * L1 + k];
+        if (v > rbest) {
+          rbest = v;
+          rarg = (uint8_t)k;
+        }
+      }
+      work->dp_ring[(size_t)row * L1 + 0] = rbest;
+      work->bp_prevlen[span_index(pos, 0, L)] = rarg;
     }
   }
 
-  /* 4) 最良終端状態を選択 */
+  /* 最良終端状態を選択 */
   uint16_t end_row = (uint16_t)(n_cp % (L + 1u));
   npycrf_score_t best_final = NPYCRF_SCORE_NEG_INF;
   uint16_t best_k = 0;
@@ -949,18 +1474,10 @@ int npycrf_decode(const npycrf_model_t *model,
     }
   }
 
-  /* 空文字列の場合 */
-  if (n_cp == 0) {
-    out_b_cp[0] = 0;
-    out_b_cp[1] = 0;
-    *out_b_count = 2;
-    if (out_best_score) *out_best_score = work->dp_ring[0];
-    return 0;
-  }
-
+  PROF_MARK(work, dp, prof_t);
   if (best_k == 0 || best_final == NPYCRF_SCORE_NEG_INF) return -20;
 
-  /* 5) バックトラックで境界を復元 */
+  /* バックトラックで境界を復元 */
   if (out_b_cap < (size_t)n_cp + 1u) {
     return -21;  /* 出力バッファ不足 */
   }
@@ -994,6 +1511,8 @@ int npycrf_decode(const npycrf_model_t *model,
     out_b_cp[bcnt - 1u - i] = tmp;
   }
 
+  PROF_MARK(work, backtrack, prof_t);
+
   /* 境界が0で始まりn_cpで終わることを確認 */
   if (out_b_cp[0] != 0 || out_b_cp[bcnt - 1u] != n_cp) return -24;
 
@@ -1002,14 +1521,1110 @@ int npycrf_decode(const npycrf_model_t *model,
   return 0;
 }
 
-/* ======================================================================
- * Subword Regularization（確率的分割）
- * ====================================================================== */
-
-static inline uintptr_t align_up_uintptr(uintptr_t p, size_t align) {
-  return (p + (uintptr_t)(align - 1u)) & ~(uintptr_t)(align - 1u);
-}
-
+int npycrf_decode(const npycrf_model_t *model,
+                  const uint8_t *utf8, size_t len,
+                  npycrf_work_t *work,
+                  uint16_t *out_b_cp, size_t out_b_cap,
+                  size_t *out_b_count,
+                  npycrf_score_t *out_best_score) {
+  if (!model || !utf8 || !work || !out_b_cp || !out_b_count) return -1;
+  if (model->max_word_len == 0) return -1;
+
+  if (!work->cp_off || work->max_n_cp == 0) return -2;
+  uint16_t L = model->max_word_len;
+  if (L > work->max_word_len) return -4;
+
+#ifdef NPYCRF_PROFILE
+  uint64_t prof_t = PROF_NOW();
+  work->prof.calls++;
+#endif
+
+  /* 1-2) コードポイントオフセット・放射スコア・スパン情報を1パスで事前計算 */
+  size_t n_cp_sz = precompute_lattice(model, utf8, len, work);
+  PROF_MARK(work, lattice, prof_t);
+  if (n_cp_sz == 0) return -3;
+
+  /* 最低2境界スロット必要（0とn） */
+  if (out_b_cap < 2u) return -5;
+
+  /* 3-5) ビタビDP・終端選択・バックトラック */
+  return viterbi_decode(model, work, (uint16_t)n_cp_sz, out_b_cp, out_b_cap,
+                        out_b_count, out_best_score);
+}
+
+int npycrf_decode_batch(const npycrf_model_t *model,
+                        const uint8_t *utf8, const size_t *sent_off, size_t n_sent,
+                        npycrf_work_t *work,
+                        uint16_t *out_b, size_t out_b_cap, size_t *out_b_count,
+                        npycrf_id_t *out_ids, size_t out_ids_cap,
+                        npycrf_score_t *out_score) {
+  if (!model || !sent_off || !work || (n_sent > 0 && (!utf8 || !out_b || !out_b_count))) return -1;
+  if (model->max_word_len == 0) return -1;
+  if (n_sent == 0) return 0;
+
+  if (!work->cp_off || work->max_n_cp == 0) return -2;
+  if (model->max_word_len > work->max_word_len) return -4;
+
+  size_t used = 0;
+  size_t used_ids = 0;
+  for (size_t i = 0; i < n_sent; i++) {
+    if (sent_off[i + 1u] < sent_off[i]) return -1;
+    size_t len = sent_off[i + 1u] - sent_off[i];
+    out_b_count[i] = 0;
+    if (out_score) out_score[i] = 0;
+    if (len == 0) continue;  /* 空の文 */
+
+#ifdef NPYCRF_PROFILE
+    uint64_t prof_t = PROF_NOW();
+    work->prof.calls++;
+#endif
+    size_t n = precompute_lattice(model, utf8 + sent_off[i], len, work);
+    PROF_MARK(work, lattice, prof_t);
+    if (n == 0) return -3;
+
+    /* ラティスがキャッシュにあるうちに DP・ID・バイト境界まで済ませる */
+    uint16_t *b = out_b + used;
+    size_t cnt = 0;
+    int rc = viterbi_decode(model, work, (uint16_t)n, b, out_b_cap - used, &cnt,
+                            out_score ? &out_score[i] : NULL);
+    if (rc != 0) return rc;
+    if (out_ids) {
+      if (npycrf_boundaries_to_ids(model, work, b, cnt, out_ids + used_ids, out_ids_cap - used_ids) != 0) {
+        return -25;
+      }
+      used_ids += cnt - 1u;
+    }
+    npycrf_boundaries_cp_to_bytes(work->cp_off, b, cnt, b);
+    out_b_count[i] = cnt;
+    used += cnt;
+  }
+  return 0;
+}
+
+int npycrf_boundaries_to_ids(const npycrf_model_t *model, const npycrf_work_t *work,
+                             const uint16_t *b_cp, size_t b_count,
+                             npycrf_id_t *out_ids, size_t out_cap) {
+  if (!model || !work || !work->span_id || !b_cp || (b_count > 1u && !out_ids)) return -1;
+  if (b_count < 2u) return 0;
+  if (out_cap < b_count - 1u) return -2;
+
+  uint16_t L = model->max_word_len;
+  for (size_t i = 0; i + 1u < b_count; i++) {
+    uint16_t s = b_cp[i];
+    uint16_t t = b_cp[i + 1u];
+    if (t <= s || (uint16_t)(t - s) > L || t > work->max_n_cp) return -3;
+    out_ids[i] = work->span_id[span_index(t, (uint16_t)(t - s), L)];
+  }
+  return 0;
+}
+
+int npycrf_decode_ids(const npycrf_model_t *model,
+                      const uint8_t *utf8, size_t len,
+                      npycrf_work_t *work,
+                      uint16_t *out_b_cp, size_t out_b_cap,
+                      size_t *out_b_count,
+                      npycrf_id_t *out_ids, size_t out_ids_cap,
+                      npycrf_score_t *out_best_score) {
+  int rc = npycrf_decode(model, utf8, len, work, out_b_cp, out_b_cap, out_b_count, out_best_score);
+  if (rc != 0) return rc;
+  rc = npycrf_boundaries_to_ids(model, work, out_b_cp, *out_b_count, out_ids, out_ids_cap);
+  if (rc == -2) return -25;
+  return (rc == 0) ? 0 : -1;
+}
+
+/* ======================================================================
+ * ストリーミングビタビ
+ * ====================================================================== */
+
+/* リング行の先頭インデックス */
+static inline size_t st_span_row(const npycrf_stream_t *st, uint64_t end_pos) {
+  return (size_t)(end_pos % ((uint64_t)st->L + 2u)) * ((size_t)st->L + 1u);
+}
+
+static inline size_t st_dp_row(const npycrf_stream_t *st, uint64_t pos) {
+  return (size_t)(pos % ((uint64_t)st->L + 1u)) * ((size_t)st->L + 1u);
+}
+
+static inline size_t st_bp_row(const npycrf_stream_t *st, uint64_t pos) {
+  return (size_t)(pos % (uint64_t)st->ring) * ((size_t)st->L + 1u);
+}
+
+/* 合流判定の間隔（コードポイント数） */
+#ifndef NPYCRF_STREAM_SYNC_EVERY
+#define NPYCRF_STREAM_SYNC_EVERY 16u
+#endif
+
+/* DPスコアがこの絶対値を超えたら正規化（NEG_INF との衝突・オーバーフロー防止） */
+#define NPYCRF_STREAM_RENORM ((npycrf_score_t)(1 << 26))
+
+static uint32_t stream_window(uint16_t max_word_len, uint32_t window) {
+  if (window == 0) window = NPYCRF_STREAM_WINDOW_DEFAULT;
+  if (window < max_word_len) window = max_word_len;
+  return window;
+}
+
+size_t npycrf_stream_workbuf_size(uint16_t max_word_len, uint32_t window) {
+  if (max_word_len == 0) return 0;
+  window = stream_window(max_word_len, window);
+
+  size_t L = (size_t)max_word_len;
+  size_t L1 = L + 1u;
+  size_t L2 = L + 2u;
+  size_t R = (size_t)window + 1u;
+  size_t nt = L * L + 1u;
+
+  size_t bytes = 0;
+  bytes += 8 + R * sizeof(uint64_t);              /* byte_off */
+  bytes += 8 + nt * sizeof(uint64_t);             /* trace_pos */
+  bytes += 4 + L * sizeof(da_index_t);            /* trie_node */
+  bytes += 4 + L1 * L1 * sizeof(uint32_t);        /* trace_mark */
+  bytes += 4 + L2 * sizeof(uint32_t);             /* pref_emit0 */
+  bytes += 4 + L1 * L1 * sizeof(npycrf_score_t);  /* dp_ring */
+  bytes += 2 + L1 * sizeof(int16_t);              /* emit0 */
+  bytes += 2 + L1 * sizeof(int16_t);              /* emit1 */
+  bytes += 2 + L2 * L1 * sizeof(npycrf_id_t);     /* span_id */
+  bytes += 2 + L2 * L1 * sizeof(int16_t);         /* span_luni */
+  bytes += 2 + nt * sizeof(uint16_t);             /* trace_len */
+  bytes += R * L1;                                /* bp_prevlen */
+  return bytes;
+}
+
+int npycrf_stream_init(npycrf_stream_t *st, const npycrf_model_t *model,
+                       void *buf, size_t buf_size, uint32_t window) {
+  if (!st || !model || !buf || model->max_word_len == 0) return -1;
+  memset(st, 0, sizeof(*st));
+
+  uint16_t L = model->max_word_len;
+  window = stream_window(L, window);
+  if (buf_size < npycrf_stream_workbuf_size(L, window)) return -2;
+
+  size_t L1 = (size_t)L + 1u;
+  size_t L2 = (size_t)L + 2u;
+  size_t R = (size_t)window + 1u;
+  size_t nt = (size_t)L * L + 1u;
+
+  /* 各ブロックを適切なアラインメントで配置（大きい型から） */
+  uint8_t *p = (uint8_t *)buf;
+  p = (uint8_t *)align_ptr(p, 8);
+  st->byte_off = (uint64_t *)p;
+  p += R * sizeof(uint64_t);
+  p = (uint8_t *)align_ptr(p, 8);
+  st->trace_pos = (uint64_t *)p;
+  p += nt * sizeof(uint64_t);
+  p = (uint8_t *)align_ptr(p, 4);
+  st->trie_node = (da_index_t *)p;
+  p += (size_t)L * sizeof(da_index_t);
+  p = (uint8_t *)align_ptr(p, 4);
+  st->trace_mark = (uint32_t *)p;
+  p += L1 * L1 * sizeof(uint32_t);
+  p = (uint8_t *)align_ptr(p, 4);
+  st->pref_emit0 = (uint32_t *)p;
+  p += L2 * sizeof(uint32_t);
+  p = (uint8_t *)align_ptr(p, 4);
+  st->dp_ring = (npycrf_score_t *)p;
+  p += L1 * L1 * sizeof(npycrf_score_t);
+  p = (uint8_t *)align_ptr(p, 2);
+  st->emit0 = (int16_t *)p;
+  p += L1 * sizeof(int16_t);
+  p = (uint8_t *)align_ptr(p, 2);
+  st->emit1 = (int16_t *)p;
+  p += L1 * sizeof(int16_t);
+  p = (uint8_t *)align_ptr(p, 2);
+  st->span_id = (npycrf_id_t *)p;
+  p += L2 * L1 * sizeof(npycrf_id_t);
+  p = (uint8_t *)align_ptr(p, 2);
+  st->span_luni = (int16_t *)p;
+  p += L2 * L1 * sizeof(int16_t);
+  p = (uint8_t *)align_ptr(p, 2);
+  st->trace_len = (uint16_t *)p;
+  p += nt * sizeof(uint16_t);
+  st->bp_prevlen = p;
+
+  st->model = model;
+  st->L = L;
+  st->window = window;
+  st->ring = (uint32_t)R;
+  npycrf_stream_reset(st);
+  return 0;
+}
+
+void npycrf_stream_reset(npycrf_stream_t *st) {
+  if (!st || !st->model) return;
+  size_t L1 = (size_t)st->L + 1u;
+  size_t L2 = (size_t)st->L + 2u;
+
+  st->pend_len = 0;
+  st->cls_prev = CC_BOS;
+  st->cls_cur = CC_EOS;
+  st->finished = 0;
+  st->n_bytes = 0;
+  st->n_cp = 0;
+  st->committed = 0;
+  st->score_base = 0;
+
+  for (size_t i = 0; i < L1 * L1; i++) st->dp_ring[i] = NPYCRF_SCORE_NEG_INF;
+  st->dp_ring[0] = (npycrf_score_t)st->model->crf.bos_to1;  /* dp[0][0] */
+  for (size_t i = 0; i < L2 * L1; i++) {
+    st->span_id[i] = NPYCRF_ID_NONE;
+    st->span_luni[i] = 0;
+  }
+  st->span_id[0] = NPYCRF_ID_BOS;  /* (位置0, 長さ0) */
+  for (size_t i = 0; i < st->L; i++) st->trie_node[i] = 0;
+  st->pref_emit0[0] = 0;
+  st->byte_off[0] = 0;
+  for (size_t i = 0; i < L1 * L1; i++) st->trace_mark[i] = 0;
+  st->trace_gen = 0;
+}
+
+/* 位置 i の放射を確定し、累積和 pref[i+1] を更新 */
+static void stream_emit(npycrf_stream_t *st, uint64_t i, uint8_t prev, uint8_t cur, uint8_t next) {
+  uint64_t L1 = (uint64_t)st->L + 1u;
+  uint64_t L2 = (uint64_t)st->L + 2u;
+  size_t e = (size_t)(i % L1);
+  crf_emit_pair(&st->model->crf, prev, cur, next, &st->emit0[e], &st->emit1[e]);
+  st->pref_emit0[(i + 1u) % L2] = st->pref_emit0[i % L2] + (uint32_t)(int32_t)st->emit0[e];
+}
+
+/* コードポイント c（バイト列 b）でトライを進め、終了位置 c+1 のスパン行を作る */
+static void stream_trie_step(npycrf_stream_t *st, uint64_t c, uint32_t cp, const uint8_t *b, size_t nb) {
+  const npycrf_model_t *m = st->model;
+  uint16_t L = st->L;
+  uint64_t end = c + 1u;
+  size_t r = st_span_row(st, end);
+  npycrf_id_t *sid = st->span_id + r;
+  int16_t *slu = st->span_luni + r;
+
+  for (uint16_t l = 0; l <= L; l++) {
+    sid[l] = NPYCRF_ID_NONE;
+    slu[l] = 0;
+  }
+
+  /* 開始位置 c の走査をルートから始める（c-L の走査は不要になる） */
+  st->trie_node[c % L] = 1;
+
+  uint16_t max_l = (uint16_t)((end < (uint64_t)L) ? end : L);
+  int walk = lm_has_trie(&m->lm);
+  uint16_t walk_l = walk ? max_l : 0u;  /* 空トライ: 全て未知語 */
+  uint32_t code = m->lm.cp_page ? lm_cp_code(&m->lm, cp) : 0u;
+  for (uint16_t l = 1; l <= walk_l; l++) {
+    da_index_t *nd = &st->trie_node[(end - l) % L];
+    da_index_t node = *nd;
+    if (node == 0) continue;  /* この開始位置の走査は既に失敗 */
+    node = trie_advance(&m->lm, node, code, b, nb);
+    *nd = node;
+    if (node != 0) sid[l] = trie_term(&m->lm, node);
+  }
+
+  for (uint16_t l = 1; l <= max_l; l++) {
+    slu[l] = lm_unigram_logp(&m->lm, sid[l], l);
+  }
+}
+
+/* 位置 pos のDP行を計算（npycrf_decode の前向きDPと同一の遷移） */
+static void stream_dp_step(npycrf_stream_t *st, uint64_t pos) {
+  const npycrf_model_t *m = st->model;
+  uint16_t L = st->L;
+  uint64_t L1 = (uint64_t)L + 1u;
+  uint64_t L2 = (uint64_t)L + 2u;
+
+  npycrf_score_t *row = st->dp_ring + st_dp_row(st, pos);
+  uint8_t *bp = st->bp_prevlen + st_bp_row(st, pos);
+  for (uint16_t k = 0; k <= L; k++) {
+    row[k] = NPYCRF_SCORE_NEG_INF;
+    bp[k] = 0;
+  }
+
+  const npycrf_id_t *sid_cur = st->span_id + st_span_row(st, pos);
+  const int16_t *slu_cur = st->span_luni + st_span_row(st, pos);
+  uint32_t pref_t = st->pref_emit0[pos % L2];
+
+  uint16_t kmax = (uint16_t)((pos <= (uint64_t)L) ? pos : L);
+  for (uint16_t k = 1; k <= kmax; k++) {
+    uint64_t start = pos - k;
+
+    /* CRFセグメントスコア（crf_seg_score と同じ式） */
+    npycrf_score_t seg;
+    if (k == 1) {
+      seg = (npycrf_score_t)st->emit1[start % L1] + (npycrf_score_t)m->crf.trans11;
+    } else {
+      seg = 0;
+      seg += (npycrf_score_t)st->emit1[start % L1];
+      seg += (npycrf_score_t)m->crf.trans10;
+      seg += (npycrf_score_t)(int32_t)(pref_t - st->pref_emit0[(start + 1u) % L2]);
+      seg += (npycrf_score_t)((int32_t)m->crf.trans00 * (int32_t)(k - 2u));
+      seg += (npycrf_score_t)m->crf.trans01;
+    }
+
+    npycrf_id_t curr_id = sid_cur[k];
+    int16_t curr_luni = slu_cur[k];
+
+    npycrf_score_t best = NPYCRF_SCORE_NEG_INF;
+    uint8_t best_j = 0;
+    const npycrf_score_t *prow = st->dp_ring + st_dp_row(st, start);
+
+    /* j=0（BOS）は start==0 の場合のみ有効 */
+    if (start == 0) {
+      npycrf_score_t prev_score = prow[0];
+      if (prev_score != NPYCRF_SCORE_NEG_INF) {
+        int16_t lm = lm_bigram_logp(&m->lm, NPYCRF_ID_BOS, curr_id, curr_luni);
+        npycrf_score_t add = q16_mul_q8((npycrf_score_t)m->lambda0, (npycrf_score_t)lm);
+        best = prev_score + seg + add;
+        best_j = 0;
+      }
+    }
+
+    const npycrf_id_t *sid_prev = st->span_id + st_span_row(st, start);
+    uint16_t jmax = (uint16_t)((start <= (uint64_t)L) ? start : L);
+    for (uint16_t j = 1; j <= jmax; j++) {
+      npycrf_score_t prev_score = prow[j];
+      if (prev_score == NPYCRF_SCORE_NEG_INF) continue;
+
+      int16_t lm = lm_bigram_logp(&m->lm, sid_prev[j], curr_id, curr_luni);
+      npycrf_score_t add = q16_mul_q8((npycrf_score_t)m->lambda0, (npycrf_score_t)lm);
+
+      npycrf_score_t cand = prev_score + seg + add;
+      if (cand > best) {
+        best = cand;
+        best_j = (uint8_t)j;
+      }
+    }
+
+    row[k] = best;
+    bp[k] = best_j;
+  }
+
+  /* 長い入力でスコアが発散しないよう、生存状態を一律にずらす（argmaxは不変） */
+  npycrf_score_t top = NPYCRF_SCORE_NEG_INF;
+  for (uint16_t k = 1; k <= kmax; k++) {
+    if (row[k] > top) top = row[k];
+  }
+  if (top != NPYCRF_SCORE_NEG_INF && (top < -NPYCRF_STREAM_RENORM || top > NPYCRF_STREAM_RENORM)) {
+    for (size_t i = 0; i < (size_t)L1 * (size_t)L1; i++) {
+      if (st->dp_ring[i] != NPYCRF_SCORE_NEG_INF) st->dp_ring[i] -= top;
+    }
+    st->score_base += (int64_t)top;
+  }
+}
+
+/* 状態 (pos, k) から committed までの境界を確定して出力 */
+static int stream_commit(npycrf_stream_t *st, uint64_t pos, uint16_t k,
+                         uint64_t *out_end, size_t out_cap, size_t *out_count) {
+  size_t base = *out_count;
+  size_t n = 0;
+  uint64_t q = pos;
+  while (q > st->committed) {
+    if (base + n >= out_cap) return -2;
+    out_end[base + n++] = st->byte_off[q % st->ring];
+    if (k == 0 || (uint64_t)k > q) return -20;  /* 無効なバックポインタ */
+    uint64_t s = q - k;
+    if (s < st->committed) return -20;          /* 確定済み境界を跨いだ */
+    uint16_t j = (s > st->committed) ? st->bp_prevlen[st_bp_row(st, q) + k] : 0u;
+    q = s;
+    k = j;
+  }
+
+  /* 逆順に集めたので反転 */
+  for (size_t i = 0; i < n / 2u; i++) {
+    uint64_t t = out_end[base + i];
+    out_end[base + i] = out_end[base + n - 1u - i];
+    out_end[base + n - 1u - i] = t;
+  }
+  *out_count = base + n;
+  st->committed = pos;
+  return 0;
+}
+
+/*
+ * 位置 pos までDPした後の確定処理
+ *
+ * 延長可能な状態（終端 q >= pos+1-L）からバックポインタを同時に辿り、
+ * 1状態に合流したらそこまでを確定。合流せず未確定区間が window に
+ * 達した場合は pos の最良状態で強制同期する。
+ */
+static int stream_sync(npycrf_stream_t *st, uint64_t pos,
+                       uint64_t *out_end, size_t out_cap, size_t *out_count) {
+  uint16_t L = st->L;
+  size_t L1 = (size_t)L + 1u;
+
+  /* 合流判定は間引いて行う（確定が遅れるだけで結果は変わらない） */
+  if (pos % NPYCRF_STREAM_SYNC_EVERY != 0 && pos - st->committed < st->window) return 0;
+
+  uint64_t qlo = (pos + 1u > (uint64_t)L) ? pos + 1u - L : 0u;
+  if (qlo < st->committed) qlo = st->committed;
+
+  /* 生存状態を列挙 */
+  size_t n = 0;
+  for (uint64_t q = qlo; q <= pos; q++) {
+    const npycrf_score_t *row = st->dp_ring + st_dp_row(st, q);
+    uint16_t k0 = (q == 0) ? 0u : 1u;
+    uint16_t k1 = (q == 0) ? 0u : (uint16_t)((q <= (uint64_t)L) ? q : L);
+    for (uint16_t k = k0; k <= k1; k++) {
+      if (row[k] == NPYCRF_SCORE_NEG_INF) continue;
+      st->trace_pos[n] = q;
+      st->trace_len[n] = k;
+      n++;
+    }
+  }
+
+  /* 最も右の状態から1手ずつ戻し、重複を除く */
+  while (n > 1) {
+    uint64_t qmax = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (st->trace_pos[i] > qmax) qmax = st->trace_pos[i];
+    }
+    if (qmax <= st->committed) break;
+
+    for (size_t i = 0; i < n; i++) {
+      if (st->trace_pos[i] != qmax) continue;
+      uint16_t k = st->trace_len[i];
+      uint64_t s = qmax - k;
+      st->trace_len[i] = (s > 0) ? st->bp_prevlen[st_bp_row(st, qmax) + k] : 0u;
+      st->trace_pos[i] = s;
+    }
+
+    /* 状態の位置は常に幅 L+1 以内に収まるので (位置 mod (L+1), 長さ) で一意 */
+    if (++st->trace_gen == 0) {
+      for (size_t i = 0; i < L1 * L1; i++) st->trace_mark[i] = 0;
+      st->trace_gen = 1;
+    }
+    size_t u = 0;
+    for (size_t i = 0; i < n; i++) {
+      size_t key = (size_t)(st->trace_pos[i] % L1) * L1 + st->trace_len[i];
+      if (st->trace_mark[key] == st->trace_gen) continue;
+      st->trace_mark[key] = st->trace_gen;
+      st->trace_pos[u] = st->trace_pos[i];
+      st->trace_len[u] = st->trace_len[i];
+      u++;
+    }
+    n = u;
+  }
+
+  if (n == 1 && st->trace_pos[0] > st->committed) {
+    int rc = stream_commit(st, st->trace_pos[0], st->trace_len[0], out_end, out_cap, out_count);
+    if (rc != 0) return rc;
+  }
+
+  if (pos - st->committed < st->window) return 0;
+
+  /* 強制同期: pos の最良状態以外の延長可能な状態を捨てる */
+  npycrf_score_t *row = st->dp_ring + st_dp_row(st, pos);
+  uint16_t kmax = (uint16_t)((pos <= (uint64_t)L) ? pos : L);
+  uint16_t best_k = 0;
+  npycrf_score_t best = NPYCRF_SCORE_NEG_INF;
+  for (uint16_t k = 1; k <= kmax; k++) {
+    if (row[k] > best) {
+      best = row[k];
+      best_k = k;
+    }
+  }
+  if (best_k == 0) return -20;
+
+  int rc = stream_commit(st, pos, best_k, out_end, out_cap, out_count);
+  if (rc != 0) return rc;
+
+  for (uint16_t k = 0; k <= L; k++) {
+    if (k != best_k) row[k] = NPYCRF_SCORE_NEG_INF;
+  }
+  for (uint64_t q = (pos >= (uint64_t)L) ? pos - L + 1u : 0u; q < pos; q++) {
+    npycrf_score_t *r = st->dp_ring + st_dp_row(st, q);
+    for (uint16_t k = 0; k <= L; k++) r[k] = NPYCRF_SCORE_NEG_INF;
+  }
+  return 0;
+}
+
+/* 1コードポイントを受理 */
+static int stream_push_cp(npycrf_stream_t *st, uint32_t cp, const uint8_t *b, size_t nb,
+                          uint64_t *out_end, size_t out_cap, size_t *out_count) {
+  uint64_t c = st->n_cp;
+  uint8_t cls = char_class(cp);
+  st->byte_off[c % st->ring] = st->n_bytes;
+
+  if (c >= 1u) {
+    /* 次クラスが判明したので位置 c-1 の放射を確定し、位置 c までDP */
+    stream_emit(st, c - 1u, st->cls_prev, st->cls_cur, cls);
+    stream_dp_step(st, c);
+    int rc = stream_sync(st, c, out_end, out_cap, out_count);
+    if (rc != 0) return rc;
+    st->cls_prev = st->cls_cur;
+  }
+  st->cls_cur = cls;
+
+  stream_trie_step(st, c, cp, b, nb);
+  st->n_cp = c + 1u;
+  st->n_bytes += nb;
+  return 0;
+}
+
+/* UTF-8先頭バイトからシーケンス長（無効なら0） */
+static inline size_t utf8_seq_len(uint8_t c0) {
+  if ((c0 & 0x80u) == 0) return 1;
+  if ((c0 & 0xE0u) == 0xC0u) return 2;
+  if ((c0 & 0xF0u) == 0xE0u) return 3;
+  if ((c0 & 0xF8u) == 0xF0u) return 4;
+  return 0;
+}
+
+int npycrf_stream_feed(npycrf_stream_t *st, const uint8_t *data, size_t len,
+                       size_t *out_consumed,
+                       uint64_t *out_end, size_t out_cap, size_t *out_count) {
+  if (!st || !st->model || (!data && len > 0) || !out_consumed || !out_end || !out_count) return -1;
+  *out_consumed = 0;
+  *out_count = 0;
+  if (st->finished) return -1;
+
+  size_t reserve = (size_t)st->window + 1u;
+  if (out_cap < reserve) return -2;
+
+  size_t i = 0;
+  int rc = 0;
+  while (i < len) {
+    /* 1コードポイントで最大 window 個の境界が確定しうる */
+    if (out_cap - *out_count < reserve) break;
+
+    size_t need = utf8_seq_len(st->pend_len ? st->pend[0] : data[i]);
+    if (need == 0) {
+      rc = -3;
+      break;
+    }
+
+    uint8_t b[4];
+    if (st->pend_len > 0 || len - i < need) {
+      /* 前回の残りと連結（足りなければ保留） */
+      size_t take = need - st->pend_len;
+      if (take > len - i) take = len - i;
+      memcpy(st->pend + st->pend_len, data + i, take);
+      st->pend_len = (uint8_t)(st->pend_len + take);
+      i += take;
+      if (st->pend_len < need) break;
+      memcpy(b, st->pend, need);
+      st->pend_len = 0;
+    } else {
+      memcpy(b, data + i, need);
+      i += need;
+    }
+
+    size_t io = 0;
+    uint32_t cp = 0;
+    if (!utf8_decode1(b, need, &io, &cp) || io != need) {
+      rc = -3;
+      break;
+    }
+    rc = stream_push_cp(st, cp, b, need, out_end, out_cap, out_count);
+    if (rc != 0) break;
+  }
+
+  *out_consumed = i;
+  return rc;
+}
+
+int npycrf_stream_finish(npycrf_stream_t *st,
+                         uint64_t *out_end, size_t out_cap, size_t *out_count,
+                         int64_t *out_score) {
+  if (!st || !st->model || !out_end || !out_count) return -1;
+  *out_count = 0;
+  if (st->finished) return -1;
+  if (st->pend_len > 0) return -3;  /* 途中で終わったUTF-8 */
+  if (out_cap < (size_t)st->window + 1u) return -2;
+
+  st->finished = 1;
+  uint64_t n = st->n_cp;
+  if (n == 0) {
+    if (out_score) *out_score = (int64_t)st->dp_ring[0];
+    return 0;
+  }
+
+  /* 末尾位置の放射（次=EOS）と位置 n のDP */
+  st->byte_off[n % st->ring] = st->n_bytes;
+  stream_emit(st, n - 1u, st->cls_prev, st->cls_cur, CC_EOS);
+  stream_dp_step(st, n);
+
+  const npycrf_score_t *row = st->dp_ring + st_dp_row(st, n);
+  uint16_t kmax = (uint16_t)((n <= (uint64_t)st->L) ? n : st->L);
+  uint16_t best_k = 0;
+  npycrf_score_t best = NPYCRF_SCORE_NEG_INF;
+  for (uint16_t k = 1; k <= kmax; k++) {
+    if (row[k] > best) {
+      best = row[k];
+      best_k = k;
+    }
+  }
+  if (best_k == 0) return -20;
+
+  int rc = stream_commit(st, n, best_k, out_end, out_cap, out_count);
+  if (rc != 0) return rc;
+  if (out_score) *out_score = (int64_t)best + st->score_base;
+  return 0;
+}
+
+/* ======================================================================
+ * 差分再デコード
+ * ====================================================================== */
+
+size_t npycrf_incr_workbuf_size(uint16_t max_n_cp, uint16_t max_word_len) {
+  size_t ncp1 = (size_t)max_n_cp + 1u;
+  size_t L1 = (size_t)max_word_len + 1u;
+
+  size_t bytes = npycrf_workbuf_size(max_n_cp, max_word_len);
+  bytes += 4 + ncp1 * L1 * sizeof(npycrf_score_t);  /* dp */
+  bytes += 4 + L1 * sizeof(npycrf_score_t);         /* row_tmp */
+  bytes += 2 + ncp1 * sizeof(uint16_t);             /* b_cp */
+  bytes += 2 + ncp1 * sizeof(uint16_t);             /* b_tmp */
+  return bytes;
+}
+
+int npycrf_incr_init(npycrf_incr_t *inc, const npycrf_model_t *model,
+                     void *buf, size_t buf_size, uint16_t max_n_cp) {
+  if (!inc || !model || !buf || model->max_word_len == 0 || max_n_cp == 0) return -1;
+  memset(inc, 0, sizeof(*inc));
+
+  uint16_t L = model->max_word_len;
+  if (buf_size < npycrf_incr_workbuf_size(max_n_cp, L)) return -2;
+  size_t wsize = npycrf_workbuf_size(max_n_cp, L);
+  if (npycrf_work_init(&inc->work, buf, wsize, max_n_cp, L) != 0) return -2;
+
+  size_t ncp1 = (size_t)max_n_cp + 1u;
+  size_t L1 = (size_t)L + 1u;
+  uint8_t *p = (uint8_t *)buf + wsize;
+  p = (uint8_t *)align_ptr(p, 4);
+  inc->dp = (npycrf_score_t *)p;
+  p += ncp1 * L1 * sizeof(npycrf_score_t);
+  p = (uint8_t *)align_ptr(p, 4);
+  inc->row_tmp = (npycrf_score_t *)p;
+  p += L1 * sizeof(npycrf_score_t);
+  p = (uint8_t *)align_ptr(p, 2);
+  inc->b_cp = (uint16_t *)p;
+  p += ncp1 * sizeof(uint16_t);
+  p = (uint8_t *)align_ptr(p, 2);
+  inc->b_tmp = (uint16_t *)p;
+
+  inc->model = model;
+  return 0;
+}
+
+/* 昇順配列 a[0..n) から v を二分探索（見つかれば 1 と *idx） */
+static int u16_find(const uint16_t *a, size_t n, size_t v, size_t *idx) {
+  size_t lo = 0;
+  size_t hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2u;
+    if ((size_t)a[mid] < v) lo = mid + 1u;
+    else hi = mid;
+  }
+  if (lo < n && (size_t)a[lo] == v) {
+    *idx = lo;
+    return 1;
+  }
+  return 0;
+}
+
+/* コードポイント i の文字クラス（cp_off[i], cp_off[i+1] が確定済みであること） */
+static uint8_t incr_class(const npycrf_work_t *w, const uint8_t *utf8, size_t i) {
+  size_t io = w->cp_off[i];
+  uint32_t cp = 0;
+  (void)utf8_decode1(utf8, w->cp_off[i + 1u], &io, &cp);
+  return char_class(cp);
+}
+
+/* 位置 pos のDP行を row に計算（npycrf_decode の前向きDPと同一の遷移、前の行は dp から読む） */
+static void incr_dp_row(const npycrf_model_t *m, npycrf_work_t *w, const npycrf_score_t *dp,
+                        uint16_t pos, int uni_only, npycrf_score_t *row) {
+  uint16_t L = m->max_word_len;
+  size_t L1 = (size_t)L + 1u;
+  for (uint16_t k = 0; k <= L; k++) row[k] = NPYCRF_SCORE_NEG_INF;
+
+  uint16_t kmax = (uint16_t)((pos <= L) ? pos : L);
+  for (uint16_t k = 1; k <= kmax; k++) {
+    uint16_t start = (uint16_t)(pos - k);
+    npycrf_score_t seg = crf_seg_score(m, w, start, pos);
+    size_t idx_curr = span_index(pos, k, L);
+    npycrf_id_t curr_id = w->span_id[idx_curr];
+    int16_t curr_luni = w->span_luni[idx_curr];
+    const npycrf_score_t *prev = dp + (size_t)start * L1;
+
+    npycrf_score_t best = NPYCRF_SCORE_NEG_INF;
+    uint8_t best_j = 0;
+    if (uni_only && start > 0) {
+      if (prev[0] != NPYCRF_SCORE_NEG_INF) {
+        npycrf_score_t add = q16_mul_q8((npycrf_score_t)m->lambda0, (npycrf_score_t)curr_luni);
+        best = prev[0] + seg + add;
+        best_j = w->bp_prevlen[span_index(start, 0, L)];
+      }
+    } else {
+      if (start == 0 && prev[0] != NPYCRF_SCORE_NEG_INF) {
+        int16_t lm = LM_BIGRAM(w, &m->lm, NPYCRF_ID_BOS, curr_id, curr_luni);
+        npycrf_score_t add = q16_mul_q8((npycrf_score_t)m->lambda0, (npycrf_score_t)lm);
+        best = prev[0] + seg + add;
+      }
+      uint16_t jmax = (uint16_t)((start <= L) ? start : L);
+      for (uint16_t j = 1; j <= jmax; j++) {
+        if (prev[j] == NPYCRF_SCORE_NEG_INF) continue;
+        npycrf_id_t prev_id = w->span_id[span_index(start, j, L)];
+        int16_t lm = LM_BIGRAM(w, &m->lm, prev_id, curr_id, curr_luni);
+        npycrf_score_t add = q16_mul_q8((npycrf_score_t)m->lambda0, (npycrf_score_t)lm);
+        npycrf_score_t cand = prev[j] + seg + add;
+        if (cand > best) {
+          best = cand;
+          best_j = (uint8_t)j;
+        }
+      }
+    }
+    row[k] = best;
+    w->bp_prevlen[span_index(pos, k, L)] = best_j;
+    STAT_ADD(w, dp_states, 1);
+    STAT_ADD(w, dp_neg_inf, best == NPYCRF_SCORE_NEG_INF);
+  }
+
+  if (uni_only) {
+    npycrf_score_t rbest = NPYCRF_SCORE_NEG_INF;
+    uint8_t rarg = 0;
+    for (uint16_t k = 1; k <= kmax; k++) {
+      if (row[k] > rbest) {
+        rbest = row[k];
+        rarg = (uint8_t)k;
+      }
+    }
+    row[0] = rbest;
+    w->bp_prevlen[span_index(pos, 0, L)] = rarg;
+  }
+}
+
+/* 位置 n の行から最良終端状態を選ぶ */
+static int incr_select_final(npycrf_incr_t *inc, uint16_t n) {
+  uint16_t L = inc->model->max_word_len;
+  const npycrf_score_t *row = inc->dp + (size_t)n * ((size_t)L + 1u);
+  uint16_t kmax = (uint16_t)((n <= L) ? n : L);
+  inc->best_k = 0;
+  inc->best_score = NPYCRF_SCORE_NEG_INF;
+  for (uint16_t k = 1; k <= kmax; k++) {
+    if (row[k] > inc->best_score) {
+      inc->best_score = row[k];
+      inc->best_k = k;
+    }
+  }
+  return (inc->best_k == 0) ? -20 : 0;
+}
+
+/*
+ * 状態 (p, k) からバックポインタを辿り、境界を b_tmp の末尾から逆順に書く
+ *
+ * 位置 merge_below 未満で旧境界 b_cp と同じ状態（位置と最終単語長が一致）に
+ * 達したら止める（そこから先の旧パスはバックポインタが変わっていない）。
+ * 止まった位置自体は書かず、その旧境界インデックスを *out_m に返す
+ * （位置0まで辿った場合は 0）。
+ *
+ * @return 書いた境界数、負数=無効なバックポインタ
+ */
+static long incr_walk(npycrf_incr_t *inc, uint16_t p, uint16_t k, size_t merge_below, size_t *out_m) {
+  uint16_t L = inc->model->max_word_len;
+  size_t cap = (size_t)inc->work.max_n_cp + 1u;
+  size_t t = 0;
+  *out_m = 0;
+  while (p > 0) {
+    size_t mi = 0;
+    if ((size_t)p < merge_below && u16_find(inc->b_cp, inc->b_count, p, &mi) && mi > 0 &&
+        inc->b_cp[mi] - inc->b_cp[mi - 1u] == k) {
+      *out_m = mi;
+      return (long)t;
+    }
+    if (t + 1u >= cap) return -23;
+    inc->b_tmp[cap - 1u - t++] = p;
+    if (k == 0 || k > p) return -22;  /* 無効なバックポインタ */
+    uint16_t s = (uint16_t)(p - k);
+    uint16_t j = (s > 0) ? inc->work.bp_prevlen[span_index(p, k, L)] : 0u;
+    p = s;
+    k = j;
+  }
+  return (long)t;
+}
+
+int npycrf_incr_decode(npycrf_incr_t *inc, const uint8_t *utf8, size_t len) {
+  if (!inc || !inc->model || !utf8) return -1;
+  const npycrf_model_t *m = inc->model;
+  npycrf_work_t *w = &inc->work;
+  uint16_t L = m->max_word_len;
+  size_t L1 = (size_t)L + 1u;
+  inc->valid = 0;
+  if (len > 0xFFFFu) return -2;
+
+  size_t n_sz = precompute_lattice(m, utf8, len, w);
+  if (n_sz == 0) return -3;
+  uint16_t n = (uint16_t)n_sz;
+
+  int uni_only = !lm_has_bigram(&m->lm);
+  npycrf_score_t *dp = inc->dp;
+  for (size_t k = 0; k < L1; k++) dp[k] = NPYCRF_SCORE_NEG_INF;
+  dp[0] = (npycrf_score_t)m->crf.bos_to1;
+  for (uint16_t pos = 1; pos <= n; pos++) {
+    incr_dp_row(m, w, dp, pos, uni_only, dp + (size_t)pos * L1);
+  }
+  int rc = incr_select_final(inc, n);
+  if (rc != 0) return rc;
+
+  inc->b_count = 0;
+  size_t mi = 0;
+  long t = incr_walk(inc, n, inc->best_k, 0, &mi);
+  if (t < 0) return (int)t;
+  size_t cap = (size_t)w->max_n_cp + 1u;
+  inc->b_cp[0] = 0;
+  memcpy(inc->b_cp + 1, inc->b_tmp + cap - (size_t)t, (size_t)t * sizeof(uint16_t));
+  inc->b_count = (size_t)t + 1u;
+  if (inc->b_cp[inc->b_count - 1u] != n) return -24;
+
+  inc->n_cp = n;
+  inc->n_bytes = len;
+  inc->valid = 1;
+  return 0;
+}
+
+int npycrf_incr_edit(npycrf_incr_t *inc, const uint8_t *utf8, size_t len,
+                     size_t at, size_t del_len, size_t ins_len,
+                     npycrf_incr_change_t *chg) {
+  if (!inc || !inc->model || !utf8 || !chg || !inc->valid) return -1;
+  const npycrf_model_t *m = inc->model;
+  npycrf_work_t *w = &inc->work;
+  uint16_t L = m->max_word_len;
+  size_t L1 = (size_t)L + 1u;
+  size_t n0 = inc->n_cp;
+  size_t len0 = inc->n_bytes;
+  if (at > len0 || del_len > len0 - at || len != len0 - del_len + ins_len) return -6;
+  if (len > 0xFFFFu) return -2;
+
+  /* 旧テキストでの編集範囲 [ca, cb)（コードポイント位置） */
+  size_t ca = 0;
+  size_t cb = 0;
+  if (!u16_find(w->cp_off, n0 + 1u, at, &ca) || !u16_find(w->cp_off, n0 + 1u, at + del_len, &cb)) {
+    return -6;
+  }
+
+  /* 挿入部分のコードポイント数 */
+  size_t k_ins = 0;
+  for (size_t i = at; i < at + ins_len; k_ins++) {
+    uint32_t cp = 0;
+    if (!utf8_decode1(utf8, at + ins_len, &i, &cp)) return -3;
+  }
+  size_t n1 = n0 - (cb - ca) + k_ins;
+  if (n1 == 0) return -3;
+  if (n1 > w->max_n_cp) return -2;
+
+  inc->valid = 0;
+  ptrdiff_t dcp = (ptrdiff_t)k_ins - (ptrdiff_t)(cb - ca);
+  size_t tail = ca + k_ins;  /* 旧 cb に対応する新しい位置 */
+
+  /* 1) 旧 cb 以降の cp_off・放射、旧 cb+1 以降の行を dcp だけずらす */
+  memmove(w->cp_off + tail, w->cp_off + cb, (n0 - cb + 1u) * sizeof(uint16_t));
+  memmove(w->emit0 + tail, w->emit0 + cb, (n0 - cb) * sizeof(int16_t));
+  memmove(w->emit1 + tail, w->emit1 + cb, (n0 - cb) * sizeof(int16_t));
+  if (n0 > cb) {
+    size_t cells = (n0 - cb) * L1;
+    size_t src = (cb + 1u) * L1;
+    size_t dst = (tail + 1u) * L1;
+    memmove(w->span_id + dst, w->span_id + src, cells * sizeof(npycrf_id_t));
+    memmove(w->span_luni + dst, w->span_luni + src, cells * sizeof(int16_t));
+    memmove(w->bp_prevlen + dst, w->bp_prevlen + src, cells * sizeof(uint8_t));
+    memmove(inc->dp + dst, inc->dp + src, cells * sizeof(npycrf_score_t));
+  }
+  if (ins_len != del_len) {
+    for (size_t i = tail; i <= n1; i++) w->cp_off[i] = (uint16_t)(w->cp_off[i] + ins_len - del_len);
+  }
+
+  /* 2) 挿入部分の cp_off */
+  {
+    size_t i = at;
+    for (size_t c = ca; c < tail; c++) {
+      uint32_t cp = 0;
+      w->cp_off[c] = (uint16_t)i;
+      (void)utf8_decode1(utf8, at + ins_len, &i, &cp);
+    }
+  }
+
+  /* 3) 放射: 前後の文字クラスが変わり得るのは ca-1..tail、累積和はそれ以降すべて */
+  size_t elo = (ca > 0) ? ca - 1u : 0u;
+  size_t ehi = (tail < n1) ? tail : n1 - 1u;
+  uint8_t prev = (elo > 0) ? incr_class(w, utf8, elo - 1u) : CC_BOS;
+  uint8_t cur = incr_class(w, utf8, elo);
+  for (size_t i = elo; i <= ehi; i++) {
+    uint8_t next = (i + 1u < n1) ? incr_class(w, utf8, i + 1u) : CC_EOS;
+    crf_emit_pair(&m->crf, prev, cur, next, &w->emit0[i], &w->emit1[i]);
+    prev = cur;
+    cur = next;
+  }
+  for (size_t i = elo; i < n1; i++) {
+    w->pref_emit0[i + 1u] = w->pref_emit0[i] + (int32_t)w->emit0[i];
+  }
+
+  /* 4) スパン表: 編集点を跨ぐ・挿入部分を含むスパンの終了位置 (ca, ehr] */
+  size_t ehr = tail + L - 1u;
+  if (ehr > n1) ehr = n1;
+  for (size_t e = ca + 1u; e <= ehr; e++) {
+    size_t max_l = (e < (size_t)L) ? e : (size_t)L;
+    for (size_t l = 1; l <= max_l; l++) w->span_id[e * L1 + l] = NPYCRF_ID_NONE;
+  }
+  if (lm_has_trie(&m->lm)) {
+    size_t slo = (ca + 1u > (size_t)L) ? ca + 1u - L : 0u;
+    for (size_t s = slo; s < ehr; s++) {
+      da_index_t v = 1;
+      for (size_t l = 1; l <= (size_t)L && s + l <= ehr; l++) {
+        size_t b0 = w->cp_off[s + l - 1u];
+        size_t io = b0;
+        uint32_t cp = 0;
+        (void)utf8_decode1(utf8, w->cp_off[s + l], &io, &cp);
+        uint32_t code = m->lm.cp_page ? lm_cp_code(&m->lm, cp) : 0u;
+        v = trie_advance(&m->lm, v, code, utf8 + b0, io - b0);
+        STAT_ADD(w, trie_steps, 1);
+        if (v == 0) break;
+        if (s + l > ca) w->span_id[(s + l) * L1 + l] = trie_term(&m->lm, v);
+      }
+    }
+  }
+  for (size_t e = ca + 1u; e <= ehr; e++) {
+    size_t max_l = (e < (size_t)L) ? e : (size_t)L;
+    for (size_t l = 1; l <= max_l; l++) {
+      w->span_luni[e * L1 + l] = lm_unigram_logp(&m->lm, w->span_id[e * L1 + l], (uint16_t)l);
+    }
+  }
+
+  /*
+   * 5) 前向きDP（行 ca 以降。ca 未満の行は入力が変わらない）
+   *
+   * tail より後ろの行は旧行をずらしたもの。新しい行が L 行続けて旧行 + c に
+   * なり、かつ以降の行の入力（スパン・放射）が旧と同じ位置（tail+L 以降）まで
+   * 来たら、残りの行は旧行 + c、バックポインタと終端状態は旧と同じ。
+   */
+  int uni_only = !lm_has_bigram(&m->lm);
+  npycrf_score_t *dp = inc->dp;
+  npycrf_score_t *row = inc->row_tmp;
+  size_t sync = 0;
+  size_t run = 0;
+  int have_c = 0;
+  npycrf_score_t c = 0;
+  uint32_t rows = 0;
+  for (size_t pos = (ca > 0) ? ca : 1u; pos <= n1; pos++) {
+    npycrf_score_t *old = dp + pos * L1;
+    incr_dp_row(m, w, dp, (uint16_t)pos, uni_only, row);
+    rows++;
+    if (pos > tail) {
+      /* 旧行との差が -inf を除いて一定か */
+      int same = 1;
+      int row_has = 0;
+      npycrf_score_t d = 0;
+      for (size_t k = 0; k < L1 && same; k++) {
+        if ((row[k] == NPYCRF_SCORE_NEG_INF) != (old[k] == NPYCRF_SCORE_NEG_INF)) same = 0;
+        else if (row[k] != NPYCRF_SCORE_NEG_INF) {
+          if (!row_has) {
+            d = row[k] - old[k];
+            row_has = 1;
+          } else if (row[k] - old[k] != d) {
+            same = 0;
+          }
+        }
+      }
+      if (!same) {
+        run = 0;
+        have_c = 0;
+      } else if (row_has && have_c && d != c) {
+        run = 1;
+        c = d;
+      } else {
+        if (row_has && !have_c) {
+          c = d;
+          have_c = 1;
+        }
+        run++;
+      }
+    }
+    memcpy(old, row, L1 * sizeof(npycrf_score_t));
+    if (run >= (size_t)L && pos >= tail + L && pos < n1) {
+      sync = pos;
+      break;
+    }
+  }
+
+  int rc = 0;
+  if (sync > 0) {
+    if (c != 0) {
+      for (size_t i = (sync + 1u) * L1; i < (n1 + 1u) * L1; i++) {
+        if (dp[i] != NPYCRF_SCORE_NEG_INF) dp[i] += c;
+      }
+    }
+    inc->best_score += c;
+  } else {
+    rc = incr_select_final(inc, (uint16_t)n1);
+    if (rc != 0) return rc;
+  }
+
+  /*
+   * 6) バックトラック
+   *
+   * sync より後ろの旧境界はそのまま新しいパスに残るので、その最初の境界から辿り、
+   * ca より前で旧パスに合流したら止める。
+   * 新しい境界 = 旧[0..mi] + 辿った t 個 + 旧[i_old+1..]（dcp だけずらす）
+   */
+  const uint16_t *ob = inc->b_cp;
+  size_t ob_n = inc->b_count;
+  size_t i_old = ob_n - 1u;
+  uint16_t p0 = (uint16_t)n1;
+  uint16_t k0 = inc->best_k;
+  if (sync > 0) {
+    size_t lo = 0;
+    size_t hi = ob_n - 1u;
+    size_t key = (size_t)((ptrdiff_t)sync - dcp);
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2u;
+      if ((size_t)ob[mid] <= key) lo = mid + 1u;
+      else hi = mid;
+    }
+    i_old = lo;
+    p0 = (uint16_t)((ptrdiff_t)ob[i_old] + dcp);
+    k0 = (uint16_t)(ob[i_old] - ob[i_old - 1u]);
+  }
+  size_t mi = 0;
+  long t = incr_walk(inc, p0, k0, ca, &mi);
+  if (t < 0) return (int)t;
+
+  size_t cap = (size_t)w->max_n_cp + 1u;
+  size_t suf = ob_n - 1u - i_old;
+  size_t nb_n = mi + 1u + (size_t)t + suf;
+  if (nb_n > cap) return -23;
+  uint16_t *nb = inc->b_tmp;
+  memcpy(nb, ob, (mi + 1u) * sizeof(uint16_t));
+  memmove(nb + mi + 1u, nb + cap - (size_t)t, (size_t)t * sizeof(uint16_t));
+  for (size_t x = 0; x < suf; x++) {
+    nb[mi + 1u + (size_t)t + x] = (uint16_t)((ptrdiff_t)ob[i_old + 1u + x] + dcp);
+  }
+  if (nb[nb_n - 1u] != n1) return -24;
+
+  /* 変化範囲: 前後で同じテキスト・同じ境界のトークンを除く */
+  size_t first = mi;
+  size_t oe = i_old;
+  size_t ne = mi + (size_t)t;
+  while (first < oe && first < ne && ob[first + 1u] <= ca && nb[first + 1u] == ob[first + 1u]) first++;
+  while (oe > first && ne > first && ob[oe - 1u] >= cb &&
+         (ptrdiff_t)nb[ne - 1u] == (ptrdiff_t)ob[oe - 1u] + dcp) {
+    oe--;
+    ne--;
+  }
+  chg->first = first;
+  chg->old_end = oe;
+  chg->new_end = ne;
+  chg->dp_rows = rows;
+
+  inc->b_tmp = inc->b_cp;
+  inc->b_cp = nb;
+  inc->b_count = nb_n;
+  inc->n_cp = (uint16_t)n1;
+  inc->n_bytes = len;
+  inc->valid = 1;
+  return 0;
+}
+
+/* ======================================================================
+ * Subword Regularization（確率的分割）
+ * ====================================================================== */
+
+static inline uintptr_t align_up_uintptr(uintptr_t p, size_t align) {
+  return (p + (uintptr_t)(align - 1u)) & ~(uintptr_t)(align - 1u);
+}
+
 static inline uint32_t xs32(uint32_t *state) {
   uint32_t x = (state && *state) ? *state : 0x12345678u;
   x ^= x << 13;
@@ -1035,55 +2650,281 @@ static inline double score_q88_to_f(npycrf_score_t q) {
   return (double)q / (double)NPYCRF_SCORE_SCALE;
 }
 
+/* 前向き表の要素: double（既定）または Q16 固定小数点の対数（NPYCRF_SAMPLE_FIXED） */
+#ifdef NPYCRF_SAMPLE_FIXED
+typedef int64_t sample_alpha_t;
+#else
+typedef double sample_alpha_t;
+#endif
+
 size_t npycrf_samplebuf_size(uint16_t max_n_cp, uint16_t max_word_len) {
   size_t states = ((size_t)max_n_cp + 1u) * ((size_t)max_word_len + 1u);
   /* +16 for alignment slack */
-  return states * sizeof(double) + 16u;
+  return states * sizeof(sample_alpha_t) + 16u;
 }
 
 /*
  * Forward-Filtering Backward-Sampling (FFBS)
  *  - forward: semi-markov lattice log-sum DP
  *  - backward: sample previous state using alpha and local edge scores
+ *
+ * forward（alpha）は温度ごとに1回、backward はサンプルごと。
  */
-int npycrf_decode_sample(const npycrf_model_t *model,
-                         const uint8_t *utf8, size_t len,
-                         npycrf_work_t *work,
-                         void *sample_buf, size_t sample_buf_size,
-                         double temperature,
-                         uint32_t seed,
-                         uint16_t *out_b_cp, size_t out_b_cap,
-                         size_t *out_b_count,
-                         npycrf_score_t *out_sample_score) {
-  if (!model || !utf8 || !work || !sample_buf || sample_buf_size == 0 || !out_b_cp || !out_b_count) return -1;
-  if (model->max_word_len == 0) return -1;
-  if (!(temperature > 0.0) || isnan(temperature) || isinf(temperature)) temperature = 1.0;
 
-  /* 1) offsets */
-  if (!work->cp_off || work->max_n_cp == 0) return -2;
-  size_t n_cp_sz = npycrf_utf8_make_offsets(utf8, len, work->cp_off, (size_t)work->max_n_cp + 1u);
-  if (n_cp_sz == 0) return -3;
-  if (n_cp_sz > work->max_n_cp) return -3;
-  uint16_t n_cp = (uint16_t)n_cp_sz;
-  uint16_t L = model->max_word_len;
-  if (L > work->max_word_len) return -4;
-  if (out_b_cap < 2u) return -5;
+#ifdef NPYCRF_SAMPLE_FIXED
+/*
+ * 固定小数点版（浮動小数点・libm を使わない）
+ *
+ *  - alpha は自然対数の Q16（int64）。エッジは Q8.8 スコア × (1/T の Q16) で変換。
+ *  - log-add: max + log(1+e^-d) を表引き（d は 1/32 刻み、線形補間、d>=12 は 0）。
+ *    1回あたりの誤差は 4e-5 nat 以下（表の丸め + 補間）。
+ *  - 後ろ向きの重み e^-d は 2^-(d·log2e) を整数シフト + 2^(-i/64) の表（線形補間）で求め、
+ *    相対誤差 3e-5 以下。d>=12（確率比 6e-6 未満）の候補は重み 0。
+ *  - 一様乱数は xs32 の上位 24 ビット。
+ */
+#define SAMPLE_Q 16
+#define SAMPLE_NEG_INF INT64_MIN
+#define SAMPLE_D_MAX ((int64_t)12 << SAMPLE_Q)
+
+/* log(1+e^-d) の Q16、d = i/32 */
+static const uint16_t k_log1p_exp_q16[385] = {
+  45426, 44410, 43410, 42426, 41458, 40506, 39570, 38649, 37745, 36856, 35983, 35125,
+  34283, 33457, 32646, 31850, 31069, 30303, 29553, 28817, 28095, 27389, 26696, 26018,
+  25354, 24704, 24068, 23445, 22836, 22240, 21657, 21087, 20530, 19985, 19453, 18933,
+  18425, 17929, 17445, 16972, 16510, 16060, 15620, 15191, 14773, 14364, 13966, 13578,
+  13200, 12831, 12471, 12121, 11780, 11447, 11123, 10808, 10500, 10201,  9910,  9626,
+   9350,  9082,  8820,  8566,  8318,  8078,  7843,  7615,  7394,  7178,  6969,  6765,
+   6567,  6375,  6187,  6006,  5829,  5657,  5490,  5328,  5170,  5017,  4868,  4724,
+   4583,  4447,  4315,  4186,  4061,  3940,  3822,  3708,  3597,  3489,  3384,  3283,
+   3184,  3089,  2996,  2905,  2818,  2733,  2651,  2571,  2493,  2418,  2345,  2274,
+   2205,  2138,  2074,  2011,  1950,  1891,  1833,  1778,  1724,  1671,  1620,  1571,
+   1523,  1477,  1432,  1389,  1346,  1305,  1265,  1227,  1189,  1153,  1118,  1084,
+   1051,  1019,   988,   957,   928,   900,   872,   846,   820,   795,   770,   747,
+    724,   702,   680,   660,   639,   620,   601,   582,   565,   547,   530,   514,
+    498,   483,   468,   454,   440,   427,   414,   401,   389,   377,   365,   354,
+    343,   332,   322,   312,   303,   293,   284,   276,   267,   259,   251,   243,
+    236,   229,   222,   215,   208,   202,   196,   190,   184,   178,   173,   167,
+    162,   157,   152,   148,   143,   139,   135,   130,   126,   123,   119,   115,
+    112,   108,   105,   102,    98,    95,    92,    90,    87,    84,    82,    79,
+     77,    74,    72,    70,    68,    66,    64,    62,    60,    58,    56,    54,
+     53,    51,    50,    48,    47,    45,    44,    42,    41,    40,    39,    37,
+     36,    35,    34,    33,    32,    31,    30,    29,    28,    27,    27,    26,
+     25,    24,    23,    23,    22,    21,    21,    20,    19,    19,    18,    18,
+     17,    17,    16,    16,    15,    15,    14,    14,    13,    13,    13,    12,
+     12,    11,    11,    11,    10,    10,    10,     9,     9,     9,     9,     8,
+      8,     8,     8,     7,     7,     7,     7,     6,     6,     6,     6,     6,
+      6,     5,     5,     5,     5,     5,     5,     4,     4,     4,     4,     4,
+      4,     4,     4,     3,     3,     3,     3,     3,     3,     3,     3,     3,
+      3,     3,     2,     2,     2,     2,     2,     2,     2,     2,     2,     2,
+      2,     2,     2,     2,     2,     2,     1,     1,     1,     1,     1,     1,
+      1,     1,     1,     1,     1,     1,     1,     1,     1,     1,     1,     1,
+      1,     1,     1,     1,     1,     1,     1,     1,     1,     1,     1,     1,
+      1,     1,     1,     1,     1,     1,     0,     0,     0,     0,     0,     0,
+      0
+
+};
+
+/* 2^(-i/64) の Q16 */
+static const uint32_t k_exp2_neg_q16[65] = {
+  65536, 64830, 64132, 63441, 62757, 62081, 61413, 60751, 60097,
+  59449, 58809, 58176, 57549, 56929, 56316, 55709, 55109, 54515,
+  53928, 53347, 52773, 52204, 51642, 51085, 50535, 49991, 49452,
+  48920, 48393, 47871, 47356, 46846, 46341, 45842, 45348, 44859,
+  44376, 43898, 43425, 42958, 42495, 42037, 41584, 41136, 40693,
+  40255, 39821, 39392, 38968, 38548, 38133, 37722, 37316, 36914,
+  36516, 36123, 35734, 35349, 34968, 34591, 34219, 33850, 33486,
+  33125, 32768
+
+};
+
+static int32_t sample_inv_t_q16(double temperature) {
+  double v = 65536.0 / temperature;
+  if (v > 1073741824.0) v = 1073741824.0;
+  if (v < 1.0) v = 1.0;
+  return (int32_t)(v + 0.5);
+}
+
+static inline int64_t sample_to_q(npycrf_score_t score, int32_t inv_t) {
+  /* Q8.8 × Q16 → Q24、>>8 で Q16 */
+  return ((int64_t)score * (int64_t)inv_t) >> 8;
+}
+
+static inline sample_alpha_t lse_q(sample_alpha_t a, sample_alpha_t b) {
+  if (a == SAMPLE_NEG_INF) return b;
+  if (b == SAMPLE_NEG_INF) return a;
+  sample_alpha_t hi = (a > b) ? a : b;
+  int64_t d = (a > b) ? a - b : b - a;
+  if (d >= SAMPLE_D_MAX) return hi;
+  uint32_t i = (uint32_t)(d >> 11);
+  uint32_t f = (uint32_t)d & 2047u;
+  uint32_t v0 = k_log1p_exp_q16[i];
+  uint32_t v1 = k_log1p_exp_q16[i + 1u];
+  return hi + (int64_t)(v0 - (((v0 - v1) * f) >> 11));
+}
+
+/* e^-d（d は Q16、d >= 0）を Q16 の重みで。1.0 = 65536 */
+static inline uint32_t exp_neg_q(int64_t d) {
+  if (d >= SAMPLE_D_MAX) return 0;
+  uint32_t y = (uint32_t)((d * 94548) >> 16);  /* d·log2(e) */
+  uint32_t n = y >> 16;
+  uint32_t f = y & 0xFFFFu;
+  uint32_t i = f >> 10;
+  uint32_t fr = f & 1023u;
+  uint32_t w = k_exp2_neg_q16[i] - (((k_exp2_neg_q16[i] - k_exp2_neg_q16[i + 1u]) * fr) >> 10);
+  return w >> n;
+}
+
+/* 重み w[0..n) から1つ選ぶ（合計 0 なら -1） */
+static int sample_pick_q(const uint32_t *w, uint16_t n, uint32_t *seed) {
+  uint64_t sum = 0;
+  for (uint16_t i = 0; i < n; i++) sum += w[i];
+  if (sum == 0) return -1;
+  uint64_t r = ((uint64_t)(xs32(seed) >> 8) * sum) >> 24;  /* [0, sum) */
+  uint64_t acc = 0;
+  int pick = -1;
+  for (uint16_t i = 0; i < n; i++) {
+    if (w[i] == 0) continue;
+    acc += w[i];
+    pick = (int)i;
+    if (r < acc) break;
+  }
+  return pick;
+}
 
-  /* 2) precompute */
-  int rc = precompute_emissions(model, utf8, len, work->cp_off, n_cp, work);
-  if (rc != 0) return -10;
-  rc = precompute_spans(model, utf8, len, work->cp_off, n_cp, work);
-  if (rc != 0) return -11;
+static inline sample_alpha_t sample_edge(const npycrf_model_t *model, npycrf_work_t *work, uint16_t L,
+                                         npycrf_score_t seg, uint16_t pos, uint16_t k, uint16_t j,
+                                         int32_t inv_t) {
+  uint16_t start = (uint16_t)(pos - k);
+  size_t idx_curr = span_index(pos, k, L);
+  npycrf_id_t prev_id = (start == 0) ? NPYCRF_ID_BOS : work->span_id[span_index(start, j, L)];
+  int16_t lm = LM_BIGRAM(work, &model->lm, prev_id, work->span_id[idx_curr], work->span_luni[idx_curr]);
+  npycrf_score_t add = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
+  return sample_to_q(seg + add, inv_t);
+}
 
-  /* 3) parse sample buffer -> alpha table */
+static void sample_forward(const npycrf_model_t *model, npycrf_work_t *work,
+                           sample_alpha_t *alpha, uint16_t n_cp, uint16_t L, double temperature) {
+  size_t L1 = (size_t)L + 1u;
+  size_t states = ((size_t)n_cp + 1u) * L1;
+  int32_t inv_t = sample_inv_t_q16(temperature);
+
+  for (size_t i = 0; i < states; i++) alpha[i] = SAMPLE_NEG_INF;
+  alpha[0] = sample_to_q((npycrf_score_t)model->crf.bos_to1, inv_t);
+
+  for (uint16_t pos = 1; pos <= n_cp; pos++) {
+    uint16_t kmax = (uint16_t)((pos <= L) ? pos : L);
+    for (uint16_t k = 1; k <= kmax; k++) {
+      uint16_t start = (uint16_t)(pos - k);
+      npycrf_score_t seg = crf_seg_score(model, work, start, pos);
+      sample_alpha_t log_sum = SAMPLE_NEG_INF;
+
+      if (start == 0) {
+        if (alpha[0] != SAMPLE_NEG_INF) log_sum = alpha[0] + sample_edge(model, work, L, seg, pos, k, 0, inv_t);
+      } else {
+        uint16_t jmax = (uint16_t)((start <= L) ? start : L);
+        for (uint16_t j = 1; j <= jmax; j++) {
+          sample_alpha_t prev = alpha[(size_t)start * L1 + (size_t)j];
+          if (prev == SAMPLE_NEG_INF) continue;
+          log_sum = lse_q(log_sum, prev + sample_edge(model, work, L, seg, pos, k, j, inv_t));
+        }
+      }
+
+      alpha[(size_t)pos * L1 + (size_t)k] = log_sum;
+    }
+  }
+}
+
+static int sample_backward(const npycrf_model_t *model, npycrf_work_t *work,
+                           const sample_alpha_t *alpha, uint16_t n_cp, uint16_t L, double temperature,
+                           uint32_t seed,
+                           uint16_t *out_b_cp, size_t out_b_cap, size_t *out_b_count) {
+  size_t L1 = (size_t)L + 1u;
+  int32_t inv_t = sample_inv_t_q16(temperature);
+  sample_alpha_t lw[256];
+  uint32_t w[256];
+
+  /* sample final k */
+  uint16_t kmax_end = (uint16_t)((n_cp <= L) ? n_cp : L);
+  const sample_alpha_t *last = alpha + (size_t)n_cp * L1;
+  sample_alpha_t mx = SAMPLE_NEG_INF;
+  for (uint16_t k = 1; k <= kmax_end; k++) {
+    if (last[k] > mx) mx = last[k];
+  }
+  if (mx == SAMPLE_NEG_INF) return -20;
+  for (uint16_t k = 1; k <= kmax_end; k++) {
+    w[k - 1u] = (last[k] == SAMPLE_NEG_INF) ? 0u : exp_neg_q(mx - last[k]);
+  }
+  int pk = sample_pick_q(w, kmax_end, &seed);
+  if (pk < 0) return -20;
+  uint16_t cur_k = (uint16_t)(pk + 1);
+
+  /* backward sample boundaries */
+  if (out_b_cap < (size_t)n_cp + 1u) return -21;
+
+  size_t bcnt = 0;
+  uint16_t pos = n_cp;
+  uint16_t k = cur_k;
+  while (1) {
+    out_b_cp[bcnt++] = pos;
+    if (pos == 0) break;
+    uint16_t start = (uint16_t)(pos - k);
+    if (start == 0) {
+      out_b_cp[bcnt++] = 0;
+      break;
+    }
+
+    /* p(j | pos,k) ∝ exp(alpha[start,j] + edge(j→k)) */
+    uint16_t jmax = (uint16_t)((start <= L) ? start : L);
+    npycrf_score_t seg = crf_seg_score(model, work, start, pos);
+    mx = SAMPLE_NEG_INF;
+    for (uint16_t j = 1; j <= jmax; j++) {
+      sample_alpha_t a_prev = alpha[(size_t)start * L1 + (size_t)j];
+      lw[j - 1u] = (a_prev == SAMPLE_NEG_INF) ? SAMPLE_NEG_INF
+                                              : a_prev + sample_edge(model, work, L, seg, pos, k, j, inv_t);
+      if (lw[j - 1u] > mx) mx = lw[j - 1u];
+    }
+    if (mx == SAMPLE_NEG_INF) return -22;
+    for (uint16_t j = 1; j <= jmax; j++) {
+      w[j - 1u] = (lw[j - 1u] == SAMPLE_NEG_INF) ? 0u : exp_neg_q(mx - lw[j - 1u]);
+    }
+    int pj = sample_pick_q(w, jmax, &seed);
+    if (pj < 0) return -22;
+
+    pos = start;
+    k = (uint16_t)(pj + 1);
+    if (bcnt > (size_t)n_cp + 1u) return -23;
+  }
+
+  /* reverse boundaries */
+  for (size_t i = 0; i < bcnt / 2u; i++) {
+    uint16_t tmp = out_b_cp[i];
+    out_b_cp[i] = out_b_cp[bcnt - 1u - i];
+    out_b_cp[bcnt - 1u - i] = tmp;
+  }
+  if (out_b_cp[0] != 0 || out_b_cp[bcnt - 1u] != n_cp) return -24;
+
+  *out_b_count = bcnt;
+  return 0;
+}
+
+#else /* !NPYCRF_SAMPLE_FIXED */
+
+/* (start, j) → (pos, k) のエッジ（温度で割った対数重み） */
+static inline double sample_edge(const npycrf_model_t *model, npycrf_work_t *work, uint16_t L,
+                                 npycrf_score_t seg, uint16_t pos, uint16_t k, uint16_t j,
+                                 double temperature) {
+  uint16_t start = (uint16_t)(pos - k);
+  size_t idx_curr = span_index(pos, k, L);
+  npycrf_id_t prev_id = (start == 0) ? NPYCRF_ID_BOS : work->span_id[span_index(start, j, L)];
+  int16_t lm = LM_BIGRAM(work, &model->lm, prev_id, work->span_id[idx_curr], work->span_luni[idx_curr]);
+  npycrf_score_t add = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
+  return score_q88_to_f(seg + add) / temperature;
+}
+
+static void sample_forward(const npycrf_model_t *model, npycrf_work_t *work,
+                           double *alpha, uint16_t n_cp, uint16_t L, double temperature) {
   size_t L1 = (size_t)L + 1u;
   size_t states = ((size_t)n_cp + 1u) * L1;
-  uintptr_t p0 = (uintptr_t)sample_buf;
-  uintptr_t p1 = align_up_uintptr(p0, (size_t)sizeof(double));
-  size_t pad = (size_t)(p1 - p0);
-  size_t need = pad + states * sizeof(double);
-  if (sample_buf_size < need) return -12;
-  double *alpha = (double *)p1;
 
   /* init alpha with -inf */
   for (size_t i = 0; i < states; i++) alpha[i] = -INFINITY;
@@ -1091,57 +2932,39 @@ int npycrf_decode_sample(const npycrf_model_t *model,
   /* alpha[0,0] = bos_to1 */
   alpha[0] = score_q88_to_f((npycrf_score_t)model->crf.bos_to1) / temperature;
 
-  /* forward DP */
   for (uint16_t pos = 1; pos <= n_cp; pos++) {
     uint16_t kmax = (uint16_t)((pos <= L) ? pos : L);
     for (uint16_t k = 1; k <= kmax; k++) {
       uint16_t start = (uint16_t)(pos - k);
-
       npycrf_score_t seg = crf_seg_score(model, work, start, pos);
-      size_t idx_curr = span_index(pos, k, L);
-      npycrf_id_t curr_id = work->span_id[idx_curr];
-      int16_t curr_luni = work->span_luni[idx_curr];
-
       double log_sum = -INFINITY;
 
       /* j=0 only if start==0 */
       if (start == 0) {
-        double prev = alpha[0 * L1 + 0];
-        if (prev != -INFINITY) {
-          int16_t lm = lm_bigram_logp(&model->lm, NPYCRF_ID_BOS, curr_id, curr_luni);
-          npycrf_score_t add = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
-          double edge = (score_q88_to_f(seg + add) / temperature);
-          log_sum = prev + edge;
-        }
+        double prev = alpha[0];
+        if (prev != -INFINITY) log_sum = prev + sample_edge(model, work, L, seg, pos, k, 0, temperature);
       } else {
         uint16_t jmax = (uint16_t)((start <= L) ? start : L);
         for (uint16_t j = 1; j <= jmax; j++) {
           double prev = alpha[(size_t)start * L1 + (size_t)j];
           if (prev == -INFINITY) continue;
-          size_t idx_prev = span_index(start, j, L);
-          npycrf_id_t prev_id = work->span_id[idx_prev];
-
-          int16_t lm = lm_bigram_logp(&model->lm, prev_id, curr_id, curr_luni);
-          npycrf_score_t add = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
-          double edge = (score_q88_to_f(seg + add) / temperature);
-          log_sum = logsumexp2(log_sum, prev + edge);
+          log_sum = logsumexp2(log_sum, prev + sample_edge(model, work, L, seg, pos, k, j, temperature));
         }
       }
 
       alpha[(size_t)pos * L1 + (size_t)k] = log_sum;
     }
   }
+}
 
-  /* empty string */
-  if (n_cp == 0) {
-    out_b_cp[0] = 0;
-    out_b_cp[1] = 0;
-    *out_b_count = 2;
-    if (out_sample_score) *out_sample_score = (npycrf_score_t)model->crf.bos_to1;
-    return 0;
-  }
+/* alpha から1サンプル引いて境界（昇順）を out_b_cp に書く */
+static int sample_backward(const npycrf_model_t *model, npycrf_work_t *work,
+                           const double *alpha, uint16_t n_cp, uint16_t L, double temperature,
+                           uint32_t seed,
+                           uint16_t *out_b_cp, size_t out_b_cap, size_t *out_b_count) {
+  size_t L1 = (size_t)L + 1u;
 
-  /* 4) sample final k */
+  /* sample final k */
   uint16_t kmax_end = (uint16_t)((n_cp <= L) ? n_cp : L);
   double logZ = -INFINITY;
   for (uint16_t k = 1; k <= kmax_end; k++) {
@@ -1162,9 +2985,10 @@ int npycrf_decode_sample(const npycrf_model_t *model,
     }
   }
 
-  /* 5) backward sample boundaries */
+  /* backward sample boundaries */
   if (out_b_cap < (size_t)n_cp + 1u) return -21;
 
+  double lw[256];
   size_t bcnt = 0;
   uint16_t pos = n_cp;
   uint16_t k = cur_k;
@@ -1180,45 +3004,32 @@ int npycrf_decode_sample(const npycrf_model_t *model,
     /* sample prev len j given current (pos,k)
      *   p(j | pos,k) ∝ exp(alpha[start,j] + edge(j→k))
      *   where edge includes CRF segment score + LM bigram
+     * 重みは1回だけ計算して lw[] に置く
      */
     uint16_t jmax = (uint16_t)((start <= L) ? start : L);
-
     npycrf_score_t seg = crf_seg_score(model, work, start, pos);
-    size_t idx_curr = span_index(pos, k, L);
-    npycrf_id_t curr_id = work->span_id[idx_curr];
-    int16_t curr_luni = work->span_luni[idx_curr];
-
     double alpha_cur = alpha[(size_t)pos * L1 + (size_t)k];
 
-    /* 1st pass: find max log-weight */
     double maxlw = -INFINITY;
     size_t valid = 0;
     for (uint16_t j = 1; j <= jmax; j++) {
       double a_prev = alpha[(size_t)start * L1 + (size_t)j];
-      if (a_prev == -INFINITY) continue;
-      size_t idx_prev = span_index(start, j, L);
-      npycrf_id_t prev_id = work->span_id[idx_prev];
-      int16_t lm = lm_bigram_logp(&model->lm, prev_id, curr_id, curr_luni);
-      npycrf_score_t add = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
-      double edge = score_q88_to_f(seg + add) / temperature;
-      double lw = (a_prev + edge) - alpha_cur;
-      if (lw > maxlw) maxlw = lw;
+      if (a_prev == -INFINITY) {
+        lw[j - 1u] = -INFINITY;
+        continue;
+      }
+      double w = (a_prev + sample_edge(model, work, L, seg, pos, k, j, temperature)) - alpha_cur;
+      lw[j - 1u] = w;
+      if (w > maxlw) maxlw = w;
       valid++;
     }
     if (valid == 0 || maxlw == -INFINITY) return -22;
 
-    /* 2nd pass: sum exp */
     double sum = 0.0;
     for (uint16_t j = 1; j <= jmax; j++) {
-      double a_prev = alpha[(size_t)start * L1 + (size_t)j];
-      if (a_prev == -INFINITY) continue;
-      size_t idx_prev = span_index(start, j, L);
-      npycrf_id_t prev_id = work->span_id[idx_prev];
-      int16_t lm = lm_bigram_logp(&model->lm, prev_id, curr_id, curr_luni);
-      npycrf_score_t add = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
-      double edge = score_q88_to_f(seg + add) / temperature;
-      double lw = (a_prev + edge) - alpha_cur;
-      sum += exp(lw - maxlw);
+      if (lw[j - 1u] == -INFINITY) continue;
+      lw[j - 1u] = exp(lw[j - 1u] - maxlw);
+      sum += lw[j - 1u];
     }
     if (!(sum > 0.0) || isnan(sum) || isinf(sum)) return -22;
 
@@ -1226,15 +3037,8 @@ int npycrf_decode_sample(const npycrf_model_t *model,
     double acc = 0.0;
     uint16_t pick = 1;
     for (uint16_t j = 1; j <= jmax; j++) {
-      double a_prev = alpha[(size_t)start * L1 + (size_t)j];
-      if (a_prev == -INFINITY) continue;
-      size_t idx_prev = span_index(start, j, L);
-      npycrf_id_t prev_id = work->span_id[idx_prev];
-      int16_t lm = lm_bigram_logp(&model->lm, prev_id, curr_id, curr_luni);
-      npycrf_score_t add = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
-      double edge = score_q88_to_f(seg + add) / temperature;
-      double lw = (a_prev + edge) - alpha_cur;
-      acc += exp(lw - maxlw);
+      if (lw[j - 1u] == -INFINITY) continue;
+      acc += lw[j - 1u];
       pick = j;
       if (r <= acc) break;
     }
@@ -1253,52 +3057,217 @@ int npycrf_decode_sample(const npycrf_model_t *model,
   if (out_b_cp[0] != 0 || out_b_cp[bcnt - 1u] != n_cp) return -24;
 
   *out_b_count = bcnt;
+  return 0;
+}
 
-  /* compute sampled path score in Q8.8 (optional) */
-  if (out_sample_score) {
-    npycrf_score_t total = (npycrf_score_t)model->crf.bos_to1;
-    for (size_t i = 0; i + 1 < bcnt; i++) {
-      uint16_t s = out_b_cp[i];
-      uint16_t t = out_b_cp[i + 1];
-      uint16_t len_cp = (uint16_t)(t - s);
-      if (len_cp == 0 || len_cp > L) continue;
-
-      npycrf_score_t seg = crf_seg_score(model, work, s, t);
-      size_t idx = span_index(t, len_cp, L);
-      npycrf_id_t curr_id = work->span_id[idx];
-      int16_t curr_luni = work->span_luni[idx];
-
-      npycrf_id_t prev_id = NPYCRF_ID_BOS;
-      if (i > 0) {
-        uint16_t ps = out_b_cp[i - 1];
-        uint16_t pt = out_b_cp[i];
-        uint16_t plen = (uint16_t)(pt - ps);
-        if (plen > 0 && plen <= L) {
-          prev_id = work->span_id[span_index(pt, plen, L)];
-        }
+#endif /* NPYCRF_SAMPLE_FIXED */
+
+/* compute sampled path score in Q8.8 */
+static npycrf_score_t sample_path_score(const npycrf_model_t *model, npycrf_work_t *work, uint16_t L,
+                                        const uint16_t *b, size_t bcnt) {
+  npycrf_score_t total = (npycrf_score_t)model->crf.bos_to1;
+  for (size_t i = 0; i + 1 < bcnt; i++) {
+    uint16_t s = b[i];
+    uint16_t t = b[i + 1];
+    uint16_t len_cp = (uint16_t)(t - s);
+    if (len_cp == 0 || len_cp > L) continue;
+
+    npycrf_score_t seg = crf_seg_score(model, work, s, t);
+    size_t idx = span_index(t, len_cp, L);
+    npycrf_id_t curr_id = work->span_id[idx];
+    int16_t curr_luni = work->span_luni[idx];
+
+    npycrf_id_t prev_id = NPYCRF_ID_BOS;
+    if (i > 0) {
+      uint16_t ps = b[i - 1];
+      uint16_t pt = b[i];
+      uint16_t plen = (uint16_t)(pt - ps);
+      if (plen > 0 && plen <= L) {
+        prev_id = work->span_id[span_index(pt, plen, L)];
       }
+    }
+
+    int16_t lm = LM_BIGRAM(work, &model->lm, prev_id, curr_id, curr_luni);
+    npycrf_score_t add = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
+    total += seg + add;
+  }
+  return total;
+}
+
+static double sample_temperature(double t) {
+  if (!(t > 0.0) || isnan(t) || isinf(t)) return 1.0;
+  return t;
+}
+
+/* 共通の前処理: ラティスを作り sample_buf から alpha を切り出す */
+static int sample_prepare(const npycrf_model_t *model, const uint8_t *utf8, size_t len,
+                          npycrf_work_t *work, void *sample_buf, size_t sample_buf_size,
+                          uint16_t *out_n_cp, sample_alpha_t **out_alpha) {
+  if (!work->cp_off || work->max_n_cp == 0) return -2;
+  uint16_t L = model->max_word_len;
+  if (L > work->max_word_len || L > 256u) return -4;
+  size_t n_cp_sz = precompute_lattice(model, utf8, len, work);
+  if (n_cp_sz == 0) return -3;
+  uint16_t n_cp = (uint16_t)n_cp_sz;
+
+  size_t states = ((size_t)n_cp + 1u) * ((size_t)L + 1u);
+  uintptr_t p0 = (uintptr_t)sample_buf;
+  uintptr_t p1 = align_up_uintptr(p0, (size_t)sizeof(sample_alpha_t));
+  size_t pad = (size_t)(p1 - p0);
+  size_t need = pad + states * sizeof(sample_alpha_t);
+  if (sample_buf_size < need) return -12;
+
+  *out_n_cp = n_cp;
+  *out_alpha = (sample_alpha_t *)p1;
+  return 0;
+}
+
+int npycrf_decode_sample(const npycrf_model_t *model,
+                         const uint8_t *utf8, size_t len,
+                         npycrf_work_t *work,
+                         void *sample_buf, size_t sample_buf_size,
+                         double temperature,
+                         uint32_t seed,
+                         uint16_t *out_b_cp, size_t out_b_cap,
+                         size_t *out_b_count,
+                         npycrf_score_t *out_sample_score) {
+  if (!model || !utf8 || !work || !sample_buf || sample_buf_size == 0 || !out_b_cp || !out_b_count) return -1;
+  if (model->max_word_len == 0) return -1;
+  temperature = sample_temperature(temperature);
+
+  uint16_t n_cp = 0;
+  sample_alpha_t *alpha = NULL;
+  int rc = sample_prepare(model, utf8, len, work, sample_buf, sample_buf_size, &n_cp, &alpha);
+  if (rc != 0) return rc;
+  if (out_b_cap < 2u) return -5;
+
+  uint16_t L = model->max_word_len;
+  sample_forward(model, work, alpha, n_cp, L, temperature);
+  rc = sample_backward(model, work, alpha, n_cp, L, temperature, seed, out_b_cp, out_b_cap, out_b_count);
+  if (rc != 0) return rc;
+  if (out_sample_score) *out_sample_score = sample_path_score(model, work, L, out_b_cp, *out_b_count);
+  return 0;
+}
 
-      int16_t lm = lm_bigram_logp(&model->lm, prev_id, curr_id, curr_luni);
-      npycrf_score_t add = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
-      total += seg + add;
+int npycrf_decode_sample_multi(const npycrf_model_t *model,
+                               const uint8_t *utf8, size_t len,
+                               npycrf_work_t *work,
+                               void *sample_buf, size_t sample_buf_size,
+                               size_t nsamples,
+                               const uint32_t *seeds,
+                               const double *temperatures,
+                               double temperature,
+                               uint16_t *out_b_cp_flat, size_t out_b_cap,
+                               size_t *out_b_count,
+                               npycrf_score_t *out_scores) {
+  if (!model || !utf8 || !work || !sample_buf || sample_buf_size == 0 || !seeds || !out_b_cp_flat || !out_b_count) return -1;
+  if (model->max_word_len == 0 || nsamples == 0) return -1;
+
+  uint16_t n_cp = 0;
+  sample_alpha_t *alpha = NULL;
+  int rc = sample_prepare(model, utf8, len, work, sample_buf, sample_buf_size, &n_cp, &alpha);
+  if (rc != 0) return rc;
+  if (out_b_cap < (size_t)n_cp + 1u) return -5;
+
+  uint16_t L = model->max_word_len;
+  double t_alpha = 0.0;  /* alpha を計算した温度（0=未計算） */
+  for (size_t i = 0; i < nsamples; i++) {
+    double t = sample_temperature(temperatures ? temperatures[i] : temperature);
+    if (t != t_alpha) {
+      sample_forward(model, work, alpha, n_cp, L, t);
+      t_alpha = t;
     }
-    *out_sample_score = total;
+    uint16_t *b = out_b_cp_flat + i * out_b_cap;
+    rc = sample_backward(model, work, alpha, n_cp, L, t, seeds[i], b, out_b_cap, &out_b_count[i]);
+    if (rc != 0) return rc;
+    if (out_scores) out_scores[i] = sample_path_score(model, work, L, b, out_b_count[i]);
   }
   return 0;
 }
 
+/*
+ * N-best は遅延 k-best（前向き Viterbi + 後ろ向き A*）
+ *
+ *  - 前向き: 全状態 (pos,k) の 1-best スコア alpha を求める（ヒューリスティックとして正確）。
+ *  - 後ろ向き: 終端から「接尾辞パス」をノードとしてヒープで best-first に展開。
+ *    ノード優先度 f = g（接尾辞のスコア）+ alpha[状態] はそのノードを通る最良の全パスのスコア。
+ *  - 子は一度に全部積まず、状態ごとに前状態を (alpha+エッジ) の降順に並べた表を引いて
+ *    「最良の子」と「次の兄弟」だけを積む（1回の pop で高々2ノード）。
+ *  - 状態 (0,0) に達したノードが pop されたら完成。pop 順がそのままスコア降順。
+ *
+ * 状態 (pos,0)（pos>0）は使われないので、(n_cp,0) を終端の仮想ルートに使う
+ * （前状態は (n_cp,j)、エッジ 0）。
+ */
+typedef struct {
+  npycrf_score_t f;  /* g + alpha[状態] */
+  npycrf_score_t g;  /* 状態から終端までのスコア */
+  uint32_t parent;   /* 後ろ側のノード */
+  uint16_t pos;
+  uint8_t k;
+  uint8_t rank;      /* parent の前状態表での順位 */
+} kbest_node_t;
+
+#define KBEST_ORD_UNSET 0xFFFFu
+
+static size_t kbest_node_cap(uint16_t max_n_cp, uint16_t max_word_len, uint16_t nbest) {
+  /* 1回の pop で高々2ノード、pop は候補あたり高々 (トークン数+1) 回（同点がなければ） */
+  return 2u * ((size_t)nbest * ((size_t)max_n_cp + 1u) + 1u) + (size_t)max_word_len + 2u;
+}
+
 size_t npycrf_nbestbuf_size(uint16_t max_n_cp, uint16_t max_word_len, uint16_t nbest) {
   if (nbest == 0) return 0;
   size_t states = ((size_t)max_n_cp + 1u) * ((size_t)max_word_len + 1u);
-  size_t n = (size_t)nbest;
   size_t bytes = 0;
   bytes += 16u; /* alignment slack */
-  bytes += states * n * sizeof(npycrf_score_t);
-  bytes += states * n * sizeof(uint8_t); /* prevlen */
-  bytes += states * n * sizeof(uint8_t); /* prevrank */
+  bytes += states * sizeof(npycrf_score_t);     /* alpha */
+  bytes += states * sizeof(uint16_t);           /* 前状態表の長さ */
+  bytes += states * (size_t)max_word_len;       /* 前状態表（降順の j） */
+  bytes += kbest_node_cap(max_n_cp, max_word_len, nbest) * (sizeof(kbest_node_t) + sizeof(uint32_t));
   return bytes;
 }
 
+/* (prev_pos, j) → (pos, k) のエッジ（prev_pos == 0 なら BOS から） */
+static inline npycrf_score_t kbest_edge(const npycrf_model_t *model, npycrf_work_t *work,
+                                        uint16_t L, uint16_t pos, uint16_t k, uint16_t j) {
+  uint16_t start = (uint16_t)(pos - k);
+  size_t idx_curr = span_index(pos, k, L);
+  npycrf_id_t prev_id = (start == 0) ? NPYCRF_ID_BOS : work->span_id[span_index(start, j, L)];
+  int16_t lm = LM_BIGRAM(work, &model->lm, prev_id, work->span_id[idx_curr], work->span_luni[idx_curr]);
+  return crf_seg_score(model, work, start, pos) + q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
+}
+
+static inline int kbest_before(const kbest_node_t *nodes, uint32_t a, uint32_t b) {
+  if (nodes[a].f != nodes[b].f) return nodes[a].f > nodes[b].f;
+  return a < b;  /* 同点は先に作ったノードを優先（決定的） */
+}
+
+static void kbest_heap_push(uint32_t *heap, size_t *n, const kbest_node_t *nodes, uint32_t id) {
+  size_t i = (*n)++;
+  while (i > 0) {
+    size_t up = (i - 1u) / 2u;
+    if (!kbest_before(nodes, id, heap[up])) break;
+    heap[i] = heap[up];
+    i = up;
+  }
+  heap[i] = id;
+}
+
+static uint32_t kbest_heap_pop(uint32_t *heap, size_t *n, const kbest_node_t *nodes) {
+  uint32_t top = heap[0];
+  uint32_t last = heap[--(*n)];
+  size_t i = 0;
+  while (1) {
+    size_t c = 2u * i + 1u;
+    if (c >= *n) break;
+    if (c + 1u < *n && kbest_before(nodes, heap[c + 1u], heap[c])) c++;
+    if (!kbest_before(nodes, heap[c], last)) break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  if (*n > 0) heap[i] = last;
+  return top;
+}
+
 int npycrf_decode_nbest(const npycrf_model_t *model,
                         const uint8_t *utf8, size_t len,
                         npycrf_work_t *work,
@@ -1310,22 +3279,20 @@ int npycrf_decode_nbest(const npycrf_model_t *model,
   if (!model || !utf8 || !work || !nbest_buf || nbest_buf_size == 0 || !out_b_cp_flat || !out_b_count) return -1;
   if (model->max_word_len == 0 || nbest == 0) return -1;
 
-  /* 1) offsets */
+  for (uint16_t i = 0; i < nbest; i++) {
+    out_b_count[i] = 0;
+    if (out_scores) out_scores[i] = 0;
+  }
+
+  /* 1-2) offsets, emissions and spans in one pass */
   if (!work->cp_off || work->max_n_cp == 0) return -2;
-  size_t n_cp_sz = npycrf_utf8_make_offsets(utf8, len, work->cp_off, (size_t)work->max_n_cp + 1u);
+  uint16_t L = model->max_word_len;
+  if (L > work->max_word_len || L > 255u) return -4;
+  size_t n_cp_sz = precompute_lattice(model, utf8, len, work);
   if (n_cp_sz == 0) return -3;
-  if (n_cp_sz > work->max_n_cp) return -3;
   uint16_t n_cp = (uint16_t)n_cp_sz;
-  uint16_t L = model->max_word_len;
-  if (L > work->max_word_len) return -4;
   if (out_b_cap < (size_t)n_cp + 1u) return -5;
 
-  /* 2) precompute */
-  int rc = precompute_emissions(model, utf8, len, work->cp_off, n_cp, work);
-  if (rc != 0) return -10;
-  rc = precompute_spans(model, utf8, len, work->cp_off, n_cp, work);
-  if (rc != 0) return -11;
-
   /* 3) parse buffer */
   size_t L1 = (size_t)L + 1u;
   size_t states = ((size_t)n_cp + 1u) * L1;
@@ -1333,201 +3300,166 @@ int npycrf_decode_nbest(const npycrf_model_t *model,
   uintptr_t p0 = (uintptr_t)nbest_buf;
   uintptr_t p1 = align_up_uintptr(p0, 4u);
   size_t pad = (size_t)(p1 - p0);
-  size_t need_scores = states * (size_t)nbest * sizeof(npycrf_score_t);
-  size_t need_prevlen = states * (size_t)nbest * sizeof(uint8_t);
-  size_t need_prevrank = states * (size_t)nbest * sizeof(uint8_t);
-  size_t need = pad + need_scores + need_prevlen + need_prevrank;
-  if (nbest_buf_size < need) return -12;
+  size_t need_alpha = states * sizeof(npycrf_score_t);
+  size_t need_cnt = states * sizeof(uint16_t);
+  size_t need_ord = states * (size_t)L;
+  size_t fixed = pad + need_alpha + need_cnt + need_ord;
+  if (nbest_buf_size < fixed) return -12;
+  size_t node_cap = (nbest_buf_size - fixed) / (sizeof(kbest_node_t) + sizeof(uint32_t));
+  size_t node_want = kbest_node_cap(n_cp, L, nbest);
+  if (node_cap > node_want) node_cap = node_want;
+  if (node_cap > (size_t)UINT32_MAX) node_cap = (size_t)UINT32_MAX;
+  if (node_cap < 2u) return -12;
 
   uint8_t *p = (uint8_t *)p1;
-  npycrf_score_t *dp = (npycrf_score_t *)p;
-  p += need_scores;
-  uint8_t *bp_len = p;
-  p += need_prevlen;
-  uint8_t *bp_rank = p;
-
-  /* init */
-  size_t total = states * (size_t)nbest;
-  for (size_t i = 0; i < total; i++) {
-    dp[i] = NPYCRF_SCORE_NEG_INF;
-    bp_len[i] = 0;
-    bp_rank[i] = 0;
+  npycrf_score_t *alpha = (npycrf_score_t *)p;
+  p += need_alpha;
+  kbest_node_t *nodes = (kbest_node_t *)p;
+  p += node_cap * sizeof(kbest_node_t);
+  uint32_t *heap = (uint32_t *)p;
+  p += node_cap * sizeof(uint32_t);
+  uint16_t *ord_n = (uint16_t *)p;
+  p += need_cnt;
+  uint8_t *ord = p;
+
+  /* 4) forward 1-best over all states (alpha) */
+  const npycrf_lm_t *lmp = &model->lm;
+  int uni_only = !lm_has_bigram(lmp);
+  for (size_t i = 0; i < states; i++) {
+    alpha[i] = NPYCRF_SCORE_NEG_INF;
+    ord_n[i] = KBEST_ORD_UNSET;
   }
+  alpha[0] = (npycrf_score_t)model->crf.bos_to1;
 
-  /* start state (0,0) rank0 */
-  dp[0 * (size_t)nbest + 0] = (npycrf_score_t)model->crf.bos_to1;
-
-  /* forward k-best */
   for (uint16_t pos = 1; pos <= n_cp; pos++) {
     uint16_t kmax = (uint16_t)((pos <= L) ? pos : L);
+    npycrf_score_t *row = alpha + (size_t)pos * L1;
     for (uint16_t k = 1; k <= kmax; k++) {
       uint16_t start = (uint16_t)(pos - k);
-
-      npycrf_score_t seg = crf_seg_score(model, work, start, pos);
-      size_t idx_curr = span_index(pos, k, L);
-      npycrf_id_t curr_id = work->span_id[idx_curr];
-      int16_t curr_luni = work->span_luni[idx_curr];
-
-      /* topK arrays (local) */
-      /* NOTE: nbest is runtime; allocate on heap? -> use fixed upper bound via malloc-free insert */
-      /* We implement insertion directly into dp for current state via temp arrays allocated with malloc? */
-      /* To keep pure C99 without VLA, cap nbest to 64. */
-      if (nbest > 64u) return -13;
-      npycrf_score_t best_s[64];
-      uint8_t best_pl[64];
-      uint8_t best_pr[64];
-      for (uint16_t r = 0; r < nbest; r++) {
-        best_s[r] = NPYCRF_SCORE_NEG_INF;
-        best_pl[r] = 0;
-        best_pr[r] = 0;
-      }
-
+      const npycrf_score_t *prev_row = alpha + (size_t)start * L1;
+      npycrf_score_t best = NPYCRF_SCORE_NEG_INF;
       if (start == 0) {
-        /* only prev (0,0) */
-        npycrf_score_t add0 = 0;
-        int16_t lm = lm_bigram_logp(&model->lm, NPYCRF_ID_BOS, curr_id, curr_luni);
-        add0 = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
-        npycrf_score_t edge = seg + add0;
-        for (uint16_t pr = 0; pr < nbest; pr++) {
-          npycrf_score_t prev = dp[0 * (size_t)nbest + pr];
-          if (prev == NPYCRF_SCORE_NEG_INF) continue;
-          npycrf_score_t cand = prev + edge;
-          /* insert cand into best_s */
-          for (uint16_t t = 0; t < nbest; t++) {
-            if (cand > best_s[t]) {
-              for (uint16_t u = nbest - 1; u > t; u--) {
-                best_s[u] = best_s[u - 1];
-                best_pl[u] = best_pl[u - 1];
-                best_pr[u] = best_pr[u - 1];
-              }
-              best_s[t] = cand;
-              best_pl[t] = 0;
-              best_pr[t] = (uint8_t)pr;
-              break;
-            }
-          }
-        }
+        best = prev_row[0] + kbest_edge(model, work, L, pos, k, 0);
+      } else if (uni_only) {
+        /* エッジが前状態に依存しない: 前の行の最大値だけでよい（row[0] に保持） */
+        if (prev_row[0] != NPYCRF_SCORE_NEG_INF) best = prev_row[0] + kbest_edge(model, work, L, pos, k, 1);
       } else {
         uint16_t jmax = (uint16_t)((start <= L) ? start : L);
         for (uint16_t j = 1; j <= jmax; j++) {
-          size_t idx_prev = span_index(start, j, L);
-          npycrf_id_t prev_id = work->span_id[idx_prev];
-          int16_t lm = lm_bigram_logp(&model->lm, prev_id, curr_id, curr_luni);
-          npycrf_score_t add = q16_mul_q8((npycrf_score_t)model->lambda0, (npycrf_score_t)lm);
-          npycrf_score_t edge = seg + add;
-
-          size_t sid_prev = (size_t)start * L1 + (size_t)j;
-          npycrf_score_t *prev_row = dp + sid_prev * (size_t)nbest;
-          for (uint16_t pr = 0; pr < nbest; pr++) {
-            npycrf_score_t prev = prev_row[pr];
-            if (prev == NPYCRF_SCORE_NEG_INF) continue;
-            npycrf_score_t cand = prev + edge;
-            for (uint16_t t = 0; t < nbest; t++) {
-              if (cand > best_s[t]) {
-                for (uint16_t u = nbest - 1; u > t; u--) {
-                  best_s[u] = best_s[u - 1];
-                  best_pl[u] = best_pl[u - 1];
-                  best_pr[u] = best_pr[u - 1];
-                }
-                best_s[t] = cand;
-                best_pl[t] = (uint8_t)j;
-                best_pr[t] = (uint8_t)pr;
-                break;
-              }
-            }
-          }
+          if (prev_row[j] == NPYCRF_SCORE_NEG_INF) continue;
+          npycrf_score_t cand = prev_row[j] + kbest_edge(model, work, L, pos, k, j);
+          if (cand > best) best = cand;
         }
       }
-
-      /* store */
-      size_t sid = (size_t)pos * L1 + (size_t)k;
-      npycrf_score_t *dst = dp + sid * (size_t)nbest;
-      uint8_t *dst_pl = bp_len + sid * (size_t)nbest;
-      uint8_t *dst_pr = bp_rank + sid * (size_t)nbest;
-      for (uint16_t r = 0; r < nbest; r++) {
-        dst[r] = best_s[r];
-        dst_pl[r] = best_pl[r];
-        dst_pr[r] = best_pr[r];
+      row[k] = best;
+    }
+    if (uni_only && pos < n_cp) {
+      npycrf_score_t m = NPYCRF_SCORE_NEG_INF;
+      for (uint16_t k = 1; k <= kmax; k++) {
+        if (row[k] > m) m = row[k];
       }
+      row[0] = m;
     }
   }
 
-  /* 4) pick global top N from final states */
-  if (nbest > 64u) return -13;
-  npycrf_score_t top_s[64];
-  uint16_t top_k[64];
-  uint8_t top_r[64];
-  for (uint16_t i = 0; i < nbest; i++) {
-    top_s[i] = NPYCRF_SCORE_NEG_INF;
-    top_k[i] = 0;
-    top_r[i] = 0;
-    out_b_count[i] = 0;
-    if (out_scores) out_scores[i] = 0;
+  /* 5) backward A* from the virtual root (n_cp,0) */
+  size_t n_nodes = 0;
+  size_t heap_n = 0;
+  int out_n = 0;
+  {
+    kbest_node_t *root = &nodes[n_nodes++];
+    root->g = 0;
+    root->pos = n_cp;
+    root->k = 0;
+    root->parent = UINT32_MAX;
+    root->rank = 0;
+    root->f = NPYCRF_SCORE_NEG_INF;
+    uint16_t kmax_end = (uint16_t)((n_cp <= L) ? n_cp : L);
+    for (uint16_t k = 1; k <= kmax_end; k++) {
+      npycrf_score_t a = alpha[(size_t)n_cp * L1 + k];
+      if (a > root->f) root->f = a;
+    }
+    if (root->f == NPYCRF_SCORE_NEG_INF) return 0;
+    kbest_heap_push(heap, &heap_n, nodes, 0);
   }
 
-  uint16_t kmax_end = (uint16_t)((n_cp <= L) ? n_cp : L);
-  for (uint16_t k = 1; k <= kmax_end; k++) {
-    size_t sid = (size_t)n_cp * L1 + (size_t)k;
-    npycrf_score_t *row = dp + sid * (size_t)nbest;
-    for (uint16_t r = 0; r < nbest; r++) {
-      npycrf_score_t s = row[r];
-      if (s == NPYCRF_SCORE_NEG_INF) continue;
-      for (uint16_t t = 0; t < nbest; t++) {
-        if (s > top_s[t]) {
-          for (uint16_t u = nbest - 1; u > t; u--) {
-            top_s[u] = top_s[u - 1];
-            top_k[u] = top_k[u - 1];
-            top_r[u] = top_r[u - 1];
-          }
-          top_s[t] = s;
-          top_k[t] = k;
-          top_r[t] = (uint8_t)r;
-          break;
-        }
+  while (heap_n > 0 && out_n < (int)nbest) {
+    uint32_t id = kbest_heap_pop(heap, &heap_n, nodes);
+    kbest_node_t nd = nodes[id];
+
+    if (nd.pos == 0) {
+      /* 完成: 親をたどると境界が昇順に並ぶ */
+      uint16_t *bout = out_b_cp_flat + (size_t)out_n * out_b_cap;
+      size_t bcnt = 0;
+      for (uint32_t c = id; c != 0; c = nodes[c].parent) {
+        if (bcnt > (size_t)n_cp) return -31;
+        bout[bcnt++] = nodes[c].pos;
       }
+      if (bcnt < 2u || bout[bcnt - 1u] != n_cp) return -32;
+      out_b_count[out_n] = bcnt;
+      if (out_scores) out_scores[out_n] = nd.f;
+      out_n++;
     }
-  }
-
-  /* 5) backtrack each */
-  int out_n = 0;
-  for (uint16_t i = 0; i < nbest; i++) {
-    if (top_s[i] == NPYCRF_SCORE_NEG_INF || top_k[i] == 0) continue;
-
-    uint16_t *bout = out_b_cp_flat + (size_t)i * out_b_cap;
-    size_t bcnt = 0;
-    uint16_t pos = n_cp;
-    uint16_t k = top_k[i];
-    uint8_t r = top_r[i];
 
-    while (1) {
-      bout[bcnt++] = pos;
-      if (pos == 0) break;
-      uint16_t start = (uint16_t)(pos - k);
-      size_t sid = (size_t)pos * L1 + (size_t)k;
-      uint8_t pl = bp_len[sid * (size_t)nbest + (size_t)r];
-      uint8_t pr = bp_rank[sid * (size_t)nbest + (size_t)r];
-      pos = start;
-      k = (uint16_t)pl;
-      r = pr;
-      if (pos == 0) {
-        bout[bcnt++] = 0;
-        break;
+    /* 兄弟（parent の次順位の前状態）と、自分の最良の子を積む */
+    for (int which = 0; which < 2; which++) {
+      uint32_t par;
+      uint16_t r;
+      if (which == 0) {
+        if (nd.parent == UINT32_MAX) continue;
+        par = nd.parent;
+        r = (uint16_t)(nd.rank + 1u);
+      } else {
+        if (nd.pos == 0) continue;
+        par = id;
+        r = 0;
       }
-      if (k == 0) return -30;
-      if (bcnt > (size_t)n_cp + 1u) return -31;
-    }
 
-    /* reverse */
-    for (size_t a = 0; a < bcnt / 2u; a++) {
-      uint16_t tmp = bout[a];
-      bout[a] = bout[bcnt - 1u - a];
-      bout[bcnt - 1u - a] = tmp;
+      const kbest_node_t *pn = &nodes[par];
+      size_t sid = (size_t)pn->pos * L1 + pn->k;
+      uint16_t prev_pos = (uint16_t)(pn->pos - pn->k);
+      uint8_t *ol = ord + sid * (size_t)L;
+
+      if (ord_n[sid] == KBEST_ORD_UNSET) {
+        /* 前状態を alpha+エッジ の降順に（同点は j の小さい順） */
+        npycrf_score_t key[256];
+        uint16_t cnt = 0;
+        if (prev_pos == 0) {
+          ol[cnt++] = 0;
+        } else {
+          uint16_t jmax = (uint16_t)((prev_pos <= L) ? prev_pos : L);
+          const npycrf_score_t *prev_row = alpha + (size_t)prev_pos * L1;
+          for (uint16_t j = 1; j <= jmax; j++) {
+            if (prev_row[j] == NPYCRF_SCORE_NEG_INF) continue;
+            npycrf_score_t kv = prev_row[j];
+            if (pn->k != 0) kv += kbest_edge(model, work, L, pn->pos, pn->k, j);
+            uint16_t t = cnt++;
+            while (t > 0 && key[t - 1u] < kv) {
+              key[t] = key[t - 1u];
+              ol[t] = ol[t - 1u];
+              t--;
+            }
+            key[t] = kv;
+            ol[t] = (uint8_t)j;
+          }
+        }
+        ord_n[sid] = cnt;
+      }
+      if (r >= ord_n[sid]) continue;
+      if (n_nodes >= node_cap) return out_n;  /* ノード枠不足: 見つかった分だけ返す */
+
+      uint16_t j = ol[r];
+      npycrf_score_t edge = (pn->k != 0) ? kbest_edge(model, work, L, pn->pos, pn->k, j) : 0;
+      uint32_t cid = (uint32_t)n_nodes++;
+      kbest_node_t *cn = &nodes[cid];
+      cn->g = pn->g + edge;
+      cn->f = cn->g + alpha[(size_t)prev_pos * L1 + j];
+      cn->parent = par;
+      cn->pos = prev_pos;
+      cn->k = (uint8_t)j;
+      cn->rank = (uint8_t)r;
+      kbest_heap_push(heap, &heap_n, nodes, cid);
     }
-    if (bout[0] != 0 || bout[bcnt - 1u] != n_cp) return -32;
-
-    out_b_count[i] = bcnt;
-    if (out_scores) out_scores[i] = top_s[i];
-    out_n++;
   }
 
   return out_n;
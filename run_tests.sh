@@ -17,22 +17,32 @@ echo "========================================="
 
 # Test 1: Build tools
 echo ""
-echo "[1/6] Building tools..."
+echo "[1/7] Building tools..."
 cd "$TOOLS_DIR"
-gcc -O3 -std=c99 -Wall -Wextra -I.. -I../double_array -I../npycrf_lite -I../suffix_array -I../unilm_mdl \
+gcc -O3 -std=c99 -Wall -Wextra -pthread -I.. -I../double_array -I../npycrf_lite -I../suffix_array -I../unilm_mdl \
   -o mmjp_train mmjp_train.c mmjp_model.c \
   ../suffix_array/sa_utf8.c ../unilm_mdl/unilm_mdl.c \
   ../double_array/double_array_trie.c ../npycrf_lite/npycrf_lite.c \
   ../mmjp_lossless.c -lm
+gcc -O3 -std=c99 -Wall -Wextra -pthread -I.. -I../double_array -I../npycrf_lite \
+  -o mmjp_tokenize mmjp_tokenize.c mmjp_model.c mmjp_cache.c \
+  ../double_array/double_array_trie.c ../npycrf_lite/npycrf_lite.c \
+  ../mmjp_lossless.c -lm
 gcc -O3 -std=c99 -Wall -Wextra -I.. -I../double_array -I../npycrf_lite \
-  -o mmjp_tokenize mmjp_tokenize.c mmjp_model.c \
+  -o mmjp_bench_bigram mmjp_bench_bigram.c mmjp_model.c \
+  ../double_array/double_array_trie.c ../npycrf_lite/npycrf_lite.c -lm
+gcc -O3 -std=c99 -Wall -Wextra -DNPYCRF_PROFILE -I.. -I../double_array -I../npycrf_lite \
+  -o mmjp_bench mmjp_bench.c mmjp_model.c \
   ../double_array/double_array_trie.c ../npycrf_lite/npycrf_lite.c \
   ../mmjp_lossless.c -lm
+gcc -O3 -std=c99 -Wall -Wextra -I.. -I../double_array -I../npycrf_lite \
+  -o mmjp_export_c mmjp_export_c.c mmjp_model.c \
+  ../double_array/double_array_trie.c ../npycrf_lite/npycrf_lite.c -lm
 echo "PASS: Tools built successfully"
 
 # Test 2: pip install
 echo ""
-echo "[2/6] Testing pip install -e ..."
+echo "[2/7] Testing pip install -e ..."
 cd "$SCRIPT_DIR"
 pip install -e . -q
 python -c "import mmjp; print(f'mmjp version: {mmjp.__version__}')"
@@ -40,7 +50,7 @@ echo "PASS: pip install successful"
 
 # Test 3: Lossless roundtrip
 echo ""
-echo "[3/6] Testing lossless roundtrip..."
+echo "[3/7] Testing lossless roundtrip..."
 cat > "$TMP_DIR/t.txt" <<'EOF'
 hello  world
 	indented line
@@ -66,9 +76,35 @@ else
   exit 1
 fi
 
+# read_all streams through npycrf_stream_*: documents past the old 65,535-codepoint limit
+for i in $(seq 1 400); do cat "$SCRIPT_DIR/datasets/wiki_small.txt"; done > "$TMP_DIR/long.txt"
+"$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_lossless.bin" --lossless_ws 1 --read_all 1 \
+  < "$TMP_DIR/long.txt" > "$TMP_DIR/long.tok"
+"$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_lossless.bin" --detok --lossless_ws 1 --max_line_bytes 0 \
+  < "$TMP_DIR/long.tok" > "$TMP_DIR/long.restored"
+if cmp -s "$TMP_DIR/long.txt" "$TMP_DIR/long.restored"; then
+  echo "PASS: Streaming lossless roundtrip successful ($(wc -c < "$TMP_DIR/long.txt") bytes)"
+else
+  echo "FAIL: Streaming lossless roundtrip - files differ"
+  exit 1
+fi
+
+# --output spans: per-token source byte ranges must tile each original line
+"$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_lossless.bin" --lossless_ws 1 --output spans \
+  < "$TMP_DIR/t.txt" > "$TMP_DIR/t.spans"
+if ! LC_ALL=C awk 'NR == FNR { if (length($0) > 0) len[++n] = length($0); next }
+    { pos = 0
+      for (i = 1; i <= NF; i++) { split($i, r, ":"); if (r[1] != pos || r[2] < r[1]) exit 1; pos = r[2] }
+      if (pos != len[FNR]) exit 1 }
+    END { if (FNR != n) exit 1 }' "$TMP_DIR/t.txt" "$TMP_DIR/t.spans"; then
+  echo "FAIL: --output spans do not cover the input lines"
+  exit 1
+fi
+echo "PASS: --output spans map tokens back to input bytes"
+
 # Test 4: cc_ranges smoke test
 echo ""
-echo "[4/6] Testing cc_ranges..."
+echo "[4/7] Testing cc_ranges..."
 cat > "$TMP_DIR/ranges.txt" <<'EOF'
 # Japanese character ranges
 0x3040 0x309F 4
@@ -82,18 +118,735 @@ EOF
   --cc_mode ranges --cc_ranges "$TMP_DIR/ranges.txt" > /dev/null 2>&1
 echo "PASS: cc_ranges smoke test successful"
 
+# v2 (streamed) and v3 (mmap) model files must tokenize identically
+"$TOOLS_DIR/mmjp_train" --corpus "$SCRIPT_DIR/datasets/wiki_small.txt" \
+  --out "$TMP_DIR/model_ranges_v2.bin" \
+  --vocab 1000 --iters 1 --model_version 2 \
+  --cc_mode ranges --cc_ranges "$TMP_DIR/ranges.txt" > /dev/null 2>&1
+"$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_ranges.bin" \
+  < "$SCRIPT_DIR/datasets/wiki_small.txt" > "$TMP_DIR/ranges_v3.out"
+"$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_ranges_v2.bin" \
+  < "$SCRIPT_DIR/datasets/wiki_small.txt" > "$TMP_DIR/ranges_v2.out"
+if cmp -s "$TMP_DIR/ranges_v3.out" "$TMP_DIR/ranges_v2.out"; then
+  echo "PASS: v2 and v3 model files tokenize identically"
+else
+  echo "FAIL: v2 and v3 model outputs differ"
+  exit 1
+fi
+
+# codepoint-keyed trie (--trie cp) must not change the segmentation
+"$TOOLS_DIR/mmjp_train" --corpus "$SCRIPT_DIR/datasets/wiki_small.txt" \
+  --out "$TMP_DIR/model_ranges_cp.bin" \
+  --vocab 1000 --iters 1 --trie cp \
+  --cc_mode ranges --cc_ranges "$TMP_DIR/ranges.txt" > /dev/null 2>&1
+"$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_ranges_cp.bin" \
+  < "$SCRIPT_DIR/datasets/wiki_small.txt" > "$TMP_DIR/ranges_cp.out"
+if cmp -s "$TMP_DIR/ranges_v3.out" "$TMP_DIR/ranges_cp.out"; then
+  echo "PASS: codepoint trie tokenizes identically to byte trie"
+else
+  echo "FAIL: codepoint trie output differs"
+  exit 1
+fi
+
+# compact (v4) model: smaller file, converter and trainer agree, segmentation stays close
+"$TOOLS_DIR/mmjp_train" --corpus "$SCRIPT_DIR/datasets/wiki_small.txt" \
+  --out "$TMP_DIR/model_ranges_v4.bin" \
+  --vocab 1000 --iters 1 --model_version 4 \
+  --cc_mode ranges --cc_ranges "$TMP_DIR/ranges.txt" > /dev/null 2>&1
+"$TOOLS_DIR/mmjp_export_c" --model "$TMP_DIR/model_ranges.bin" \
+  --out "$TMP_DIR/model_ranges_v4c.bin" --compact --bin 2> /dev/null
+"$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_ranges_v4.bin" \
+  < "$SCRIPT_DIR/datasets/wiki_small.txt" > "$TMP_DIR/ranges_v4.out"
+SAME_LINES=$(awk 'NR == FNR { a[FNR] = $0; next } a[FNR] == $0 { n++ } END { print n + 0 }' \
+  "$TMP_DIR/ranges_v3.out" "$TMP_DIR/ranges_v4.out")
+ALL_LINES=$(wc -l < "$TMP_DIR/ranges_v3.out")
+if cmp -s "$TMP_DIR/model_ranges_v4.bin" "$TMP_DIR/model_ranges_v4c.bin" &&
+   [ "$(wc -c < "$TMP_DIR/model_ranges_v4.bin")" -lt "$(wc -c < "$TMP_DIR/model_ranges.bin")" ] &&
+   [ $((SAME_LINES * 100)) -ge $((ALL_LINES * 90)) ]; then
+  echo "PASS: compact model matches v3 on $SAME_LINES/$ALL_LINES lines"
+else
+  echo "FAIL: compact model ($SAME_LINES/$ALL_LINES lines match v3)"
+  exit 1
+fi
+
+# the generated specialized decoder must split every line exactly like npycrf_decode()
+"$TOOLS_DIR/mmjp_export_c" --model "$TMP_DIR/model_ranges.bin" \
+  --out "$TMP_DIR/spec_dec.c" --decoder --max_cp 1024 2> /dev/null
+cat > "$TMP_DIR/spec_main.c" <<'CEOF'
+#include <stdio.h>
+#include <string.h>
+#include "spec_dec.h"
+static mmjp_dec_work_t w;
+int main(void) {
+  static char line[16384];
+  static uint16_t b[MMJP_DEC_MAX_CP + 1u];
+  while (fgets(line, sizeof(line), stdin)) {
+    size_t len = strcspn(line, "\r\n"), n = 0;
+    if (mmjp_dec_decode((const uint8_t *)line, len, &w, b, MMJP_DEC_MAX_CP + 1u, &n, NULL) != 0) return 1;
+    for (size_t i = 0; i + 1 < n; i++) printf("%s%u:%u", i ? " " : "", w.cp_off[b[i]], w.cp_off[b[i + 1]]);
+    printf("\n");
+  }
+  return 0;
+}
+CEOF
+gcc -O2 -std=c99 -Wall -Wextra -o "$TMP_DIR/spec_dec" "$TMP_DIR/spec_main.c" "$TMP_DIR/spec_dec.c"
+"$TMP_DIR/spec_dec" < "$SCRIPT_DIR/datasets/wiki_small.txt" > "$TMP_DIR/spec_dec.out"
+"$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_ranges.bin" --output spans \
+  < "$SCRIPT_DIR/datasets/wiki_small.txt" > "$TMP_DIR/spec_ref.out"
+if cmp -s "$TMP_DIR/spec_dec.out" "$TMP_DIR/spec_ref.out"; then
+  echo "PASS: specialized decoder matches npycrf_decode"
+else
+  echo "FAIL: specialized decoder output differs"
+  exit 1
+fi
+
+# SA-IS must build the same suffix array as the radix quicksort (every flag combination,
+# in-place and allocated work arrays, 1-4 byte characters and 0xF8-0xFF leads), and the
+# LCP array must match a naive scan with 1 and 4 threads
+cat > "$TMP_DIR/sa_check.c" <<'CEOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sa_utf8.h"
+static uint32_t rng = 12345u;
+static uint32_t rnd(void) { rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5; return rng; }
+static size_t put_cp(uint8_t *o, uint32_t c) {
+  if (c < 0x80u) { o[0] = (uint8_t)c; return 1; }
+  if (c < 0x800u) { o[0] = (uint8_t)(0xC0u | (c >> 6)); o[1] = (uint8_t)(0x80u | (c & 0x3Fu)); return 2; }
+  if (c < 0x10000u) {
+    o[0] = (uint8_t)(0xE0u | (c >> 12)); o[1] = (uint8_t)(0x80u | ((c >> 6) & 0x3Fu));
+    o[2] = (uint8_t)(0x80u | (c & 0x3Fu)); return 3;
+  }
+  o[0] = (uint8_t)(0xF0u | (c >> 18)); o[1] = (uint8_t)(0x80u | ((c >> 12) & 0x3Fu));
+  o[2] = (uint8_t)(0x80u | ((c >> 6) & 0x3Fu)); o[3] = (uint8_t)(0x80u | (c & 0x3Fu)); return 4;
+}
+/* kind: 0 = mixed widths + 0xF8-0xFF leads, 1 = small alphabet (long repeats), 2 = mixed + truncated tail */
+static size_t gen(uint8_t *o, size_t n_chars, int kind) {
+  static const char punct[] = " .,!?-:;()\t\n";
+  size_t len = 0;
+  for (size_t i = 0; i < n_chars; i++) {
+    uint32_t r = rnd();
+    if (kind == 1) {
+      static const uint32_t al[4] = {'a', ' ', 0x3042u, 0x1F600u};
+      len += put_cp(o + len, al[(r >> 3) % ((r & 4u) ? 2u : 4u)]);
+      continue;
+    }
+    switch (r % 8u) {
+      case 0: o[len++] = (uint8_t)punct[(r >> 8) % (sizeof(punct) - 1u)]; break;
+      case 1: o[len++] = (uint8_t)('a' + (r >> 8) % 3u); break;
+      case 2: len += put_cp(o + len, 0x80u + (r >> 8) % 0x780u); break;
+      case 3: len += put_cp(o + len, 0x4E00u + (r >> 8) % 16u); break;
+      case 4: len += put_cp(o + len, 0x800u + (r >> 8) % 0xF000u); break;
+      case 5: len += put_cp(o + len, 0x10000u + (r >> 8) % 0x100000u); break;
+      case 6: len += put_cp(o + len, 0x1F600u + (r >> 8) % 4u); break;
+      default: o[len++] = (uint8_t)(0xF8u + (r >> 8) % 8u); break;
+    }
+  }
+  if (kind == 2 && len > 0) o[len++] = 0xE3u;  /* incomplete sequence: radix fallback */
+  return len;
+}
+static int fail(const char *what, size_t len, unsigned f) {
+  fprintf(stderr, "FAIL: %s (len=%zu flags=%u)\n", what, len, f);
+  return 1;
+}
+static int check(const uint8_t *t, size_t len) {
+  for (unsigned f = 0; f < 8u; f++) {
+    const size_t n = sa_utf8_count_starts(t, len, f);
+    const size_t wcap = sa_utf8_build_work_cap(t, len);
+    const size_t cap = (wcap > n) ? wcap : n;
+    sa_idx_t *ref = malloc((n + 1u) * sizeof(sa_idx_t));
+    sa_idx_t *a = malloc((n + 1u) * sizeof(sa_idx_t));
+    sa_idx_t *b = malloc((cap + 1u) * sizeof(sa_idx_t));
+    uint8_t *lcp = malloc(n + 1u), *lcp4 = malloc(n + 1u);
+    if (!ref || !a || !b || !lcp || !lcp4) return fail("malloc", len, f);
+    if (sa_utf8_build(ref, n, t, len, f | SA_BUILD_RADIX_SORT) != n) return fail("radix count", len, f);
+    /* sa_out_cap < work cap: SA-IS allocates its own work array */
+    if (sa_utf8_build(a, n, t, len, f) != n || memcmp(a, ref, n * sizeof(sa_idx_t)) != 0)
+      return fail("SA-IS (allocated work) differs from radix", len, f);
+    /* sa_out_cap >= work cap: SA-IS runs in sa_out */
+    if (sa_utf8_build(b, cap, t, len, f) != n || memcmp(b, ref, n * sizeof(sa_idx_t)) != 0)
+      return fail("SA-IS (in place) differs from radix", len, f);
+    for (size_t i = 1; i < n; i++) {
+      size_t x = ref[i - 1], y = ref[i], k = 0;
+      while (x + k < len && y + k < len && t[x + k] == t[y + k]) k++;
+      if (!(x + k == len || (y + k < len && t[x + k] < t[y + k]))) return fail("not sorted", len, f);
+    }
+    sa_utf8_view_t v = sa_utf8_view(t, len, ref, n);
+    if (sa_utf8_build_lcp(&v, lcp, n, 255, 1) != n || sa_utf8_build_lcp(&v, lcp4, n, 255, 4) != n)
+      return fail("lcp count", len, f);
+    for (size_t i = 0; i < n; i++) {
+      size_t k = 0;
+      if (i > 0) {
+        while (k < 255 && ref[i - 1] + k < len && ref[i] + k < len && t[ref[i - 1] + k] == t[ref[i] + k]) k++;
+      }
+      if (lcp[i] != k || lcp4[i] != k) return fail("lcp differs from naive", len, f);
+    }
+    free(ref); free(a); free(b); free(lcp); free(lcp4);
+  }
+  return 0;
+}
+int main(int argc, char **argv) {
+  static uint8_t t[1u << 20];
+  size_t n_texts = 0;
+  static const size_t sizes[] = {1, 2, 3, 7, 64, 65, 500, 4096, 30000};
+  for (int kind = 0; kind < 3; kind++) {
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      for (int rep = 0; rep < 3; rep++, n_texts++) {
+        if (check(t, gen(t, sizes[s], kind))) return 1;
+      }
+    }
+  }
+  for (int i = 1; i < argc; i++, n_texts++) {
+    FILE *fp = fopen(argv[i], "rb");
+    if (!fp) return 1;
+    size_t len = fread(t, 1, sizeof(t), fp);
+    fclose(fp);
+    if (check(t, len)) return 1;
+  }
+  printf("%zu\n", n_texts);
+  return 0;
+}
+CEOF
+gcc -O2 -std=c99 -Wall -Wextra -pthread -I"$SCRIPT_DIR/suffix_array" -o "$TMP_DIR/sa_check" \
+  "$TMP_DIR/sa_check.c" "$SCRIPT_DIR/suffix_array/sa_utf8.c"
+SA_TEXTS=$("$TMP_DIR/sa_check" "$SCRIPT_DIR/datasets/wiki_small.txt")
+echo "PASS: SA-IS matches the radix suffix array builder ($SA_TEXTS texts)"
+
 # Test 5: wiki_small
 echo ""
-echo "[5/6] Testing wiki_small training..."
+echo "[5/7] Testing wiki_small training..."
 "$TOOLS_DIR/mmjp_train" --corpus "$SCRIPT_DIR/datasets/wiki_small.txt" \
   --out "$TMP_DIR/model_small.bin" \
   --vocab 1000 --iters 2 \
   --lossless_ws 1 --crf_unsupervised 1 > /dev/null 2>&1
 echo "PASS: wiki_small training successful"
 
-# Test 6: wiki_full (if available)
+# bigram row index must not change the segmentation (the bench exits 1 on mismatch)
+"$TOOLS_DIR/mmjp_bench_bigram" --model "$TMP_DIR/model_small.bin" \
+  --input "$SCRIPT_DIR/datasets/wiki_small.txt" --sizes 1000,50000 --reps 1 > /dev/null 2>&1
+echo "PASS: bigram index decode matches binary search"
+
+# mmjp_bench must emit valid JSON with error-free runs for every mode
+"$TOOLS_DIR/mmjp_bench" --model "$TMP_DIR/model_small.bin" \
+  --input "$SCRIPT_DIR/datasets/wiki_small.txt" --warmup 1 --reps 1 > "$TMP_DIR/bench.json"
+python - "$TMP_DIR/bench.json" <<'PYEOF'
+import json, sys
+r = json.load(open(sys.argv[1]))
+assert [x["mode"] for x in r["results"]] == ["best", "sample", "nbest"]
+assert all(x["errors"] == 0 and x["sentences"] == r["lines"] for x in r["results"])
+assert "stages_sec" in r["results"][0]
+PYEOF
+echo "PASS: mmjp_bench JSON report"
+
+# incremental re-decode after random edits must match a full decode of the edited text
+"$TOOLS_DIR/mmjp_bench" --model "$TMP_DIR/model_small.bin" \
+  --input "$SCRIPT_DIR/datasets/wiki_small.txt" --modes edit --edit_doc 512 --edits 64 --reps 1 > "$TMP_DIR/bench_edit.json"
+EDITS=$(python - "$TMP_DIR/bench_edit.json" <<'PYEOF'
+import json, sys
+x = json.load(open(sys.argv[1]))["results"][0]
+assert x["mode"] == "edit" and x["edits"] > 0 and x["errors"] == 0
+print(x["edits"])
+PYEOF
+)
+echo "PASS: incremental re-decode matches full decode ($EDITS edits)"
+
+# batched decode must match per-sentence decode (boundaries, ids, scores)
+"$TOOLS_DIR/mmjp_bench" --model "$TMP_DIR/model_small.bin" \
+  --input "$SCRIPT_DIR/datasets/wiki_small.txt" --modes batch --batch 16 --reps 1 > "$TMP_DIR/bench_batch.json"
+python - "$TMP_DIR/bench_batch.json" <<'PYEOF'
+import json, sys
+r = json.load(open(sys.argv[1]))
+x = r["results"][0]
+assert x["mode"] == "batch" and x["errors"] == 0 and x["sentences"] == r["lines"]
+PYEOF
+echo "PASS: batched decode matches per-sentence decode"
+
+# N-best: candidate 0 is the 1-best, scores never increase, candidates are distinct,
+# K > 64 works, and an undersized nbest_buf returns a prefix of the full list
+cat > "$TMP_DIR/nbest_check.c" <<'CEOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mmjp_model.h"
+#define MAX_CP 256u
+#define K 200u
+static uint16_t flat[K * (MAX_CP + 1u)], flat2[K * (MAX_CP + 1u)];
+static size_t cnt[K], cnt2[K];
+static npycrf_score_t sc[K], sc2[K];
+static int fail(const char *what, int line) {
+  fprintf(stderr, "FAIL: %s (line %d)\n", what, line);
+  return 1;
+}
+static int same(const uint16_t *a, size_t na, const uint16_t *b, size_t nb) {
+  return na == nb && memcmp(a, b, na * sizeof(uint16_t)) == 0;
+}
+int main(int argc, char **argv) {
+  mmjp_loaded_model_t mb;
+  if (argc < 3 || mmjp_model_map_bin(argv[1], &mb) != 0) return 1;
+  const uint16_t L = mb.m.max_word_len;
+  size_t wcap = npycrf_workbuf_size(MAX_CP, L), ncap = npycrf_nbestbuf_size(MAX_CP, L, K);
+  void *wbuf = malloc(wcap), *nbuf = malloc(ncap);
+  npycrf_work_t wk;
+  if (!wbuf || !nbuf || npycrf_work_init(&wk, wbuf, wcap, MAX_CP, L) != 0) return 1;
+  FILE *fp = fopen(argv[2], "rb");
+  if (!fp) return 1;
+  static char text[1u << 16];
+  int line = 0, over64 = 0, prefixes = 0;
+  while (fgets(text, sizeof(text), fp)) {
+    line++;
+    size_t len = strcspn(text, "\r\n");
+    /* keep each sentence within MAX_CP codepoints (cut at a character start) */
+    size_t n_cp = 0, cut = 0;
+    while (cut < len && n_cp < MAX_CP - 1u) {
+      cut++;
+      while (cut < len && ((uint8_t)text[cut] & 0xC0u) == 0x80u) cut++;
+      n_cp++;
+    }
+    len = cut;
+    if (len == 0) continue;
+    uint16_t best[MAX_CP + 1u];
+    size_t nb = 0;
+    npycrf_score_t bs = 0;
+    if (npycrf_decode(&mb.m, (const uint8_t *)text, len, &wk, best, MAX_CP + 1u, &nb, &bs) != 0) return fail("decode", line);
+    int n = npycrf_decode_nbest(&mb.m, (const uint8_t *)text, len, &wk, nbuf, ncap, K,
+                                flat, MAX_CP + 1u, cnt, sc);
+    if (n <= 0) return fail("nbest returned no candidates", line);
+    if (!same(flat, cnt[0], best, nb) || sc[0] != bs) return fail("candidate 0 differs from 1-best", line);
+    for (int i = 1; i < n; i++) {
+      if (sc[i] > sc[i - 1]) return fail("scores increase", line);
+      for (int j = 0; j < i; j++) {
+        if (same(flat + (size_t)i * (MAX_CP + 1u), cnt[i], flat + (size_t)j * (MAX_CP + 1u), cnt[j]))
+          return fail("duplicate candidate", line);
+      }
+    }
+    for (int i = 0; i < n; i++) {
+      const uint16_t *b = flat + (size_t)i * (MAX_CP + 1u);
+      if (cnt[i] < 2 || b[0] != 0) return fail("bad boundaries", line);
+      for (size_t k = 1; k < cnt[i]; k++) {
+        if (b[k] <= b[k - 1] || b[k] - b[k - 1] > L) return fail("bad boundaries", line);
+      }
+    }
+    if (n > 64) over64 = 1;
+    /* a smaller nbest_buf yields a prefix of the full list (or -12 when even the tables do not fit) */
+    for (size_t sz = ncap / 2u; sz > 0; sz = sz * 2u / 3u) {
+      int m = npycrf_decode_nbest(&mb.m, (const uint8_t *)text, len, &wk, nbuf, sz, K,
+                                  flat2, MAX_CP + 1u, cnt2, sc2);
+      if (m == -12) break;
+      if (m < 0 || m > n) return fail("undersized buffer", line);
+      for (int i = 0; i < m; i++) {
+        if (sc2[i] != sc[i] || !same(flat2 + (size_t)i * (MAX_CP + 1u), cnt2[i],
+                                     flat + (size_t)i * (MAX_CP + 1u), cnt[i]))
+          return fail("undersized buffer is not a prefix", line);
+      }
+      if (m < n) prefixes++;
+    }
+  }
+  fclose(fp);
+  if (!over64) return fail("no sentence produced more than 64 candidates", line);
+  if (!prefixes) return fail("no truncated result was checked", line);
+  printf("%d\n", line);
+  free(wbuf);
+  free(nbuf);
+  mmjp_model_free(&mb);
+  return 0;
+}
+CEOF
+(cd "$TOOLS_DIR" && gcc -O2 -std=c99 -Wall -Wextra -I. -I.. -I../double_array -I../npycrf_lite \
+  -o "$TMP_DIR/nbest_check" "$TMP_DIR/nbest_check.c" mmjp_model.c \
+  ../double_array/double_array_trie.c ../npycrf_lite/npycrf_lite.c -lm)
+"$TMP_DIR/nbest_check" "$TMP_DIR/model_small.bin" "$SCRIPT_DIR/datasets/wiki_small.txt" > /dev/null
+echo "PASS: N-best candidates are ordered, distinct and start with the 1-best"
+
+# Test 6: multi-threaded tokenization keeps input order
+echo ""
+echo "[6/7] Testing multi-threaded tokenization..."
+for i in $(seq 50); do cat "$SCRIPT_DIR/datasets/wiki_small.txt"; done > "$TMP_DIR/mt.txt"
+for opts in "" "--sample --nsamples 2 --seed 3" "--nbest 3"; do
+  "$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_small.bin" $opts \
+    < "$TMP_DIR/mt.txt" > "$TMP_DIR/mt.t1"
+  "$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_small.bin" --threads 4 $opts \
+    < "$TMP_DIR/mt.txt" > "$TMP_DIR/mt.t4"
+  if ! cmp -s "$TMP_DIR/mt.t1" "$TMP_DIR/mt.t4"; then
+    echo "FAIL: --threads 4 output differs from single-threaded ($opts)"
+    exit 1
+  fi
+done
+python - "$TMP_DIR/model_small.bin" "$TMP_DIR/mt.txt" <<'PYEOF'
+import sys
+import mmjp
+m = mmjp.Model(sys.argv[1])
+lines = [l.rstrip("\n") for l in open(sys.argv[2], encoding="utf-8") if l.strip()]
+ref = [m.tokenize(x) for x in lines]
+for nt in (1, 4):
+    assert m.tokenize_batch(lines, num_threads=nt) == ref, nt
+# the batch decodes an owned snapshot of the input sequence
+assert m.tokenize_batch(iter(lines), num_threads=2) == ref
+# a loaded Model is never re-initialized under running decode calls
+try:
+    m.__init__(sys.argv[1])
+except RuntimeError:
+    pass
+else:
+    raise AssertionError("Model.__init__ on a loaded model must fail")
+assert m.tokenize_batch(lines) == ref
+PYEOF
+echo "PASS: multi-threaded output matches single-threaded"
+
+# --output ids / Model.encode(): piece IDs must match a vocabulary lookup of each token
+"$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_small.bin" --lossless_ws 0 \
+  --output ids --threads 4 < "$SCRIPT_DIR/datasets/wiki_small.txt" > "$TMP_DIR/ids.bin"
+python - "$TMP_DIR/model_small.bin" "$SCRIPT_DIR/datasets/wiki_small.txt" "$TMP_DIR/ids.bin" <<'PYEOF'
+import struct, sys
+import mmjp
+m = mmjp.Model(sys.argv[1])
+lines = [l.rstrip("\r\n") for l in open(sys.argv[2], encoding="utf-8")]
+lines = [x for x in lines if x]
+raw = open(sys.argv[3], "rb").read()
+pos = 0
+for x in lines:
+    ids = list(m.encode(x))
+    assert ids == [m.piece_to_id(t) for t in m.tokenize(x)], x
+    (n,) = struct.unpack_from("<I", raw, pos)
+    assert list(struct.unpack_from("<%dH" % n, raw, pos + 4)) == ids, x
+    pos += 4 + 2 * n
+assert pos == len(raw)
+PYEOF
+echo "PASS: --output ids and Model.encode() match the vocabulary"
+
+# --cache / cache_size: repeated lines must decode exactly as without the cache
+cat "$SCRIPT_DIR/datasets/wiki_small.txt" "$SCRIPT_DIR/datasets/wiki_small.txt" > "$TMP_DIR/twice.txt"
+"$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_small.bin" --lossless_ws 0 \
+  < "$TMP_DIR/twice.txt" > "$TMP_DIR/nocache.txt"
+"$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_small.bin" --lossless_ws 0 \
+  --cache 64 --threads 3 < "$TMP_DIR/twice.txt" > "$TMP_DIR/cache.txt" 2>/dev/null
+cmp -s "$TMP_DIR/nocache.txt" "$TMP_DIR/cache.txt" || { echo "FAIL: --cache output differs"; exit 1; }
+python - "$TMP_DIR/model_small.bin" "$TMP_DIR/twice.txt" <<'PYEOF'
+import sys
+import mmjp
+plain = mmjp.Model(sys.argv[1])
+m = mmjp.Model(sys.argv[1], cache_size=1024)
+lines = [l.rstrip("\r\n") for l in open(sys.argv[2], encoding="utf-8")]
+for x in lines:
+    assert m.tokenize(x) == plain.tokenize(x), x
+    assert list(m.encode(x)) == list(plain.encode(x)), x
+assert m.tokenize_batch(lines, num_threads=3) == plain.tokenize_batch(lines, num_threads=3)
+assert m.cache_info()["hits"] > 0
+PYEOF
+echo "PASS: cached decode matches uncached"
+
+# --serve: pipelined framed requests must answer like one CLI run per line
+python - "$TOOLS_DIR/mmjp_tokenize" "$TMP_DIR/model_small.bin" "$TMP_DIR/twice.txt" "$TMP_DIR/serve.sock" <<'PYEOF'
+import os, socket, struct, subprocess, sys, threading, time
+tok, model, corpus, path = sys.argv[1:5]
+lines = [l.rstrip(b"\r\n") for l in open(corpus, "rb")]
+lines = [x for x in lines if x]
+ops = {"text": 0, "ids": 1, "spans": 2}
+cli = [tok, "--model", model, "--lossless_ws", "0"]
+reqs, want = [], []
+for fmt, op in ops.items():
+    for x in lines:
+        reqs.append(struct.pack("<IB", len(x), op) + x)
+        want.append((0, subprocess.run(cli + ["--output", fmt], input=x + b"\n", capture_output=True).stdout))
+reqs.append(struct.pack("<IB", 0, 1))
+want.append((0, b"\0\0\0\0"))
+reqs.append(struct.pack("<IB", 1, 9) + b"x")
+req = b"".join(reqs)
+
+def parse(buf):
+    out, i = [], 0
+    while i < len(buf):
+        n, st = struct.unpack_from("<IB", buf, i)
+        out.append((st, buf[i + 5:i + 5 + n]))
+        i += 5 + n
+    assert i == len(buf)
+    return out
+
+def recv_exact(s, n):
+    buf = b""
+    while len(buf) < n:
+        d = s.recv(n - len(buf))
+        assert d
+        buf += d
+    return buf
+
+def call(s, data, n):
+    # send from a thread: answers come back while requests are still being written
+    th = threading.Thread(target=lambda: s.sendall(data))
+    th.start()
+    out = []
+    for _ in range(n):
+        ln, st = struct.unpack("<IB", recv_exact(s, 5))
+        out.append((st, recv_exact(s, ln)))
+    th.join()
+    return out
+
+srv = subprocess.Popen(cli + ["--threads", "3", "--cache", "64", "--serve", path], stderr=subprocess.DEVNULL)
+for _ in range(200):
+    if os.path.exists(path):
+        break
+    time.sleep(0.05)
+s = socket.socket(socket.AF_UNIX)
+s.connect(path)
+got = call(s, req, len(reqs))
+assert got[:-1] == want, [k for k in range(len(want)) if got[k] != want[k]][:5]
+assert got[-1][0] == 1, got[-1]
+(st, stats), = call(s, struct.pack("<IB", 0, 3), 1)
+assert st == 0 and b"requests %d\n" % len(reqs) in stats and b"errors 1\n" in stats, stats
+s.close()
+srv.terminate()
+assert srv.wait(timeout=30) == 0 and not os.path.exists(path)
+
+# a client that never reads its answers must not keep the server from stopping
+srv = subprocess.Popen(cli + ["--threads", "2", "--serve", path], stderr=subprocess.DEVNULL)
+for _ in range(200):
+    if os.path.exists(path):
+        break
+    time.sleep(0.05)
+s = socket.socket(socket.AF_UNIX)
+s.connect(path)
+def flood():
+    try:
+        for _ in range(50):
+            s.sendall(req)
+    except OSError:
+        pass
+th = threading.Thread(target=flood, daemon=True)
+th.start()
+time.sleep(1.0)
+t0 = time.time()
+srv.terminate()
+assert srv.wait(timeout=30) == 0 and time.time() - t0 < 15
+s.close()
+
+# "-": the same framing on stdin/stdout
+r = subprocess.run(cli + ["--threads", "2", "--serve", "-"], input=req, capture_output=True)
+assert r.returncode == 0 and parse(r.stdout) == got
+
+# a server that cannot listen must report it in the exit status
+r = subprocess.run(cli + ["--serve", os.path.join(path + ".missing", "x.sock")], capture_output=True, timeout=30)
+assert r.returncode != 0 and b"cannot listen" in r.stderr, (r.returncode, r.stderr)
+PYEOF
+echo "PASS: --serve answers pipelined requests like the CLI"
+
+# saving over a model that a running tokenizer has mapped must not disturb it
+cp "$TMP_DIR/model_small.bin" "$TMP_DIR/model_live.bin"
+python - "$TOOLS_DIR" "$TMP_DIR/model_small.bin" "$TMP_DIR/model_live.bin" "$TMP_DIR/twice.txt" <<'PYEOF'
+import subprocess, sys, time
+tools, small, live, corpus = sys.argv[1:5]
+lines = [l.rstrip(b"\r\n") for l in open(corpus, "rb")]
+lines = [x for x in lines if x][:20]
+want = subprocess.run([tools + "/mmjp_tokenize", "--model", small], input=b"\n".join(lines) + b"\n",
+                      capture_output=True).stdout
+p = subprocess.Popen([tools + "/mmjp_tokenize", "--model", live], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+half = len(lines) // 2
+p.stdin.write(b"\n".join(lines[:half]) + b"\n")
+p.stdin.flush()
+time.sleep(0.5)
+# a smaller (compact v4) image: an in-place rewrite would cut the mapping short
+r = subprocess.run([tools + "/mmjp_export_c", "--model", small, "--bin", "--compact", "--out", live],
+                   capture_output=True)
+assert r.returncode == 0, r.stderr
+out, _ = p.communicate(b"\n".join(lines[half:]) + b"\n", timeout=60)
+assert p.returncode == 0 and out == want, p.returncode
+PYEOF
+echo "PASS: saving a model does not disturb a process that has it mapped"
+
+# NPYCRF_STATS build: counting must not change the output
+(cd "$TOOLS_DIR" && gcc -O3 -std=c99 -Wall -Wextra -pthread -DNPYCRF_STATS -I.. -I../double_array -I../npycrf_lite \
+  -o "$TMP_DIR/mmjp_tokenize_stats" mmjp_tokenize.c mmjp_model.c mmjp_cache.c \
+  ../double_array/double_array_trie.c ../npycrf_lite/npycrf_lite.c ../mmjp_lossless.c -lm)
+"$TMP_DIR/mmjp_tokenize_stats" --model "$TMP_DIR/model_small.bin" --lossless_ws 0 --stats --threads 3 \
+  < "$TMP_DIR/twice.txt" > "$TMP_DIR/stats.txt" 2> "$TMP_DIR/stats.err"
+cmp -s "$TMP_DIR/nocache.txt" "$TMP_DIR/stats.txt" || { echo "FAIL: NPYCRF_STATS output differs"; exit 1; }
+n_lat=$(awk '$1 == "lattices" { print $2 }' "$TMP_DIR/stats.err")
+[ "$n_lat" = "$(wc -l < "$TMP_DIR/twice.txt" | tr -d ' ')" ] || { echo "FAIL: --stats lattices=$n_lat"; exit 1; }
+echo "PASS: NPYCRF_STATS counters"
+
+# --nsamples / Model.sample(n=...) draw every sample from one forward pass
+"$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_small.bin" --lossless_ws 0 --sample --nsamples 3 --seed 7 \
+  < "$SCRIPT_DIR/datasets/wiki_small.txt" > "$TMP_DIR/samples.txt"
+python - "$TMP_DIR/model_small.bin" "$SCRIPT_DIR/datasets/wiki_small.txt" "$TMP_DIR/samples.txt" <<'PYEOF'
+import sys
+import mmjp
+def xs32(x):
+    x ^= (x << 13) & 0xFFFFFFFF
+    x ^= x >> 17
+    x ^= (x << 5) & 0xFFFFFFFF
+    return x
+m = mmjp.Model(sys.argv[1])
+lines = [l.rstrip("\r\n") for l in open(sys.argv[2], encoding="utf-8") if l.strip("\r\n")]
+got = [l.split() for l in open(sys.argv[3], encoding="utf-8")]
+seed, want = 7, []
+for x in lines:
+    want += m.sample(x, seed=seed, n=3)
+    for _ in range(3):
+        seed = xs32(seed)
+assert got == want
+assert m.sample(lines[0], seed=7) == want[0]
+PYEOF
+echo "PASS: multi-sample FFBS matches single samples"
+
+# NPYCRF_SAMPLE_FIXED: the fixed-point sampler must stay close to the double one
+(cd "$TOOLS_DIR" && gcc -O3 -std=c99 -Wall -Wextra -pthread -DNPYCRF_SAMPLE_FIXED -I.. -I../double_array -I../npycrf_lite \
+  -o "$TMP_DIR/mmjp_tokenize_fixed" mmjp_tokenize.c mmjp_model.c mmjp_cache.c \
+  ../double_array/double_array_trie.c ../npycrf_lite/npycrf_lite.c ../mmjp_lossless.c -lm)
+"$TMP_DIR/mmjp_tokenize_fixed" --model "$TMP_DIR/model_small.bin" --lossless_ws 0 --sample --nsamples 3 --seed 7 \
+  < "$SCRIPT_DIR/datasets/wiki_small.txt" > "$TMP_DIR/samples_fixed.txt"
+python - "$TMP_DIR/samples.txt" "$TMP_DIR/samples_fixed.txt" <<'PYEOF'
+import sys
+a = open(sys.argv[1], encoding="utf-8").read().splitlines()
+b = open(sys.argv[2], encoding="utf-8").read().splitlines()
+assert len(a) == len(b)
+assert all(x.replace(" ", "") == y.replace(" ", "") for x, y in zip(a, b))
+same = sum(x == y for x, y in zip(a, b))
+assert same * 10 >= len(a) * 9, (same, len(a))
+PYEOF
+echo "PASS: fixed-point sampler agrees with double"
+
+# parallel EM E-step: with a fixed reduction order the model must not depend on --threads
+for nt in 1 3; do
+  "$TOOLS_DIR/mmjp_train" --corpus "$SCRIPT_DIR/datasets/wiki_small.txt" \
+    --out "$TMP_DIR/model_em_t$nt.bin" --vocab 1000 --iters 1 \
+    --threads $nt --fixed_reduce 1 > /dev/null 2>&1
+done
+if cmp -s "$TMP_DIR/model_em_t1.bin" "$TMP_DIR/model_em_t3.bin"; then
+  echo "PASS: parallel E-step model matches single-threaded"
+else
+  echo "FAIL: --threads 3 --fixed_reduce 1 model differs"
+  exit 1
+fi
+
+# incremental pruning must shrink the vocabulary to the target in one call and keep full coverage
+VOCAB=$("$TOOLS_DIR/mmjp_train" --corpus "$SCRIPT_DIR/datasets/wiki_small.txt" \
+  --out "$TMP_DIR/model_shrink.bin" --vocab 300 --iters 2 --min_count 2 --prune_shrink 0.75 2>&1 \
+  | sed -n 's/^  iter 1: .* vocab=\([0-9]*\) .*/\1/p')
+"$TOOLS_DIR/mmjp_tokenize" --model "$TMP_DIR/model_shrink.bin" \
+  < "$SCRIPT_DIR/datasets/wiki_small.txt" > "$TMP_DIR/shrink.out"
+if [ "$VOCAB" = "300" ] && [ "$(wc -l < "$TMP_DIR/shrink.out")" = "$(wc -l < "$SCRIPT_DIR/datasets/wiki_small.txt")" ]; then
+  echo "PASS: incremental pruning reaches the target vocabulary"
+else
+  echo "FAIL: --prune_shrink vocab=$VOCAB"
+  exit 1
+fi
+
+# a sweep shares the corpus scan and candidates but each model must match its own run
+"$TOOLS_DIR/mmjp_train" --corpus "$SCRIPT_DIR/datasets/wiki_small.txt" \
+  --out "$TMP_DIR/model_sw.bin" --vocab 300 --iters 1 --min_count 2 --sweep "lambda0=0.5,1" > /dev/null 2>&1
+"$TOOLS_DIR/mmjp_train" --corpus "$SCRIPT_DIR/datasets/wiki_small.txt" \
+  --out "$TMP_DIR/model_sw_ref.bin" --vocab 300 --iters 1 --min_count 2 --lambda0 0.5 > /dev/null 2>&1
+if cmp -s "$TMP_DIR/model_sw.0.bin" "$TMP_DIR/model_sw_ref.bin" && [ -s "$TMP_DIR/model_sw.1.bin" ] \
+  && [ "$(wc -l < "$TMP_DIR/model_sw.sweep.tsv")" = "3" ]; then
+  echo "PASS: --sweep models match separate runs"
+else
+  echo "FAIL: --sweep model differs from a separate run"
+  exit 1
+fi
+
+# vocab changes char_vocab, so each vocab of a sweep needs its own character set
+python - "$TMP_DIR/sweep_kanji.txt" <<'PY'
+import random, sys
+rnd = random.Random(7)
+chars = [chr(0x4E00 + i) for i in range(1500)]
+words = ["".join(rnd.choice(chars) for _ in range(rnd.randint(2, 4))) for _ in range(300)]
+with open(sys.argv[1], "w", encoding="utf-8") as f:
+    for i in range(3000):
+        line = [rnd.choice(words) for _ in range(rnd.randint(3, 8))]
+        line.insert(rnd.randint(0, len(line)), chars[i % len(chars)])
+        f.write("".join(line) + "\n")
+PY
+"$TOOLS_DIR/mmjp_train" --corpus "$TMP_DIR/sweep_kanji.txt" \
+  --out "$TMP_DIR/model_swv.bin" --iters 1 --min_count 2 --sweep "vocab=300,3000" > /dev/null 2>&1
+SWV_OK=1
+for v in 300 3000; do
+  "$TOOLS_DIR/mmjp_train" --corpus "$TMP_DIR/sweep_kanji.txt" \
+    --out "$TMP_DIR/model_swv_$v.bin" --vocab $v --iters 1 --min_count 2 > /dev/null 2>&1
+done
+cmp -s "$TMP_DIR/model_swv.0.bin" "$TMP_DIR/model_swv_300.bin" || SWV_OK=0
+cmp -s "$TMP_DIR/model_swv.1.bin" "$TMP_DIR/model_swv_3000.bin" || SWV_OK=0
+if [ "$SWV_OK" = "1" ]; then
+  echo "PASS: a vocab sweep matches separate runs"
+else
+  echo "FAIL: a vocab sweep model differs from a separate run"
+  exit 1
+fi
+
+# the second run with the same sample must reuse the cached suffix array and give the same model
+for i in 1 2; do
+  "$TOOLS_DIR/mmjp_train" --corpus "$SCRIPT_DIR/datasets/wiki_small.txt" \
+    --out "$TMP_DIR/model_sac$i.bin" --vocab 300 --iters 1 --min_count 2 \
+    --sa_cache "$TMP_DIR/sa.cache" > "$TMP_DIR/sac$i.log" 2>&1
+done
+if grep -q "reused suffix array and" "$TMP_DIR/sac2.log" \
+  && cmp -s "$TMP_DIR/model_sac1.bin" "$TMP_DIR/model_sac2.bin" \
+  && cmp -s "$TMP_DIR/model_sac1.bin" "$TMP_DIR/model_sw.1.bin"; then
+  echo "PASS: --sa_cache reuses the suffix array"
+else
+  echo "FAIL: --sa_cache was not reused or changed the model"
+  exit 1
+fi
+
+# a damaged cache must be rebuilt (bad SA entry) or recounted (bad candidate list), not trusted
+python - "$TMP_DIR/sa.cache" <<'PY'
+import sys
+with open(sys.argv[1], "r+b") as f:
+    f.seek(128)
+    f.write(b"\xff" * 8)
+PY
+"$TOOLS_DIR/mmjp_train" --corpus "$SCRIPT_DIR/datasets/wiki_small.txt" \
+  --out "$TMP_DIR/model_sac3.bin" --vocab 300 --iters 1 --min_count 2 \
+  --sa_cache "$TMP_DIR/sa.cache" > "$TMP_DIR/sac3.log" 2>&1
+python - "$TMP_DIR/sa.cache" <<'PY'
+import struct, sys
+with open(sys.argv[1], "r+b") as f:
+    cand_off = struct.unpack("=Q", f.read(128)[72:80])[0]
+    f.seek(cand_off + 4)
+    f.write(b"\xff\xff")
+PY
+"$TOOLS_DIR/mmjp_train" --corpus "$SCRIPT_DIR/datasets/wiki_small.txt" \
+  --out "$TMP_DIR/model_sac4.bin" --vocab 300 --iters 1 --min_count 2 \
+  --sa_cache "$TMP_DIR/sa.cache" > "$TMP_DIR/sac4.log" 2>&1
+if grep -q "suffix-array: starts=" "$TMP_DIR/sac3.log" \
+  && grep -q "recounting" "$TMP_DIR/sac4.log" \
+  && cmp -s "$TMP_DIR/model_sac1.bin" "$TMP_DIR/model_sac3.bin" \
+  && cmp -s "$TMP_DIR/model_sac1.bin" "$TMP_DIR/model_sac4.bin"; then
+  echo "PASS: a damaged --sa_cache is rebuilt"
+else
+  echo "FAIL: a damaged --sa_cache was trusted or changed the model"
+  exit 1
+fi
+
+# parallel CRF training: gradient shards are summed in a fixed order, so --threads must not matter
+for i in $(seq 4); do cat "$TMP_DIR/mt.txt"; done | "$TOOLS_DIR/mmjp_tokenize" \
+  --model "$TMP_DIR/model_small.bin" --lossless_ws 0 > "$TMP_DIR/crf_seg.txt"
+for opts in "--crf_opt lbfgs" "--crf_opt adagrad --crf_batch 300"; do
+  for nt in 1 3; do
+    "$TOOLS_DIR/mmjp_train" --corpus "$SCRIPT_DIR/datasets/wiki_small.txt" \
+      --out "$TMP_DIR/model_crf_t$nt.bin" --vocab 1000 --iters 1 --fixed_reduce 1 \
+      --crf_supervised "$TMP_DIR/crf_seg.txt" --crf_epochs 5 $opts --threads $nt > /dev/null 2>&1
+  done
+  if ! cmp -s "$TMP_DIR/model_crf_t1.bin" "$TMP_DIR/model_crf_t3.bin"; then
+    echo "FAIL: --threads 3 CRF training differs from single-threaded ($opts)"
+    exit 1
+  fi
+done
+echo "PASS: parallel CRF training matches single-threaded"
+
+# unsupervised CRF: pseudo-labels are generated per line block in parallel and joined in corpus order
+for i in $(seq 6); do cat "$TMP_DIR/mt.txt"; done > "$TMP_DIR/unsup.txt"
+for nt in 1 3; do
+  "$TOOLS_DIR/mmjp_train" --corpus "$TMP_DIR/unsup.txt" \
+    --out "$TMP_DIR/model_unsup_t$nt.bin" --vocab 1000 --iters 1 --fixed_reduce 1 \
+    --crf_unsupervised 1 --crf_unsup_sentences 2500 --crf_epochs 2 --threads $nt > /dev/null 2>&1
+done
+if ! cmp -s "$TMP_DIR/model_unsup_t1.bin" "$TMP_DIR/model_unsup_t3.bin"; then
+  echo "FAIL: --threads 3 pseudo-labels differ from single-threaded"
+  exit 1
+fi
+echo "PASS: parallel pseudo-labeling matches single-threaded"
+
+# Test 7: wiki_full (if available)
 echo ""
-echo "[6/6] Testing wiki_full (if available)..."
+echo "[7/7] Testing wiki_full (if available)..."
 WIKI_FULL="$SCRIPT_DIR/datasets/wiki_full_lf.txt"
 if [ -f "$WIKI_FULL" ]; then
   echo "Found wiki_full_lf.txt, running full verification..."
@@ -10,11 +10,26 @@ def is_windows() -> bool:
 
 extra_compile_args: list[str] = []
 extra_link_args: list[str] = []
+define_macros: list[tuple[str, str | None]] = []
 
 if not is_windows():
     extra_compile_args.append("-std=c99")
+    # tokenize_batch() runs pthread workers
+    extra_compile_args.append("-pthread")
+    extra_link_args.append("-pthread")
     # exp/log are used in stochastic decoding
     extra_link_args.append("-lm")
+else:
+    # no pthreads: tokenize_batch() decodes on the calling thread
+    define_macros.append(("MMJP_NO_THREADS", None))
+
+# MMJP_STATS=1: count decoder hot-path events for Model.stats()
+if os.environ.get("MMJP_STATS", "") not in ("", "0"):
+    define_macros.append(("NPYCRF_STATS", None))
+
+# MMJP_SAMPLE_FIXED=1: fixed-point FFBS (no exp/log in sample()); see npycrf_lite.h
+if os.environ.get("MMJP_SAMPLE_FIXED", "") not in ("", "0"):
+    define_macros.append(("NPYCRF_SAMPLE_FIXED", None))
 
 ext_modules = [
     Extension(
@@ -22,10 +37,12 @@ ext_modules = [
         sources=[
             "mmjp/_mmjp.c",
             "tools/mmjp_model.c",
+            "tools/mmjp_cache.c",
             "npycrf_lite/npycrf_lite.c",
             "double_array/double_array_trie.c",
         ],
         include_dirs=[".", "tools", "npycrf_lite", "double_array"],
+        define_macros=define_macros,
         extra_compile_args=extra_compile_args,
         extra_link_args=extra_link_args,
     ),
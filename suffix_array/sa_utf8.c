@@ -6,6 +6,14 @@
 
 #include "sa_utf8.h"
 
+#ifndef SA_NO_MALLOC
+#include <stdlib.h>
+#endif
+
+#ifndef SA_NO_THREADS
+#include <pthread.h>
+#endif
+
 /* ---------------- UTF-8 ヘルパー関数 ---------------- */
 
 /* UTF-8 継続バイトかどうかを判定 */
@@ -268,12 +276,498 @@ static int sa_sort_3way_radix(sa_idx_t *sa, size_t n,
   return 1;
 }
 
+/* ---------------- SA-IS（誘導ソートによる線形時間構築） ---------------- */
+
+#ifndef SA_NO_MALLOC
+
+/* 空きスロット */
+#define SA_EMPTY ((sa_idx_t)~(sa_idx_t)0)
+
+/*
+ * UTF-8 1 文字をコードポイント順を保つシンボルに写像する（0 は番兵）
+ *   [1, 0x81)         ASCII
+ *   [SYM2, +0x800)    2 バイト列 (先頭 0xC0-0xDF)
+ *   [SYM3, +0x10000)  3 バイト列 (先頭 0xE0-0xEF)
+ *   [SYM4, +0x200000) 4 バイト列 (先頭 0xF0-0xF7)
+ *   [SYMX, +8)        1 バイト扱いの不正な先頭バイト 0xF8-0xFF
+ * 先頭バイトが同じ文字は同じバイト長なので、シンボル列の辞書順 = バイト列の辞書順
+ */
+#define SA_SYM2 0x81u
+#define SA_SYM3 (SA_SYM2 + 0x800u)
+#define SA_SYM4 (SA_SYM3 + 0x10000u)
+#define SA_SYMX (SA_SYM4 + 0x200000u)
+#define SA_SYM_K (SA_SYMX + 8u)
+
+/*
+ * 出現したシンボルだけを密な順位 [0, K) に写像する 2 段の表（K = 異なり文字数 + 番兵）。
+ * dir[code >> 8] がページ番号（0 = そのページのシンボルは出現しない。ページ 0 はダミー）、
+ * page[ページ番号 * 256 + (code & 255)] が順位。順位はコード順なので型の判定も変わらない
+ */
+#define SA_PAGE_BITS 8u
+#define SA_PAGE_SIZE (1u << SA_PAGE_BITS)
+#define SA_DIR_SIZE ((SA_SYM_K + SA_PAGE_SIZE - 1u) >> SA_PAGE_BITS)
+
+/* SA-IS の適用条件: 全文字が完全な多バイト列で、単独の継続バイトがないこと */
+static int sa_sais_scan(const uint8_t *text, size_t text_len, size_t *out_units) {
+  size_t m = 0;
+  size_t pos = 0;
+  while (pos < text_len) {
+    const uint8_t lead = text[pos];
+    if (sa_is_utf8_cont(lead)) return 0;
+    const size_t n = (lead >= 0xF8u) ? 1u : sa_utf8_seq_len_from_lead(lead);
+    if (n > text_len - pos) return 0;
+    for (size_t i = 1; i < n; ++i) {
+      if (!sa_is_utf8_cont(text[pos + i])) return 0;
+    }
+    pos += n;
+    ++m;
+  }
+  *out_units = m;
+  return 1;
+}
+
+/* レベル 0（テキスト上のバイトオフセットで接尾辞を表す） */
+typedef struct {
+  const uint8_t *text;
+  size_t len;        /* 番兵のオフセット */
+  uint64_t *t;       /* S 型ビット（バイトオフセット索引） */
+  uint64_t *lms;     /* LMS ビット（同上） */
+  sa_idx_t *rank;    /* lms の 64 ビット語ごとの累積数 */
+  sa_idx_t *dir;     /* [SA_DIR_SIZE] シンボル → ページ番号 */
+  sa_idx_t *page;    /* [npages * SA_PAGE_SIZE] 出現数、ranks 後は順位 */
+  size_t npages;
+  size_t dir_end;    /* 使われている dir の上限 + 1 */
+} sa_l0_t;
+
+static inline int sa_bit_get(const uint64_t *b, size_t i) {
+  return (int)((b[i >> 6] >> (i & 63u)) & 1u);
+}
+
+static inline void sa_bit_set(uint64_t *b, size_t i) {
+  b[i >> 6] |= (uint64_t)1u << (i & 63u);
+}
+
+static inline unsigned sa_ctz64(uint64_t w) {
+#if defined(__GNUC__) || defined(__clang__)
+  return (unsigned)__builtin_ctzll(w);
+#else
+  unsigned n = 0;
+  while (!(w & 1u)) { w >>= 1; ++n; }
+  return n;
+#endif
+}
+
+static inline unsigned sa_popcount64(uint64_t w) {
+#if defined(__GNUC__) || defined(__clang__)
+  return (unsigned)__builtin_popcountll(w);
+#else
+  unsigned n = 0;
+  while (w) { w &= w - 1u; ++n; }
+  return n;
+#endif
+}
+
+/* 位置 p の文字のコード（SA_SYM_* の写像、番兵は 0） */
+static inline size_t sa_l0_code(const sa_l0_t *z, size_t p) {
+  if (p >= z->len) return 0;
+  const uint8_t *s = z->text + p;
+  const uint8_t b0 = s[0];
+  if (b0 < 0x80u) return 1u + b0;
+  if (b0 < 0xE0u) return SA_SYM2 + ((((size_t)b0 & 0x1Fu) << 6) | (s[1] & 0x3Fu));
+  if (b0 < 0xF0u) return SA_SYM3 + ((((size_t)b0 & 0x0Fu) << 12) | ((size_t)(s[1] & 0x3Fu) << 6) | (s[2] & 0x3Fu));
+  if (b0 < 0xF8u) {
+    return SA_SYM4 + ((((size_t)b0 & 0x07u) << 18) | ((size_t)(s[1] & 0x3Fu) << 12) |
+                      ((size_t)(s[2] & 0x3Fu) << 6) | (s[3] & 0x3Fu));
+  }
+  return SA_SYMX + (size_t)(b0 - 0xF8u);
+}
+
+/* 位置 p の文字の順位（sa_l0_ranks() 後のみ） */
+static inline size_t sa_l0_sym(const sa_l0_t *z, size_t p) {
+  const size_t c = sa_l0_code(z, p);
+  return z->page[((size_t)z->dir[c >> SA_PAGE_BITS] << SA_PAGE_BITS) | (c & (SA_PAGE_SIZE - 1u))];
+}
+
+/* コード c の出現を数える（ページがなければ追加）。新しいシンボルなら 1、確保失敗は -1 */
+static int sa_l0_count(sa_l0_t *z, size_t c) {
+  sa_idx_t *d = &z->dir[c >> SA_PAGE_BITS];
+  if (*d == 0) {
+    sa_idx_t *np = (sa_idx_t *)realloc(z->page, (z->npages + 1u) * SA_PAGE_SIZE * sizeof(sa_idx_t));
+    if (!np) return -1;
+    for (size_t i = 0; i < SA_PAGE_SIZE; ++i) np[z->npages * SA_PAGE_SIZE + i] = 0;
+    z->page = np;
+    *d = (sa_idx_t)z->npages++;
+    if ((c >> SA_PAGE_BITS) >= z->dir_end) z->dir_end = (c >> SA_PAGE_BITS) + 1u;
+  }
+  sa_idx_t *e = &z->page[((size_t)*d << SA_PAGE_BITS) | (c & (SA_PAGE_SIZE - 1u))];
+  return (*e)++ == 0;
+}
+
+/* 出現数をコード順の順位に置き換え、順位ごとの出現数を cnt[0..K) に書く */
+static void sa_l0_ranks(sa_l0_t *z, sa_idx_t *cnt) {
+  size_t k = 0;
+  for (size_t h = 0; h < z->dir_end; ++h) {
+    if (z->dir[h] == 0) continue;
+    sa_idx_t *pg = z->page + ((size_t)z->dir[h] << SA_PAGE_BITS);
+    for (size_t lo = 0; lo < SA_PAGE_SIZE; ++lo) {
+      if (pg[lo] == 0) continue;
+      cnt[k] = pg[lo];
+      pg[lo] = (sa_idx_t)k++;
+    }
+  }
+}
+
+static inline size_t sa_l0_next(const sa_l0_t *z, size_t p) {
+  const uint8_t b0 = z->text[p];
+  return p + ((b0 >= 0xF8u) ? 1u : sa_utf8_seq_len_from_lead(b0));
+}
+
+/* 直前の文字の先頭（sa_sais_scan 済みなので継続バイトを戻るだけでよい） */
+static inline size_t sa_l0_prev(const sa_l0_t *z, size_t p) {
+  --p;
+  while (p > 0 && sa_is_utf8_cont(z->text[p])) --p;
+  return p;
+}
+
+/* テキスト順で何番目の LMS か */
+static inline size_t sa_l0_lms_rank(const sa_l0_t *z, size_t p) {
+  const uint64_t below = z->lms[p >> 6] & (((uint64_t)1u << (p & 63u)) - 1u);
+  return (size_t)z->rank[p >> 6] + sa_popcount64(below);
+}
+
+/* cnt からバケット先頭 (end=0) / 末尾 (end=1) を作る */
+static void sa_buckets(const sa_idx_t *cnt, sa_idx_t *bkt, size_t K, int end) {
+  sa_idx_t sum = 0;
+  for (size_t c = 0; c < K; ++c) {
+    sum += cnt[c];
+    bkt[c] = end ? sum : (sa_idx_t)(sum - cnt[c]);
+  }
+}
+
+static void sa_l0_induce(const sa_l0_t *z, sa_idx_t *SA, size_t n,
+                         const sa_idx_t *cnt, sa_idx_t *bkt, size_t K) {
+  sa_buckets(cnt, bkt, K, 0);
+  for (size_t i = 0; i < n; ++i) {
+    const sa_idx_t j = SA[i];
+    if (j == SA_EMPTY || j == 0) continue;
+    const size_t q = sa_l0_prev(z, j);
+    if (!sa_bit_get(z->t, q)) SA[bkt[sa_l0_sym(z, q)]++] = (sa_idx_t)q;
+  }
+  sa_buckets(cnt, bkt, K, 1);
+  for (size_t i = n; i-- > 0;) {
+    const sa_idx_t j = SA[i];
+    if (j == SA_EMPTY || j == 0) continue;
+    const size_t q = sa_l0_prev(z, j);
+    if (sa_bit_get(z->t, q)) SA[--bkt[sa_l0_sym(z, q)]] = (sa_idx_t)q;
+  }
+}
+
+/* ---- レベル 1 以降（縮約文字列 s、末尾は唯一最小の番兵 0） ---- */
+
+#define SA_T_GET(t, i) (((t)[(i) >> 3] >> ((i) & 7u)) & 1u)
+#define SA_T_SET(t, i, v) \
+  ((t)[(i) >> 3] = (uint8_t)((v) ? ((t)[(i) >> 3] | (1u << ((i) & 7u))) \
+                                 : ((t)[(i) >> 3] & ~(1u << ((i) & 7u)))))
+#define SA_IS_LMS(t, i) ((i) > 0 && SA_T_GET(t, i) && !SA_T_GET(t, (i) - 1u))
+
+static void sa_int_buckets(const sa_idx_t *s, size_t n, sa_idx_t *bkt, size_t K, int end) {
+  for (size_t c = 0; c < K; ++c) bkt[c] = 0;
+  for (size_t i = 0; i < n; ++i) bkt[s[i]]++;
+  sa_idx_t sum = 0;
+  for (size_t c = 0; c < K; ++c) {
+    sum += bkt[c];
+    bkt[c] = end ? sum : (sa_idx_t)(sum - bkt[c]);
+  }
+}
+
+static void sa_int_induce(const sa_idx_t *s, const uint8_t *t, sa_idx_t *SA, size_t n,
+                          sa_idx_t *bkt, size_t K) {
+  sa_int_buckets(s, n, bkt, K, 0);
+  for (size_t i = 0; i < n; ++i) {
+    const sa_idx_t j = SA[i];
+    if (j == SA_EMPTY || j == 0) continue;
+    if (!SA_T_GET(t, j - 1u)) SA[bkt[s[j - 1u]]++] = j - 1u;
+  }
+  sa_int_buckets(s, n, bkt, K, 1);
+  for (size_t i = n; i-- > 0;) {
+    const sa_idx_t j = SA[i];
+    if (j == SA_EMPTY || j == 0) continue;
+    if (SA_T_GET(t, j - 1u)) SA[--bkt[s[j - 1u]]] = j - 1u;
+  }
+}
+
+/* 汎用 SA-IS（Nong-Zhang-Chan）。成功時 1 */
+static int sa_int_sais(const sa_idx_t *s, sa_idx_t *SA, size_t n, size_t K) {
+  uint8_t *t = (uint8_t *)calloc(n / 8u + 1u, 1u);
+  sa_idx_t *bkt = (sa_idx_t *)malloc(K * sizeof(sa_idx_t));
+  if (!t || !bkt) { free(t); free(bkt); return 0; }
+
+  SA_T_SET(t, n - 1u, 1);
+  if (n >= 2u) SA_T_SET(t, n - 2u, 0);
+  for (size_t i = n - 2u; n >= 2u && i-- > 0;) {
+    SA_T_SET(t, i, s[i] < s[i + 1u] || (s[i] == s[i + 1u] && SA_T_GET(t, i + 1u)));
+  }
+
+  /* stage 1: LMS 部分文字列をソート */
+  sa_int_buckets(s, n, bkt, K, 1);
+  for (size_t i = 0; i < n; ++i) SA[i] = SA_EMPTY;
+  for (size_t i = 1; i < n; ++i) {
+    if (SA_IS_LMS(t, i)) SA[--bkt[s[i]]] = (sa_idx_t)i;
+  }
+  sa_int_induce(s, t, SA, n, bkt, K);
+  free(bkt);
+
+  size_t n1 = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (SA_IS_LMS(t, SA[i])) SA[n1++] = SA[i];
+  }
+  for (size_t i = n1; i < n; ++i) SA[i] = SA_EMPTY;
+
+  size_t name = 0;
+  size_t prev = (size_t)SA_EMPTY;
+  for (size_t i = 0; i < n1; ++i) {
+    const size_t pos = SA[i];
+    int diff = 0;
+    for (size_t d = 0; d < n; ++d) {
+      if (prev == (size_t)SA_EMPTY || s[pos + d] != s[prev + d] ||
+          SA_T_GET(t, pos + d) != SA_T_GET(t, prev + d)) {
+        diff = 1;
+        break;
+      }
+      if (d > 0 && (SA_IS_LMS(t, pos + d) || SA_IS_LMS(t, prev + d))) break;
+    }
+    if (diff) { ++name; prev = pos; }
+    SA[n1 + pos / 2u] = (sa_idx_t)(name - 1u);
+  }
+  for (size_t i = n, j = n; i-- > n1;) {
+    if (SA[i] != SA_EMPTY) SA[--j] = SA[i];
+  }
+
+  /* stage 2: 縮約文字列を再帰ソート */
+  sa_idx_t *SA1 = SA;
+  sa_idx_t *s1 = SA + n - n1;
+  if (name < n1) {
+    if (!sa_int_sais(s1, SA1, n1, name)) { free(t); return 0; }
+  } else {
+    for (size_t i = 0; i < n1; ++i) SA1[s1[i]] = (sa_idx_t)i;
+  }
+
+  /* stage 3: LMS の順序から全体を誘導 */
+  bkt = (sa_idx_t *)malloc(K * sizeof(sa_idx_t));
+  if (!bkt) { free(t); return 0; }
+  for (size_t i = 1, j = 0; i < n; ++i) {
+    if (SA_IS_LMS(t, i)) s1[j++] = (sa_idx_t)i;
+  }
+  for (size_t i = 0; i < n1; ++i) SA1[i] = s1[SA1[i]];
+  for (size_t i = n1; i < n; ++i) SA[i] = SA_EMPTY;
+  sa_int_buckets(s, n, bkt, K, 1);
+  for (size_t i = n1; i-- > 0;) {
+    const sa_idx_t j = SA[i];
+    SA[i] = SA_EMPTY;
+    SA[--bkt[s[j]]] = j;
+  }
+  sa_int_induce(s, t, SA, n, bkt, K);
+  free(bkt);
+  free(t);
+  return 1;
+}
+
+/*
+ * レベル 0 の SA-IS。SA（容量 m+1）にテキスト全文字 + 番兵（オフセット text_len）の
+ * 接尾辞をソートして格納する。SA[0] は番兵。成功時 1
+ */
+static int sa_l0_sais(const uint8_t *text, size_t text_len, size_t m, sa_idx_t *SA) {
+  const size_t n = m + 1u;
+  const size_t nwords = text_len / 64u + 1u;
+  sa_l0_t z;
+  z.text = text;
+  z.len = text_len;
+  z.t = (uint64_t *)calloc(nwords, sizeof(uint64_t));
+  z.lms = (uint64_t *)calloc(nwords, sizeof(uint64_t));
+  z.rank = (sa_idx_t *)malloc(nwords * sizeof(sa_idx_t));
+  z.dir = (sa_idx_t *)calloc(SA_DIR_SIZE, sizeof(sa_idx_t));
+  z.page = (sa_idx_t *)calloc(SA_PAGE_SIZE, sizeof(sa_idx_t));  /* ページ 0 はダミー */
+  z.npages = 1;
+  z.dir_end = 0;
+  sa_idx_t *cnt = NULL;
+  sa_idx_t *bkt = NULL;
+  size_t K = 0;
+  int ok = 0;
+  if (!z.t || !z.lms || !z.rank || !z.dir || !z.page) goto done;
+
+  /* 型・LMS・出現数を末尾から 1 パスで求める（番兵は S 型かつ LMS） */
+  sa_bit_set(z.t, text_len);
+  if (sa_l0_count(&z, 0) < 0) goto done;
+  K = 1;
+  {
+    size_t p = text_len;
+    size_t sym_p = 0;
+    int t_p = 1;
+    while (p > 0) {
+      const size_t q = sa_l0_prev(&z, p);
+      const size_t sym_q = sa_l0_code(&z, q);
+      const int t_q = (sym_q < sym_p) || (sym_q == sym_p && t_p);
+      if (t_q) sa_bit_set(z.t, q);
+      else if (t_p) sa_bit_set(z.lms, p);
+      const int added = sa_l0_count(&z, sym_q);
+      if (added < 0) goto done;
+      K += (size_t)added;
+      p = q;
+      sym_p = sym_q;
+      t_p = t_q;
+    }
+  }
+  cnt = (sa_idx_t *)malloc(K * sizeof(sa_idx_t));
+  bkt = (sa_idx_t *)malloc(K * sizeof(sa_idx_t));
+  if (!cnt || !bkt) goto done;
+  sa_l0_ranks(&z, cnt);
+  {
+    sa_idx_t acc = 0;
+    for (size_t w = 0; w < nwords; ++w) {
+      z.rank[w] = acc;
+      acc += (sa_idx_t)sa_popcount64(z.lms[w]);
+    }
+  }
+
+  /* stage 1: LMS 部分文字列をソート */
+  for (size_t i = 0; i < n; ++i) SA[i] = SA_EMPTY;
+  sa_buckets(cnt, bkt, K, 1);
+  for (size_t w = 0; w < nwords; ++w) {
+    for (uint64_t b = z.lms[w]; b; b &= b - 1u) {
+      const size_t p = w * 64u + sa_ctz64(b);
+      SA[--bkt[sa_l0_sym(&z, p)]] = (sa_idx_t)p;
+    }
+  }
+  sa_l0_induce(&z, SA, n, cnt, bkt, K);
+
+  size_t n1 = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (sa_bit_get(z.lms, SA[i])) SA[n1++] = SA[i];
+  }
+
+  /* 名前付け。名前はテキスト順の LMS 番号 r に対して SA[n1 + r] に置く（n1 <= n/2） */
+  size_t name = 0;
+  size_t prev = (size_t)SA_EMPTY;
+  for (size_t i = 0; i < n1; ++i) {
+    const size_t pos = SA[i];
+    int diff = 0;
+    if (prev == (size_t)SA_EMPTY) {
+      diff = 1;
+    } else {
+      size_t a = pos, b = prev;
+      for (size_t d = 0;; ++d) {
+        if (sa_l0_sym(&z, a) != sa_l0_sym(&z, b) || sa_bit_get(z.t, a) != sa_bit_get(z.t, b)) {
+          diff = 1;
+          break;
+        }
+        if (d > 0 && (sa_bit_get(z.lms, a) || sa_bit_get(z.lms, b))) break;
+        a = sa_l0_next(&z, a);
+        b = sa_l0_next(&z, b);
+      }
+    }
+    if (diff) { ++name; prev = pos; }
+    SA[n1 + sa_l0_lms_rank(&z, pos)] = (sa_idx_t)(name - 1u);
+  }
+  for (size_t r = n1; r-- > 0;) SA[n - n1 + r] = SA[n1 + r];
+
+  /* stage 2: 縮約文字列を再帰ソート */
+  sa_idx_t *SA1 = SA;
+  sa_idx_t *s1 = SA + n - n1;
+  if (name < n1) {
+    if (!sa_int_sais(s1, SA1, n1, name)) goto done;
+  } else {
+    for (size_t i = 0; i < n1; ++i) SA1[s1[i]] = (sa_idx_t)i;
+  }
+
+  /* stage 3: LMS の順序から全体を誘導 */
+  {
+    size_t j = 0;
+    for (size_t w = 0; w < nwords; ++w) {
+      for (uint64_t b = z.lms[w]; b; b &= b - 1u) s1[j++] = (sa_idx_t)(w * 64u + sa_ctz64(b));
+    }
+  }
+  for (size_t i = 0; i < n1; ++i) SA1[i] = s1[SA1[i]];
+  for (size_t i = n1; i < n; ++i) SA[i] = SA_EMPTY;
+  sa_buckets(cnt, bkt, K, 1);
+  for (size_t i = n1; i-- > 0;) {
+    const sa_idx_t j = SA[i];
+    SA[i] = SA_EMPTY;
+    SA[--bkt[sa_l0_sym(&z, j)]] = j;
+  }
+  sa_l0_induce(&z, SA, n, cnt, bkt, K);
+  ok = 1;
+
+done:
+  free(z.t);
+  free(z.lms);
+  free(z.rank);
+  free(z.dir);
+  free(z.page);
+  free(cnt);
+  free(bkt);
+  return ok;
+}
+
+#endif /* SA_NO_MALLOC */
+
+/* sa_utf8_build() が SA-IS を sa_out 上でそのまま実行できる容量 */
+size_t sa_utf8_build_work_cap(const uint8_t *text, size_t text_len) {
+  if (!text) return 0;
+#ifndef SA_NO_MALLOC
+  size_t m = 0;
+  if (sa_sais_scan(text, text_len, &m)) return m + 1u;
+#endif
+  return sa_utf8_count_starts(text, text_len, SA_BUILD_DEFAULT);
+}
+
+#ifndef SA_NO_MALLOC
+
+/* SA-IS を適用できない（呼び出し側は基数ソートにフォールバック） */
+#define SA_SAIS_NA ((size_t)-1)
+
+static size_t sa_sais_build(sa_idx_t *sa_out, size_t sa_out_cap,
+                            const uint8_t *text, size_t text_len,
+                            unsigned flags) {
+  size_t m = 0;
+  if (text_len >= (size_t)SA_EMPTY || !sa_sais_scan(text, text_len, &m) || m == 0) return SA_SAIS_NA;
+  const size_t starts = sa_utf8_count_starts(text, text_len, flags);
+  if (starts == 0 || starts > sa_out_cap) return 0;
+
+  sa_idx_t *SA = (sa_out_cap > m) ? sa_out : (sa_idx_t *)malloc((m + 1u) * sizeof(sa_idx_t));
+  if (!SA) return SA_SAIS_NA;
+  if (!sa_l0_sais(text, text_len, m, SA)) {
+    if (SA != sa_out) free(SA);
+    return SA_SAIS_NA;
+  }
+
+  /* 番兵 (SA[0]) とスキップ対象を除いて詰める（書き込み位置 <= 読み出し位置） */
+  size_t k = 0;
+  for (size_t i = 1; i <= m; ++i) {
+    const sa_idx_t p = SA[i];
+    const uint8_t lead = text[p];
+    if ((flags & SA_BUILD_SKIP_ASCII_SPACE) && lead < 0x80u && sa_is_ascii_space(lead)) continue;
+    if ((flags & SA_BUILD_SKIP_ASCII_PUNCT) && lead < 0x80u && sa_is_ascii_punct(lead)) continue;
+    sa_out[k++] = p;
+  }
+  if (SA != sa_out) free(SA);
+  return k;
+}
+
+#endif /* SA_NO_MALLOC */
+
 /* 接尾辞配列を構築 */
 size_t sa_utf8_build(sa_idx_t *sa_out, size_t sa_out_cap,
                      const uint8_t *text, size_t text_len,
                      unsigned flags) {
   if (!sa_out || sa_out_cap == 0 || !text) return 0;
 
+#ifndef SA_NO_MALLOC
+  if (!(flags & SA_BUILD_RADIX_SORT)) {
+    const size_t built = sa_sais_build(sa_out, sa_out_cap, text, text_len, flags);
+    if (built != SA_SAIS_NA) return built;
+  }
+#endif
+
   /* 接尾辞開始位置を収集 */
   size_t n = 0;
   size_t pos = 0;
@@ -302,6 +796,87 @@ size_t sa_utf8_build(sa_idx_t *sa_out, size_t sa_out_cap,
   return n;
 }
 
+/* ---------------- LCP 配列 ---------------- */
+
+typedef struct {
+  const sa_utf8_view_t *v;
+  uint8_t *lcp;
+  size_t b, e;
+  size_t depth;
+} sa_lcp_job_t;
+
+static void sa_lcp_range(const sa_lcp_job_t *job) {
+  const uint8_t *text = job->v->text;
+  const size_t len = job->v->text_len;
+  const sa_idx_t *sa = job->v->sa;
+  for (size_t i = job->b; i < job->e; ++i) {
+    if (i == 0) {
+      job->lcp[0] = 0;
+      continue;
+    }
+    const size_t pa = sa[i - 1u];
+    const size_t pb = sa[i];
+    size_t lim = job->depth;
+    if (len - pa < lim) lim = len - pa;
+    if (len - pb < lim) lim = len - pb;
+    size_t d = 0;
+    while (d < lim && text[pa + d] == text[pb + d]) ++d;
+    job->lcp[i] = (uint8_t)d;
+  }
+}
+
+#ifndef SA_NO_THREADS
+static void *sa_lcp_thread(void *arg) {
+  sa_lcp_range((const sa_lcp_job_t *)arg);
+  return NULL;
+}
+#endif
+
+/* スレッド数の上限 */
+#ifndef SA_LCP_MAX_THREADS
+#define SA_LCP_MAX_THREADS 64u
+#endif
+
+size_t sa_utf8_build_lcp(const sa_utf8_view_t *view,
+                         uint8_t *lcp_out, size_t lcp_cap,
+                         size_t max_depth, unsigned num_threads) {
+  if (!view || !view->text || !view->sa || !lcp_out) return 0;
+  const size_t n = view->sa_len;
+  if (n == 0 || lcp_cap < n) return 0;
+  if (max_depth > 255u) max_depth = 255u;
+
+  sa_lcp_job_t jobs[SA_LCP_MAX_THREADS];
+  size_t nt = (num_threads > 1u) ? (size_t)num_threads : 1u;
+#ifdef SA_NO_THREADS
+  nt = 1u;
+#endif
+  if (nt > SA_LCP_MAX_THREADS) nt = SA_LCP_MAX_THREADS;
+  if (nt > n) nt = n;
+  for (size_t t = 0; t < nt; ++t) {
+    jobs[t].v = view;
+    jobs[t].lcp = lcp_out;
+    jobs[t].b = n * t / nt;
+    jobs[t].e = n * (t + 1u) / nt;
+    jobs[t].depth = max_depth;
+  }
+
+#ifndef SA_NO_THREADS
+  pthread_t tid[SA_LCP_MAX_THREADS];
+  int started[SA_LCP_MAX_THREADS];
+  for (size_t t = 1; t < nt; ++t) {
+    started[t] = (pthread_create(&tid[t], NULL, sa_lcp_thread, &jobs[t]) == 0);
+  }
+  sa_lcp_range(&jobs[0]);
+  for (size_t t = 1; t < nt; ++t) {
+    if (started[t]) pthread_join(tid[t], NULL);
+    else sa_lcp_range(&jobs[t]);
+  }
+#else
+  for (size_t t = 0; t < nt; ++t) sa_lcp_range(&jobs[t]);
+#endif
+  return n;
+}
+
 /* ---------------- 接尾辞とキーの比較 ---------------- */
 
 /*
@@ -7,13 +7,25 @@
  *   - テキスト自体は生の UTF-8 バイトとして扱う
  *   - 接尾辞の開始位置は UTF-8 コードポイント境界のみで生成（継続バイトでは生成しない）
  *   - オプションフィルタリング: ASCII 空白および/または ASCII 句読点を接尾辞開始位置からスキップ可能
- *   - ヒープアロケーション不要: 呼び出し側が接尾辞配列バッファを提供
+ *   - 接尾辞配列バッファは呼び出し側が提供。既定の SA-IS は補助配列をヒープに確保する
+ *     （SA_NO_MALLOC 定義時・SA_BUILD_RADIX_SORT 指定時はヒープアロケーション不要）
  *
  * この実装は提供された 2008 年頃のコードをリファクタリング/移植したもの:
  *   - 固定長処理（NUL 終端バッファに依存しない）
  *   - UCHAR_MAX オフバイワンバグを修正（該当ステージを削除）
  *   - LCP 依存を削除（RAM 節約）、代わりに 2 回の二分探索境界を使用
  *   - 反復的 3-way 基数クイックソート（明示的な小さいスタック）で再帰を回避
+ *
+ * 構築アルゴリズム:
+ *   - 既定: SA-IS（誘導ソート、線形時間）。UTF-8 1 文字を 1 シンボル（コードポイント順）とみなし、
+ *     接尾辞はテキスト上のバイトオフセットのまま扱う。SA_NO_MALLOC 未定義時のみ
+ *   - 構造的に不正な UTF-8（途中で切れた多バイト列、単独の継続バイト）を含む入力、
+ *     SA_BUILD_RADIX_SORT 指定時は従来の 3-way 基数クイックソート
+ *   - どちらもバイト辞書順で同一の結果を返す
+ *
+ * LCP:
+ *   - sa_utf8_build_lcp() で隣接接尾辞の共通接頭辞長を最大 255 バイトで打ち切って求める
+ *     （n-gram 候補抽出では短い深さしか見ないため 1 要素 1 バイトで足りる）
  */
 
 #ifndef SA_UTF8_H
@@ -52,7 +64,8 @@ enum sa_build_flags {
   SA_BUILD_DEFAULT            = 0u,
   SA_BUILD_SKIP_ASCII_SPACE   = 1u << 0,  /* ASCII 空白位置をスキップ */
   SA_BUILD_SKIP_ASCII_PUNCT   = 1u << 1,  /* ASCII 句読点位置をスキップ */
-  SA_BUILD_VALIDATE_UTF8      = 1u << 2   /* 強い境界検証（遅い） */
+  SA_BUILD_VALIDATE_UTF8      = 1u << 2,  /* 強い境界検証（遅い） */
+  SA_BUILD_RADIX_SORT         = 1u << 3   /* SA-IS を使わず 3-way 基数クイックソートで構築 */
 };
 
 /* 指定フラグでこのテキストに対して生成される接尾辞開始位置の数を返す */
@@ -61,11 +74,32 @@ size_t sa_utf8_count_starts(const uint8_t *text, size_t text_len, unsigned flags
 /*
  * 接尾辞配列を sa_out（容量 sa_out_cap）に構築。書き込んだ接尾辞数を返す。
  * エラー時（容量不足、NULL 入力など）は 0 を返す。
+ *
+ * SA-IS はスキップ対象も含む全 UTF-8 文字 + 番兵の作業配列を必要とする。
+ * sa_out_cap >= sa_utf8_build_work_cap() なら sa_out をそのまま作業配列に使い、
+ * 足りなければ内部で確保する。ほかに常に内部確保するもの:
+ *   - テキスト 1 バイトあたり約 0.3 バイトの補助ビット列
+ *   - 出現した文字を密な番号に写す表: 約 33KB の索引 + 出現したコード 256 個ごとに 1KB のページ
+ *     + 異なり文字 1 つあたり 8 バイトのバケット（アルファベットの大きさ分は確保しない）
  */
 size_t sa_utf8_build(sa_idx_t *sa_out, size_t sa_out_cap,
                      const uint8_t *text, size_t text_len,
                      unsigned flags);
 
+/* sa_utf8_build() が追加の作業配列なしで SA-IS を実行できる sa_out 容量（UTF-8 文字数 + 1） */
+size_t sa_utf8_build_work_cap(const uint8_t *text, size_t text_len);
+
+/*
+ * 隣接接尾辞の LCP 配列を構築: lcp_out[0] = 0,
+ * lcp_out[i] = min(max_depth, suffix(sa[i-1]) と suffix(sa[i]) の共通接頭辞バイト数)
+ *   - max_depth は 255 以下に丸める
+ *   - num_threads > 1 なら区間を分割して並列計算（SA_NO_THREADS 定義時は無視）
+ * 書き込んだ要素数（view->sa_len）を返す。lcp_cap 不足などのエラー時は 0
+ */
+size_t sa_utf8_build_lcp(const sa_utf8_view_t *view,
+                         uint8_t *lcp_out, size_t lcp_cap,
+                         size_t max_depth, unsigned num_threads);
+
 /* 既に構築済みの接尾辞配列からビューを作成 */
 static inline sa_utf8_view_t sa_utf8_view(const uint8_t *text, size_t text_len,
                                          const sa_idx_t *sa, size_t sa_len) {
@@ -0,0 +1,738 @@
+/*
+ * mmjp_bench.c
+ *
+ * Reproducible decode benchmark with JSON output.
+ *
+ *  - loads a model.bin and a corpus (1 line = 1 sentence), prepares each
+ *    line the way mmjp_tokenize does (lossless encoding per model flag)
+ *  - runs npycrf_decode / npycrf_decode_sample / npycrf_decode_nbest over
+ *    the corpus: --warmup unmeasured passes, then --reps measured passes
+ *  - reports sentences/sec, MB/s and per-sentence latency (mean, p50, p99)
+ *  - for 1-best, splits the time into lattice (codepoint offsets, emissions
+ *    and span table, which the decoder builds in one pass), DP and
+ *    backtrack; build with -DNPYCRF_PROFILE (the stage fields are omitted
+ *    otherwise)
+ *  - the batch mode (not in the default list) decodes groups of lines with
+ *    npycrf_decode_batch and compares speed and output with per-line calls
+ *    (errors counts groups with any difference)
+ *  - the edit mode (not in the default list) times npycrf_incr_edit against
+ *    a full npycrf_decode after random single-codepoint edits of multi-line
+ *    documents and counts any segmentation difference as an error
+ *
+ * The JSON goes to stdout (or --json FILE) so runs can be diffed/tracked.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mmjp_model.h"
+#include "../mmjp_lossless.h"
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s --model model.bin --input corpus.txt [options]\n"
+          "  --modes LIST      comma separated: best,sample,nbest,batch,edit (default: best,sample,nbest)\n"
+          "  --warmup N        unmeasured passes over the corpus per mode (default: 1)\n"
+          "  --reps N          measured passes over the corpus per mode (default: 3)\n"
+          "  --max_lines N     use at most N corpus lines (default: 0=all)\n"
+          "  --nbest N         candidates for the nbest mode (default: 8)\n"
+          "  --temperature X   sampling temperature (default: 1.0)\n"
+          "  --seed S          sampling seed (default: 1)\n"
+          "  --batch N         batch mode: lines per npycrf_decode_batch call (default: 64)\n"
+          "  --edit_doc N      edit mode: document size in bytes, lines joined (default: 4096)\n"
+          "  --edits N         edit mode: random edits per document (default: 16)\n"
+          "  --lossless_ws N   -1=auto (from model), 0=off, 1=on (default: -1)\n"
+          "  --json FILE       write the JSON report to FILE instead of stdout\n",
+          prog);
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t xs32(uint32_t *s) {
+  uint32_t x = *s;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *s = x ? x : 0x9e3779b9u;
+  return *s;
+}
+
+typedef struct {
+  uint8_t *buf;      /* all prepared lines back to back */
+  size_t *off;       /* [n+1] */
+  size_t n;
+  size_t bytes;      /* raw input bytes of the used lines (for MB/s) */
+  size_t max_len;    /* longest prepared line */
+} corpus_t;
+
+static void corpus_free(corpus_t *c) {
+  free(c->buf);
+  free(c->off);
+  memset(c, 0, sizeof(*c));
+}
+
+static int corpus_append(corpus_t *c, size_t *cap_b, size_t *cap_o, const uint8_t *p, size_t n) {
+  if (c->n + 2u > *cap_o) {
+    size_t nc = *cap_o ? *cap_o * 2u : 1024u;
+    size_t *no = (size_t *)realloc(c->off, nc * sizeof(size_t));
+    if (!no) return 0;
+    c->off = no;
+    *cap_o = nc;
+  }
+  size_t used = c->off[c->n];
+  if (used + n > *cap_b) {
+    size_t nc = *cap_b ? *cap_b : 65536u;
+    while (nc < used + n) nc *= 2u;
+    uint8_t *nb = (uint8_t *)realloc(c->buf, nc);
+    if (!nb) return 0;
+    c->buf = nb;
+    *cap_b = nc;
+  }
+  memcpy(c->buf + used, p, n);
+  c->n++;
+  c->off[c->n] = used + n;
+  if (n > c->max_len) c->max_len = n;
+  return 1;
+}
+
+/* read lines (CR trimmed, empty lines skipped), lossless-encode if requested */
+static int load_corpus(const char *path, size_t max_lines, int lossless_ws, corpus_t *c) {
+  memset(c, 0, sizeof(*c));
+  FILE *f = fopen(path, "rb");
+  if (!f) return 0;
+  size_t cap_b = 0, cap_o = 0;
+  c->off = (size_t *)calloc(1, sizeof(size_t));
+  cap_o = c->off ? 1u : 0u;
+  char *line = NULL;
+  size_t lcap = 0;
+  uint8_t *enc = NULL;
+  size_t enc_cap = 0;
+  int ok = (c->off != NULL);
+
+  while (ok && (max_lines == 0 || c->n < max_lines)) {
+    size_t len = 0;
+    int ch;
+    while ((ch = fgetc(f)) != EOF && ch != '\n') {
+      if (len + 1u > lcap) {
+        size_t nc = lcap ? lcap * 2u : 256u;
+        char *nb = (char *)realloc(line, nc);
+        if (!nb) {
+          ok = 0;
+          break;
+        }
+        line = nb;
+        lcap = nc;
+      }
+      line[len++] = (char)ch;
+    }
+    if (!ok || (ch == EOF && len == 0)) break;
+    while (len > 0 && line[len - 1] == '\r') len--;
+    if (len == 0) continue;
+
+    const uint8_t *p = (const uint8_t *)line;
+    size_t plen = len;
+    if (lossless_ws > 0) {
+      size_t need = mmjp_lossless_encode(p, plen, NULL, 0, 0);
+      if (need + 1u > enc_cap) {
+        uint8_t *nb = (uint8_t *)realloc(enc, need + 1u);
+        if (!nb) {
+          ok = 0;
+          break;
+        }
+        enc = nb;
+        enc_cap = need + 1u;
+      }
+      mmjp_lossless_encode(p, plen, enc, enc_cap, 0);
+      p = enc;
+      plen = need;
+    }
+    if (!corpus_append(c, &cap_b, &cap_o, p, plen)) ok = 0;
+    c->bytes += len;
+  }
+  free(line);
+  free(enc);
+  fclose(f);
+  if (!ok) corpus_free(c);
+  return ok;
+}
+
+typedef enum { BENCH_BEST = 0, BENCH_SAMPLE = 1, BENCH_NBEST = 2, BENCH_EDIT = 3,
+               BENCH_BATCH = 4 } bench_mode_t;
+
+static const char *mode_name(bench_mode_t m) {
+  switch (m) {
+    case BENCH_BEST: return "best";
+    case BENCH_SAMPLE: return "sample";
+    case BENCH_EDIT: return "edit";
+    case BENCH_BATCH: return "batch";
+    default: return "nbest";
+  }
+}
+
+typedef struct {
+  const mmjp_loaded_model_t *mb;
+  npycrf_work_t wk;
+  uint8_t *workbuf;
+  uint8_t *samplebuf;
+  size_t samplecap;
+  uint8_t *nbestbuf;
+  size_t nbestcap;
+  uint16_t *b_cp;
+  size_t b_cap;
+  uint16_t *b_flat;
+  size_t *b_counts;
+  npycrf_score_t *scores;
+  uint16_t nbest;
+  double temperature;
+  uint32_t seed;
+} bench_ctx_t;
+
+static void bench_ctx_free(bench_ctx_t *bc) {
+  free(bc->workbuf);
+  free(bc->samplebuf);
+  free(bc->nbestbuf);
+  free(bc->b_cp);
+  free(bc->b_flat);
+  free(bc->b_counts);
+  free(bc->scores);
+}
+
+static int bench_ctx_init(bench_ctx_t *bc, const mmjp_loaded_model_t *mb, size_t max_len,
+                          uint16_t nbest, double temperature, uint32_t seed) {
+  memset(bc, 0, sizeof(*bc));
+  bc->mb = mb;
+  bc->nbest = nbest;
+  bc->temperature = temperature;
+  bc->seed = seed;
+  if (max_len > 65530u) return 0;
+  uint16_t n_cp = (uint16_t)(max_len > 0 ? max_len : 1u);  /* bytes >= codepoints */
+  uint16_t L = mb->m.max_word_len;
+
+  size_t wsize = npycrf_workbuf_size(n_cp, L);
+  bc->workbuf = (uint8_t *)malloc(wsize);
+  bc->samplecap = npycrf_samplebuf_size(n_cp, L);
+  bc->samplebuf = (uint8_t *)malloc(bc->samplecap);
+  bc->nbestcap = npycrf_nbestbuf_size(n_cp, L, nbest);
+  bc->nbestbuf = (uint8_t *)malloc(bc->nbestcap);
+  bc->b_cap = (size_t)n_cp + 1u;
+  bc->b_cp = (uint16_t *)malloc(bc->b_cap * sizeof(uint16_t));
+  bc->b_flat = (uint16_t *)malloc((size_t)nbest * bc->b_cap * sizeof(uint16_t));
+  bc->b_counts = (size_t *)malloc((size_t)nbest * sizeof(size_t));
+  bc->scores = (npycrf_score_t *)malloc((size_t)nbest * sizeof(npycrf_score_t));
+  if (!bc->workbuf || !bc->samplebuf || !bc->nbestbuf || !bc->b_cp || !bc->b_flat ||
+      !bc->b_counts || !bc->scores) {
+    return 0;
+  }
+  return npycrf_work_init(&bc->wk, bc->workbuf, wsize, n_cp, L) == 0;
+}
+
+static int bench_decode_one(bench_ctx_t *bc, bench_mode_t mode, const uint8_t *p, size_t n) {
+  size_t b_count = 0;
+  npycrf_score_t score = 0;
+  switch (mode) {
+    case BENCH_BEST:
+      return npycrf_decode(&bc->mb->m, p, n, &bc->wk, bc->b_cp, bc->b_cap, &b_count, &score);
+    case BENCH_SAMPLE: {
+      uint32_t seed = bc->seed;
+      (void)xs32(&bc->seed);
+      return npycrf_decode_sample(&bc->mb->m, p, n, &bc->wk, bc->samplebuf, bc->samplecap,
+                                  bc->temperature, seed, bc->b_cp, bc->b_cap, &b_count, &score);
+    }
+    default: {
+      int rc = npycrf_decode_nbest(&bc->mb->m, p, n, &bc->wk, bc->nbestbuf, bc->nbestcap,
+                                   bc->nbest, bc->b_flat, bc->b_cap, bc->b_counts, bc->scores);
+      return (rc < 0) ? rc : 0;
+    }
+  }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of a sorted array */
+static uint64_t percentile(const uint64_t *v, size_t n, double q) {
+  if (n == 0) return 0;
+  size_t r = (size_t)(q * (double)n + 0.999999);
+  if (r == 0) r = 1;
+  if (r > n) r = n;
+  return v[r - 1u];
+}
+
+/* one mode: warmup + measured passes; writes one JSON object */
+static int bench_mode(FILE *js, bench_ctx_t *bc, bench_mode_t mode, const corpus_t *c,
+                      unsigned warmup, unsigned reps, int first) {
+  size_t total = c->n * (size_t)reps;
+  uint64_t *lat = (uint64_t *)malloc((total ? total : 1u) * sizeof(uint64_t));
+  if (!lat) return 0;
+  size_t errors = 0;
+
+  for (unsigned w = 0; w < warmup; w++) {
+    for (size_t i = 0; i < c->n; i++) {
+      (void)bench_decode_one(bc, mode, c->buf + c->off[i], c->off[i + 1] - c->off[i]);
+    }
+  }
+
+#ifdef NPYCRF_PROFILE
+  memset(&bc->wk.prof, 0, sizeof(bc->wk.prof));
+#endif
+  size_t k = 0;
+  double t0 = now_sec();
+  for (unsigned r = 0; r < reps; r++) {
+    for (size_t i = 0; i < c->n; i++) {
+      uint64_t s = now_ns();
+      int rc = bench_decode_one(bc, mode, c->buf + c->off[i], c->off[i + 1] - c->off[i]);
+      lat[k++] = now_ns() - s;
+      if (rc != 0) errors++;
+    }
+  }
+  double sec = now_sec() - t0;
+
+  uint64_t sum = 0;
+  for (size_t i = 0; i < k; i++) sum += lat[i];
+  qsort(lat, k, sizeof(uint64_t), cmp_u64);
+  double mb = (double)c->bytes * (double)reps / (1024.0 * 1024.0);
+
+  fprintf(js, "%s    {\n", first ? "" : ",\n");
+  fprintf(js, "      \"mode\": \"%s\",\n", mode_name(mode));
+  fprintf(js, "      \"sentences\": %zu,\n", k);
+  fprintf(js, "      \"errors\": %zu,\n", errors);
+  fprintf(js, "      \"seconds\": %.6f,\n", sec);
+  fprintf(js, "      \"sent_per_sec\": %.1f,\n", (sec > 0.0) ? (double)k / sec : 0.0);
+  fprintf(js, "      \"mb_per_sec\": %.3f,\n", (sec > 0.0) ? mb / sec : 0.0);
+  fprintf(js, "      \"latency_us\": {\"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+          k ? (double)sum / (double)k / 1e3 : 0.0,
+          (double)percentile(lat, k, 0.50) / 1e3,
+          (double)percentile(lat, k, 0.99) / 1e3,
+          k ? (double)lat[k - 1u] / 1e3 : 0.0);
+#ifdef NPYCRF_PROFILE
+  if (mode == BENCH_BEST) {
+    const npycrf_profile_t *pf = &bc->wk.prof;
+    double st = (double)(pf->lattice + pf->dp + pf->backtrack);
+    fprintf(js, ",\n      \"stages_sec\": {\"lattice\": %.6f, \"dp\": %.6f, \"backtrack\": %.6f},\n",
+            (double)pf->lattice * 1e-9, (double)pf->dp * 1e-9, (double)pf->backtrack * 1e-9);
+    fprintf(js, "      \"stages_share\": {\"lattice\": %.4f, \"dp\": %.4f, \"backtrack\": %.4f}",
+            st > 0.0 ? (double)pf->lattice / st : 0.0,
+            st > 0.0 ? (double)pf->dp / st : 0.0,
+            st > 0.0 ? (double)pf->backtrack / st : 0.0);
+  }
+#endif
+  fprintf(js, "\n    }");
+  free(lat);
+  return 1;
+}
+
+/*
+ * batch mode: decodes groups of --batch consecutive lines with one
+ * npycrf_decode_batch call (byte boundaries and token ids) and the same
+ * lines with npycrf_decode + npycrf_boundaries_to_ids +
+ * npycrf_boundaries_cp_to_bytes one at a time. Both are timed; any boundary,
+ * id or score difference counts as an error.
+ */
+static int bench_batch(FILE *js, bench_ctx_t *bc, const corpus_t *c, unsigned warmup,
+                       unsigned reps, size_t batch, int first) {
+  const npycrf_model_t *m = &bc->mb->m;
+  if (batch == 0) return 0;
+
+  size_t max_bytes = 0;
+  for (size_t i = 0; i < c->n; i += batch) {
+    size_t j = (i + batch < c->n) ? i + batch : c->n;
+    if (c->off[j] - c->off[i] > max_bytes) max_bytes = c->off[j] - c->off[i];
+  }
+  size_t b_cap = max_bytes + batch;  /* bytes >= codepoints */
+  size_t *soff = (size_t *)malloc((batch + 1u) * sizeof(size_t));
+  uint16_t *b_batch = (uint16_t *)malloc(b_cap * sizeof(uint16_t));
+  npycrf_id_t *ids_batch = (npycrf_id_t *)malloc(b_cap * sizeof(npycrf_id_t));
+  size_t *b_counts = (size_t *)malloc(batch * sizeof(size_t));
+  npycrf_score_t *scores = (npycrf_score_t *)malloc(batch * sizeof(npycrf_score_t));
+  uint16_t *b_one = (uint16_t *)malloc(bc->b_cap * sizeof(uint16_t));
+  npycrf_id_t *ids_one = (npycrf_id_t *)malloc(bc->b_cap * sizeof(npycrf_id_t));
+  int ok = soff && b_batch && ids_batch && b_counts && scores && b_one && ids_one;
+
+  size_t errors = 0, sentences = 0;
+  double sec_batch = 0.0, sec_single = 0.0;
+  for (unsigned r = 0; ok && r < warmup + reps; r++) {
+    int measured = (r >= warmup);
+    for (size_t i0 = 0; i0 < c->n; i0 += batch) {
+      size_t ns = (i0 + batch < c->n) ? batch : c->n - i0;
+      const uint8_t *p = c->buf + c->off[i0];
+      for (size_t i = 0; i <= ns; i++) soff[i] = c->off[i0 + i] - c->off[i0];
+
+      double t0 = now_sec();
+      int rc = npycrf_decode_batch(m, p, soff, ns, &bc->wk, b_batch, b_cap, b_counts,
+                                   ids_batch, b_cap, scores);
+      double t1 = now_sec();
+      int same = (rc == 0);
+      size_t ob = 0, oi = 0;
+      for (size_t i = 0; i < ns; i++) {
+        size_t b_count = 0;
+        npycrf_score_t score = 0;
+        int rc1 = npycrf_decode(m, p + soff[i], soff[i + 1] - soff[i], &bc->wk,
+                                bc->b_cp, bc->b_cap, &b_count, &score);
+        if (rc1 == 0) rc1 = npycrf_boundaries_to_ids(m, &bc->wk, bc->b_cp, b_count, ids_one, bc->b_cap);
+        npycrf_boundaries_cp_to_bytes(bc->wk.cp_off, bc->b_cp, b_count, b_one);
+        if (!measured || !same) continue;
+        same = (rc1 == 0 && b_counts[i] == b_count && scores[i] == score &&
+                memcmp(b_batch + ob, b_one, b_count * sizeof(uint16_t)) == 0 &&
+                memcmp(ids_batch + oi, ids_one, (b_count - 1u) * sizeof(npycrf_id_t)) == 0);
+        ob += b_count;
+        oi += b_count - 1u;
+      }
+      double t2 = now_sec();
+      if (measured) {
+        if (!same) errors++;
+        sec_batch += t1 - t0;
+        sec_single += t2 - t1;
+        sentences += ns;
+      }
+    }
+  }
+
+  if (ok) {
+    double mb = (double)c->bytes * (double)reps / (1024.0 * 1024.0);
+    fprintf(js, "%s    {\n", first ? "" : ",\n");
+    fprintf(js, "      \"mode\": \"batch\",\n");
+    fprintf(js, "      \"sentences\": %zu,\n", sentences);
+    fprintf(js, "      \"errors\": %zu,\n", errors);
+    fprintf(js, "      \"batch\": %zu,\n", batch);
+    fprintf(js, "      \"seconds\": %.6f,\n", sec_batch);
+    fprintf(js, "      \"sent_per_sec\": %.1f,\n", sec_batch > 0.0 ? (double)sentences / sec_batch : 0.0);
+    fprintf(js, "      \"mb_per_sec\": %.3f,\n", sec_batch > 0.0 ? mb / sec_batch : 0.0);
+    fprintf(js, "      \"single_sent_per_sec\": %.1f,\n", sec_single > 0.0 ? (double)sentences / sec_single : 0.0);
+    fprintf(js, "      \"speedup\": %.3f\n", sec_batch > 0.0 ? sec_single / sec_batch : 0.0);
+    fprintf(js, "    }");
+  }
+  free(soff);
+  free(b_batch);
+  free(ids_batch);
+  free(b_counts);
+  free(scores);
+  free(b_one);
+  free(ids_one);
+  return ok;
+}
+
+/*
+ * edit mode: concatenates consecutive lines into documents of up to
+ * doc_bytes, decodes each once with npycrf_incr_decode, then applies random
+ * single-codepoint edits (delete, insert or replace with a codepoint taken
+ * from the same document). Each edit is timed through npycrf_incr_edit and
+ * through a full npycrf_decode of the edited text; any boundary difference
+ * counts as an error.
+ */
+static int bench_edit(FILE *js, const bench_ctx_t *bc, const corpus_t *c, unsigned reps,
+                      size_t doc_bytes, unsigned edits, uint32_t seed, int first) {
+  const npycrf_model_t *m = &bc->mb->m;
+  uint16_t L = m->max_word_len;
+  size_t max_doc = (doc_bytes > c->max_len) ? doc_bytes : c->max_len;  /* a long line is its own document */
+  if (max_doc > 65000u || edits == 0) return 0;
+  size_t text_cap = max_doc + 8u;  /* room for inserts beyond the document size */
+  uint16_t n_cp = (uint16_t)text_cap;
+
+  size_t isize = npycrf_incr_workbuf_size(n_cp, L);
+  size_t wsize = npycrf_workbuf_size(n_cp, L);
+  size_t total = c->n * (size_t)reps * edits;
+  uint8_t *ibuf = (uint8_t *)malloc(isize);
+  uint8_t *wbuf = (uint8_t *)malloc(wsize);
+  uint8_t *text = (uint8_t *)malloc(text_cap);
+  uint16_t *b_full = (uint16_t *)malloc(((size_t)n_cp + 1u) * sizeof(uint16_t));
+  uint64_t *lat = (uint64_t *)malloc((total ? total : 1u) * sizeof(uint64_t));
+  uint64_t *lat_full = (uint64_t *)malloc((total ? total : 1u) * sizeof(uint64_t));
+  npycrf_incr_t inc;
+  npycrf_work_t wk;
+  int ok = ibuf && wbuf && text && b_full && lat && lat_full &&
+           npycrf_incr_init(&inc, m, ibuf, isize, n_cp) == 0 &&
+           npycrf_work_init(&wk, wbuf, wsize, n_cp, L) == 0;
+
+  size_t k = 0, errors = 0, docs = 0, doc_sum = 0;
+  uint64_t rows_sum = 0, changed_sum = 0;
+  double t0 = now_sec();
+  for (unsigned r = 0; ok && r < reps; r++) {
+    size_t i = 0;
+    while (i < c->n) {
+      /* next document */
+      size_t len = 0;
+      while (i < c->n && (len == 0 || len + (c->off[i + 1] - c->off[i]) <= doc_bytes)) {
+        size_t n = c->off[i + 1] - c->off[i];
+        memcpy(text + len, c->buf + c->off[i], n);
+        len += n;
+        i++;
+      }
+      docs++;
+      doc_sum += len;
+      if (npycrf_incr_decode(&inc, text, len) != 0) {
+        errors += edits;
+        continue;
+      }
+
+      for (unsigned e = 0; e < edits; e++) {
+        const uint16_t *off = inc.work.cp_off;
+        size_t ncp = inc.n_cp;
+        size_t at_cp = xs32(&seed) % ncp;
+        size_t src_cp = xs32(&seed) % ncp;
+        size_t at = off[at_cp];
+        size_t del = 0;
+        uint8_t ins[4];
+        size_t ins_len = off[src_cp + 1] - off[src_cp];
+        memcpy(ins, text + off[src_cp], ins_len);
+        switch (xs32(&seed) % 3u) {
+          case 0: /* delete */
+            if (ncp > 1) {
+              del = off[at_cp + 1] - at;
+              ins_len = 0;
+            }
+            break;
+          case 1: /* insert */
+            break;
+          default: /* replace */
+            del = off[at_cp + 1] - at;
+            break;
+        }
+        if (len - del + ins_len > text_cap) {
+          del = off[at_cp + 1] - at;
+          ins_len = 0;
+        }
+        memmove(text + at + ins_len, text + at + del, len - at - del);
+        memcpy(text + at, ins, ins_len);
+        len = len - del + ins_len;
+
+        npycrf_incr_change_t chg;
+        uint64_t s = now_ns();
+        int rc = npycrf_incr_edit(&inc, text, len, at, del, ins_len, &chg);
+        lat[k] = now_ns() - s;
+
+        size_t bcnt = 0;
+        s = now_ns();
+        int rc_full = npycrf_decode(m, text, len, &wk, b_full, (size_t)n_cp + 1u, &bcnt, NULL);
+        lat_full[k++] = now_ns() - s;
+
+        if (rc != 0 || rc_full != 0 || bcnt != inc.b_count ||
+            memcmp(b_full, inc.b_cp, bcnt * sizeof(uint16_t)) != 0) {
+          errors++;
+          if (npycrf_incr_decode(&inc, text, len) != 0) break;
+          continue;
+        }
+        rows_sum += chg.dp_rows;
+        changed_sum += chg.new_end - chg.first;
+      }
+    }
+  }
+  double sec = now_sec() - t0;
+
+  if (ok) {
+    uint64_t sum = 0, sum_full = 0;
+    for (size_t x = 0; x < k; x++) {
+      sum += lat[x];
+      sum_full += lat_full[x];
+    }
+    qsort(lat, k, sizeof(uint64_t), cmp_u64);
+    qsort(lat_full, k, sizeof(uint64_t), cmp_u64);
+    fprintf(js, "%s    {\n", first ? "" : ",\n");
+    fprintf(js, "      \"mode\": \"edit\",\n");
+    fprintf(js, "      \"edits\": %zu,\n", k);
+    fprintf(js, "      \"errors\": %zu,\n", errors);
+    fprintf(js, "      \"seconds\": %.6f,\n", sec);
+    fprintf(js, "      \"docs\": %zu,\n", docs);
+    fprintf(js, "      \"doc_bytes_mean\": %.1f,\n", docs ? (double)doc_sum / (double)docs : 0.0);
+    fprintf(js, "      \"dp_rows_mean\": %.2f,\n", k ? (double)rows_sum / (double)k : 0.0);
+    fprintf(js, "      \"changed_tokens_mean\": %.2f,\n", k ? (double)changed_sum / (double)k : 0.0);
+    fprintf(js, "      \"speedup\": %.2f,\n", sum ? (double)sum_full / (double)sum : 0.0);
+    fprintf(js, "      \"latency_us\": {\"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n",
+            k ? (double)sum / (double)k / 1e3 : 0.0,
+            (double)percentile(lat, k, 0.50) / 1e3,
+            (double)percentile(lat, k, 0.99) / 1e3,
+            k ? (double)lat[k - 1u] / 1e3 : 0.0);
+    fprintf(js, "      \"full_latency_us\": {\"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f}\n",
+            k ? (double)sum_full / (double)k / 1e3 : 0.0,
+            (double)percentile(lat_full, k, 0.50) / 1e3,
+            (double)percentile(lat_full, k, 0.99) / 1e3,
+            k ? (double)lat_full[k - 1u] / 1e3 : 0.0);
+    fprintf(js, "    }");
+  }
+  free(ibuf);
+  free(wbuf);
+  free(text);
+  free(b_full);
+  free(lat);
+  free(lat_full);
+  return ok;
+}
+
+/* minimal JSON string escape for paths */
+static void json_str(FILE *js, const char *s) {
+  fputc('"', js);
+  for (; *s; s++) {
+    unsigned char ch = (unsigned char)*s;
+    if (ch == '"' || ch == '\\') {
+      fputc('\\', js);
+      fputc(ch, js);
+    } else if (ch < 0x20u) {
+      fprintf(js, "\\u%04x", ch);
+    } else {
+      fputc(ch, js);
+    }
+  }
+  fputc('"', js);
+}
+
+int main(int argc, char **argv) {
+  const char *model_path = NULL;
+  const char *input_path = NULL;
+  const char *json_path = NULL;
+  const char *modes = "best,sample,nbest";
+  unsigned warmup = 1u;
+  unsigned reps = 3u;
+  size_t max_lines = 0;
+  uint16_t nbest = 8u;
+  double temperature = 1.0;
+  uint32_t seed = 1u;
+  int lossless_ws = -1;
+  size_t batch = 64u;
+  size_t edit_doc = 4096u;
+  unsigned edits = 16u;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--model") == 0 && i + 1 < argc) {
+      model_path = argv[++i];
+    } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+      input_path = argv[++i];
+    } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      json_path = argv[++i];
+    } else if (strcmp(argv[i], "--modes") == 0 && i + 1 < argc) {
+      modes = argv[++i];
+    } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      warmup = (unsigned)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+      reps = (unsigned)strtoul(argv[++i], NULL, 10);
+      if (reps == 0) reps = 1;
+    } else if (strcmp(argv[i], "--max_lines") == 0 && i + 1 < argc) {
+      max_lines = (size_t)strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--nbest") == 0 && i + 1 < argc) {
+      nbest = (uint16_t)strtoul(argv[++i], NULL, 10);
+      if (nbest == 0) nbest = 1;
+    } else if (strcmp(argv[i], "--temperature") == 0 && i + 1 < argc) {
+      temperature = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+      if (seed == 0) seed = 1;
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch = (size_t)strtoull(argv[++i], NULL, 10);
+      if (batch == 0) batch = 1;
+    } else if (strcmp(argv[i], "--edit_doc") == 0 && i + 1 < argc) {
+      edit_doc = (size_t)strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--edits") == 0 && i + 1 < argc) {
+      edits = (unsigned)strtoul(argv[++i], NULL, 10);
+      if (edits == 0) edits = 1;
+    } else if (strcmp(argv[i], "--lossless_ws") == 0 && i + 1 < argc) {
+      lossless_ws = (int)strtol(argv[++i], NULL, 10);
+    } else {
+      usage(argv[0]);
+      return (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) ? 0 : 1;
+    }
+  }
+  if (!model_path || !input_path) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  bench_mode_t list[8];
+  size_t n_modes = 0;
+  {
+    const char *p = modes;
+    while (*p && n_modes < 8u) {
+      size_t l = strcspn(p, ",");
+      if (l == 4 && strncmp(p, "best", 4) == 0) list[n_modes++] = BENCH_BEST;
+      else if (l == 6 && strncmp(p, "sample", 6) == 0) list[n_modes++] = BENCH_SAMPLE;
+      else if (l == 5 && strncmp(p, "nbest", 5) == 0) list[n_modes++] = BENCH_NBEST;
+      else if (l == 4 && strncmp(p, "edit", 4) == 0) list[n_modes++] = BENCH_EDIT;
+      else if (l == 5 && strncmp(p, "batch", 5) == 0) list[n_modes++] = BENCH_BATCH;
+      else {
+        fprintf(stderr, "unknown mode in --modes: %.*s\n", (int)l, p);
+        return 1;
+      }
+      p += l;
+      if (*p == ',') p++;
+    }
+  }
+
+  mmjp_loaded_model_t mb;
+  int rc = mmjp_model_map_bin(model_path, &mb);
+  if (rc != 0) {
+    fprintf(stderr, "failed to load model rc=%d\n", rc);
+    return 1;
+  }
+  if (lossless_ws == -1) lossless_ws = (mb.m.flags & NPYCRF_FLAG_LOSSLESS_WS) ? 1 : 0;
+
+  corpus_t c;
+  if (!load_corpus(input_path, max_lines, lossless_ws, &c) || c.n == 0) {
+    fprintf(stderr, "failed to read corpus: %s\n", input_path);
+    mmjp_model_free(&mb);
+    return 1;
+  }
+
+  bench_ctx_t bc;
+  if (!bench_ctx_init(&bc, &mb, c.max_len, nbest, temperature, seed)) {
+    fprintf(stderr, "failed to allocate work buffers (longest line %zu bytes)\n", c.max_len);
+    bench_ctx_free(&bc);
+    corpus_free(&c);
+    mmjp_model_free(&mb);
+    return 1;
+  }
+#ifdef NPYCRF_PROFILE
+  npycrf_profile_set_clock(now_ns);
+#endif
+
+  FILE *js = json_path ? fopen(json_path, "w") : stdout;
+  if (!js) {
+    fprintf(stderr, "failed to open %s\n", json_path);
+    bench_ctx_free(&bc);
+    corpus_free(&c);
+    mmjp_model_free(&mb);
+    return 1;
+  }
+
+  fprintf(js, "{\n  \"model\": ");
+  json_str(js, model_path);
+  fprintf(js, ",\n  \"input\": ");
+  json_str(js, input_path);
+  fprintf(js, ",\n  \"lines\": %zu,\n  \"bytes\": %zu,\n", c.n, c.bytes);
+  fprintf(js, "  \"max_word_len\": %u,\n  \"vocab\": %u,\n  \"bigram_size\": %u,\n",
+          (unsigned)mb.m.max_word_len, (unsigned)mb.m.lm.vocab_size, (unsigned)mb.m.lm.bigram_size);
+  fprintf(js, "  \"lossless_ws\": %d,\n  \"warmup\": %u,\n  \"reps\": %u,\n  \"nbest\": %u,\n",
+          lossless_ws, warmup, reps, (unsigned)nbest);
+#ifdef NPYCRF_PROFILE
+  fprintf(js, "  \"profile\": true,\n");
+#else
+  fprintf(js, "  \"profile\": false,\n");
+#endif
+  fprintf(js, "  \"results\": [\n");
+  int ok = 1;
+  for (size_t m = 0; m < n_modes && ok; m++) {
+    if (list[m] == BENCH_EDIT) ok = bench_edit(js, &bc, &c, reps, edit_doc, edits, seed, m == 0);
+    else if (list[m] == BENCH_BATCH) ok = bench_batch(js, &bc, &c, warmup, reps, batch, m == 0);
+    else ok = bench_mode(js, &bc, list[m], &c, warmup, reps, m == 0);
+  }
+  fprintf(js, "\n  ]\n}\n");
+  if (json_path) fclose(js);
+
+  bench_ctx_free(&bc);
+  corpus_free(&c);
+  mmjp_model_free(&mb);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,304 @@
+/*
+ * mmjp_bench_bigram.c
+ *
+ * Viterbi throughput vs. bigram table size, with and without the
+ * bigram row index (npycrf_lm_build_bigram_index).
+ *
+ *  - loads a model.bin and a corpus (1 line = 1 sentence)
+ *  - for each requested size B, synthesizes a sorted bigram table:
+ *    word pairs observed in the 1-best segmentation first (so lookups hit),
+ *    then random (prev, curr) pairs up to B
+ *  - decodes the corpus with binary search only and with the row index,
+ *    checks both give identical boundaries, and prints lines/sec
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mmjp_model.h"
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s --model model.bin --input corpus.txt [options]\n"
+          "  --sizes LIST   comma separated bigram table sizes (default: 0,1000,10000,100000,1000000)\n"
+          "  --reps N       decode the corpus N times per measurement (default: 3)\n"
+          "  --max_lines N  use at most N corpus lines (default: 10000)\n"
+          "  --seed S       RNG seed for the synthetic pairs (default: 1)\n",
+          prog);
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint32_t xs32(uint32_t *s) {
+  uint32_t x = *s;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *s = x ? x : 0x9e3779b9u;
+  return *s;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+typedef struct {
+  char **line;
+  size_t *len;
+  size_t n;
+  uint16_t max_n_cp;
+} corpus_t;
+
+static int load_corpus(const char *path, size_t max_lines, corpus_t *c) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return 0;
+  memset(c, 0, sizeof(*c));
+  c->line = (char **)calloc(max_lines, sizeof(char *));
+  c->len = (size_t *)calloc(max_lines, sizeof(size_t));
+  if (!c->line || !c->len) {
+    fclose(f);
+    return 0;
+  }
+  char buf[1 << 16];
+  while (c->n < max_lines && fgets(buf, sizeof(buf), f)) {
+    size_t n = strlen(buf);
+    while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r')) n--;
+    if (n == 0) continue;
+    size_t n_cp = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (((uint8_t)buf[i] & 0xC0u) != 0x80u) n_cp++;
+    }
+    if (n_cp > 4096) continue;
+    if (n_cp > c->max_n_cp) c->max_n_cp = (uint16_t)n_cp;
+    c->line[c->n] = (char *)malloc(n + 1);
+    if (!c->line[c->n]) break;
+    memcpy(c->line[c->n], buf, n);
+    c->line[c->n][n] = '\0';
+    c->len[c->n] = n;
+    c->n++;
+  }
+  fclose(f);
+  return c->n > 0;
+}
+
+/* Decode every line once; optionally record adjacent word-id pairs and a checksum of boundaries. */
+static int decode_corpus(const npycrf_model_t *m, const corpus_t *c, npycrf_work_t *wk,
+                         uint16_t *b_cp, size_t b_cap,
+                         uint32_t *pairs, size_t pairs_cap, size_t *pairs_n,
+                         uint64_t *checksum) {
+  uint64_t h = 1469598103934665603ull;
+  for (size_t li = 0; li < c->n; li++) {
+    size_t bcount = 0;
+    int rc = npycrf_decode(m, (const uint8_t *)c->line[li], c->len[li], wk, b_cp, b_cap, &bcount, NULL);
+    if (rc < 0) return rc;
+    for (size_t i = 0; i < bcount; i++) h = (h ^ b_cp[i]) * 1099511628211ull;
+    h = (h ^ 0xFFFFu) * 1099511628211ull;
+
+    if (!pairs) continue;
+    npycrf_id_t prev = NPYCRF_ID_BOS;
+    for (size_t i = 0; i + 1 < bcount && *pairs_n < pairs_cap; i++) {
+      size_t s = wk->cp_off[b_cp[i]];
+      size_t e = wk->cp_off[b_cp[i + 1]];
+      npycrf_id_t id = NPYCRF_ID_NONE;
+      if (npycrf_lm_lookup(&m->lm, (const uint8_t *)c->line[li] + s, e - s, &id) != 1) {
+        id = NPYCRF_ID_NONE;
+      }
+      if (prev != NPYCRF_ID_NONE && id != NPYCRF_ID_NONE) {
+        pairs[(*pairs_n)++] = ((uint32_t)prev << 16) | (uint32_t)id;
+      }
+      prev = id;
+    }
+  }
+  if (checksum) *checksum = h;
+  return 0;
+}
+
+static double time_corpus(const npycrf_model_t *m, const corpus_t *c, npycrf_work_t *wk,
+                          uint16_t *b_cp, size_t b_cap, int reps, uint64_t *checksum) {
+  double t0 = now_sec();
+  for (int r = 0; r < reps; r++) {
+    if (decode_corpus(m, c, wk, b_cp, b_cap, NULL, 0, NULL, checksum) != 0) return -1.0;
+  }
+  return now_sec() - t0;
+}
+
+int main(int argc, char **argv) {
+  const char *model_path = NULL;
+  const char *input_path = NULL;
+  const char *sizes_str = "0,1000,10000,100000,1000000";
+  int reps = 3;
+  size_t max_lines = 10000;
+  uint32_t seed = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--model") == 0 && i + 1 < argc) {
+      model_path = argv[++i];
+    } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+      input_path = argv[++i];
+    } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+      sizes_str = argv[++i];
+    } else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+      reps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--max_lines") == 0 && i + 1 < argc) {
+      max_lines = (size_t)strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      usage(argv[0]);
+      return 0;
+    } else {
+      fprintf(stderr, "unknown arg: %s\n", argv[i]);
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!model_path || !input_path || reps < 1 || max_lines == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (seed == 0) seed = 1;
+
+  mmjp_loaded_model_t lm;
+  int rc = mmjp_model_load_bin(model_path, &lm);
+  if (rc != 0) {
+    fprintf(stderr, "failed to load model rc=%d\n", rc);
+    return 1;
+  }
+
+  corpus_t corpus;
+  if (!load_corpus(input_path, max_lines, &corpus)) {
+    fprintf(stderr, "failed to read corpus: %s\n", input_path);
+    mmjp_model_free(&lm);
+    return 1;
+  }
+
+  npycrf_model_t m = lm.m;
+  uint16_t max_n_cp = corpus.max_n_cp;
+  size_t wb_size = npycrf_workbuf_size(max_n_cp, m.max_word_len);
+  void *wb = malloc(wb_size);
+  size_t b_cap = (size_t)max_n_cp + 1u;
+  uint16_t *b_cp = (uint16_t *)malloc(b_cap * sizeof(uint16_t));
+  npycrf_work_t wk;
+  if (!wb || !b_cp || npycrf_work_init(&wk, wb, wb_size, max_n_cp, m.max_word_len) != 0) {
+    fprintf(stderr, "failed to allocate workspace\n");
+    return 1;
+  }
+
+  /* Observed pairs from the unigram-only segmentation. */
+  m.lm.bigram_key = NULL;
+  m.lm.logp_bi = NULL;
+  m.lm.bigram_size = 0;
+  m.lm.bigram_row = NULL;
+  m.lm.bigram_rows = 0;
+  size_t obs_cap = 1u << 20;
+  uint32_t *obs = (uint32_t *)malloc(obs_cap * sizeof(uint32_t));
+  size_t obs_n = 0;
+  if (!obs || decode_corpus(&m, &corpus, &wk, b_cp, b_cap, obs, obs_cap, &obs_n, NULL) != 0) {
+    fprintf(stderr, "decode failed\n");
+    return 1;
+  }
+  qsort(obs, obs_n, sizeof(uint32_t), cmp_u32);
+  size_t uniq = 0;
+  for (size_t i = 0; i < obs_n; i++) {
+    if (uniq == 0 || obs[uniq - 1] != obs[i]) obs[uniq++] = obs[i];
+  }
+  obs_n = uniq;
+
+  fprintf(stderr, "model: vocab=%u max_word_len=%u  corpus: %zu lines, observed pairs=%zu\n",
+          (unsigned)m.lm.vocab_size, (unsigned)m.max_word_len, corpus.n, obs_n);
+  printf("%12s %14s %14s %9s\n", "bigram_size", "search_lps", "indexed_lps", "speedup");
+
+  const char *p = sizes_str;
+  while (*p) {
+    char *endp = NULL;
+    unsigned long long req = strtoull(p, &endp, 10);
+    if (endp == p) break;
+    p = (*endp == ',') ? endp + 1 : endp;
+
+    uint64_t space = (uint64_t)m.lm.vocab_size * (uint64_t)m.lm.vocab_size;
+    size_t B = (size_t)((req < space) ? req : space);
+
+    /* Build the synthetic table: observed pairs first, then random fill. */
+    uint32_t *key = (uint32_t *)malloc((B + 1u) * sizeof(uint32_t));
+    int16_t *w = (int16_t *)malloc((B + 1u) * sizeof(int16_t));
+    if (!key || !w) {
+      fprintf(stderr, "out of memory for bigram_size=%zu\n", B);
+      free(key);
+      free(w);
+      break;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < obs_n && n < B; i++) key[n++] = obs[i];
+    while (n < B) {
+      size_t need = B - n;
+      for (size_t i = 0; i < need; i++) {
+        uint32_t a = xs32(&seed) % m.lm.vocab_size;
+        uint32_t b = xs32(&seed) % m.lm.vocab_size;
+        key[n++] = (a << 16) | b;
+      }
+      qsort(key, n, sizeof(uint32_t), cmp_u32);
+      size_t u = 0;
+      for (size_t i = 0; i < n; i++) {
+        if (u == 0 || key[u - 1] != key[i]) key[u++] = key[i];
+      }
+      n = u;
+    }
+    qsort(key, n, sizeof(uint32_t), cmp_u32);
+    for (size_t i = 0; i < n; i++) w[i] = (int16_t)(-256 - (int)(xs32(&seed) % 2048u));
+
+    m.lm.bigram_key = key;
+    m.lm.logp_bi = w;
+    m.lm.bigram_size = (uint32_t)n;
+    m.lm.bigram_row = NULL;
+    m.lm.bigram_rows = 0;
+
+    uint64_t sum_search = 0, sum_index = 0;
+    double t_search = time_corpus(&m, &corpus, &wk, b_cp, b_cap, reps, &sum_search);
+
+    uint32_t *row = NULL;
+    size_t row_bytes = npycrf_bigram_index_size(&m.lm);
+    if (row_bytes > 0) {
+      row = (uint32_t *)malloc(row_bytes);
+      if (!row || npycrf_lm_build_bigram_index(&m.lm, row, row_bytes) != 0) {
+        fprintf(stderr, "failed to build bigram index\n");
+        return 1;
+      }
+    }
+    double t_index = time_corpus(&m, &corpus, &wk, b_cp, b_cap, reps, &sum_index);
+
+    if (t_search < 0.0 || t_index < 0.0) {
+      fprintf(stderr, "decode failed\n");
+      return 1;
+    }
+    if (sum_search != sum_index) {
+      fprintf(stderr, "MISMATCH: indexed decode differs at bigram_size=%zu\n", n);
+      return 1;
+    }
+
+    double lines = (double)corpus.n * (double)reps;
+    printf("%12zu %14.0f %14.0f %8.2fx\n", n, lines / t_search, lines / t_index, t_search / t_index);
+    fflush(stdout);
+
+    free(row);
+    free(key);
+    free(w);
+  }
+
+  for (size_t i = 0; i < corpus.n; i++) free(corpus.line[i]);
+  free(corpus.line);
+  free(corpus.len);
+  free(obs);
+  free(b_cp);
+  free(wb);
+  mmjp_model_free(&lm);
+  return 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * mmjp_cache.c
+ *
+ * デコード結果キャッシュ（CLOCK 置換、シャード単位ロック）
+ */
+
+#include "mmjp_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_NONE UINT32_MAX
+
+#ifndef MMJP_NO_THREADS
+#define SHARD_LOCK(s) pthread_mutex_lock(&(s)->mu)
+#define SHARD_UNLOCK(s) pthread_mutex_unlock(&(s)->mu)
+#else
+#define SHARD_LOCK(s) ((void)0)
+#define SHARD_UNLOCK(s) ((void)0)
+#endif
+
+/* FNV-1a (64bit) に opts を混ぜる */
+static uint64_t cache_hash(uint32_t opts, const uint8_t *key, size_t klen) {
+  uint64_t h = 1469598103934665603ull ^ ((uint64_t)opts * 0x9E3779B97F4A7C15ull);
+  for (size_t i = 0; i < klen; i++) {
+    h ^= (uint64_t)key[i];
+    h *= 1099511628211ull;
+  }
+  h ^= h >> 29;
+  return h;
+}
+
+static mmjp_cache_shard_t *cache_shard(mmjp_cache_t *c, uint64_t h) {
+  return &c->shard[(size_t)(h >> 40) % MMJP_CACHE_SHARDS];
+}
+
+static size_t entry_bytes(const mmjp_cache_entry_t *e) {
+  return (size_t)e->nval * sizeof(uint16_t) + (size_t)e->klen;
+}
+
+/* 見つからなければ CACHE_NONE */
+static uint32_t shard_find(const mmjp_cache_shard_t *s, uint64_t h, uint32_t opts,
+                           const uint8_t *key, size_t klen) {
+  uint32_t i = s->bucket[h & (s->nbucket - 1u)];
+  while (i != CACHE_NONE) {
+    const mmjp_cache_entry_t *e = &s->ent[i];
+    if (e->hash == h && e->opts == opts && e->klen == klen &&
+        memcmp(e->blob + (size_t)e->nval * sizeof(uint16_t), key, klen) == 0) {
+      return i;
+    }
+    i = e->next;
+  }
+  return CACHE_NONE;
+}
+
+/* エントリ i をバケットから外して空きリストへ（空きリストは未使用エントリの next で連結） */
+static void shard_drop(mmjp_cache_shard_t *s, uint32_t i, uint32_t *free_head) {
+  mmjp_cache_entry_t *e = &s->ent[i];
+  uint32_t *link = &s->bucket[e->hash & (s->nbucket - 1u)];
+  while (*link != i) link = &s->ent[*link].next;
+  *link = e->next;
+
+  s->st.bytes -= entry_bytes(e);
+  s->st.entries--;
+  free(e->blob);
+  memset(e, 0, sizeof(*e));
+  e->next = *free_head;
+  *free_head = i;
+}
+
+/* CLOCK: 参照ビットが立っていれば落として次へ、落ちていれば追い出す */
+static int shard_evict_one(mmjp_cache_shard_t *s, uint32_t *free_head) {
+  for (uint32_t step = 0; step < 2u * s->cap; step++) {
+    uint32_t i = s->hand;
+    s->hand = (s->hand + 1u == s->cap) ? 0u : s->hand + 1u;
+    mmjp_cache_entry_t *e = &s->ent[i];
+    if (!e->used) continue;
+    if (e->ref) {
+      e->ref = 0;
+      continue;
+    }
+    shard_drop(s, i, free_head);
+    s->st.evictions++;
+    return 1;
+  }
+  return 0;
+}
+
+int mmjp_cache_init(mmjp_cache_t *c, size_t max_entries, size_t max_bytes, size_t max_key) {
+  if (!c) return -1;
+  memset(c, 0, sizeof(*c));
+  c->max_key = max_key ? max_key : (size_t)MMJP_CACHE_DEFAULT_MAX_KEY;
+  if (max_entries == 0) return 0;  /* 無効 */
+  if (max_entries > (size_t)UINT32_MAX / 2u) max_entries = (size_t)UINT32_MAX / 2u;
+  if (max_bytes == 0) max_bytes = max_entries * 256u;
+
+  size_t per = (max_entries + MMJP_CACHE_SHARDS - 1u) / MMJP_CACHE_SHARDS;
+  size_t per_bytes = max_bytes / MMJP_CACHE_SHARDS;
+  if (per_bytes == 0) per_bytes = 1;
+  uint32_t nb = 1;
+  while ((size_t)nb < per * 2u) nb <<= 1;
+
+  for (unsigned k = 0; k < MMJP_CACHE_SHARDS; k++) {
+    mmjp_cache_shard_t *s = &c->shard[k];
+    s->cap = (uint32_t)per;
+    s->nbucket = nb;
+    s->max_bytes = per_bytes;
+    s->ent = (mmjp_cache_entry_t *)calloc(per, sizeof(mmjp_cache_entry_t));
+    s->bucket = (uint32_t *)malloc((size_t)nb * sizeof(uint32_t));
+    if (!s->ent || !s->bucket) {
+      free(s->ent);
+      free(s->bucket);
+      s->ent = NULL;
+      s->bucket = NULL;
+      c->enabled = 1;
+      mmjp_cache_free(c);
+      return -1;
+    }
+    for (uint32_t b = 0; b < nb; b++) s->bucket[b] = CACHE_NONE;
+    for (uint32_t i = 0; i < s->cap; i++) s->ent[i].next = (i + 1u < s->cap) ? i + 1u : CACHE_NONE;
+    s->free_head = 0;
+#ifndef MMJP_NO_THREADS
+    pthread_mutex_init(&s->mu, NULL);
+#endif
+  }
+  c->enabled = 1;
+  return 0;
+}
+
+void mmjp_cache_free(mmjp_cache_t *c) {
+  if (!c) return;
+  if (c->enabled) {
+    for (unsigned k = 0; k < MMJP_CACHE_SHARDS; k++) {
+      mmjp_cache_shard_t *s = &c->shard[k];
+      if (!s->ent) continue;
+      for (uint32_t i = 0; i < s->cap; i++) {
+        if (s->ent[i].used) free(s->ent[i].blob);
+      }
+      free(s->ent);
+      free(s->bucket);
+#ifndef MMJP_NO_THREADS
+      pthread_mutex_destroy(&s->mu);
+#endif
+    }
+  }
+  memset(c, 0, sizeof(*c));
+}
+
+void mmjp_cache_clear(mmjp_cache_t *c) {
+  if (!c || !c->enabled) return;
+  for (unsigned k = 0; k < MMJP_CACHE_SHARDS; k++) {
+    mmjp_cache_shard_t *s = &c->shard[k];
+    SHARD_LOCK(s);
+    for (uint32_t i = 0; i < s->cap; i++) {
+      if (s->ent[i].used) shard_drop(s, i, &s->free_head);
+    }
+    s->hand = 0;
+    SHARD_UNLOCK(s);
+  }
+}
+
+int mmjp_cache_get(mmjp_cache_t *c, uint32_t opts, const uint8_t *key, size_t klen,
+                   uint16_t *out, size_t out_cap, size_t *out_n) {
+  if (!c || !c->enabled || !key || klen > c->max_key) return 0;
+  uint64_t h = cache_hash(opts, key, klen);
+  mmjp_cache_shard_t *s = cache_shard(c, h);
+  int hit = 0;
+
+  SHARD_LOCK(s);
+  uint32_t i = shard_find(s, h, opts, key, klen);
+  if (i != CACHE_NONE && s->ent[i].nval <= out_cap && out) {
+    mmjp_cache_entry_t *e = &s->ent[i];
+    memcpy(out, e->blob, (size_t)e->nval * sizeof(uint16_t));
+    if (out_n) *out_n = e->nval;
+    e->ref = 1;
+    hit = 1;
+  }
+  if (hit) s->st.hits++;
+  else s->st.misses++;
+  SHARD_UNLOCK(s);
+  return hit;
+}
+
+int mmjp_cache_put(mmjp_cache_t *c, uint32_t opts, const uint8_t *key, size_t klen,
+                   const uint16_t *val, size_t nval) {
+  if (!c || !c->enabled || !key || klen > c->max_key || (nval > 0 && !val)) return 0;
+  if (nval > UINT32_MAX) return 0;
+  uint64_t h = cache_hash(opts, key, klen);
+  mmjp_cache_shard_t *s = cache_shard(c, h);
+  size_t need = nval * sizeof(uint16_t) + klen;
+  if (need > s->max_bytes) return 0;
+
+  uint8_t *blob = (uint8_t *)malloc(need ? need : 1u);
+  if (!blob) return 0;
+  if (nval > 0) memcpy(blob, val, nval * sizeof(uint16_t));
+  memcpy(blob + nval * sizeof(uint16_t), key, klen);
+
+  SHARD_LOCK(s);
+  uint32_t i = shard_find(s, h, opts, key, klen);
+  if (i != CACHE_NONE) {
+    /* 置き換え */
+    shard_drop(s, i, &s->free_head);
+  }
+  while (s->free_head == CACHE_NONE || s->st.bytes + need > s->max_bytes) {
+    if (!shard_evict_one(s, &s->free_head)) break;
+  }
+  if (s->free_head == CACHE_NONE || s->st.bytes + need > s->max_bytes) {
+    SHARD_UNLOCK(s);
+    free(blob);
+    return 0;
+  }
+
+  i = s->free_head;
+  mmjp_cache_entry_t *e = &s->ent[i];
+  s->free_head = e->next;
+  e->hash = h;
+  e->blob = blob;
+  e->opts = opts;
+  e->klen = (uint32_t)klen;
+  e->nval = (uint32_t)nval;
+  e->ref = 1;
+  e->used = 1;
+  uint32_t *head = &s->bucket[h & (s->nbucket - 1u)];
+  e->next = *head;
+  *head = i;
+  s->st.entries++;
+  s->st.bytes += need;
+  s->st.inserts++;
+  SHARD_UNLOCK(s);
+  return 1;
+}
+
+void mmjp_cache_get_stats(mmjp_cache_t *c, mmjp_cache_stats_t *out) {
+  if (!out) return;
+  memset(out, 0, sizeof(*out));
+  if (!c || !c->enabled) return;
+  for (unsigned k = 0; k < MMJP_CACHE_SHARDS; k++) {
+    mmjp_cache_shard_t *s = &c->shard[k];
+    SHARD_LOCK(s);
+    out->hits += s->st.hits;
+    out->misses += s->st.misses;
+    out->inserts += s->st.inserts;
+    out->evictions += s->st.evictions;
+    out->entries += s->st.entries;
+    out->bytes += s->st.bytes;
+    SHARD_UNLOCK(s);
+  }
+}
+
+int mmjp_cache_decode(mmjp_cache_t *c, uint32_t kind,
+                      const npycrf_model_t *model,
+                      const uint8_t *utf8, size_t len,
+                      npycrf_work_t *work,
+                      uint16_t *b_cp, size_t b_cap,
+                      uint16_t *out, size_t out_cap, size_t *out_n) {
+  if (!out || !out_n) return -1;
+  if (mmjp_cache_get(c, kind, utf8, len, out, out_cap, out_n)) return 0;
+
+  size_t b_count = 0;
+  int rc = npycrf_decode(model, utf8, len, work, b_cp, b_cap, &b_count, NULL);
+  if (rc != 0) return rc;
+  if (out_cap < b_count) return -30;
+
+  size_t n = b_count;
+  if (kind == MMJP_CACHE_IDS) {
+    n = (b_count > 1u) ? b_count - 1u : 0u;
+    if (npycrf_boundaries_to_ids(model, work, b_cp, b_count, (npycrf_id_t *)out, out_cap) != 0) return -1;
+  } else {
+    npycrf_boundaries_cp_to_bytes(work->cp_off, b_cp, b_count, out);
+  }
+  *out_n = n;
+  (void)mmjp_cache_put(c, kind, utf8, len, out, n);
+  return 0;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+/*
+ * mmjp_cache.h
+ *
+ * 目的:
+ *  - 同じ入力文字列（検索クエリ、商品名など）を繰り返しデコードする用途で、
+ *    デコード結果（境界やトークンID）を入力バイト列ごとに保持する有界キャッシュ。
+ *  - ヒット時は npycrf_decode() の事前計算・DP を丸ごと省く。
+ *
+ * 方針:
+ *  - キーは (opts, 入力バイト列)。opts は呼び出し側が決めるデコード条件の識別子
+ *    （出力の種類など）。モデルはキャッシュごとに1つの前提。
+ *  - 値は uint16 配列（バイト境界、トークンIDなど）をそのままコピーして保持。
+ *  - 置換は CLOCK（参照ビット付きの循環走査）。エントリ数とバイト数の両方で上限。
+ *  - キーのハッシュで MMJP_CACHE_SHARDS 個のシャードに分け、シャードごとに
+ *    ロックを持つ（MMJP_NO_THREADS ならロックなし）。複数スレッドから共有可。
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../npycrf_lite/npycrf_lite.h"
+
+#ifndef MMJP_NO_THREADS
+#include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MMJP_CACHE_SHARDS
+#define MMJP_CACHE_SHARDS 16u
+#endif
+
+/* これより長い入力はキャッシュしない（既定値） */
+#define MMJP_CACHE_DEFAULT_MAX_KEY 1024u
+
+/* mmjp_cache_decode() の出力種別（キーの opts にも使う） */
+#define MMJP_CACHE_BOUNDS 1u  /* 1-best のバイト境界（トークン数+1個） */
+#define MMJP_CACHE_IDS    2u  /* 1-best のトークンID（トークン数個） */
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t inserts;
+  uint64_t evictions;
+  size_t entries;  /* 現在のエントリ数 */
+  size_t bytes;    /* 現在のキー+値の合計バイト数 */
+} mmjp_cache_stats_t;
+
+typedef struct {
+  uint64_t hash;
+  uint8_t *blob;  /* [nval] uint16 値 + [klen] キー */
+  uint32_t opts;
+  uint32_t klen;
+  uint32_t nval;
+  uint32_t next;  /* 同じバケットの次エントリ（UINT32_MAX=終端） */
+  uint8_t ref;    /* CLOCK 参照ビット */
+  uint8_t used;
+} mmjp_cache_entry_t;
+
+typedef struct {
+  mmjp_cache_entry_t *ent;  /* [cap] */
+  uint32_t *bucket;         /* [nbucket] 先頭エントリ（UINT32_MAX=空） */
+  uint32_t cap;
+  uint32_t nbucket;         /* 2のべき */
+  uint32_t hand;            /* CLOCK の針 */
+  uint32_t free_head;       /* 空きエントリ（UINT32_MAX=なし） */
+  size_t max_bytes;
+  mmjp_cache_stats_t st;
+#ifndef MMJP_NO_THREADS
+  pthread_mutex_t mu;
+#endif
+} mmjp_cache_shard_t;
+
+typedef struct {
+  mmjp_cache_shard_t shard[MMJP_CACHE_SHARDS];
+  size_t max_key;
+  int enabled;
+} mmjp_cache_t;
+
+/*
+ * 初期化
+ *
+ * @param max_entries  最大エントリ数（0 なら無効化: get は常にミス、put は何もしない）
+ * @param max_bytes    キー+値の合計バイト上限（0 なら max_entries*256）
+ * @param max_key      キャッシュする入力の最大バイト数（0 なら MMJP_CACHE_DEFAULT_MAX_KEY）
+ * @return 0=成功, -1=確保失敗
+ */
+int mmjp_cache_init(mmjp_cache_t *c, size_t max_entries, size_t max_bytes, size_t max_key);
+
+void mmjp_cache_free(mmjp_cache_t *c);
+
+/* 全エントリを破棄（統計はそのまま） */
+void mmjp_cache_clear(mmjp_cache_t *c);
+
+/*
+ * 検索
+ *
+ * ヒットすれば値を out[0..n) にコピーして *out_n = n。
+ * n > out_cap の場合はミス扱い（コピーしない）。
+ *
+ * @return 1=ヒット, 0=ミス
+ */
+int mmjp_cache_get(mmjp_cache_t *c, uint32_t opts, const uint8_t *key, size_t klen,
+                   uint16_t *out, size_t out_cap, size_t *out_n);
+
+/*
+ * 登録（同じキーがあれば値を置き換える）
+ *
+ * 入力が max_key より長い場合や、1エントリがシャードのバイト上限を超える場合は何もしない。
+ *
+ * @return 1=登録, 0=登録せず
+ */
+int mmjp_cache_put(mmjp_cache_t *c, uint32_t opts, const uint8_t *key, size_t klen,
+                   const uint16_t *val, size_t nval);
+
+/* 全シャードの統計を合算 */
+void mmjp_cache_get_stats(mmjp_cache_t *c, mmjp_cache_stats_t *out);
+
+/*
+ * キャッシュを前段に置いた 1-best デコード
+ *
+ * ヒットすれば npycrf_decode() を呼ばずに保存済みの結果を返す。
+ * ミスなら npycrf_decode() で b_cp にコードポイント境界を求め、
+ * kind に応じてバイト境界（MMJP_CACHE_BOUNDS）またはトークンID（MMJP_CACHE_IDS）
+ * を out に書いて登録する。c が NULL・無効ならキャッシュなしで同じ結果。
+ *
+ * ヒット時は work の内容（cp_off など）は更新されない。
+ *
+ * @param b_cp   コードポイント境界の作業配列（npycrf_decode() の out_b_cp）
+ * @param b_cap  b_cp の容量
+ * @param out    出力（out_cap >= b_cap であれば足りる）
+ * @param out_n  出力要素数
+ * @return 0=成功, 負数=npycrf_decode() のエラー, -30=out 不足
+ */
+int mmjp_cache_decode(mmjp_cache_t *c, uint32_t kind,
+                      const npycrf_model_t *model,
+                      const uint8_t *utf8, size_t len,
+                      npycrf_work_t *work,
+                      uint16_t *b_cp, size_t b_cap,
+                      uint16_t *out, size_t out_cap, size_t *out_n);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
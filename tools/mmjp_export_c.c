@@ -4,6 +4,7 @@
  * model.bin (MMJP) を MCU で使いやすい C ヘッダに変換する。
  */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,9 +13,22 @@
 
 static void usage(const char *prog) {
   fprintf(stderr,
-          "Usage: %s --model model.bin --out model.h [--symbol mmjp]\n"
-          "  --symbol S  ... base symbol name prefix (default: mmjp)\n",
-          prog);
+          "Usage: %s --model model.bin --out model.h [--symbol mmjp] [--dense_emit] [--compact] [--bin]\n"
+          "       %s --model model.bin --out dec.c --decoder [--symbol mmjp] [--max_cp N]\n"
+          "  --symbol S    ... base symbol name prefix (default: mmjp)\n"
+          "  --dense_emit  ... also emit the precomputed CRF emission table\n"
+          "                    (faster decode, costs a few KB of flash)\n"
+          "  --compact     ... emit the compact tables (int16 trie when it fits,\n"
+          "                    8-bit logp, delta-coded bigram keys); v4 models are\n"
+          "                    always emitted compact\n"
+          "  --bin         ... write a model.bin instead of a C header\n"
+          "                    (version 4 with --compact, else version 3)\n"
+          "  --decoder     ... write a 1-best decoder specialized for this model\n"
+          "                    (compile-time L and weights, fixed-size work struct)\n"
+          "                    to dec.c and its declarations to dec.h;\n"
+          "                    unigram-only models\n"
+          "  --max_cp N    ... default max codepoints per --decoder call (default: 256)\n",
+          prog, prog);
 }
 
 static void emit_array_u32(FILE *o, const char *name, const uint32_t *a, size_t n) {
@@ -33,6 +47,15 @@ static void emit_array_i16(FILE *o, const char *name, const int16_t *a, size_t n
   fprintf(o, "\n};\n\n");
 }
 
+static void emit_array_u8(FILE *o, const char *name, const uint8_t *a, size_t n) {
+  fprintf(o, "static const uint8_t %s[%zu] = {\n", name, n ? n : 1u);
+  for (size_t i = 0; i < n; i++) {
+    fprintf(o, "  %u,%s", (unsigned)a[i], (i % 16 == 15) ? "\n" : " ");
+  }
+  if (n == 0) fprintf(o, "  0");
+  fprintf(o, "\n};\n\n");
+}
+
 static void emit_array_da_index(FILE *o, const char *name, const da_index_t *a, size_t n) {
   fprintf(o, "static const da_index_t %s[%zu] = {\n", name, n);
   for (size_t i = 0; i < n; i++) {
@@ -41,10 +64,408 @@ static void emit_array_da_index(FILE *o, const char *name, const da_index_t *a,
   fprintf(o, "\n};\n\n");
 }
 
+/* =====================
+ * 特化デコーダ（--decoder）
+ * ===================== */
+
+/*
+ * モデル定数（L、遷移重み、lambda0、未知語ペナルティ）を埋め込み、
+ * 表（トライ、語彙の対数確率、放射の密テーブル）を固定した 1-best デコーダの
+ * 翻訳単位 (.c) と、その宣言 (.h) を書き出す。
+ *
+ * ユニグラムのみのモデル（mmjp_train の出力）が対象。この場合 LM 項は前単語に
+ * 依存しないので、npycrf_decode() の (位置, 単語長) の DP は位置ごとの最良値と
+ * その単語長だけで済み、ワークは MAX_CP から決まる固定長の構造体になる。
+ * 分割結果とスコアは同じモデルでの npycrf_decode() と一致する。
+ */
+
+static da_index_t dec_base(const npycrf_lm_t *lm, size_t i) {
+  return lm->trie16 ? (da_index_t)lm->trie16[2u * i] : lm->trie.base[i];
+}
+
+static da_index_t dec_check(const npycrf_lm_t *lm, size_t i) {
+  return lm->trie16 ? (da_index_t)lm->trie16[2u * i + 1u] : lm->trie.check[i];
+}
+
+/* SYM_ の大文字版（マクロ名用） */
+static void dec_upper(char *dst, size_t cap, const char *sym) {
+  size_t i = 0;
+  for (; sym[i] && i + 1u < cap; i++) dst[i] = (char)toupper((unsigned char)sym[i]);
+  dst[i] = '\0';
+}
+
+/* "dir/dec.c" → "dir/dec.h"（.c で終わらなければ ".h" を付ける） */
+static char *dec_header_path(const char *c_path) {
+  size_t n = strlen(c_path);
+  char *p = (char *)malloc(n + 3u);
+  if (!p) return NULL;
+  memcpy(p, c_path, n + 1u);
+  if (n >= 2 && strcmp(c_path + n - 2, ".c") == 0) p[n - 1] = 'h';
+  else memcpy(p + n, ".h", 3u);
+  return p;
+}
+
+static int write_decoder(const mmjp_loaded_model_t *lmod, const char *model_path,
+                         const char *c_path, const char *sym, unsigned max_cp) {
+  const npycrf_model_t *m = &lmod->m;
+  const npycrf_lm_t *lm = &m->lm;
+  unsigned L = m->max_word_len;
+
+  int has_bigram = lm->bigram_size > 0 &&
+                   ((lm->bigram_blk && lm->bigram_delta && lm->logp_bi_q8 && lm->bigram_nblk > 0) ||
+                    (lm->bigram_key && lm->logp_bi));
+  if (has_bigram) {
+    fprintf(stderr, "--decoder supports unigram-only models (this one has %u bigrams)\n",
+            (unsigned)lm->bigram_size);
+    return 1;
+  }
+  if (L == 0 || L > 255u) {
+    fprintf(stderr, "--decoder: unsupported max_word_len %u\n", L);
+    return 1;
+  }
+  if ((!lm->trie16 && (!lm->trie.base || !lm->trie.check)) || lm->trie.capacity < 2u ||
+      (lm->cp_page && !lm->cp_code) || (!lm->logp_uni && !lm->logp_uni_q8) || lm->vocab_size == 0) {
+    fprintf(stderr, "--decoder: model has no usable trie or unigram table\n");
+    return 1;
+  }
+
+  /* 使用中の最大ノード+1 まで（以降は check=0 なので遷移は必ず失敗する） */
+  size_t cap = lm->trie.capacity;
+  while (cap > 2u && dec_base(lm, cap - 1u) == 0 && dec_check(lm, cap - 1u) == 0) cap--;
+  int t16 = 1;
+  for (size_t i = 0; i < cap && t16; i++) {
+    da_index_t b = dec_base(lm, i), c = dec_check(lm, i);
+    if (b < INT16_MIN || b > INT16_MAX || c < INT16_MIN || c > INT16_MAX) t16 = 0;
+  }
+
+  /* 語彙 ID の上限（NPYCRF_ID_BOS/NONE と重ならない範囲） */
+  size_t vocab = lm->vocab_size;
+  if (vocab > (size_t)NPYCRF_ID_BOS) vocab = (size_t)NPYCRF_ID_BOS;
+
+  /* 放射の密テーブル（既定の文字クラス 9 種 + BOS/EOS） */
+  uint8_t ncls = (uint8_t)NPYCRF_EMIT_NCLS_DEFAULT;
+  size_t emit_bytes = npycrf_emit_table_size(ncls);
+  int16_t *emit = (int16_t *)malloc(emit_bytes);
+  npycrf_crf_t crf = m->crf;
+  if (!emit || npycrf_crf_compile_emit(&crf, emit, emit_bytes, ncls) != 0) {
+    fprintf(stderr, "--decoder: cannot build the emission table\n");
+    free(emit);
+    return 1;
+  }
+  unsigned d = (unsigned)ncls + 2u;
+
+  char up[96];
+  dec_upper(up, sizeof(up), sym);
+  char *h_path = dec_header_path(c_path);
+  FILE *h = h_path ? fopen(h_path, "wb") : NULL;
+  FILE *o = fopen(c_path, "wb");
+  if (!h || !o) {
+    fprintf(stderr, "failed to open out\n");
+    if (h) fclose(h);
+    if (o) fclose(o);
+    free(h_path);
+    free(emit);
+    return 1;
+  }
+  int pad = (int)strlen(sym) + 16;  /* "int <sym>_dec_decode(" の幅 */
+  const char *h_base = strrchr(h_path, '/');
+  h_base = h_base ? h_base + 1 : h_path;
+
+  /* ---- header ---- */
+  fprintf(h,
+          "#pragma once\n\n"
+          "/* Auto-generated from %s: 1-best decoder specialized for this model */\n\n"
+          "#include <stddef.h>\n"
+          "#include <stdint.h>\n\n"
+          "#ifdef __cplusplus\n"
+          "extern \"C\" {\n"
+          "#endif\n\n"
+          "#define %s_DEC_L %uu\n\n"
+          "/* max codepoints per call; must be the same in every TU that uses the work struct */\n"
+          "#ifndef %s_DEC_MAX_CP\n"
+          "#define %s_DEC_MAX_CP %uu\n"
+          "#endif\n\n"
+          "typedef struct {\n"
+          "  uint16_t cp_off[%s_DEC_MAX_CP + 1u];  /* byte offset of each codepoint (+ end) */\n"
+          "  int16_t emit1[%s_DEC_MAX_CP];         /* label-1 emission per position */\n"
+          "  int32_t pref0[%s_DEC_MAX_CP + 1u];    /* prefix sums of label-0 emissions */\n"
+          "  int32_t best[%s_DEC_MAX_CP + 1u];     /* best score up to each position */\n"
+          "  uint8_t arg[%s_DEC_MAX_CP + 1u];      /* length of the last word on that path */\n"
+          "} %s_dec_work_t;\n\n"
+          "/*\n"
+          " * Same contract as npycrf_decode() on this model: codepoint boundaries\n"
+          " * (0, ..., n) in out_b_cp, byte offsets in w->cp_off.\n"
+          " * Returns 0, -1 (bad args), -3 (invalid UTF-8, empty, or more than\n"
+          " * %s_DEC_MAX_CP codepoints), -5/-21 (out_b_cap too small).\n"
+          " */\n"
+          "int %s_dec_decode(const uint8_t *utf8, size_t len, %s_dec_work_t *w,\n"
+          "%*suint16_t *out_b_cp, size_t out_b_cap, size_t *out_b_count,\n"
+          "%*sint32_t *out_best_score);\n\n"
+          "#ifdef __cplusplus\n"
+          "} /* extern \"C\" */\n"
+          "#endif\n",
+          model_path, up, L, up, up, max_cp, up, up, up, up, up, sym, up, sym, sym,
+          pad, "", pad, "");
+
+  /* ---- tables ---- */
+  fprintf(o, "/* Auto-generated from %s: 1-best decoder specialized for this model */\n\n", model_path);
+  fprintf(o, "#include \"%s\"\n\n", h_base);
+  fprintf(o,
+          "#define DEC_L %s_DEC_L\n"
+          "#define DEC_MAX_CP %s_DEC_MAX_CP\n"
+          "#define DEC_CAP %zuu\n"
+          "#define DEC_VOCAB %zuu\n"
+          "#define DEC_LAMBDA0 (%d)\n"
+          "#define DEC_T00 (%d)\n"
+          "#define DEC_T01 (%d)\n"
+          "#define DEC_T10 (%d)\n"
+          "#define DEC_T11 (%d)\n"
+          "#define DEC_BOS_TO1 (%d)\n"
+          "#define DEC_NEG_INF (-0x3fffffff)\n"
+          "#define DEC_D %uu      /* emission classes incl. BOS/EOS */\n"
+          "#define DEC_BOS %uu\n"
+          "#define DEC_EOS %uu\n\n",
+          up, up, cap, vocab, (int)m->lambda0,
+          (int)m->crf.trans00, (int)m->crf.trans01, (int)m->crf.trans10, (int)m->crf.trans11,
+          (int)m->crf.bos_to1, d, (unsigned)ncls, (unsigned)ncls + 1u);
+  fprintf(o, "typedef %s_dec_work_t dec_work_t;\n\n", sym);
+
+  /* trie: (base, check) interleaved */
+  fprintf(o, "static const %s dec_trie[%zu] = {\n", t16 ? "int16_t" : "int32_t", cap * 2u);
+  for (size_t i = 0; i < cap; i++) {
+    fprintf(o, "%s%d, %d,", (i % 6u == 0) ? "  " : " ", (int)dec_base(lm, i), (int)dec_check(lm, i));
+    if (i % 6u == 5u) fprintf(o, "\n");
+  }
+  fprintf(o, "\n};\n\n");
+
+  fprintf(o, "static const int16_t dec_luni[DEC_VOCAB] = {\n");
+  for (size_t i = 0; i < vocab; i++) {
+    int v = 0;
+    if (i < lm->vocab_size) {
+      v = lm->logp_uni_q8 ? (int)lm->uni_q8.off + (int)lm->logp_uni_q8[i] * (int)lm->uni_q8.scale
+                          : (int)lm->logp_uni[i];
+    }
+    fprintf(o, "%s%d,", (i % 12u == 0) ? "  " : " ", v);
+    if (i % 12u == 11u) fprintf(o, "\n");
+  }
+  fprintf(o, "\n};\n\n");
+
+  fprintf(o, "/* unknown-word score by length */\nstatic const int16_t dec_unk[DEC_L + 1u] = {");
+  for (unsigned l = 0; l <= L; l++) {
+    int32_t v = (int32_t)lm->unk_base + (int32_t)lm->unk_per_cp * (int32_t)l;
+    if (v > 32767) v = 32767;
+    if (v < -32768) v = -32768;
+    fprintf(o, "%s%d", l ? ", " : "", (int)v);
+  }
+  fprintf(o, "};\n\n");
+
+  fprintf(o, "/* [label][prev][cur][next] */\nstatic const int16_t dec_emit[2u * DEC_D * DEC_D * DEC_D] = {\n");
+  size_t ne = emit_bytes / sizeof(int16_t);
+  for (size_t i = 0; i < ne; i++) {
+    fprintf(o, "%s%d,", (i % 12u == 0) ? "  " : " ", (int)emit[i]);
+    if (i % 12u == 11u) fprintf(o, "\n");
+  }
+  fprintf(o, "\n};\n\n");
+  free(emit);
+
+  if (lm->cp_page) {
+    size_t n = npycrf_cp_map_count(lm->cp_npages);
+    fprintf(o, "/* codepoint -> trie code: page table, then 256-entry pages */\n"
+               "static const uint16_t dec_cp_map[%zu] = {\n", n);
+    for (size_t i = 0; i < n; i++) {
+      uint16_t v = (i < NPYCRF_CP_PAGES) ? lm->cp_page[i] : lm->cp_code[i - NPYCRF_CP_PAGES];
+      fprintf(o, "%s%u,", (i % 16u == 0) ? "  " : " ", (unsigned)v);
+      if (i % 16u == 15u) fprintf(o, "\n");
+    }
+    fprintf(o, "\n};\n\n");
+  }
+
+  /* ---- code ---- */
+  fprintf(o, "%s",
+          "/* one codepoint; 0 on invalid UTF-8 (same checks as npycrf_lite) */\n"
+          "static int dec_utf8(const uint8_t *s, size_t len, size_t *io, uint32_t *out) {\n"
+          "  size_t i = *io;\n"
+          "  uint8_t c0 = s[i];\n"
+          "  uint32_t cp;\n"
+          "  size_t n;\n"
+          "  if ((c0 & 0x80u) == 0) {\n"
+          "    *out = c0;\n"
+          "    *io = i + 1u;\n"
+          "    return 1;\n"
+          "  } else if ((c0 & 0xE0u) == 0xC0u) {\n"
+          "    n = 2u;\n"
+          "    cp = c0 & 0x1Fu;\n"
+          "  } else if ((c0 & 0xF0u) == 0xE0u) {\n"
+          "    n = 3u;\n"
+          "    cp = c0 & 0x0Fu;\n"
+          "  } else if ((c0 & 0xF8u) == 0xF0u) {\n"
+          "    n = 4u;\n"
+          "    cp = c0 & 0x07u;\n"
+          "  } else {\n"
+          "    return 0;\n"
+          "  }\n"
+          "  if (i + n - 1u >= len) return 0;\n"
+          "  for (size_t k = 1; k < n; k++) {\n"
+          "    uint8_t c = s[i + k];\n"
+          "    if ((c & 0xC0u) != 0x80u) return 0;\n"
+          "    cp = (cp << 6) | (uint32_t)(c & 0x3Fu);\n"
+          "  }\n"
+          "  if (n == 2u && cp < 0x80u) return 0;\n"
+          "  if (n == 3u && (cp < 0x800u || (cp >= 0xD800u && cp <= 0xDFFFu))) return 0;\n"
+          "  if (n == 4u && (cp < 0x10000u || cp > 0x10FFFFu)) return 0;\n"
+          "  *out = cp;\n"
+          "  *io = i + n;\n"
+          "  return 1;\n"
+          "}\n\n"
+          "/* default character classes of npycrf_decode() */\n"
+          "static uint8_t dec_class(uint32_t cp) {\n"
+          "  if (cp >= 0x2580u && cp <= 0x2584u) return 1u;  /* lossless meta -> SPACE */\n"
+          "  if (cp <= 0x7Fu) {\n"
+          "    if (cp == ' ' || cp == '\\t' || cp == '\\n' || cp == '\\r') return 1u;\n"
+          "    if (cp >= '0' && cp <= '9') return 2u;\n"
+          "    if ((cp >= 'A' && cp <= 'Z') || (cp >= 'a' && cp <= 'z')) return 3u;\n"
+          "    return 8u;\n"
+          "  }\n"
+          "  if (cp >= 0x3040u && cp <= 0x309Fu) return 4u;\n"
+          "  if (cp >= 0x30A0u && cp <= 0x30FFu) return 5u;\n"
+          "  if (cp >= 0x4E00u && cp <= 0x9FFFu) return 6u;\n"
+          "  if (cp >= 0xFF00u && cp <= 0xFFEFu) return 7u;\n"
+          "  return 0u;\n"
+          "}\n\n"
+          "static int32_t dec_next(int32_t cur, uint32_t code) {\n"
+          "  int32_t b = dec_trie[2u * (uint32_t)cur];\n"
+          "  if (b <= 0) return 0;\n"
+          "  uint32_t idx = (uint32_t)b + code;\n"
+          "  if (idx >= DEC_CAP) return 0;\n"
+          "  return (dec_trie[2u * idx + 1u] == cur) ? (int32_t)idx : 0;\n"
+          "}\n\n"
+          "/* score of the word ending at trie node v (0 = no such prefix), l codepoints long */\n"
+          "static int16_t dec_word(int32_t v, unsigned l) {\n"
+          "  if (v != 0) {\n"
+          "    int32_t t = dec_next(v, 0u);\n"
+          "    if (t != 0) {\n"
+          "      int32_t b = dec_trie[2u * (uint32_t)t];\n"
+          "      if (b < 0 && (uint32_t)(-(b + 1)) < DEC_VOCAB) return dec_luni[-(b + 1)];\n"
+          "    }\n"
+          "  }\n"
+          "  return dec_unk[l];\n"
+          "}\n\n"
+          "static void dec_emit_at(dec_work_t *w, size_t i, uint8_t p, uint8_t c, uint8_t nx) {\n"
+          "  size_t k = ((size_t)p * DEC_D + c) * DEC_D + nx;\n"
+          "  w->emit1[i] = dec_emit[DEC_D * DEC_D * DEC_D + k];\n"
+          "  w->pref0[i + 1u] = w->pref0[i] + dec_emit[k];\n"
+          "}\n\n"
+          "/* best path to pos over the last word length k; lu[k] = word score of (pos-k, pos) */\n"
+          "static void dec_step(dec_work_t *w, size_t pos, const int16_t *lu) {\n"
+          "  int32_t rbest = DEC_NEG_INF;\n"
+          "  uint8_t rarg = 0;\n"
+          "  for (unsigned k = 1; k <= DEC_L; k++) {\n"
+          "    if (k > pos) break;\n"
+          "    size_t s = pos - k;\n"
+          "    int32_t seg = (k == 1u) ? (int32_t)w->emit1[s] + DEC_T11\n"
+          "                            : (int32_t)w->emit1[s] + DEC_T10 + (w->pref0[pos] - w->pref0[s + 1u]) +\n"
+          "                                  DEC_T00 * (int32_t)(k - 2u) + DEC_T01;\n"
+          "    int32_t v = w->best[s] + seg + (int32_t)(((int64_t)DEC_LAMBDA0 * (int64_t)lu[k]) >> 8);\n"
+          "    if (v > rbest) {\n"
+          "      rbest = v;\n"
+          "      rarg = (uint8_t)k;\n"
+          "    }\n"
+          "  }\n"
+          "  w->best[pos] = rbest;\n"
+          "  w->arg[pos] = rarg;\n"
+          "}\n\n");
+
+  fprintf(o,
+          "int %s_dec_decode(const uint8_t *utf8, size_t len, %s_dec_work_t *w,\n"
+          "%*suint16_t *out_b_cp, size_t out_b_cap, size_t *out_b_count,\n"
+          "%*sint32_t *out_best_score) {\n"
+          "  if (!utf8 || !w || !out_b_cp || !out_b_count) return -1;\n"
+          "  int32_t node[DEC_L];    /* trie walk of the word starting at s, in node[s %% L] */\n"
+          "  int16_t lu[DEC_L + 1u]; /* word scores of the spans ending at the next position */\n"
+          "  uint8_t prev = DEC_BOS, cur = DEC_EOS;\n"
+          "  size_t n = 0, i = 0;\n"
+          "  w->best[0] = DEC_BOS_TO1;\n"
+          "  w->pref0[0] = 0;\n"
+          "  while (i < len) {\n"
+          "    if (n >= DEC_MAX_CP) return -3;\n"
+          "    size_t b0 = i;\n"
+          "    uint32_t cp = 0;\n"
+          "    if (!dec_utf8(utf8, len, &i, &cp)) return -3;\n"
+          "    w->cp_off[n] = (uint16_t)b0;\n"
+          "    uint8_t cls = dec_class(cp);\n"
+          "    if (n > 0) {\n"
+          "      /* the class of n fixes the emission of n-1, so position n can be scored */\n"
+          "      dec_emit_at(w, n - 1u, prev, cur, cls);\n"
+          "      prev = cur;\n"
+          "      dec_step(w, n, lu);\n"
+          "    }\n"
+          "    cur = cls;\n\n"
+          "    size_t end = n + 1u;\n"
+          "    node[n %% DEC_L] = 1;\n",
+          sym, sym, pad, "", pad, "");
+  if (lm->cp_page) {
+    fprintf(o,
+            "    uint32_t code = (cp >> 8) < %uu ? dec_cp_map[%uu + ((uint32_t)dec_cp_map[cp >> 8] << 8) + (cp & 0xFFu)] : 0u;\n",
+            (unsigned)NPYCRF_CP_PAGES, (unsigned)NPYCRF_CP_PAGES);
+  }
+  fprintf(o,
+          "    for (unsigned l = 1; l <= DEC_L; l++) {\n"
+          "      if (l > end) break;\n"
+          "      int32_t *nd = &node[(end - l) %% DEC_L];\n"
+          "      int32_t v = *nd;\n"
+          "      if (v != 0) {\n");
+  if (lm->cp_page) {
+    fprintf(o, "        v = (code != 0) ? dec_next(v, code) : 0;\n");
+  } else {
+    fprintf(o, "        for (size_t b = b0; b < i && v != 0; b++) v = dec_next(v, utf8[b]);\n");
+  }
+  fprintf(o, "%s",
+          "        *nd = v;\n"
+          "      }\n"
+          "      lu[l] = dec_word(v, l);\n"
+          "    }\n"
+          "    n++;\n"
+          "  }\n"
+          "  if (n == 0) return -3;\n"
+          "  w->cp_off[n] = (uint16_t)len;\n"
+          "  dec_emit_at(w, n - 1u, prev, cur, DEC_EOS);\n"
+          "  dec_step(w, n, lu);\n"
+          "  if (out_b_cap < 2u) return -5;\n"
+          "  if (out_b_cap < n + 1u) return -21;\n\n"
+          "  size_t cnt = 1;\n"
+          "  for (size_t p = n; p > 0; p -= w->arg[p]) {\n"
+          "    if (w->arg[p] == 0) return -22;\n"
+          "    cnt++;\n"
+          "  }\n"
+          "  size_t k = cnt;\n"
+          "  out_b_cp[--k] = (uint16_t)n;\n"
+          "  for (size_t p = n; p > 0;) {\n"
+          "    p -= w->arg[p];\n"
+          "    out_b_cp[--k] = (uint16_t)p;\n"
+          "  }\n"
+          "  *out_b_count = cnt;\n"
+          "  if (out_best_score) *out_best_score = w->best[n];\n"
+          "  return 0;\n"
+          "}\n");
+
+  int err = ferror(o) || ferror(h);
+  fclose(o);
+  fclose(h);
+  fprintf(stderr, "wrote %s and %s (L=%u, %zu trie nodes, %s)\n", c_path, h_path, L, cap,
+          t16 ? "int16 trie" : "int32 trie");
+  free(h_path);
+  return err ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
   const char *model_path = NULL;
   const char *out_path = NULL;
   const char *sym = "mmjp";
+  int dense_emit = 0;
+  int compact = 0;
+  int bin = 0;
+  int decoder = 0;
+  unsigned max_cp = 256u;
 
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--model") == 0 && i + 1 < argc) {
@@ -53,6 +474,16 @@ int main(int argc, char **argv) {
       out_path = argv[++i];
     } else if (strcmp(argv[i], "--symbol") == 0 && i + 1 < argc) {
       sym = argv[++i];
+    } else if (strcmp(argv[i], "--dense_emit") == 0) {
+      dense_emit = 1;
+    } else if (strcmp(argv[i], "--compact") == 0) {
+      compact = 1;
+    } else if (strcmp(argv[i], "--bin") == 0) {
+      bin = 1;
+    } else if (strcmp(argv[i], "--decoder") == 0) {
+      decoder = 1;
+    } else if (strcmp(argv[i], "--max_cp") == 0 && i + 1 < argc) {
+      max_cp = (unsigned)strtoul(argv[++i], NULL, 10);
     } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
       usage(argv[0]);
       return 0;
@@ -67,6 +498,10 @@ int main(int argc, char **argv) {
     usage(argv[0]);
     return 1;
   }
+  if (decoder && (max_cp == 0 || max_cp > 65534u)) {
+    fprintf(stderr, "--max_cp must be in 1..65534\n");
+    return 1;
+  }
 
   mmjp_loaded_model_t lm;
   int rc = mmjp_model_load_bin(model_path, &lm);
@@ -75,6 +510,31 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (lm.m.lm.trie16 || lm.m.lm.logp_uni_q8) compact = 1;  /* v4 */
+  if (compact && (rc = mmjp_model_compact(&lm)) != 0) {
+    fprintf(stderr, "compact failed: %d\n", rc);
+    mmjp_model_free(&lm);
+    return 1;
+  }
+
+  if (decoder) {
+    rc = write_decoder(&lm, model_path, out_path, sym, max_cp);
+    mmjp_model_free(&lm);
+    return rc;
+  }
+
+  if (bin) {
+    uint32_t version = compact ? MMJP_MODEL_VERSION_V4 : MMJP_MODEL_VERSION_V3;
+    rc = mmjp_model_save_bin_version(out_path, &lm.m, version);
+    mmjp_model_free(&lm);
+    if (rc != 0) {
+      fprintf(stderr, "save failed: %d\n", rc);
+      return 1;
+    }
+    fprintf(stderr, "wrote %s (v%u)\n", out_path, (unsigned)version);
+    return 0;
+  }
+
   FILE *o = fopen(out_path, "wb");
   if (!o) {
     fprintf(stderr, "failed to open out\n");
@@ -87,17 +547,48 @@ int main(int argc, char **argv) {
   fprintf(o, "#include <stdint.h>\n");
   fprintf(o, "#include \"npycrf_lite.h\"\n\n");
 
-  char name_base[128], name_check[128], name_uni[128], name_fkey[128], name_fw[128], name_model[128];
+  char name_base[128], name_check[128], name_uni[128], name_fkey[128], name_fw[128], name_emit[128], name_model[128];
+  char name_cpmap[128], name_trie16[128], name_uni8[128], name_bi8[128], name_blk[128], name_delta[128];
   snprintf(name_base, sizeof(name_base), "%s_base", sym);
   snprintf(name_check, sizeof(name_check), "%s_check", sym);
   snprintf(name_uni, sizeof(name_uni), "%s_logp_uni", sym);
   snprintf(name_fkey, sizeof(name_fkey), "%s_feat_key", sym);
   snprintf(name_fw, sizeof(name_fw), "%s_feat_w", sym);
+  snprintf(name_emit, sizeof(name_emit), "%s_emit_tab", sym);
   snprintf(name_model, sizeof(name_model), "%s_model", sym);
+  snprintf(name_cpmap, sizeof(name_cpmap), "%s_cp_map", sym);
+  snprintf(name_trie16, sizeof(name_trie16), "%s_trie16", sym);
+  snprintf(name_uni8, sizeof(name_uni8), "%s_logp_uni_q8", sym);
+  snprintf(name_bi8, sizeof(name_bi8), "%s_logp_bi_q8", sym);
+  snprintf(name_blk, sizeof(name_blk), "%s_bigram_blk", sym);
+  snprintf(name_delta, sizeof(name_delta), "%s_bigram_delta", sym);
 
-  emit_array_da_index(o, name_base, lm.m.lm.trie.base, lm.m.lm.trie.capacity);
-  emit_array_da_index(o, name_check, lm.m.lm.trie.check, lm.m.lm.trie.capacity);
-  emit_array_i16(o, name_uni, lm.m.lm.logp_uni, lm.m.lm.vocab_size);
+  const npycrf_lm_t *cl = &lm.m.lm;
+  char base_ref[160], check_ref[160], uni_ref[160];
+  snprintf(base_ref, sizeof(base_ref), "%s", name_base);
+  snprintf(check_ref, sizeof(check_ref), "%s", name_check);
+  snprintf(uni_ref, sizeof(uni_ref), "%s", name_uni);
+  if (cl->trie16) {
+    emit_array_i16(o, name_trie16, cl->trie16, cl->trie.capacity * 2u);
+    snprintf(base_ref, sizeof(base_ref), "(const da_index_t*)0");
+    snprintf(check_ref, sizeof(check_ref), "(const da_index_t*)0");
+  } else {
+    emit_array_da_index(o, name_base, cl->trie.base, cl->trie.capacity);
+    emit_array_da_index(o, name_check, cl->trie.check, cl->trie.capacity);
+  }
+  if (cl->logp_uni_q8) {
+    emit_array_u8(o, name_uni8, cl->logp_uni_q8, cl->vocab_size);
+    snprintf(uni_ref, sizeof(uni_ref), "(const int16_t*)0");
+  } else {
+    emit_array_i16(o, name_uni, cl->logp_uni, cl->vocab_size);
+  }
+  /* コンパクト形式はバイグラムも書き出す（8bit 値 + 差分符号化キー） */
+  int has_blk = (cl->bigram_blk && cl->bigram_size > 0);
+  if (has_blk) {
+    emit_array_u32(o, name_blk, cl->bigram_blk, (size_t)cl->bigram_nblk * 2u);
+    emit_array_u8(o, name_delta, cl->bigram_delta, cl->bigram_delta_bytes);
+    emit_array_u8(o, name_bi8, cl->logp_bi_q8, cl->bigram_size);
+  }
   if (lm.m.crf.feat_count > 0) {
     emit_array_u32(o, name_fkey, lm.m.crf.feat_key, lm.m.crf.feat_count);
     emit_array_i16(o, name_fw, lm.m.crf.feat_w, lm.m.crf.feat_count);
@@ -106,6 +597,55 @@ int main(int argc, char **argv) {
     fprintf(o, "static const int16_t %s[1] = {0};\n\n", name_fw);
   }
 
+  /* load_bin がロード時に生成した密テーブルをそのまま書き出す */
+  const int16_t *emit_tab = dense_emit ? lm.m.crf.emit_tab : NULL;
+  unsigned emit_ncls = emit_tab ? (unsigned)lm.m.crf.emit_ncls : 0u;
+  if (emit_tab) {
+    emit_array_i16(o, name_emit, emit_tab,
+                   npycrf_emit_table_size((uint8_t)emit_ncls) / sizeof(int16_t));
+  }
+
+  /* codepoint-keyed trie: cp_page and cp_code share one array */
+  const uint16_t *cp_map = lm.m.lm.cp_page;
+  char cp_page_ref[160], cp_code_ref[160];
+  snprintf(cp_page_ref, sizeof(cp_page_ref), "(const uint16_t*)0");
+  snprintf(cp_code_ref, sizeof(cp_code_ref), "(const uint16_t*)0");
+  if (cp_map) {
+    size_t n = npycrf_cp_map_count(lm.m.lm.cp_npages);
+    fprintf(o, "static const uint16_t %s[%zu] = {\n", name_cpmap, n);
+    for (size_t i = 0; i < n; i++) {
+      uint16_t v = (i < NPYCRF_CP_PAGES) ? cp_map[i] : lm.m.lm.cp_code[i - NPYCRF_CP_PAGES];
+      fprintf(o, "%s%u,", (i % 16u == 0) ? "  " : " ", (unsigned)v);
+      if (i % 16u == 15u) fprintf(o, "\n");
+    }
+    fprintf(o, "\n};\n\n");
+    snprintf(cp_page_ref, sizeof(cp_page_ref), "%s", name_cpmap);
+    snprintf(cp_code_ref, sizeof(cp_code_ref), "%s + %uu", name_cpmap, (unsigned)NPYCRF_CP_PAGES);
+  }
+
+  char compact_init[1280] = "";
+  if (compact) {
+    char bi_init[768] = "";
+    if (has_blk) {
+      snprintf(bi_init, sizeof(bi_init),
+               "    .logp_bi_q8 = %s,\n"
+               "    .bigram_blk = %s,\n"
+               "    .bigram_delta = %s,\n"
+               "    .bigram_delta_bytes = %uu,\n"
+               "    .bigram_nblk = %uu,\n"
+               "    .bi_q8 = { .off = %d, .scale = %uu },\n",
+               name_bi8, name_blk, name_delta, (unsigned)cl->bigram_delta_bytes,
+               (unsigned)cl->bigram_nblk, (int)cl->bi_q8.off, (unsigned)cl->bi_q8.scale);
+    }
+    snprintf(compact_init, sizeof(compact_init),
+             "    .trie16 = %s,\n"
+             "    .logp_uni_q8 = %s,\n"
+             "    .uni_q8 = { .off = %d, .scale = %uu },\n"
+             "%s",
+             cl->trie16 ? name_trie16 : "(const int16_t*)0",
+             name_uni8, (int)cl->uni_q8.off, (unsigned)cl->uni_q8.scale, bi_init);
+  }
+
   fprintf(o,
           "static const npycrf_model_t %s = {\n"
           "  .lm = {\n"
@@ -117,6 +657,10 @@ int main(int argc, char **argv) {
           "    .vocab_size = %uu,\n"
           "    .unk_base = %d,\n"
           "    .unk_per_cp = %d,\n"
+          "    .cp_page = %s,\n"
+          "    .cp_code = %s,\n"
+          "    .cp_npages = %uu,\n"
+          "%s"
           "  },\n"
           "  .lambda0 = %d,\n"
           "  .crf = {\n"
@@ -125,20 +669,27 @@ int main(int argc, char **argv) {
           "    .feat_key = %s,\n"
           "    .feat_w = %s,\n"
           "    .feat_count = %uu,\n"
+          "    .emit_tab = %s,\n"
+          "    .emit_ncls = %uu,\n"
           "  },\n"
           "  .max_word_len = %uu,\n"
+          "  .flags = %uu,\n"
           "};\n\n",
           name_model,
-          name_base,
-          name_check,
+          base_ref,
+          check_ref,
           (size_t)lm.m.lm.trie.capacity,
-          name_uni,
+          uni_ref,
           (lm.m.lm.logp_bi ? "(const int16_t*)0" : "(const int16_t*)0"),
           (lm.m.lm.bigram_key ? "(const uint32_t*)0" : "(const uint32_t*)0"),
           (unsigned)lm.m.lm.bigram_size,
           (unsigned)lm.m.lm.vocab_size,
           (int)lm.m.lm.unk_base,
           (int)lm.m.lm.unk_per_cp,
+          cp_page_ref,
+          cp_code_ref,
+          (unsigned)lm.m.lm.cp_npages,
+          compact_init,
           (int)lm.m.lambda0,
           (int)lm.m.crf.trans00,
           (int)lm.m.crf.trans01,
@@ -148,7 +699,10 @@ int main(int argc, char **argv) {
           name_fkey,
           name_fw,
           (unsigned)lm.m.crf.feat_count,
-          (unsigned)lm.m.max_word_len);
+          (emit_tab ? name_emit : "(const int16_t*)0"),
+          emit_ncls,
+          (unsigned)lm.m.max_word_len,
+          (unsigned)lm.m.flags);
 
   fclose(o);
   mmjp_model_free(&lm);
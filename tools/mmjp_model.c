@@ -1,9 +1,21 @@
+#if !defined(_WIN32) && !defined(MMJP_NO_MMAP) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* mmap/fstat under -std=c99 */
+#endif
+
 #include "mmjp_model.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+#if !defined(_WIN32) && !defined(MMJP_NO_MMAP)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MMJP_HAVE_MMAP 1
+#endif
+
 /* =====================
  * 小さなLEエンコード/デコード
  * ===================== */
@@ -39,6 +51,15 @@ static int rd_i16(FILE *f, int16_t *out) {
   return 1;
 }
 
+/* メモリ上の LE 値（v3 ヘッダ/非ゼロコピー時の配列用） */
+static uint32_t ld_u32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int16_t ld_i16(const uint8_t *p) {
+  return (int16_t)(uint16_t)((uint16_t)p[0] | ((uint16_t)p[1] << 8));
+}
+
 /* =====================
  * バイナリフォーマット
  * ===================== */
@@ -55,18 +76,223 @@ enum {
   MMJP_DA_INDEX_BYTES = 4u,
 };
 
-int mmjp_model_save_bin(const char *path, const npycrf_model_t *m) {
-  if (!path || !m) return -1;
+/*
+ * v3 ヘッダレイアウト（バイトオフセット）
+ *
+ *   0  magic[8]
+ *   8  version, da_index_bytes, da_cap, vocab, max_word_len   (u32 x5)
+ *  28  unk_base, unk_per_cp, lambda0,
+ *      trans00, trans01, trans10, trans11, bos_to1           (i16 x8)
+ *  44  feat_count, bigram_size, flags                         (u32 x3)
+ *  56  cc_mode, cc_fallback, pad[2]                           (u8 x4)
+ *  60  cc_range_count                                         (u32)
+ *  64  section offsets (BASE..CC_RANGES)                      (u32 x 8)
+ *  96  file_bytes                                             (u32)
+ * 100  CP_MAP section offset                                  (u32)
+ * 104  cp_npages                                              (u32)
+ * 108  reserved (0)
+ *
+ * CP_MAP（flags に NPYCRF_FLAG_TRIE_CP がある場合のみ）:
+ *   cp_page[NPYCRF_CP_PAGES] + cp_code[(cp_npages+1)*256]（u16）
+ *
+ * v4（コンパクト）は同じレイアウトで、108 以降に量子化パラメータを持つ:
+ * 108  uni_q8.off, uni_q8.scale                               (i16, u16)
+ * 112  bi_q8.off, bi_q8.scale                                 (i16, u16)
+ * 116  bigram_nblk                                            (u32)
+ * 120  bigram_delta bytes                                     (u32)
+ * 124  reserved (0)
+ *
+ *   BASE        da_index_bytes=2: (base, check) の i16 組 [da_cap*2]（CHECK は空）
+ *               da_index_bytes=4: v3 と同じ（CHECK も v3 と同じ）
+ *   UNIGRAM     u8[vocab]（量子化値）
+ *   BIGRAM_KEY  ブロック索引 u32[bigram_nblk*2] + キー差分（LEB128）
+ *   BIGRAM_LOGP u8[bigram_size]（量子化値）
+ */
+enum {
+  MMJP_V3_SEC_BASE = 0,
+  MMJP_V3_SEC_CHECK,
+  MMJP_V3_SEC_UNIGRAM,
+  MMJP_V3_SEC_BIGRAM_KEY,
+  MMJP_V3_SEC_BIGRAM_LOGP,
+  MMJP_V3_SEC_FEAT_KEY,
+  MMJP_V3_SEC_FEAT_W,
+  MMJP_V3_SEC_CC_RANGES,
+  MMJP_V3_SEC_CP_MAP,
+  MMJP_V3_SEC_COUNT
+};
+
+#define MMJP_V3_OFF_SECTIONS 64u
+#define MMJP_V3_OFF_FILE_BYTES 96u
+#define MMJP_V3_OFF_CP_MAP 100u
+#define MMJP_V3_OFF_CP_NPAGES 104u
+#define MMJP_V3_CC_RANGE_BYTES 12u
+#define MMJP_V4_OFF_UNI_Q8 108u
+#define MMJP_V4_OFF_BI_Q8 112u
+#define MMJP_V4_OFF_BIGRAM_NBLK 116u
+#define MMJP_V4_OFF_DELTA_BYTES 120u
+
+/* セクション s のオフセットを格納するヘッダ位置（CP_MAP は file_bytes の後ろ） */
+static size_t v3_sec_slot(int s) {
+  if (s == MMJP_V3_SEC_CP_MAP) return MMJP_V3_OFF_CP_MAP;
+  return MMJP_V3_OFF_SECTIONS + 4u * (size_t)s;
+}
+
+/* 共通ヘッダ値（v1/v2/v3） */
+typedef struct {
+  uint32_t da_cap;
+  uint32_t vocab;
+  uint32_t max_word_len;
+  int16_t unk_base, unk_per_cp, lambda0;
+  int16_t trans00, trans01, trans10, trans11, bos_to1;
+  uint32_t feat_count;
+  uint32_t bigram_size;
+  uint32_t flags;
+  uint8_t cc_mode;
+  uint8_t cc_fallback;
+  uint32_t cc_range_count;
+  uint32_t cp_npages;  /* v3: NPYCRF_FLAG_TRIE_CP のみ */
+} mmjp_hdr_t;
+
+/* cp_page + cp_code の要素数（コードポイント単位トライでなければ0） */
+static size_t hdr_cp_map_count(const mmjp_hdr_t *h) {
+  return (h->flags & NPYCRF_FLAG_TRIE_CP) ? npycrf_cp_map_count(h->cp_npages) : 0u;
+}
+
+/* owned バッファ内の配列ポインタ */
+typedef struct {
+  da_index_t *base;
+  da_index_t *check;
+  int16_t *unigram;
+  uint32_t *bigram_key;
+  int16_t *logp_bi;
+  uint32_t *feat_key;
+  int16_t *feat_w;
+  npycrf_cc_range_t *cc_ranges;
+  uint16_t *cp_map;
+} mmjp_tables_t;
+
+/* ヘッダのサイズ情報から owned ブロックを1回で確保して分割する */
+static uint8_t *tables_alloc(const mmjp_hdr_t *h, mmjp_tables_t *t, size_t *out_bytes) {
+  size_t bytes = 0;
+  bytes += (size_t)h->da_cap * sizeof(da_index_t);  /* base */
+  bytes += (size_t)h->da_cap * sizeof(da_index_t);  /* check */
+  bytes += (size_t)h->vocab * sizeof(int16_t);      /* unigram */
+  bytes += (size_t)h->bigram_size * sizeof(uint32_t);
+  bytes += (size_t)h->bigram_size * sizeof(int16_t);
+  bytes += (size_t)h->feat_count * sizeof(uint32_t);
+  bytes += (size_t)h->feat_count * sizeof(int16_t);
+  bytes += (size_t)h->cc_range_count * sizeof(npycrf_cc_range_t);  /* v2: cc_ranges */
+  bytes += hdr_cp_map_count(h) * sizeof(uint16_t);                 /* v3: cp_map */
+
+  uint8_t *mem = (uint8_t *)malloc(bytes);
+  if (!mem) return NULL;
+  memset(mem, 0, bytes);
+  memset(t, 0, sizeof(*t));
+
+  uint8_t *p = mem;
+  t->base = (da_index_t *)p;
+  p += (size_t)h->da_cap * sizeof(da_index_t);
+  t->check = (da_index_t *)p;
+  p += (size_t)h->da_cap * sizeof(da_index_t);
+  t->unigram = (int16_t *)p;
+  p += (size_t)h->vocab * sizeof(int16_t);
+  if (h->bigram_size > 0) {
+    t->bigram_key = (uint32_t *)p;
+    p += (size_t)h->bigram_size * sizeof(uint32_t);
+    t->logp_bi = (int16_t *)p;
+    p += (size_t)h->bigram_size * sizeof(int16_t);
+  }
+  if (h->feat_count > 0) {
+    t->feat_key = (uint32_t *)p;
+    p += (size_t)h->feat_count * sizeof(uint32_t);
+    t->feat_w = (int16_t *)p;
+    p += (size_t)h->feat_count * sizeof(int16_t);
+  }
+  if (h->cc_range_count > 0) {
+    t->cc_ranges = (npycrf_cc_range_t *)p;
+    p += (size_t)h->cc_range_count * sizeof(npycrf_cc_range_t);
+  }
+  if (hdr_cp_map_count(h) > 0) {
+    t->cp_map = (uint16_t *)p;
+    p += hdr_cp_map_count(h) * sizeof(uint16_t);
+  }
+
+  *out_bytes = bytes;
+  return mem;
+}
+
+/* ヘッダ値 + 配列ポインタから npycrf_model_t を組み立てる */
+static void model_setup(const mmjp_hdr_t *h,
+                        const da_index_t *base, const da_index_t *check,
+                        const int16_t *unigram,
+                        const uint32_t *bigram_key, const int16_t *logp_bi,
+                        const uint32_t *feat_key, const int16_t *feat_w,
+                        const npycrf_cc_range_t *cc_ranges,
+                        const uint16_t *cp_map,
+                        npycrf_model_t *m_out) {
+  memset(m_out, 0, sizeof(*m_out));
+
+  m_out->max_word_len = (uint16_t)h->max_word_len;
+
+  m_out->lm.trie.base = base;
+  m_out->lm.trie.check = check;
+  m_out->lm.trie.capacity = (size_t)h->da_cap;
+  m_out->lm.logp_uni = unigram;
+  m_out->lm.vocab_size = (uint32_t)h->vocab;
+  m_out->lm.bigram_key = (h->bigram_size > 0) ? bigram_key : NULL;
+  m_out->lm.logp_bi = (h->bigram_size > 0) ? logp_bi : NULL;
+  m_out->lm.bigram_size = h->bigram_size;
+  m_out->lm.unk_base = h->unk_base;
+  m_out->lm.unk_per_cp = h->unk_per_cp;
+  m_out->lambda0 = h->lambda0;
+
+  m_out->crf.trans00 = h->trans00;
+  m_out->crf.trans01 = h->trans01;
+  m_out->crf.trans10 = h->trans10;
+  m_out->crf.trans11 = h->trans11;
+  m_out->crf.bos_to1 = h->bos_to1;
+  m_out->crf.feat_key = (h->feat_count > 0) ? feat_key : NULL;
+  m_out->crf.feat_w = (h->feat_count > 0) ? feat_w : NULL;
+  m_out->crf.feat_count = h->feat_count;
+
+  /* v2: flags and cc */
+  m_out->flags = h->flags;
+  m_out->cc.mode = (npycrf_cc_mode_t)h->cc_mode;
+  m_out->cc.fallback = (npycrf_cc_mode_t)h->cc_fallback;
+  m_out->cc.ranges = (h->cc_range_count > 0) ? cc_ranges : NULL;
+  m_out->cc.range_count = h->cc_range_count;
+
+  /* v3: コードポイント単位トライ */
+  if (cp_map && hdr_cp_map_count(h) > 0) {
+    m_out->lm.cp_page = cp_map;
+    m_out->lm.cp_code = cp_map + NPYCRF_CP_PAGES;
+    m_out->lm.cp_npages = h->cp_npages;
+  }
+}
+
+static int model_check_save_args(const npycrf_model_t *m) {
   if (!m->lm.trie.base || !m->lm.trie.check || m->lm.trie.capacity == 0) return -2;
   if (!m->lm.logp_uni || m->lm.vocab_size == 0) return -3;
+  if (m->lm.bigram_size > 0 && (!m->lm.bigram_key || !m->lm.logp_bi)) return -4;
+  if (m->crf.feat_count > 0 && (!m->crf.feat_key || !m->crf.feat_w)) return -5;
+  if ((m->flags & NPYCRF_FLAG_TRIE_CP) && (!m->lm.cp_page || !m->lm.cp_code)) return -7;
+  return 0;
+}
 
-  FILE *f = fopen(path, "wb");
-  if (!f) return -10;
+/* npycrf_lm_compact() 済みのモデル（v4 として書けるのはこの形のみ） */
+static int model_check_compact_args(const npycrf_model_t *m) {
+  if (!m->lm.trie16 && (!m->lm.trie.base || !m->lm.trie.check)) return -2;
+  if (m->lm.trie.capacity == 0) return -2;
+  if (!m->lm.logp_uni_q8 || m->lm.vocab_size == 0) return -3;
+  if (m->lm.bigram_size > 0 && (!m->lm.bigram_blk || !m->lm.bigram_delta || !m->lm.logp_bi_q8)) return -4;
+  if (m->crf.feat_count > 0 && (!m->crf.feat_key || !m->crf.feat_w)) return -5;
+  if ((m->flags & NPYCRF_FLAG_TRIE_CP) && (!m->lm.cp_page || !m->lm.cp_code)) return -7;
+  return 0;
+}
 
-  /* --- header (v2) --- */
-  fwrite(MMJP_MODEL_MAGIC, 1, 8, f);
-  wr_u32(f, MMJP_MODEL_VERSION);
-  wr_u32(f, MMJP_DA_INDEX_BYTES);
+/* v2 と v3 で共通のスカラ部（magic/version を除く） */
+static void wr_scalars(FILE *f, const npycrf_model_t *m, uint32_t range_count, uint32_t da_index_bytes) {
+  wr_u32(f, da_index_bytes);
   wr_u32(f, (uint32_t)m->lm.trie.capacity);
   wr_u32(f, (uint32_t)m->lm.vocab_size);
   wr_u32(f, (uint32_t)m->max_word_len);
@@ -95,7 +321,36 @@ int mmjp_model_save_bin(const char *path, const npycrf_model_t *m) {
   /* 2バイトパディング */
   uint8_t pad2[2] = {0, 0};
   fwrite(pad2, 1, 2, f);
-  wr_u32(f, m->cc.range_count);
+  wr_u32(f, range_count);
+}
+
+static void wr_i16_array(FILE *f, const int16_t *a, size_t n) {
+  for (size_t i = 0; i < n; i++) wr_i16(f, a[i]);
+}
+
+static void wr_u32_array(FILE *f, const uint32_t *a, size_t n) {
+  for (size_t i = 0; i < n; i++) wr_u32(f, a[i]);
+}
+
+static void wr_cc_ranges(FILE *f, const npycrf_cc_range_t *r, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    wr_u32(f, r[i].lo);
+    wr_u32(f, r[i].hi);
+    uint8_t class_id = r[i].class_id;
+    fwrite(&class_id, 1, 1, f);
+    uint8_t pad3[3] = {0, 0, 0};
+    fwrite(pad3, 1, 3, f);
+  }
+}
+
+static int save_v2(FILE *f, const npycrf_model_t *m) {
+  uint32_t range_count = m->cc.ranges ? m->cc.range_count : 0u;
+  if (m->flags & NPYCRF_FLAG_TRIE_CP) return -8;  /* コードポイント単位トライは v3 のみ */
+
+  /* --- header (v2) --- */
+  fwrite(MMJP_MODEL_MAGIC_V2, 1, 8, f);
+  wr_u32(f, MMJP_MODEL_VERSION_V2);
+  wr_scalars(f, m, range_count, MMJP_DA_INDEX_BYTES);
 
   /* --- arrays --- */
   /* base/check: int32_t として保存 */
@@ -109,45 +364,472 @@ int mmjp_model_save_bin(const char *path, const npycrf_model_t *m) {
   }
 
   /* unigram logp Q8.8 */
-  fwrite(m->lm.logp_uni, sizeof(int16_t), m->lm.vocab_size, f);
+  wr_i16_array(f, m->lm.logp_uni, m->lm.vocab_size);
 
   /* bigram (optional) */
   if (m->lm.bigram_size > 0) {
-    if (!m->lm.bigram_key || !m->lm.logp_bi) {
-      fclose(f);
-      return -4;
-    }
-    fwrite(m->lm.bigram_key, sizeof(uint32_t), m->lm.bigram_size, f);
-    fwrite(m->lm.logp_bi, sizeof(int16_t), m->lm.bigram_size, f);
+    wr_u32_array(f, m->lm.bigram_key, m->lm.bigram_size);
+    wr_i16_array(f, m->lm.logp_bi, m->lm.bigram_size);
   }
 
   /* CRF features */
   if (m->crf.feat_count > 0) {
-    if (!m->crf.feat_key || !m->crf.feat_w) {
-      fclose(f);
-      return -5;
-    }
-    fwrite(m->crf.feat_key, sizeof(uint32_t), m->crf.feat_count, f);
-    fwrite(m->crf.feat_w, sizeof(int16_t), m->crf.feat_count, f);
+    wr_u32_array(f, m->crf.feat_key, m->crf.feat_count);
+    wr_i16_array(f, m->crf.feat_w, m->crf.feat_count);
   }
 
   /* v2: cc_ranges */
-  if (m->cc.range_count > 0 && m->cc.ranges) {
-    for (uint32_t i = 0; i < m->cc.range_count; i++) {
-      wr_u32(f, m->cc.ranges[i].lo);
-      wr_u32(f, m->cc.ranges[i].hi);
-      uint8_t class_id = m->cc.ranges[i].class_id;
-      fwrite(&class_id, 1, 1, f);
-      uint8_t pad3[3] = {0, 0, 0};
-      fwrite(pad3, 1, 3, f);
+  wr_cc_ranges(f, m->cc.ranges, range_count);
+  return 0;
+}
+
+static size_t align_up_sz(size_t v, size_t a) {
+  return (v + a - 1u) / a * a;
+}
+
+static void wr_zeros(FILE *f, size_t n) {
+  static const uint8_t zeros[MMJP_MODEL_V3_ALIGN] = {0};
+  while (n > 0) {
+    size_t k = (n < sizeof(zeros)) ? n : sizeof(zeros);
+    fwrite(zeros, 1, k, f);
+    n -= k;
+  }
+}
+
+static int model_is_compact(const npycrf_model_t *m) {
+  return m->lm.trie16 || m->lm.logp_uni_q8 || m->lm.bigram_blk;
+}
+
+/* version: 3 または 4（4 の場合 m は npycrf_lm_compact() 済み） */
+static int save_v3(FILE *f, const npycrf_model_t *m, uint32_t version) {
+  uint32_t range_count = m->cc.ranges ? m->cc.range_count : 0u;
+  size_t cap = m->lm.trie.capacity;
+  int compact = (version == MMJP_MODEL_VERSION_V4);
+  int narrow = compact && m->lm.trie16;
+  size_t delta_bytes = compact ? (size_t)m->lm.bigram_delta_bytes : 0u;
+  size_t logp_bytes = compact ? 1u : 2u;
+
+  /* section sizes (bytes) */
+  size_t sec_bytes[MMJP_V3_SEC_COUNT];
+  sec_bytes[MMJP_V3_SEC_BASE] = cap * 4u;
+  sec_bytes[MMJP_V3_SEC_CHECK] = narrow ? 0u : cap * 4u;
+  sec_bytes[MMJP_V3_SEC_UNIGRAM] = (size_t)m->lm.vocab_size * logp_bytes;
+  sec_bytes[MMJP_V3_SEC_BIGRAM_KEY] = compact ? (size_t)m->lm.bigram_nblk * 8u + delta_bytes
+                                              : (size_t)m->lm.bigram_size * 4u;
+  sec_bytes[MMJP_V3_SEC_BIGRAM_LOGP] = (size_t)m->lm.bigram_size * logp_bytes;
+  sec_bytes[MMJP_V3_SEC_FEAT_KEY] = (size_t)m->crf.feat_count * 4u;
+  sec_bytes[MMJP_V3_SEC_FEAT_W] = (size_t)m->crf.feat_count * 2u;
+  sec_bytes[MMJP_V3_SEC_CC_RANGES] = (size_t)range_count * MMJP_V3_CC_RANGE_BYTES;
+  uint32_t cp_npages = (m->flags & NPYCRF_FLAG_TRIE_CP) ? m->lm.cp_npages : 0u;
+  size_t cp_count = (m->flags & NPYCRF_FLAG_TRIE_CP) ? npycrf_cp_map_count(cp_npages) : 0u;
+  sec_bytes[MMJP_V3_SEC_CP_MAP] = cp_count * 2u;
+
+  /* section offsets (0 = empty) */
+  uint32_t sec_off[MMJP_V3_SEC_COUNT];
+  size_t pos = MMJP_MODEL_V3_HEADER_BYTES;
+  for (int s = 0; s < MMJP_V3_SEC_COUNT; s++) {
+    if (sec_bytes[s] == 0) {
+      sec_off[s] = 0;
+      continue;
     }
+    pos = align_up_sz(pos, MMJP_MODEL_V3_ALIGN);
+    if (pos + sec_bytes[s] > 0xFFFFFFFFu) return -6;
+    sec_off[s] = (uint32_t)pos;
+    pos += sec_bytes[s];
   }
+  size_t file_bytes = pos;
 
-  fclose(f);
+  /* --- header (v3/v4) --- */
+  fwrite(compact ? MMJP_MODEL_MAGIC_V4 : MMJP_MODEL_MAGIC_V3, 1, 8, f);
+  wr_u32(f, version);
+  wr_scalars(f, m, range_count, narrow ? 2u : MMJP_DA_INDEX_BYTES);
+  for (int s = 0; s < MMJP_V3_SEC_CP_MAP; s++) wr_u32(f, sec_off[s]);
+  wr_u32(f, (uint32_t)file_bytes);
+  wr_u32(f, sec_off[MMJP_V3_SEC_CP_MAP]);
+  wr_u32(f, cp_npages);
+  if (compact) {
+    wr_i16(f, m->lm.uni_q8.off);
+    wr_i16(f, (int16_t)m->lm.uni_q8.scale);
+    wr_i16(f, m->lm.bi_q8.off);
+    wr_i16(f, (int16_t)m->lm.bi_q8.scale);
+    wr_u32(f, m->lm.bigram_nblk);
+    wr_u32(f, (uint32_t)delta_bytes);
+  }
+  wr_zeros(f, MMJP_MODEL_V3_HEADER_BYTES - (compact ? MMJP_V4_OFF_DELTA_BYTES + 4u : MMJP_V3_OFF_CP_NPAGES + 4u));
+
+  /* --- sections --- */
+  pos = MMJP_MODEL_V3_HEADER_BYTES;
+  for (int s = 0; s < MMJP_V3_SEC_COUNT; s++) {
+    if (sec_bytes[s] == 0) continue;
+    wr_zeros(f, (size_t)sec_off[s] - pos);
+    switch (s) {
+      case MMJP_V3_SEC_BASE:
+        if (narrow) {
+          wr_i16_array(f, m->lm.trie16, cap * 2u);
+          break;
+        }
+        for (size_t i = 0; i < cap; i++) wr_u32(f, (uint32_t)(int32_t)m->lm.trie.base[i]);
+        break;
+      case MMJP_V3_SEC_CHECK:
+        for (size_t i = 0; i < cap; i++) wr_u32(f, (uint32_t)(int32_t)m->lm.trie.check[i]);
+        break;
+      case MMJP_V3_SEC_UNIGRAM:
+        if (compact) fwrite(m->lm.logp_uni_q8, 1, m->lm.vocab_size, f);
+        else wr_i16_array(f, m->lm.logp_uni, m->lm.vocab_size);
+        break;
+      case MMJP_V3_SEC_BIGRAM_KEY:
+        if (compact) {
+          wr_u32_array(f, m->lm.bigram_blk, (size_t)m->lm.bigram_nblk * 2u);
+          fwrite(m->lm.bigram_delta, 1, delta_bytes, f);
+        } else {
+          wr_u32_array(f, m->lm.bigram_key, m->lm.bigram_size);
+        }
+        break;
+      case MMJP_V3_SEC_BIGRAM_LOGP:
+        if (compact) fwrite(m->lm.logp_bi_q8, 1, m->lm.bigram_size, f);
+        else wr_i16_array(f, m->lm.logp_bi, m->lm.bigram_size);
+        break;
+      case MMJP_V3_SEC_FEAT_KEY:
+        wr_u32_array(f, m->crf.feat_key, m->crf.feat_count);
+        break;
+      case MMJP_V3_SEC_FEAT_W:
+        wr_i16_array(f, m->crf.feat_w, m->crf.feat_count);
+        break;
+      case MMJP_V3_SEC_CC_RANGES:
+        wr_cc_ranges(f, m->cc.ranges, range_count);
+        break;
+      case MMJP_V3_SEC_CP_MAP:
+        /* cp_page と cp_code は連続したセクションとして保存 */
+        for (size_t i = 0; i < NPYCRF_CP_PAGES; i++) wr_i16(f, (int16_t)m->lm.cp_page[i]);
+        for (size_t i = NPYCRF_CP_PAGES; i < cp_count; i++) {
+          wr_i16(f, (int16_t)m->lm.cp_code[i - NPYCRF_CP_PAGES]);
+        }
+        break;
+      default:
+        break;
+    }
+    pos = (size_t)sec_off[s] + sec_bytes[s];
+  }
   return 0;
 }
 
-int mmjp_model_load_bin(const char *path, mmjp_loaded_model_t *out) {
+/* コンパクト形式で保存（通常形式なら一時バッファに変換してから書く） */
+static int save_v4(FILE *f, const npycrf_model_t *m) {
+  if (model_is_compact(m)) return save_v3(f, m, MMJP_MODEL_VERSION_V4);
+
+  size_t bytes = npycrf_lm_compact_size(&m->lm);
+  if (bytes == 0) return -1;
+  void *buf = malloc(bytes);
+  if (!buf) return -20;
+  npycrf_model_t cm = *m;
+  int rc = npycrf_lm_compact(&m->lm, &cm.lm, buf, bytes);
+  if (rc == 0) rc = save_v3(f, &cm, MMJP_MODEL_VERSION_V4);
+  else rc = -4;
+  free(buf);
+  return rc;
+}
+
+int mmjp_model_save_bin_version(const char *path, const npycrf_model_t *m, uint32_t version) {
+  if (!path || !m) return -1;
+  int rc = (version == MMJP_MODEL_VERSION_V4 && model_is_compact(m)) ? model_check_compact_args(m)
+                                                                     : model_check_save_args(m);
+  if (rc != 0) return rc;
+  if (version != MMJP_MODEL_VERSION_V2 && version != MMJP_MODEL_VERSION_V3 &&
+      version != MMJP_MODEL_VERSION_V4) {
+    return -1;
+  }
+
+  /*
+   * 一時ファイルに書いてから rename で置き換える。
+   * v3/v4 は読み込み側が mmap するので、同じパスを上書き（切り詰め）すると
+   * 使用中のプロセスが SIGBUS で落ちる。rename なら既存の mmap は古い内容のまま有効。
+   */
+  size_t plen = strlen(path);
+  char *tmp = (char *)malloc(plen + 5u);
+  if (!tmp) return -10;
+  memcpy(tmp, path, plen);
+  memcpy(tmp + plen, ".tmp", 5u);
+
+  FILE *f = fopen(tmp, "wb");
+  if (!f) {
+    free(tmp);
+    return -10;
+  }
+
+  if (version == MMJP_MODEL_VERSION_V2) rc = save_v2(f, m);
+  else if (version == MMJP_MODEL_VERSION_V3) rc = save_v3(f, m, version);
+  else rc = save_v4(f, m);
+  /* 書き込みエラーはストリームに残るので、個々の fwrite の失敗もここで拾える */
+  if (ferror(f) && rc == 0) rc = -11;
+  if (fclose(f) != 0 && rc == 0) rc = -11;
+  if (rc == 0 && rename(tmp, path) != 0) rc = -11;
+  if (rc != 0) remove(tmp);
+  free(tmp);
+  return rc;
+}
+
+int mmjp_model_save_bin(const char *path, const npycrf_model_t *m) {
+  return mmjp_model_save_bin_version(path, m, MMJP_MODEL_VERSION);
+}
+
+/* =====================
+ * v3 読み込み（メモリ上のファイルイメージから）
+ * ===================== */
+
+static int host_is_little_endian(void) {
+  const uint16_t one = 1u;
+  return *(const uint8_t *)&one == 1u;
+}
+
+/* ファイルイメージを直接参照できるか（型幅とエンディアンが一致） */
+static int v3_zero_copy_ok(void) {
+  return host_is_little_endian() && sizeof(da_index_t) == 4u &&
+         sizeof(npycrf_cc_range_t) == MMJP_V3_CC_RANGE_BYTES;
+}
+
+/* v4 はゼロコピー専用（narrow: (base, check) が i16 組のトライ） */
+static int v4_zero_copy_ok(int narrow) {
+  return host_is_little_endian() && (narrow || sizeof(da_index_t) == 4u) &&
+         sizeof(npycrf_cc_range_t) == MMJP_V3_CC_RANGE_BYTES;
+}
+
+static int image_is_v4(const uint8_t *buf, size_t size) {
+  return size >= 8u && memcmp(buf, MMJP_MODEL_MAGIC_V4, 8) == 0;
+}
+
+/*
+ * buf[0..size) の v4 イメージのコンパクト形式セクションを out->m.lm に設定する。
+ * sec は load_v3_image() で範囲確認済み。
+ */
+static int load_v4_compact(const uint8_t *buf, const uint8_t *const *sec, const mmjp_hdr_t *h,
+                           size_t delta_bytes, int narrow, npycrf_lm_t *lm) {
+  lm->logp_uni = NULL;
+  lm->bigram_key = NULL;
+  lm->logp_bi = NULL;
+  lm->uni_q8.off = ld_i16(buf + MMJP_V4_OFF_UNI_Q8);
+  lm->uni_q8.scale = (uint16_t)ld_i16(buf + MMJP_V4_OFF_UNI_Q8 + 2u);
+  lm->bi_q8.off = ld_i16(buf + MMJP_V4_OFF_BI_Q8);
+  lm->bi_q8.scale = (uint16_t)ld_i16(buf + MMJP_V4_OFF_BI_Q8 + 2u);
+  if (lm->uni_q8.scale == 0 || (h->bigram_size > 0 && lm->bi_q8.scale == 0)) return -16;
+  lm->logp_uni_q8 = sec[MMJP_V3_SEC_UNIGRAM];
+
+  if (narrow) {
+    lm->trie.base = NULL;
+    lm->trie.check = NULL;
+    lm->trie16 = (const int16_t *)(const void *)sec[MMJP_V3_SEC_BASE];
+  }
+
+  if (h->bigram_size > 0) {
+    uint32_t nblk = ld_u32(buf + MMJP_V4_OFF_BIGRAM_NBLK);
+    if (nblk != (h->bigram_size + NPYCRF_BIGRAM_BLOCK - 1u) / NPYCRF_BIGRAM_BLOCK) return -29;
+    const uint32_t *blk = (const uint32_t *)(const void *)sec[MMJP_V3_SEC_BIGRAM_KEY];
+    const uint8_t *delta = sec[MMJP_V3_SEC_BIGRAM_KEY] + (size_t)nblk * 8u;
+    /* 差分列の中だけを読むこと: ブロック先頭は範囲内、最後のバイトは継続ビットなし */
+    for (uint32_t b = 0; b < nblk; b++) {
+      if (blk[2u * b + 1u] > delta_bytes) return -29;
+    }
+    if (delta_bytes > 0 && (delta[delta_bytes - 1u] & 0x80u)) return -29;
+    lm->bigram_blk = blk;
+    lm->bigram_delta = delta;
+    lm->bigram_nblk = nblk;
+    lm->bigram_delta_bytes = (uint32_t)delta_bytes;
+    lm->logp_bi_q8 = sec[MMJP_V3_SEC_BIGRAM_LOGP];
+  }
+  return 0;
+}
+
+/*
+ * buf[0..size) の v3/v4 イメージを解釈して out を設定する。
+ *
+ *  - zero_copy != 0: out->m のポインタは buf 内を指す（buf の寿命は呼び出し側管理）
+ *  - zero_copy == 0: owned ブロックへデコードしてコピー（v3 のみ）
+ */
+static int load_v3_image(const uint8_t *buf, size_t size, int zero_copy, mmjp_loaded_model_t *out) {
+  if (size < MMJP_MODEL_V3_HEADER_BYTES) return -13;
+  int v4 = image_is_v4(buf, size);
+  if (!v4 && memcmp(buf, MMJP_MODEL_MAGIC_V3, 8) != 0) return -12;
+  if (ld_u32(buf + 8) != (v4 ? MMJP_MODEL_VERSION_V4 : MMJP_MODEL_VERSION_V3)) return -14;
+  uint32_t da_index_bytes = ld_u32(buf + 12);
+  int narrow = v4 && da_index_bytes == 2u;
+  if (da_index_bytes != MMJP_DA_INDEX_BYTES && !narrow) return -15;
+  if (v4 && (!zero_copy || !v4_zero_copy_ok(narrow))) return -15;
+
+  mmjp_hdr_t h;
+  memset(&h, 0, sizeof(h));
+  h.da_cap = ld_u32(buf + 16);
+  h.vocab = ld_u32(buf + 20);
+  h.max_word_len = ld_u32(buf + 24);
+  if (h.da_cap < 2 || h.vocab == 0 || h.max_word_len == 0) return -16;
+  h.unk_base = ld_i16(buf + 28);
+  h.unk_per_cp = ld_i16(buf + 30);
+  h.lambda0 = ld_i16(buf + 32);
+  h.trans00 = ld_i16(buf + 34);
+  h.trans01 = ld_i16(buf + 36);
+  h.trans10 = ld_i16(buf + 38);
+  h.trans11 = ld_i16(buf + 40);
+  h.bos_to1 = ld_i16(buf + 42);
+  h.feat_count = ld_u32(buf + 44);
+  h.bigram_size = ld_u32(buf + 48);
+  h.flags = ld_u32(buf + 52);
+  h.cc_mode = buf[56];
+  h.cc_fallback = buf[57];
+  h.cc_range_count = ld_u32(buf + 60);
+  h.cp_npages = ld_u32(buf + MMJP_V3_OFF_CP_NPAGES);
+  if ((size_t)ld_u32(buf + MMJP_V3_OFF_FILE_BYTES) > size) return -19;
+  if (h.cp_npages >= NPYCRF_CP_PAGES) return -16;
+
+  /* section bounds/alignment */
+  size_t delta_bytes = v4 ? (size_t)ld_u32(buf + MMJP_V4_OFF_DELTA_BYTES) : 0u;
+  size_t logp_bytes = v4 ? 1u : 2u;
+  size_t sec_bytes[MMJP_V3_SEC_COUNT];
+  sec_bytes[MMJP_V3_SEC_BASE] = (size_t)h.da_cap * 4u;
+  sec_bytes[MMJP_V3_SEC_CHECK] = narrow ? 0u : (size_t)h.da_cap * 4u;
+  sec_bytes[MMJP_V3_SEC_UNIGRAM] = (size_t)h.vocab * logp_bytes;
+  sec_bytes[MMJP_V3_SEC_BIGRAM_KEY] = v4 ? (size_t)ld_u32(buf + MMJP_V4_OFF_BIGRAM_NBLK) * 8u + delta_bytes
+                                         : (size_t)h.bigram_size * 4u;
+  if (v4 && h.bigram_size == 0) sec_bytes[MMJP_V3_SEC_BIGRAM_KEY] = 0;
+  sec_bytes[MMJP_V3_SEC_BIGRAM_LOGP] = (size_t)h.bigram_size * logp_bytes;
+  sec_bytes[MMJP_V3_SEC_FEAT_KEY] = (size_t)h.feat_count * 4u;
+  sec_bytes[MMJP_V3_SEC_FEAT_W] = (size_t)h.feat_count * 2u;
+  sec_bytes[MMJP_V3_SEC_CC_RANGES] = (size_t)h.cc_range_count * MMJP_V3_CC_RANGE_BYTES;
+  size_t cp_count = hdr_cp_map_count(&h);
+  sec_bytes[MMJP_V3_SEC_CP_MAP] = cp_count * 2u;
+
+  const uint8_t *sec[MMJP_V3_SEC_COUNT];
+  for (int s = 0; s < MMJP_V3_SEC_COUNT; s++) {
+    size_t off = (size_t)ld_u32(buf + v3_sec_slot(s));
+    sec[s] = NULL;
+    if (sec_bytes[s] == 0) continue;
+    if (off < MMJP_MODEL_V3_HEADER_BYTES || (off % MMJP_MODEL_V3_ALIGN) != 0) return -29;
+    if (off > size || sec_bytes[s] > size - off) return -29;
+    sec[s] = buf + off;
+  }
+
+  /* cp_page は cp_code の範囲内を指すこと */
+  for (size_t i = 0; cp_count > 0 && i < NPYCRF_CP_PAGES; i++) {
+    if ((uint32_t)(uint16_t)ld_i16(sec[MMJP_V3_SEC_CP_MAP] + 2u * i) > h.cp_npages) return -29;
+  }
+
+  npycrf_model_t m_out;
+  if (zero_copy) {
+    model_setup(&h,
+                (const da_index_t *)(const void *)sec[MMJP_V3_SEC_BASE],
+                (const da_index_t *)(const void *)sec[MMJP_V3_SEC_CHECK],
+                (const int16_t *)(const void *)sec[MMJP_V3_SEC_UNIGRAM],
+                (const uint32_t *)(const void *)sec[MMJP_V3_SEC_BIGRAM_KEY],
+                (const int16_t *)(const void *)sec[MMJP_V3_SEC_BIGRAM_LOGP],
+                (const uint32_t *)(const void *)sec[MMJP_V3_SEC_FEAT_KEY],
+                (const int16_t *)(const void *)sec[MMJP_V3_SEC_FEAT_W],
+                (const npycrf_cc_range_t *)(const void *)sec[MMJP_V3_SEC_CC_RANGES],
+                (const uint16_t *)(const void *)sec[MMJP_V3_SEC_CP_MAP],
+                &m_out);
+    if (v4) {
+      int rc = load_v4_compact(buf, sec, &h, delta_bytes, narrow, &m_out.lm);
+      if (rc != 0) return rc;
+    }
+    out->m = m_out;
+    out->cc_ranges_owned = NULL;
+    out->cc_ranges_count = h.cc_range_count;
+    return 0;
+  }
+
+  /* --- copy path (BE host / non-int32 da_index_t) --- */
+  mmjp_tables_t t;
+  size_t bytes = 0;
+  uint8_t *mem = tables_alloc(&h, &t, &bytes);
+  if (!mem) return -20;
+
+  for (size_t i = 0; i < h.da_cap; i++) {
+    t.base[i] = (da_index_t)(int32_t)ld_u32(sec[MMJP_V3_SEC_BASE] + 4u * i);
+    t.check[i] = (da_index_t)(int32_t)ld_u32(sec[MMJP_V3_SEC_CHECK] + 4u * i);
+  }
+  for (size_t i = 0; i < h.vocab; i++) t.unigram[i] = ld_i16(sec[MMJP_V3_SEC_UNIGRAM] + 2u * i);
+  for (size_t i = 0; i < h.bigram_size; i++) {
+    t.bigram_key[i] = ld_u32(sec[MMJP_V3_SEC_BIGRAM_KEY] + 4u * i);
+    t.logp_bi[i] = ld_i16(sec[MMJP_V3_SEC_BIGRAM_LOGP] + 2u * i);
+  }
+  for (size_t i = 0; i < h.feat_count; i++) {
+    t.feat_key[i] = ld_u32(sec[MMJP_V3_SEC_FEAT_KEY] + 4u * i);
+    t.feat_w[i] = ld_i16(sec[MMJP_V3_SEC_FEAT_W] + 2u * i);
+  }
+  for (uint32_t i = 0; i < h.cc_range_count; i++) {
+    const uint8_t *r = sec[MMJP_V3_SEC_CC_RANGES] + (size_t)MMJP_V3_CC_RANGE_BYTES * i;
+    t.cc_ranges[i].lo = ld_u32(r);
+    t.cc_ranges[i].hi = ld_u32(r + 4);
+    t.cc_ranges[i].class_id = r[8];
+  }
+  for (size_t i = 0; i < cp_count; i++) {
+    t.cp_map[i] = (uint16_t)ld_i16(sec[MMJP_V3_SEC_CP_MAP] + 2u * i);
+  }
+
+  model_setup(&h, t.base, t.check, t.unigram, t.bigram_key, t.logp_bi,
+              t.feat_key, t.feat_w, t.cc_ranges, t.cp_map, &m_out);
+  out->m = m_out;
+  out->cc_ranges_owned = t.cc_ranges;
+  out->cc_ranges_count = h.cc_range_count;
+  out->owned = mem;
+  out->owned_bytes = bytes;
+  return 0;
+}
+
+/* v3: ファイル全体を1回の fread で読み、イメージを直接参照する */
+static int load_v3_file(FILE *f, mmjp_loaded_model_t *out) {
+  if (fseek(f, 0, SEEK_END) != 0) return -13;
+  long fsz = ftell(f);
+  if (fsz < (long)MMJP_MODEL_V3_HEADER_BYTES || fseek(f, 0, SEEK_SET) != 0) return -13;
+  size_t size = (size_t)fsz;
+
+  uint8_t *img = (uint8_t *)malloc(size);
+  if (!img) return -20;
+  if (fread(img, 1, size, f) != size) {
+    free(img);
+    return -21;
+  }
+
+  int zc = image_is_v4(img, size) ? 1 : v3_zero_copy_ok();
+  int rc = load_v3_image(img, size, zc, out);
+  if (rc != 0 || !zc) {
+    /* copy path keeps its own owned block */
+    free(img);
+    return rc;
+  }
+  out->owned = img;
+  out->owned_bytes = size;
+  return 0;
+}
+
+/* ロード済みモデルに検索用インデックスを付与（確保できなければ二分探索のまま） */
+static void model_build_indexes(mmjp_loaded_model_t *out) {
+  size_t bytes = npycrf_emit_table_size(NPYCRF_EMIT_NCLS_DEFAULT);
+  int16_t *tab = (int16_t *)malloc(bytes);
+  if (tab && npycrf_crf_compile_emit(&out->m.crf, tab, bytes, NPYCRF_EMIT_NCLS_DEFAULT) == 0) {
+    out->emit_tab_owned = tab;
+  } else {
+    free(tab);
+  }
+
+  bytes = npycrf_bigram_index_size(&out->m.lm);
+  if (bytes > 0) {
+    uint32_t *row = (uint32_t *)malloc(bytes);
+    if (row && npycrf_lm_build_bigram_index(&out->m.lm, row, bytes) == 0) {
+      out->bigram_row_owned = row;
+    } else {
+      free(row);
+    }
+  }
+
+  bytes = npycrf_term_index_size(&out->m.lm);
+  if (bytes > 0) {
+    npycrf_id_t *term = (npycrf_id_t *)malloc(bytes);
+    if (term && npycrf_lm_build_term_index(&out->m.lm, term, bytes) == 0) {
+      out->term_id_owned = term;
+    } else {
+      free(term);
+    }
+  }
+}
+
+static int model_load_bin(const char *path, mmjp_loaded_model_t *out) {
   if (!path || !out) return -1;
   memset(out, 0, sizeof(*out));
 
@@ -161,9 +843,14 @@ int mmjp_model_load_bin(const char *path, mmjp_loaded_model_t *out) {
     return -11;
   }
 
-  /* v1/v2 判定 */
+  /* v1/v2/v3/v4 判定 */
   int is_v1 = 0;
-  if (memcmp(magic, MMJP_MODEL_MAGIC, 8) == 0) {
+  if (memcmp(magic, MMJP_MODEL_MAGIC_V3, 8) == 0 || memcmp(magic, MMJP_MODEL_MAGIC_V4, 8) == 0) {
+    int rc = load_v3_file(f, out);
+    fclose(f);
+    if (rc != 0) memset(out, 0, sizeof(*out));
+    return rc;
+  } else if (memcmp(magic, MMJP_MODEL_MAGIC_V2, 8) == 0) {
     is_v1 = 0;  /* v2 */
   } else if (memcmp(magic, MMJP_MODEL_MAGIC_V1, 8) == 0) {
     is_v1 = 1;  /* v1 */
@@ -172,9 +859,12 @@ int mmjp_model_load_bin(const char *path, mmjp_loaded_model_t *out) {
     return -12;
   }
 
-  uint32_t version = 0, da_index_bytes = 0, da_cap = 0, vocab = 0, max_word_len = 0;
-  if (!rd_u32(f, &version) || !rd_u32(f, &da_index_bytes) || !rd_u32(f, &da_cap) || !rd_u32(f, &vocab) ||
-      !rd_u32(f, &max_word_len)) {
+  mmjp_hdr_t h;
+  memset(&h, 0, sizeof(h));
+
+  uint32_t version = 0, da_index_bytes = 0;
+  if (!rd_u32(f, &version) || !rd_u32(f, &da_index_bytes) || !rd_u32(f, &h.da_cap) || !rd_u32(f, &h.vocab) ||
+      !rd_u32(f, &h.max_word_len)) {
     fclose(f);
     return -13;
   }
@@ -184,7 +874,7 @@ int mmjp_model_load_bin(const char *path, mmjp_loaded_model_t *out) {
       return -14;
     }
   } else {
-    if (version != MMJP_MODEL_VERSION) {
+    if (version != MMJP_MODEL_VERSION_V2) {
       fclose(f);
       return -14;
     }
@@ -193,38 +883,33 @@ int mmjp_model_load_bin(const char *path, mmjp_loaded_model_t *out) {
     fclose(f);
     return -15;
   }
-  if (da_cap < 2 || vocab == 0 || max_word_len == 0) {
+  if (h.da_cap < 2 || h.vocab == 0 || h.max_word_len == 0) {
     fclose(f);
     return -16;
   }
 
-  int16_t unk_base = 0, unk_per_cp = 0, lambda0 = 0;
-  if (!rd_i16(f, &unk_base) || !rd_i16(f, &unk_per_cp) || !rd_i16(f, &lambda0)) {
+  if (!rd_i16(f, &h.unk_base) || !rd_i16(f, &h.unk_per_cp) || !rd_i16(f, &h.lambda0)) {
     fclose(f);
     return -17;
   }
 
-  int16_t trans00 = 0, trans01 = 0, trans10 = 0, trans11 = 0, bos_to1 = 0;
-  if (!rd_i16(f, &trans00) || !rd_i16(f, &trans01) || !rd_i16(f, &trans10) || !rd_i16(f, &trans11) ||
-      !rd_i16(f, &bos_to1)) {
+  if (!rd_i16(f, &h.trans00) || !rd_i16(f, &h.trans01) || !rd_i16(f, &h.trans10) || !rd_i16(f, &h.trans11) ||
+      !rd_i16(f, &h.bos_to1)) {
     fclose(f);
     return -18;
   }
 
-  uint32_t feat_count = 0, bigram_size = 0;
-  if (!rd_u32(f, &feat_count) || !rd_u32(f, &bigram_size)) {
+  if (!rd_u32(f, &h.feat_count) || !rd_u32(f, &h.bigram_size)) {
     fclose(f);
     return -19;
   }
 
   /* v2: flags, cc_mode, cc_fallback, cc_range_count */
-  uint32_t flags = 0;
-  uint8_t cc_mode = (uint8_t)NPYCRF_CC_MODE_UTF8LEN;
-  uint8_t cc_fallback = (uint8_t)NPYCRF_CC_MODE_ASCII;
-  uint32_t cc_range_count = 0;
+  h.cc_mode = (uint8_t)NPYCRF_CC_MODE_UTF8LEN;
+  h.cc_fallback = (uint8_t)NPYCRF_CC_MODE_ASCII;
 
   if (!is_v1) {
-    if (!rd_u32(f, &flags)) {
+    if (!rd_u32(f, &h.flags)) {
       fclose(f);
       return -19;
     }
@@ -233,10 +918,15 @@ int mmjp_model_load_bin(const char *path, mmjp_loaded_model_t *out) {
       fclose(f);
       return -19;
     }
-    cc_mode = buf4[0];
-    cc_fallback = buf4[1];
+    h.cc_mode = buf4[0];
+    h.cc_fallback = buf4[1];
     /* buf4[2], buf4[3] はパディング */
-    if (!rd_u32(f, &cc_range_count)) {
+    if (!rd_u32(f, &h.cc_range_count)) {
+      fclose(f);
+      return -19;
+    }
+    if (h.flags & NPYCRF_FLAG_TRIE_CP) {
+      /* コードポイント単位トライは v3 のみ */
       fclose(f);
       return -19;
     }
@@ -244,99 +934,60 @@ int mmjp_model_load_bin(const char *path, mmjp_loaded_model_t *out) {
 
   /* --- allocate owned block --- */
   /* base/check int32 -> da_index_t (assume int32 in CLI build) */
+  mmjp_tables_t t;
   size_t bytes = 0;
-  bytes += (size_t)da_cap * sizeof(da_index_t);  /* base */
-  bytes += (size_t)da_cap * sizeof(da_index_t);  /* check */
-  bytes += (size_t)vocab * sizeof(int16_t);      /* unigram */
-  bytes += (size_t)bigram_size * sizeof(uint32_t);
-  bytes += (size_t)bigram_size * sizeof(int16_t);
-  bytes += (size_t)feat_count * sizeof(uint32_t);
-  bytes += (size_t)feat_count * sizeof(int16_t);
-  bytes += (size_t)cc_range_count * sizeof(npycrf_cc_range_t);  /* v2: cc_ranges */
-
-  uint8_t *mem = (uint8_t *)malloc(bytes);
+  uint8_t *mem = tables_alloc(&h, &t, &bytes);
   if (!mem) {
     fclose(f);
     return -20;
   }
-  memset(mem, 0, bytes);
-
-  uint8_t *p = mem;
-  da_index_t *base = (da_index_t *)p;
-  p += (size_t)da_cap * sizeof(da_index_t);
-  da_index_t *check = (da_index_t *)p;
-  p += (size_t)da_cap * sizeof(da_index_t);
-  int16_t *unigram = (int16_t *)p;
-  p += (size_t)vocab * sizeof(int16_t);
-  uint32_t *bigram_key = NULL;
-  int16_t *logp_bi = NULL;
-  if (bigram_size > 0) {
-    bigram_key = (uint32_t *)p;
-    p += (size_t)bigram_size * sizeof(uint32_t);
-    logp_bi = (int16_t *)p;
-    p += (size_t)bigram_size * sizeof(int16_t);
-  }
-  uint32_t *feat_key = NULL;
-  int16_t *feat_w = NULL;
-  if (feat_count > 0) {
-    feat_key = (uint32_t *)p;
-    p += (size_t)feat_count * sizeof(uint32_t);
-    feat_w = (int16_t *)p;
-    p += (size_t)feat_count * sizeof(int16_t);
-  }
-
-  npycrf_cc_range_t *cc_ranges = NULL;
-  if (cc_range_count > 0) {
-    cc_ranges = (npycrf_cc_range_t *)p;
-    p += (size_t)cc_range_count * sizeof(npycrf_cc_range_t);
-  }
 
   /* --- read arrays --- */
-  for (size_t i = 0; i < da_cap; i++) {
+  for (size_t i = 0; i < h.da_cap; i++) {
     uint32_t u = 0;
     if (!rd_u32(f, &u)) {
       free(mem);
       fclose(f);
       return -21;
     }
-    base[i] = (da_index_t)(int32_t)u;
+    t.base[i] = (da_index_t)(int32_t)u;
   }
-  for (size_t i = 0; i < da_cap; i++) {
+  for (size_t i = 0; i < h.da_cap; i++) {
     uint32_t u = 0;
     if (!rd_u32(f, &u)) {
       free(mem);
       fclose(f);
       return -22;
     }
-    check[i] = (da_index_t)(int32_t)u;
+    t.check[i] = (da_index_t)(int32_t)u;
   }
 
-  if (fread(unigram, sizeof(int16_t), vocab, f) != vocab) {
+  if (fread(t.unigram, sizeof(int16_t), h.vocab, f) != h.vocab) {
     free(mem);
     fclose(f);
     return -23;
   }
 
-  if (bigram_size > 0) {
-    if (fread(bigram_key, sizeof(uint32_t), bigram_size, f) != bigram_size) {
+  if (h.bigram_size > 0) {
+    if (fread(t.bigram_key, sizeof(uint32_t), h.bigram_size, f) != h.bigram_size) {
       free(mem);
       fclose(f);
       return -24;
     }
-    if (fread(logp_bi, sizeof(int16_t), bigram_size, f) != bigram_size) {
+    if (fread(t.logp_bi, sizeof(int16_t), h.bigram_size, f) != h.bigram_size) {
       free(mem);
       fclose(f);
       return -25;
     }
   }
 
-  if (feat_count > 0) {
-    if (fread(feat_key, sizeof(uint32_t), feat_count, f) != feat_count) {
+  if (h.feat_count > 0) {
+    if (fread(t.feat_key, sizeof(uint32_t), h.feat_count, f) != h.feat_count) {
       free(mem);
       fclose(f);
       return -26;
     }
-    if (fread(feat_w, sizeof(int16_t), feat_count, f) != feat_count) {
+    if (fread(t.feat_w, sizeof(int16_t), h.feat_count, f) != h.feat_count) {
       free(mem);
       fclose(f);
       return -27;
@@ -344,8 +995,8 @@ int mmjp_model_load_bin(const char *path, mmjp_loaded_model_t *out) {
   }
 
   /* v2: cc_ranges */
-  if (!is_v1 && cc_range_count > 0 && cc_ranges) {
-    for (uint32_t i = 0; i < cc_range_count; i++) {
+  if (!is_v1 && h.cc_range_count > 0 && t.cc_ranges) {
+    for (uint32_t i = 0; i < h.cc_range_count; i++) {
       uint32_t lo = 0, hi = 0;
       uint8_t buf4[4];
       if (!rd_u32(f, &lo) || !rd_u32(f, &hi)) {
@@ -358,12 +1009,12 @@ int mmjp_model_load_bin(const char *path, mmjp_loaded_model_t *out) {
         fclose(f);
         return -28;
       }
-      cc_ranges[i].lo = lo;
-      cc_ranges[i].hi = hi;
-      cc_ranges[i].class_id = buf4[0];
-      cc_ranges[i]._pad[0] = 0;
-      cc_ranges[i]._pad[1] = 0;
-      cc_ranges[i]._pad[2] = 0;
+      t.cc_ranges[i].lo = lo;
+      t.cc_ranges[i].hi = hi;
+      t.cc_ranges[i].class_id = buf4[0];
+      t.cc_ranges[i]._pad[0] = 0;
+      t.cc_ranges[i]._pad[1] = 0;
+      t.cc_ranges[i]._pad[2] = 0;
     }
   }
 
@@ -371,48 +1022,95 @@ int mmjp_model_load_bin(const char *path, mmjp_loaded_model_t *out) {
 
   /* --- setup model pointers --- */
   npycrf_model_t m_out;
-  memset(&m_out, 0, sizeof(m_out));
-
-  m_out.max_word_len = (uint16_t)max_word_len;
-
-  m_out.lm.trie.base = base;
-  m_out.lm.trie.check = check;
-  m_out.lm.trie.capacity = (size_t)da_cap;
-  m_out.lm.logp_uni = unigram;
-  m_out.lm.vocab_size = (uint32_t)vocab;
-  m_out.lm.bigram_key = bigram_key;
-  m_out.lm.logp_bi = logp_bi;
-  m_out.lm.bigram_size = bigram_size;
-  m_out.lm.unk_base = unk_base;
-  m_out.lm.unk_per_cp = unk_per_cp;
-  m_out.lambda0 = lambda0;
-
-  m_out.crf.trans00 = trans00;
-  m_out.crf.trans01 = trans01;
-  m_out.crf.trans10 = trans10;
-  m_out.crf.trans11 = trans11;
-  m_out.crf.bos_to1 = bos_to1;
-  m_out.crf.feat_key = feat_key;
-  m_out.crf.feat_w = feat_w;
-  m_out.crf.feat_count = feat_count;
-
-  /* v2: flags and cc */
-  m_out.flags = flags;
-  m_out.cc.mode = (npycrf_cc_mode_t)cc_mode;
-  m_out.cc.fallback = (npycrf_cc_mode_t)cc_fallback;
-  m_out.cc.ranges = cc_ranges;
-  m_out.cc.range_count = cc_range_count;
+  model_setup(&h, t.base, t.check, t.unigram, t.bigram_key, t.logp_bi,
+              t.feat_key, t.feat_w, t.cc_ranges, NULL, &m_out);
 
   out->m = m_out;
-  out->cc_ranges_owned = cc_ranges;
-  out->cc_ranges_count = cc_range_count;
+  out->cc_ranges_owned = t.cc_ranges;
+  out->cc_ranges_count = h.cc_range_count;
   out->owned = mem;
   out->owned_bytes = bytes;
   return 0;
 }
 
+static int model_map_bin(const char *path, mmjp_loaded_model_t *out) {
+  if (!path || !out) return -1;
+#ifdef MMJP_HAVE_MMAP
+  memset(out, 0, sizeof(*out));
+  if (!v3_zero_copy_ok()) return model_load_bin(path, out);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return -10;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)MMJP_MODEL_V3_HEADER_BYTES) {
+    close(fd);
+    /* 小さすぎるファイルは v1/v2 かもしれないので通常ロードに任せる */
+    return model_load_bin(path, out);
+  }
+  size_t size = (size_t)st.st_size;
+  void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) return model_load_bin(path, out);
+
+  if (memcmp(addr, MMJP_MODEL_MAGIC_V3, 8) != 0 && memcmp(addr, MMJP_MODEL_MAGIC_V4, 8) != 0) {
+    /* v1/v2: 整列されていないのでコピー読み込み */
+    munmap(addr, size);
+    return model_load_bin(path, out);
+  }
+
+  int rc = load_v3_image((const uint8_t *)addr, size, 1, out);
+  if (rc != 0) {
+    munmap(addr, size);
+    memset(out, 0, sizeof(*out));
+    return rc;
+  }
+  out->mapped = addr;
+  out->mapped_bytes = size;
+  return 0;
+#else
+  return model_load_bin(path, out);
+#endif
+}
+
+int mmjp_model_load_bin(const char *path, mmjp_loaded_model_t *out) {
+  int rc = model_load_bin(path, out);
+  if (rc == 0) model_build_indexes(out);
+  return rc;
+}
+
+int mmjp_model_map_bin(const char *path, mmjp_loaded_model_t *out) {
+  int rc = model_map_bin(path, out);
+  if (rc == 0) model_build_indexes(out);
+  return rc;
+}
+
+int mmjp_model_compact(mmjp_loaded_model_t *m) {
+  if (!m) return -1;
+  if (model_is_compact(&m->m)) return 0;
+  size_t bytes = npycrf_lm_compact_size(&m->m.lm);
+  if (bytes == 0) return -1;
+  void *buf = malloc(bytes);
+  if (!buf) return -20;
+  npycrf_lm_t lm;
+  int rc = npycrf_lm_compact(&m->m.lm, &lm, buf, bytes);
+  if (rc != 0) {
+    free(buf);
+    return rc;
+  }
+  m->m.lm = lm;
+  m->compact_owned = buf;
+  return 0;
+}
+
 void mmjp_model_free(mmjp_loaded_model_t *m) {
   if (!m) return;
+#ifdef MMJP_HAVE_MMAP
+  if (m->mapped) munmap(m->mapped, m->mapped_bytes);
+#endif
   free(m->owned);
+  free(m->emit_tab_owned);
+  free(m->bigram_row_owned);
+  free(m->term_id_owned);
+  free(m->compact_owned);
   memset(m, 0, sizeof(*m));
 }
@@ -30,8 +30,40 @@ extern "C" {
 #define MMJP_MODEL_VERSION_V1 1u
 
 /* v2: 言語非依存化（flags, cc_mode, cc_ranges） */
-#define MMJP_MODEL_MAGIC "MMJPv2\0\0" /* 8 bytes */
-#define MMJP_MODEL_VERSION 2u
+#define MMJP_MODEL_MAGIC_V2 "MMJPv2\0\0" /* 8 bytes */
+#define MMJP_MODEL_VERSION_V2 2u
+
+/*
+ * v3: セクション整列フォーマット（mmap でゼロコピー参照可能）
+ *
+ *  - 固定長ヘッダ（MMJP_MODEL_V3_HEADER_BYTES）に v2 と同じスカラ値と
+ *    各配列セクションのファイル先頭からのオフセットを格納。
+ *  - 各セクションは MMJP_MODEL_V3_ALIGN バイト境界に整列し、
+ *    メモリ上の型（int32 base/check, int16 logp, uint32 key,
+ *    npycrf_cc_range_t）と同じ little-endian レイアウトで格納。
+ *  - ファイルサイズは 4GB 未満（オフセットは uint32）。
+ */
+#define MMJP_MODEL_MAGIC_V3 "MMJPv3\0\0" /* 8 bytes */
+#define MMJP_MODEL_VERSION_V3 3u
+#define MMJP_MODEL_V3_HEADER_BYTES 128u
+#define MMJP_MODEL_V3_ALIGN 64u
+
+/*
+ * v4: コンパクトフォーマット（npycrf_lm_compact() の形式をそのまま格納）
+ *
+ *  - ヘッダとセクション整列は v3 と同じ。トライは使用中のノードまでに詰め、
+ *    全要素が int16 に収まれば (base, check) の int16 組（da_index_bytes=2）。
+ *  - ユニグラム/バイグラムの対数確率は 8bit 量子化（表ごとの off/scale はヘッダ後半）。
+ *  - バイグラムキーはブロック索引 + キー差分（LEB128）。
+ *  - 推論はこの形のまま行う（展開しない）。ゼロコピー前提のため
+ *    little-endian ホストでのみ読み込める（それ以外は -15）。
+ */
+#define MMJP_MODEL_MAGIC_V4 "MMJPv4\0\0" /* 8 bytes */
+#define MMJP_MODEL_VERSION_V4 4u
+
+/* 保存時の既定フォーマット */
+#define MMJP_MODEL_MAGIC MMJP_MODEL_MAGIC_V3
+#define MMJP_MODEL_VERSION MMJP_MODEL_VERSION_V3
 
 typedef struct {
   npycrf_model_t m;
@@ -43,6 +75,18 @@ typedef struct {
   /* 所有バッファ（free 対象）。load した場合のみ非NULL。 */
   void *owned;
   size_t owned_bytes;
+
+  /* mmap 領域（munmap 対象）。mmjp_model_map_bin() でゼロコピーした場合のみ非NULL。 */
+  void *mapped;
+  size_t mapped_bytes;
+
+  /* ロード時に生成した高速化インデックス（free 対象、確保失敗時は NULL で二分探索のまま） */
+  int16_t *emit_tab_owned;     /* 密な放射テーブル */
+  uint32_t *bigram_row_owned;  /* バイグラム行インデックス */
+  npycrf_id_t *term_id_owned;  /* 終端IDインデックス */
+
+  /* mmjp_model_compact() で生成したコンパクト形式の配列（free 対象） */
+  void *compact_owned;
 } mmjp_loaded_model_t;
 
 /*
@@ -53,6 +97,18 @@ typedef struct {
  */
 int mmjp_model_save_bin(const char *path, const npycrf_model_t *m);
 
+/*
+ * フォーマットを指定して保存（version: 2, 3 または 4）
+ *
+ *  - 2: 旧ツールとの互換用
+ *  - 3: mmap 可能な整列フォーマット（mmjp_model_save_bin の既定）
+ *  - 4: コンパクトフォーマット（通常形式の m は保存時に変換、コンパクト形式の m はそのまま）
+ *
+ * コンパクト形式の m（trie16/logp_uni_q8 など）は 4 でのみ保存できる。
+ * path + ".tmp" に書いてから rename するので、path を mmap 中のプロセスは影響を受けない。
+ */
+int mmjp_model_save_bin_version(const char *path, const npycrf_model_t *m, uint32_t version);
+
 /*
  * バイナリ読み込み（CLI用）
  *
@@ -60,6 +116,28 @@ int mmjp_model_save_bin(const char *path, const npycrf_model_t *m);
  *  - 使い終わったら mmjp_model_free() を呼んでください。
  */
 int mmjp_model_load_bin(const char *path, mmjp_loaded_model_t *out);
+
+/*
+ * mmap 読み込み（v3, CLI/サーバ用）
+ *
+ *  - v3 ファイルを読み取り専用で mmap し、out->m のポインタを
+ *    マッピング内の各セクションに直接向けます（コピーなし）。
+ *    同じモデルを開く複数プロセスはページキャッシュを共有します。
+ *  - v1/v2、big-endian ホスト、mmap 非対応環境（MMJP_NO_MMAP / _WIN32）では
+ *    mmjp_model_load_bin() にフォールバックします。
+ *  - 解放は mmjp_model_free() で共通です。
+ */
+int mmjp_model_map_bin(const char *path, mmjp_loaded_model_t *out);
+
+/*
+ * ロード済みモデルをコンパクト形式に変換（npycrf_lm_compact()）
+ *
+ *  - 既にコンパクト形式（v4 を読んだ場合など）なら何もしない。
+ *  - 元の配列は解放しない（int16 に収まらないトライはそのまま参照する）。
+ *
+ * @return 0=成功, -1=変換不可, -20=確保失敗, その他=npycrf_lm_compact() のエラー
+ */
+int mmjp_model_compact(mmjp_loaded_model_t *m);
 void mmjp_model_free(mmjp_loaded_model_t *m);
 
 #ifdef __cplusplus
@@ -6,153 +6,37 @@
  *  - または引数に文字列を渡して1回だけ実行
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#include "mmjp_model.h"
-#include "../mmjp_lossless.h"
-
-
-/* =====================
- * UTF-8 normalize (CLI side)
- *  - normalize to canonical UTF-8 (avoid overlong sequences)
- *  - invalid sequences -> fallback char
- *
- * NOTE: This is mainly to make it possible to tokenize imperfect corpora dumps.
- * For normal UTF-8 input, output is identical.
- * ===================== */
-
-static int utf8_decode1_cli(const uint8_t *s, size_t len, size_t pos, uint32_t *out_cp, size_t *out_adv) {
-  if (!s || pos >= len) return 0;
-  uint8_t b0 = s[pos];
-  if (b0 < 0x80u) {
-    *out_cp = b0;
-    *out_adv = 1;
-    return 1;
-  }
-  if ((b0 & 0xE0u) == 0xC0u) {
-    if (pos + 2 > len) return 0;
-    uint8_t b1 = s[pos + 1];
-    if ((b1 & 0xC0u) != 0x80u) return 0;
-    *out_cp = ((uint32_t)(b0 & 0x1Fu) << 6) | (uint32_t)(b1 & 0x3Fu);
-    *out_adv = 2;
-    return 1;
-  }
-  if ((b0 & 0xF0u) == 0xE0u) {
-    if (pos + 3 > len) return 0;
-    uint8_t b1 = s[pos + 1], b2 = s[pos + 2];
-    if ((b1 & 0xC0u) != 0x80u || (b2 & 0xC0u) != 0x80u) return 0;
-    *out_cp = ((uint32_t)(b0 & 0x0Fu) << 12) | ((uint32_t)(b1 & 0x3Fu) << 6) | (uint32_t)(b2 & 0x3Fu);
-    *out_adv = 3;
-    return 1;
-  }
-  if ((b0 & 0xF8u) == 0xF0u) {
-    if (pos + 4 > len) return 0;
-    uint8_t b1 = s[pos + 1], b2 = s[pos + 2], b3 = s[pos + 3];
-    if ((b1 & 0xC0u) != 0x80u || (b2 & 0xC0u) != 0x80u || (b3 & 0xC0u) != 0x80u) return 0;
-    *out_cp = ((uint32_t)(b0 & 0x07u) << 18) | ((uint32_t)(b1 & 0x3Fu) << 12) | ((uint32_t)(b2 & 0x3Fu) << 6) | (uint32_t)(b3 & 0x3Fu);
-    *out_adv = 4;
-    return 1;
-  }
-  return 0;
-}
+#ifndef MMJP_NO_THREADS
+#include <pthread.h>
+#endif
 
-static size_t utf8_encode1_cli(uint32_t cp, uint8_t out[4]) {
-  if (cp <= 0x7Fu) {
-    out[0] = (uint8_t)cp;
-    return 1;
-  }
-  if (cp <= 0x7FFu) {
-    out[0] = (uint8_t)(0xC0u | ((cp >> 6) & 0x1Fu));
-    out[1] = (uint8_t)(0x80u | (cp & 0x3Fu));
-    return 2;
-  }
-  if (cp <= 0xFFFFu) {
-    out[0] = (uint8_t)(0xE0u | ((cp >> 12) & 0x0Fu));
-    out[1] = (uint8_t)(0x80u | ((cp >> 6) & 0x3Fu));
-    out[2] = (uint8_t)(0x80u | (cp & 0x3Fu));
-    return 3;
-  }
-  out[0] = (uint8_t)(0xF0u | ((cp >> 18) & 0x07u));
-  out[1] = (uint8_t)(0x80u | ((cp >> 12) & 0x3Fu));
-  out[2] = (uint8_t)(0x80u | ((cp >> 6) & 0x3Fu));
-  out[3] = (uint8_t)(0x80u | (cp & 0x3Fu));
-  return 4;
-}
-
-static int normalize_utf8_canonical(const uint8_t *in, size_t in_len, uint32_t fallback_cp,
-                                   uint8_t **out, size_t *out_cap, size_t *out_len) {
-  if (!in || !out || !out_cap || !out_len) return 0;
-  uint8_t fb[4];
-  size_t fb_len = utf8_encode1_cli(fallback_cp, fb);
-
-  if (*out_cap < in_len + 1) {
-    size_t nc = (*out_cap == 0) ? 256 : (*out_cap);
-    while (nc < in_len + 1) nc *= 2;
-    uint8_t *nb = (uint8_t *)realloc(*out, nc);
-    if (!nb) return 0;
-    *out = nb;
-    *out_cap = nc;
-  }
-
-  size_t pos = 0;
-  size_t op = 0;
-  while (pos < in_len) {
-    uint32_t cp = 0;
-    size_t adv = 0;
-    int ok = utf8_decode1_cli(in, in_len, pos, &cp, &adv);
-    if (!ok || adv == 0) {
-      if (op + fb_len + 1 > *out_cap) {
-        size_t nc = (*out_cap) * 2;
-        while (nc < op + fb_len + 1) nc *= 2;
-        uint8_t *nb = (uint8_t *)realloc(*out, nc);
-        if (!nb) return 0;
-        *out = nb;
-        *out_cap = nc;
-      }
-      memcpy(*out + op, fb, fb_len);
-      op += fb_len;
-      pos += 1;
-      continue;
-    }
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <unistd.h>
+#define TOK_HAVE_READ 1
+#endif
 
-    /* invalid Unicode scalar -> fallback */
-    if (cp > 0x10FFFFu || (cp >= 0xD800u && cp <= 0xDFFFu)) {
-      if (op + fb_len + 1 > *out_cap) {
-        size_t nc = (*out_cap) * 2;
-        while (nc < op + fb_len + 1) nc *= 2;
-        uint8_t *nb = (uint8_t *)realloc(*out, nc);
-        if (!nb) return 0;
-        *out = nb;
-        *out_cap = nc;
-      }
-      memcpy(*out + op, fb, fb_len);
-      op += fb_len;
-      pos += adv;
-      continue;
-    }
+#if !defined(MMJP_NO_THREADS) && defined(TOK_HAVE_READ)
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#define TOK_HAVE_SERVE 1
+#endif
 
-    /* canonical encode (this also removes overlong sequences) */
-    uint8_t enc[4];
-    size_t enc_len = utf8_encode1_cli(cp, enc);
-    if (op + enc_len + 1 > *out_cap) {
-      size_t nc = (*out_cap) * 2;
-      while (nc < op + enc_len + 1) nc *= 2;
-      uint8_t *nb = (uint8_t *)realloc(*out, nc);
-      if (!nb) return 0;
-      *out = nb;
-      *out_cap = nc;
-    }
-    memcpy(*out + op, enc, enc_len);
-    op += enc_len;
-    pos += adv;
-  }
+#include "mmjp_model.h"
+#include "mmjp_cache.h"
+#include "../mmjp_lossless.h"
 
-  (*out)[op] = 0;
-  *out_len = op;
-  return 1;
-}
 
 static void usage(const char *prog) {
   fprintf(stderr,
@@ -166,10 +50,17 @@ static void usage(const char *prog) {
           "  --max_line_bytes N    skip lines longer than this (default: 16384)\n"
           "  --no_normalize        do not normalize UTF-8 (CLI side)\n"
           "  --fallback_char C     fallback ASCII char for invalid UTF-8 (default: ?)\n"
+          "  --threads N           worker threads for stdin line mode (default: 1)\n"
+          "  --output FMT          text | ids | spans (default: text)\n"
+          "  --cache N             cache 1-best results of up to N distinct lines (default: 0=off)\n"
+          "  --throughput          print input bytes, lines and MB/s to stderr at exit\n"
+          "  --stats               print decoder counters to stderr at exit (NPYCRF_STATS build)\n"
           "\n"
           "Lossless tokenization:\n"
           "  --lossless_ws N       -1=auto (from model), 0=off, 1=on (default: -1)\n"
           "  --read_all 1          read all stdin as one text (include newlines)\n"
+          "  --stream_window N     --read_all 1-best: force a commit after N undecided\n"
+          "                        codepoints (default: 8192; output is exact unless hit)\n"
           "  --detok               detokenize mode (token stream -> original text)\n"
           "\n"
           "Stochastic tokenization (Subword Regularization):\n"
@@ -181,11 +72,31 @@ static void usage(const char *prog) {
           "  --nbest N             output N-best segmentations (one per line)\n"
           "  --sample_nbest N      sample 1 segmentation from top-N (uniform)\n"
           "\n"
+          "Server mode:\n"
+          "  --serve PATH          keep the model loaded and answer framed requests on the\n"
+          "                        Unix socket PATH (\"-\" = stdin/stdout) until SIGINT/SIGTERM\n"
+          "\n"
           "Notes:\n"
           "  - --sample / --sample_nbest are intended for dataset augmentation.\n"
           "  - --nbest is mainly for debugging/analysis.\n"
           "  - --lossless_ws 1 encodes spaces as meta-chars for lossless round-trip.\n"
-          "  - --detok restores original text from lossless token stream.\n");
+          "  - --detok restores original text from lossless token stream.\n"
+          "  - --threads keeps output in input line order (same bytes as --threads 1).\n"
+          "  - --cache skips decoding for repeated lines (shared by all --threads workers);\n"
+          "    hit/miss counters are printed to stderr at exit.\n"
+          "  - --output ids writes binary records instead of text: per line a uint32\n"
+          "    little-endian token count, then that many uint16 little-endian piece IDs\n"
+          "    (65535 = not in the vocabulary).\n"
+          "  - --output spans prints each token as START:END byte offsets into the\n"
+          "    original input line (before lossless encoding / normalization);\n"
+          "    with --read_all the whole input is decoded in memory.\n"
+          "  - --serve request: uint32 LE payload length, uint8 op, payload (one line);\n"
+          "    response: uint32 LE payload length, uint8 status (0=ok, 1=error), payload.\n"
+          "    ops 0/1/2 answer like --output text/ids/spans for that line, op 3 returns\n"
+          "    server counters and a latency histogram as text. Requests may be pipelined;\n"
+          "    answers come back in request order. --threads workers are shared by all\n"
+          "    connections; decode options (--sample, --nbest, --seed, ...) apply to every\n"
+          "    request, and each request starts from --seed.\n");
 }
 
 typedef enum {
@@ -195,6 +106,12 @@ typedef enum {
   MODE_SAMPLE_NBEST = 3,
 } decode_mode_t;
 
+typedef enum {
+  OUTPUT_TEXT = 0,
+  OUTPUT_IDS = 1,
+  OUTPUT_SPANS = 2,
+} output_fmt_t;
+
 static inline uint32_t xs32(uint32_t *s) {
   uint32_t x = (s && *s) ? *s : 0x12345678u;
   x ^= x << 13;
@@ -204,84 +121,456 @@ static inline uint32_t xs32(uint32_t *s) {
   return x;
 }
 
-static int read_line_dynamic(FILE *f, char **buf, size_t *cap, size_t *len, size_t max_bytes) {
-  if (!f || !buf || !cap || !len) return 0;
-  *len = 0;
-  int c;
-  while ((c = fgetc(f)) != EOF) {
-    if (c == '\n') break;
-    if (max_bytes > 0 && *len >= max_bytes) {
-      /* discard rest */
-      while ((c = fgetc(f)) != EOF && c != '\n') {}
-      *len = 0;
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* =====================
+ * Block-buffered line reader
+ *  - reads stdin in TOK_READ_CHUNK blocks (read(2) where available, so a
+ *    pipe hands over whatever is there instead of blocking for a full
+ *    chunk) and splits lines with memchr.
+ *  - lines are returned in place (NUL-terminated, CR trimmed); the pointer
+ *    is valid until the next call.
+ *  - lines longer than max_bytes are skipped (returned with len 0).
+ * ===================== */
+
+#define TOK_READ_CHUNK (1u << 20)
+
+static void print_throughput(uint64_t bytes, uint64_t lines, double sec) {
+  double mb = (double)bytes / (1024.0 * 1024.0);
+  fprintf(stderr, "[mmjp_tokenize] input: %.1f MB, %llu lines in %.2f s (%.1f MB/s)\n",
+          mb, (unsigned long long)lines, sec, (sec > 0.0) ? mb / sec : 0.0);
+}
+
+typedef struct {
+  FILE *f;
+  char *buf;
+  size_t cap;
+  size_t beg;  /* first unread byte */
+  size_t end;  /* end of buffered data */
+  int eof;
+  uint64_t n_bytes;  /* bytes read so far */
+  uint64_t n_lines;  /* lines returned so far */
+} line_reader_t;
+
+static void line_reader_init(line_reader_t *lr, FILE *f) {
+  memset(lr, 0, sizeof(*lr));
+  lr->f = f;
+}
+
+static void line_reader_free(line_reader_t *lr) {
+  free(lr->buf);
+  memset(lr, 0, sizeof(*lr));
+}
+
+/* 1 if the next line_reader_next() will not wait for input */
+static int line_reader_ready(const line_reader_t *lr) {
+  if (lr->eof) return 1;
+  return lr->end > lr->beg && memchr(lr->buf + lr->beg, '\n', lr->end - lr->beg) != NULL;
+}
+
+/* move unread data to the front and append one block; returns 0 on error */
+static int line_reader_fill(line_reader_t *lr) {
+  if (lr->beg > 0) {
+    memmove(lr->buf, lr->buf + lr->beg, lr->end - lr->beg);
+    lr->end -= lr->beg;
+    lr->beg = 0;
+  }
+  /* +1 keeps room for the NUL after an unterminated last line */
+  if (lr->cap - lr->end < TOK_READ_CHUNK + 1u) {
+    size_t nc = lr->cap ? lr->cap * 2u : (size_t)TOK_READ_CHUNK * 2u;
+    while (nc - lr->end < TOK_READ_CHUNK + 1u) nc *= 2u;
+    char *nb = (char *)realloc(lr->buf, nc);
+    if (!nb) return 0;
+    lr->buf = nb;
+    lr->cap = nc;
+  }
+  size_t n;
+#ifdef TOK_HAVE_READ
+  ssize_t got;
+  do {
+    got = read(fileno(lr->f), lr->buf + lr->end, TOK_READ_CHUNK);
+  } while (got < 0 && errno == EINTR);
+  n = (got > 0) ? (size_t)got : 0u;
+#else
+  n = fread(lr->buf + lr->end, 1, TOK_READ_CHUNK, lr->f);
+#endif
+  lr->end += n;
+  lr->n_bytes += n;
+  if (n == 0) lr->eof = 1;
+  return 1;
+}
+
+static int line_reader_next(line_reader_t *lr, char **line, size_t *len, size_t max_bytes) {
+  size_t scan = lr->beg;
+  int skip = 0;
+  for (;;) {
+    char *nl = (lr->end > scan) ? (char *)memchr(lr->buf + scan, '\n', lr->end - scan) : NULL;
+    size_t stop = nl ? (size_t)(nl - lr->buf) : lr->end;
+    if (max_bytes > 0 && stop - lr->beg > max_bytes) skip = 1;
+
+    if (nl || (lr->eof && (lr->end > lr->beg || skip))) {
+      char *p = lr->buf + lr->beg;
+      size_t n = skip ? 0u : stop - lr->beg;
+      lr->beg = nl ? stop + 1u : stop;
+      while (n > 0 && p[n - 1] == '\r') n--;
+      p[n] = '\0';
+      *line = p;
+      *len = n;
+      lr->n_lines++;
       return 1;
     }
-    if (*len + 1 > *cap) {
-      size_t nc = (*cap == 0) ? 256 : (*cap * 2);
-      char *nb = (char *)realloc(*buf, nc);
+    if (lr->eof) return 0;
+
+    /* a skipped line does not need to be kept while we look for its end */
+    if (skip) lr->beg = lr->end;
+    size_t keep = lr->end - lr->beg;
+    if (!line_reader_fill(lr)) return 0;
+    scan = keep;
+  }
+}
+
+/* =====================
+ * Output buffer
+ *  - tokenize_one() appends here instead of writing stdout directly,
+ *    so worker threads can produce lines out of order and the writer
+ *    can emit them in input order.
+ * ===================== */
+
+typedef struct {
+  char *p;
+  size_t len;
+  size_t cap;
+} outbuf_t;
+
+static int outbuf_put(outbuf_t *ob, const void *src, size_t n) {
+  if (ob->len + n > ob->cap) {
+    size_t nc = (ob->cap == 0) ? 256 : ob->cap;
+    while (nc < ob->len + n) nc *= 2;
+    char *nb = (char *)realloc(ob->p, nc);
+    if (!nb) return 0;
+    ob->p = nb;
+    ob->cap = nc;
+  }
+  memcpy(ob->p + ob->len, src, n);
+  ob->len += n;
+  return 1;
+}
+
+static int outbuf_putc(outbuf_t *ob, char c) {
+  return outbuf_put(ob, &c, 1);
+}
+
+static void outbuf_flush(outbuf_t *ob, FILE *f) {
+  if (ob->len > 0) fwrite(ob->p, 1, ob->len, f);
+  ob->len = 0;
+}
+
+/* stdin line modes collect output up to this size before one fwrite */
+#define TOK_OUT_FLUSH (1u << 20)
+
+/* append tokens delimited by byte boundaries b[0..bcount) as one line */
+static int outbuf_put_tokens(outbuf_t *ob, const uint8_t *utf8, size_t len,
+                             const uint16_t *b, size_t bcount) {
+  for (size_t i = 0; i + 1 < bcount; i++) {
+    uint16_t s = b[i];
+    uint16_t e = b[i + 1];
+    if (e > len) e = (uint16_t)len;
+    if (s > e) s = e;
+    if (!outbuf_put(ob, utf8 + s, (size_t)(e - s))) return 0;
+    if (i + 2 < bcount && !outbuf_putc(ob, ' ')) return 0;
+  }
+  return outbuf_putc(ob, '\n');
+}
+
+static int outbuf_put_dec(outbuf_t *ob, uint32_t v) {
+  char d[10];
+  size_t n = 0;
+  do {
+    d[sizeof(d) - 1u - n++] = (char)('0' + v % 10u);
+    v /= 10u;
+  } while (v);
+  return outbuf_put(ob, d + sizeof(d) - n, n);
+}
+
+/* append tokens b[0..bcount) of the prepared text as source byte ranges START:END */
+static int outbuf_put_spans(outbuf_t *ob, const uint32_t *src_off, size_t len,
+                            const uint16_t *b, size_t bcount) {
+  for (size_t i = 0; i + 1 < bcount; i++) {
+    uint16_t s = b[i];
+    uint16_t e = b[i + 1];
+    if (e > len) e = (uint16_t)len;
+    if (s > e) s = e;
+    if (!outbuf_put_dec(ob, src_off[s]) || !outbuf_putc(ob, ':') || !outbuf_put_dec(ob, src_off[e])) return 0;
+    if (i + 2 < bcount && !outbuf_putc(ob, ' ')) return 0;
+  }
+  return outbuf_putc(ob, '\n');
+}
+
+static int outbuf_put_u16le(outbuf_t *ob, uint16_t v) {
+  uint8_t b[2] = {(uint8_t)(v & 0xFFu), (uint8_t)(v >> 8)};
+  return outbuf_put(ob, b, 2);
+}
+
+static int outbuf_put_u32le(outbuf_t *ob, uint32_t v) {
+  uint8_t b[4] = {(uint8_t)(v & 0xFFu), (uint8_t)((v >> 8) & 0xFFu),
+                  (uint8_t)((v >> 16) & 0xFFu), (uint8_t)(v >> 24)};
+  return outbuf_put(ob, b, 4);
+}
+
+/* append one --output ids record: uint32 LE count, then count uint16 LE IDs */
+static int outbuf_put_ids(outbuf_t *ob, const npycrf_id_t *ids, size_t n) {
+  if (n > 0xFFFFFFFFu || !outbuf_put_u32le(ob, (uint32_t)n)) return 0;
+  for (size_t i = 0; i < n; i++) {
+    if (!outbuf_put_u16le(ob, ids[i])) return 0;
+  }
+  return 1;
+}
+
+/* =====================
+ * Per-worker decode context
+ *  - everything that npycrf_decode* writes to lives here.
+ *  - the loaded model itself is read-only and shared.
+ * ===================== */
+
+typedef struct {
+  uint8_t *workbuf;
+  size_t workcap;
+  npycrf_work_t wk;
+
+  uint16_t *b_cp;
+  size_t bcp_cap;
+  uint16_t *b_bytes;
+  size_t bb_cap;
+  npycrf_id_t *ids;
+  size_t ids_cap;
+
+  /* stochastic/nbest buffers */
+  uint8_t *samplebuf;
+  size_t samplecap;
+  uint8_t *nbestbuf;
+  size_t nbestcap;
+  uint16_t *bcp_flat;
+  size_t bcp_flat_cap;
+  size_t *bcount_arr;
+  size_t bcount_cap;
+  npycrf_score_t *score_arr;
+  size_t score_cap;
+  uint32_t *seeds;
+  size_t seeds_cap;
+
+  /* prepared input (lossless + normalize) and, with track_off, its byte -> source offset map */
+  uint8_t *prep;
+  size_t prep_cap;
+  uint32_t *src_off;
+  int track_off;
+
+  size_t max_n_cp;
+  size_t wk_n_cp;  /* max_n_cp that wk and the boundary buffers are set up for (0 = none) */
+
+  /* counters of earlier wk generations + regrows (--stats) */
+  npycrf_stats_t stats;
+
+  /* shared 1-best result cache (NULL = off) */
+  mmjp_cache_t *cache;
+} tok_ctx_t;
+
+static void tok_ctx_init(tok_ctx_t *tc, size_t max_n_cp) {
+  memset(tc, 0, sizeof(*tc));
+  tc->max_n_cp = max_n_cp;
+}
+
+/* all counters of this context (earlier work generations + the current one) */
+static void tok_ctx_stats(const tok_ctx_t *tc, npycrf_stats_t *out) {
+  *out = tc->stats;
+  if (tc->wk_n_cp != 0) {
+    npycrf_stats_t cur;
+    npycrf_stats_get(&tc->wk, &cur);
+    npycrf_stats_add(out, &cur);
+  }
+}
+
+static double stat_ratio(uint64_t a, uint64_t b) {
+  return b ? (double)a / (double)b : 0.0;
+}
+
+static void print_stats(const npycrf_stats_t *st) {
+  fprintf(stderr, "[mmjp_tokenize] stats:%s\n",
+          npycrf_stats_enabled() ? "" : " (decoder counters need a -DNPYCRF_STATS build)");
+  fprintf(stderr, "  lattices        %llu\n", (unsigned long long)st->lattices);
+  fprintf(stderr, "  codepoints      %llu\n", (unsigned long long)st->codepoints);
+  fprintf(stderr, "  trie_steps      %llu (%.2f per codepoint)\n", (unsigned long long)st->trie_steps,
+          stat_ratio(st->trie_steps, st->codepoints));
+  fprintf(stderr, "  spans           %llu (hits %llu, oov %llu, hit rate %.4f)\n",
+          (unsigned long long)st->spans, (unsigned long long)st->span_hits,
+          (unsigned long long)(st->spans - st->span_hits), stat_ratio(st->span_hits, st->spans));
+  fprintf(stderr, "  bigram_lookups  %llu (hits %llu, hit rate %.4f)\n",
+          (unsigned long long)st->bigram_lookups, (unsigned long long)st->bigram_hits,
+          stat_ratio(st->bigram_hits, st->bigram_lookups));
+  fprintf(stderr, "  dp_states       %llu (neg_inf %llu, %.4f)\n", (unsigned long long)st->dp_states,
+          (unsigned long long)st->dp_neg_inf, stat_ratio(st->dp_neg_inf, st->dp_states));
+  fprintf(stderr, "  regrows         %llu\n", (unsigned long long)st->regrows);
+}
+
+static void tok_ctx_free(tok_ctx_t *tc) {
+  free(tc->workbuf);
+  free(tc->b_cp);
+  free(tc->b_bytes);
+  free(tc->ids);
+  free(tc->samplebuf);
+  free(tc->nbestbuf);
+  free(tc->bcp_flat);
+  free(tc->bcount_arr);
+  free(tc->score_arr);
+  free(tc->seeds);
+  free(tc->prep);
+  free(tc->src_off);
+  memset(tc, 0, sizeof(*tc));  /* the cache is not owned */
+}
+
+static int tok_ctx_reserve_prep(tok_ctx_t *tc, size_t cap) {
+  if (tc->prep_cap >= cap) return 1;
+  uint8_t *nb = (uint8_t *)realloc(tc->prep, cap);
+  if (!nb) return 0;
+  tc->prep = nb;
+  if (tc->track_off) {
+    uint32_t *no = (uint32_t *)realloc(tc->src_off, cap * sizeof(uint32_t));
+    if (!no) return 0;
+    tc->src_off = no;
+  }
+  tc->prep_cap = cap;
+  return 1;
+}
+
+/*
+ * lossless encode (optional) + canonical UTF-8 normalize (optional) in one pass.
+ * With tc->track_off, tc->src_off[i] is the input offset of output byte i.
+ */
+static int prepare_input(tok_ctx_t *tc, const uint8_t *in, size_t in_len,
+                         int lossless_ws, int include_newlines,
+                         int normalize, uint32_t fallback_cp,
+                         const uint8_t **out, size_t *out_len) {
+  unsigned flags = 0;
+  if (lossless_ws > 0) flags |= MMJP_PREP_LOSSLESS | (include_newlines ? MMJP_PREP_NEWLINES : 0u);
+  if (normalize) flags |= MMJP_PREP_NORMALIZE;
+  if (flags == 0 && !tc->track_off) {
+    *out = in;
+    *out_len = in_len;
+    return 1;
+  }
+  if (tc->track_off && in_len > UINT32_MAX) return 0;
+
+  /* a few spaces / meta chars fit in the slack; otherwise size exactly and redo */
+  if (!tok_ctx_reserve_prep(tc, in_len + in_len / 4u + 64u)) return 0;
+  size_t n = mmjp_lossless_prepare(in, in_len, tc->prep, tc->prep_cap, flags, fallback_cp, tc->src_off);
+  if (n + 1u > tc->prep_cap) {
+    if (!tok_ctx_reserve_prep(tc, n + 1u)) return 0;
+    n = mmjp_lossless_prepare(in, in_len, tc->prep, tc->prep_cap, flags, fallback_cp, tc->src_off);
+  }
+  *out = tc->prep;
+  *out_len = n;
+  return 1;
+}
+
+/* append one segmentation (cp boundaries from the last decode in tc->wk) */
+static int put_segmentation(const mmjp_loaded_model_t *mb, tok_ctx_t *tc, outbuf_t *out,
+                            output_fmt_t fmt, const uint8_t *utf8, size_t len,
+                            const uint16_t *b_cp, size_t b_count) {
+  if (fmt == OUTPUT_IDS) {
+    /* piece IDs come straight from the decoder's span table */
+    size_t n = (b_count > 1u) ? b_count - 1u : 0u;
+    if (tc->ids_cap < n) {
+      npycrf_id_t *nb = (npycrf_id_t *)realloc(tc->ids, n * sizeof(npycrf_id_t));
       if (!nb) return 0;
-      *buf = nb;
-      *cap = nc;
+      tc->ids = nb;
+      tc->ids_cap = n;
     }
-    (*buf)[(*len)++] = (char)c;
+    if (npycrf_boundaries_to_ids(&mb->m, &tc->wk, b_cp, b_count, tc->ids, tc->ids_cap) != 0) return 0;
+    return outbuf_put_ids(out, tc->ids, n);
+  }
+  npycrf_boundaries_cp_to_bytes(tc->wk.cp_off, b_cp, b_count, tc->b_bytes);
+  if (fmt == OUTPUT_SPANS) return outbuf_put_spans(out, tc->src_off, len, tc->b_bytes, b_count);
+  return outbuf_put_tokens(out, utf8, len, tc->b_bytes, b_count);
+}
+
+/* room for n candidate segmentations of per boundaries each (n-best / multi-sample) */
+static int tok_ctx_reserve_flat(tok_ctx_t *tc, size_t n, size_t per) {
+  size_t flat_need = n * per;
+  if (tc->bcp_flat_cap < flat_need) {
+    uint16_t *nb = (uint16_t *)realloc(tc->bcp_flat, flat_need * sizeof(uint16_t));
+    if (!nb) return 0;
+    tc->bcp_flat = nb;
+    tc->bcp_flat_cap = flat_need;
+  }
+  if (tc->bcount_cap < n) {
+    size_t *nb = (size_t *)realloc(tc->bcount_arr, n * sizeof(size_t));
+    if (!nb) return 0;
+    tc->bcount_arr = nb;
+    tc->bcount_cap = n;
   }
-  if (c == EOF && *len == 0) return 0;
-  /* trim CR */
-  while (*len > 0 && ((*buf)[*len - 1] == '\r')) (*len)--;
-  if (*len + 1 > *cap) {
-    char *nb = (char *)realloc(*buf, *len + 1);
+  if (tc->score_cap < n) {
+    npycrf_score_t *nb = (npycrf_score_t *)realloc(tc->score_arr, n * sizeof(npycrf_score_t));
     if (!nb) return 0;
-    *buf = nb;
-    *cap = *len + 1;
+    tc->score_arr = nb;
+    tc->score_cap = n;
   }
-  (*buf)[*len] = '\0';
   return 1;
 }
 
-static int tokenize_one(mmjp_loaded_model_t *mb, const uint8_t *utf8, size_t len,
-                        uint8_t **workbuf, size_t *workcap,
-                        npycrf_work_t *wk,
-                        uint16_t **b_cp, size_t *bcp_cap,
-                        uint16_t **b_bytes, size_t *bb_cap,
-                        /* stochastic/nbest buffers */
-                        uint8_t **samplebuf, size_t *samplecap,
-                        uint8_t **nbestbuf, size_t *nbestcap,
-                        uint16_t **bcp_flat, size_t *bcp_flat_cap,
-                        size_t **bcount_arr, size_t *bcount_cap,
-                        npycrf_score_t **score_arr, size_t *score_cap,
+/*
+ * Decode one (preprocessed) input and append its output.
+ * nsamples is used by MODE_SAMPLE_FFBS only: all samples are drawn from one
+ * forward pass, sample i with the i-th xs32 step of *seed_io.
+ */
+static int tokenize_one(const mmjp_loaded_model_t *mb, const uint8_t *utf8, size_t len,
+                        tok_ctx_t *tc, outbuf_t *out,
+                        output_fmt_t fmt,
                         decode_mode_t mode,
                         uint16_t nbest,
                         double temperature,
-                        uint32_t *seed_io,
-                        size_t *max_n_cp_inout) {
-  if (!mb || !utf8 || !wk || !workbuf || !workcap || !b_cp || !b_bytes || !max_n_cp_inout) return 0;
+                        unsigned nsamples,
+                        uint32_t *seed_io) {
+  if (!mb || !utf8 || !tc || !out) return 0;
 
-  /* work buffer (npycrf_work_t) */
-  size_t max_n_cp = *max_n_cp_inout;
+  /* work buffer (npycrf_work_t); set up again only when max_n_cp grows */
+  size_t max_n_cp = tc->max_n_cp;
   for (;;) {
-    size_t need = npycrf_workbuf_size(max_n_cp, mb->m.max_word_len);
-    if (*workcap < need) {
-      uint8_t *nb = (uint8_t *)realloc(*workbuf, need);
-      if (!nb) return 0;
-      *workbuf = nb;
-      *workcap = need;
-    }
-    if (npycrf_work_init(wk, *workbuf, *workcap, (uint16_t)max_n_cp, mb->m.max_word_len) != 0) {
-      return 0;
-    }
-    /* boundary buffers */
-    size_t out_cap = max_n_cp + 1u;
-    if (*bcp_cap < out_cap) {
-      uint16_t *nb = (uint16_t *)realloc(*b_cp, out_cap * sizeof(uint16_t));
-      if (!nb) return 0;
-      *b_cp = nb;
-      *bcp_cap = out_cap;
-    }
-    if (*bb_cap < out_cap) {
-      uint16_t *nb = (uint16_t *)realloc(*b_bytes, out_cap * sizeof(uint16_t));
-      if (!nb) return 0;
-      *b_bytes = nb;
-      *bb_cap = out_cap;
+    if (tc->wk_n_cp != max_n_cp) {
+      size_t need = npycrf_workbuf_size(max_n_cp, mb->m.max_word_len);
+      if (tc->workcap < need) {
+        uint8_t *nb = (uint8_t *)realloc(tc->workbuf, need);
+        if (!nb) return 0;
+        tc->workbuf = nb;
+        tc->workcap = need;
+      }
+      if (tc->wk_n_cp != 0) {
+        /* npycrf_work_init clears the decoder counters; keep them */
+        npycrf_stats_t cur;
+        npycrf_stats_get(&tc->wk, &cur);
+        npycrf_stats_add(&tc->stats, &cur);
+      }
+      tc->wk_n_cp = 0;
+      if (npycrf_work_init(&tc->wk, tc->workbuf, tc->workcap, (uint16_t)max_n_cp, mb->m.max_word_len) != 0) {
+        return 0;
+      }
+      /* boundary buffers */
+      size_t out_cap = max_n_cp + 1u;
+      if (tc->bcp_cap < out_cap) {
+        uint16_t *nb = (uint16_t *)realloc(tc->b_cp, out_cap * sizeof(uint16_t));
+        if (!nb) return 0;
+        tc->b_cp = nb;
+        tc->bcp_cap = out_cap;
+      }
+      if (tc->bb_cap < out_cap) {
+        uint16_t *nb = (uint16_t *)realloc(tc->b_bytes, out_cap * sizeof(uint16_t));
+        if (!nb) return 0;
+        tc->b_bytes = nb;
+        tc->bb_cap = out_cap;
+      }
+      tc->wk_n_cp = max_n_cp;
     }
 
     size_t b_count = 0;
@@ -291,67 +580,71 @@ static int tokenize_one(mmjp_loaded_model_t *mb, const uint8_t *utf8, size_t len
     if (mode == MODE_SAMPLE_FFBS) {
       /* ensure sample buffer */
       size_t need_s = npycrf_samplebuf_size((uint16_t)max_n_cp, mb->m.max_word_len);
-      if (*samplecap < need_s) {
-        uint8_t *nb = (uint8_t *)realloc(*samplebuf, need_s);
+      if (tc->samplecap < need_s) {
+        uint8_t *nb = (uint8_t *)realloc(tc->samplebuf, need_s);
         if (!nb) return 0;
-        *samplebuf = nb;
-        *samplecap = need_s;
+        tc->samplebuf = nb;
+        tc->samplecap = need_s;
+      }
+      if (nsamples == 0) nsamples = 1;
+      size_t per = max_n_cp + 1u;
+      if (!tok_ctx_reserve_flat(tc, nsamples, per)) return 0;
+      if (tc->seeds_cap < nsamples) {
+        uint32_t *nb = (uint32_t *)realloc(tc->seeds, (size_t)nsamples * sizeof(uint32_t));
+        if (!nb) return 0;
+        tc->seeds = nb;
+        tc->seeds_cap = nsamples;
       }
       uint32_t seed = seed_io ? *seed_io : 1u;
-      rc = npycrf_decode_sample(&mb->m, utf8, len, wk,
-                                *samplebuf, *samplecap,
-                                temperature,
-                                seed,
-                                *b_cp, *bcp_cap, &b_count,
-                                &score);
-      if (seed_io) *seed_io = xs32(seed_io);
+      for (unsigned i = 0; i < nsamples; i++) {
+        tc->seeds[i] = seed;
+        seed = xs32(&seed);
+      }
+
+      rc = npycrf_decode_sample_multi(&mb->m, utf8, len, &tc->wk,
+                                      tc->samplebuf, tc->samplecap,
+                                      nsamples, tc->seeds, NULL, temperature,
+                                      tc->bcp_flat, per, tc->bcount_arr, tc->score_arr);
+      if (rc == 0) {
+        if (seed_io) *seed_io = seed;
+        for (unsigned i = 0; i < nsamples; i++) {
+          if (!put_segmentation(mb, tc, out, fmt, utf8, len, tc->bcp_flat + (size_t)i * per,
+                                tc->bcount_arr[i])) {
+            return 0;
+          }
+        }
+        tc->max_n_cp = max_n_cp;
+        return 1;
+      }
     } else if (mode == MODE_NBEST_LIST || mode == MODE_SAMPLE_NBEST) {
       if (nbest == 0) nbest = 1;
 
       /* ensure nbest work buffer */
       size_t need_n = npycrf_nbestbuf_size((uint16_t)max_n_cp, mb->m.max_word_len, nbest);
-      if (*nbestcap < need_n) {
-        uint8_t *nb = (uint8_t *)realloc(*nbestbuf, need_n);
+      if (tc->nbestcap < need_n) {
+        uint8_t *nb = (uint8_t *)realloc(tc->nbestbuf, need_n);
         if (!nb) return 0;
-        *nbestbuf = nb;
-        *nbestcap = need_n;
+        tc->nbestbuf = nb;
+        tc->nbestcap = need_n;
       }
 
       /* ensure flat boundary storage */
       size_t per = max_n_cp + 1u;
-      size_t flat_need = (size_t)nbest * per;
-      if (*bcp_flat_cap < flat_need) {
-        uint16_t *nb = (uint16_t *)realloc(*bcp_flat, flat_need * sizeof(uint16_t));
-        if (!nb) return 0;
-        *bcp_flat = nb;
-        *bcp_flat_cap = flat_need;
-      }
-      if (*bcount_cap < (size_t)nbest) {
-        size_t *nb = (size_t *)realloc(*bcount_arr, (size_t)nbest * sizeof(size_t));
-        if (!nb) return 0;
-        *bcount_arr = nb;
-        *bcount_cap = (size_t)nbest;
-      }
-      if (*score_cap < (size_t)nbest) {
-        npycrf_score_t *nb = (npycrf_score_t *)realloc(*score_arr, (size_t)nbest * sizeof(npycrf_score_t));
-        if (!nb) return 0;
-        *score_arr = nb;
-        *score_cap = (size_t)nbest;
-      }
+      if (!tok_ctx_reserve_flat(tc, nbest, per)) return 0;
 
-      int n_out = npycrf_decode_nbest(&mb->m, utf8, len, wk,
-                                     *nbestbuf, *nbestcap,
+      int n_out = npycrf_decode_nbest(&mb->m, utf8, len, &tc->wk,
+                                     tc->nbestbuf, tc->nbestcap,
                                      nbest,
-                                     *bcp_flat, per,
-                                     *bcount_arr,
-                                     *score_arr);
+                                     tc->bcp_flat, per,
+                                     tc->bcount_arr,
+                                     tc->score_arr);
       if (n_out < 0) {
         fprintf(stderr, "npycrf_decode_nbest failed rc=%d\n", n_out);
         return 0;
       }
       if (n_out == 0) {
         /* fallback to best */
-        rc = npycrf_decode(&mb->m, utf8, len, wk, *b_cp, *bcp_cap, &b_count, &score);
+        rc = npycrf_decode(&mb->m, utf8, len, &tc->wk, tc->b_cp, tc->bcp_cap, &b_count, &score);
       } else {
         if (mode == MODE_SAMPLE_NBEST) {
           /* choose one candidate uniformly from available */
@@ -360,37 +653,43 @@ static int tokenize_one(mmjp_loaded_model_t *mb, const uint8_t *utf8, size_t len
           if (seed_io) *seed_io = seed;
           int pick = (int)(r % (uint32_t)n_out);
           /* copy picked boundaries into b_cp */
-          size_t pcnt = (*bcount_arr)[(size_t)pick];
-          if (pcnt > *bcp_cap) return 0;
-          memcpy(*b_cp, *bcp_flat + (size_t)pick * per, pcnt * sizeof(uint16_t));
+          size_t pcnt = tc->bcount_arr[(size_t)pick];
+          if (pcnt > tc->bcp_cap) return 0;
+          memcpy(tc->b_cp, tc->bcp_flat + (size_t)pick * per, pcnt * sizeof(uint16_t));
           b_count = pcnt;
-          score = (*score_arr)[(size_t)pick];
+          score = tc->score_arr[(size_t)pick];
           rc = 0;
         } else {
           /* list mode: print each candidate, then return */
           for (int ci = 0; ci < n_out; ci++) {
-            size_t pcnt = (*bcount_arr)[(size_t)ci];
+            size_t pcnt = tc->bcount_arr[(size_t)ci];
             if (pcnt < 2) continue;
-            npycrf_boundaries_cp_to_bytes(wk->cp_off, *bcp_flat + (size_t)ci * per, pcnt, *b_bytes);
-            for (size_t i = 0; i + 1 < pcnt; i++) {
-              uint16_t s = (*b_bytes)[i];
-              uint16_t e = (*b_bytes)[i + 1];
-              if (e > len) e = (uint16_t)len;
-              if (s > e) s = e;
-              fwrite(utf8 + s, 1, (size_t)(e - s), stdout);
-              if (i + 2 < pcnt) fputc(' ', stdout);
-            }
-            fputc('\n', stdout);
+            if (!put_segmentation(mb, tc, out, fmt, utf8, len, tc->bcp_flat + (size_t)ci * per, pcnt)) return 0;
           }
-          *max_n_cp_inout = max_n_cp;
+          tc->max_n_cp = max_n_cp;
           return 1;
         }
       }
+    } else if (tc->cache) {
+      /* b_bytes gets byte boundaries or piece IDs, whichever fmt prints */
+      size_t n = 0;
+      rc = mmjp_cache_decode(tc->cache, (fmt == OUTPUT_IDS) ? MMJP_CACHE_IDS : MMJP_CACHE_BOUNDS,
+                             &mb->m, utf8, len, &tc->wk, tc->b_cp, tc->bcp_cap,
+                             tc->b_bytes, tc->bb_cap, &n);
+      if (rc == 0) {
+        int ok = (fmt == OUTPUT_IDS)     ? outbuf_put_ids(out, tc->b_bytes, n)
+                 : (fmt == OUTPUT_SPANS) ? outbuf_put_spans(out, tc->src_off, len, tc->b_bytes, n)
+                                         : outbuf_put_tokens(out, utf8, len, tc->b_bytes, n);
+        if (!ok) return 0;
+        tc->max_n_cp = max_n_cp;
+        return 1;
+      }
     } else {
-      rc = npycrf_decode(&mb->m, utf8, len, wk, *b_cp, *bcp_cap, &b_count, &score);
+      rc = npycrf_decode(&mb->m, utf8, len, &tc->wk, tc->b_cp, tc->bcp_cap, &b_count, &score);
     }
     if (rc == -3) {
       /* cp_off overflow -> grow max_n_cp */
+      tc->stats.regrows++;
       max_n_cp = max_n_cp * 2u;
       if (max_n_cp > 65530u) return 0;
       continue;
@@ -400,23 +699,1062 @@ static int tokenize_one(mmjp_loaded_model_t *mb, const uint8_t *utf8, size_t len
       return 0;
     }
 
-    /* convert cp boundaries -> byte boundaries */
-    npycrf_boundaries_cp_to_bytes(wk->cp_off, *b_cp, b_count, *b_bytes);
+    /* print tokens (or piece IDs) */
+    if (!put_segmentation(mb, tc, out, fmt, utf8, len, tc->b_cp, b_count)) return 0;
+
+    tc->max_n_cp = max_n_cp;
+    return 1;
+  }
+}
+
+/* reps outputs for one line; FFBS draws them all from a single forward pass (0 = some failed) */
+static int tokenize_reps(const mmjp_loaded_model_t *mb, const uint8_t *utf8, size_t len,
+                         tok_ctx_t *tc, outbuf_t *out, output_fmt_t fmt, decode_mode_t mode,
+                         uint16_t nbest, double temperature, unsigned reps, uint32_t *seed_io) {
+  if (mode == MODE_SAMPLE_FFBS) {
+    return tokenize_one(mb, utf8, len, tc, out, fmt, mode, nbest, temperature, reps, seed_io);
+  }
+  int ok = 1;
+  for (unsigned r = 0; r < reps; r++) {
+    ok &= tokenize_one(mb, utf8, len, tc, out, fmt, mode, nbest, temperature, 1u, seed_io);
+  }
+  return ok;
+}
+
+/* =====================
+ * Multi-threaded stdin line mode (--threads N)
+ *
+ *  - main thread: reads lines into a ring of slots and writes finished
+ *    slots to stdout strictly in input order (reorder buffer).
+ *  - workers: take READY slots in order, preprocess + decode with their
+ *    own tok_ctx_t, append output into the slot.
+ *
+ * The RNG seed for each line is assigned by the reader so that sampling
+ * modes reproduce the single-threaded stream (one xs32 step per sample).
+ * ===================== */
+
+#ifndef MMJP_NO_THREADS
+
+/* slots per worker in the reorder ring */
+#define TOK_SLOTS_PER_THREAD 64u
+
+enum { SLOT_FREE = 0, SLOT_READY = 1, SLOT_DONE = 2 };
+
+typedef struct {
+  char *line;
+  size_t cap;
+  size_t len;
+  uint32_t seed;
+  int state;
+  outbuf_t out;
+} line_slot_t;
+
+typedef struct {
+  const mmjp_loaded_model_t *mb;
+
+  /* decode options (read-only while running) */
+  int lossless_ws;
+  int normalize;
+  uint32_t fallback_cp;
+  output_fmt_t fmt;
+  decode_mode_t mode;
+  uint16_t nbest;
+  double temperature;
+  unsigned reps;
+  size_t max_n_cp;
+  mmjp_cache_t *cache;
+
+  /* workers add their counters here on exit (under mu) */
+  npycrf_stats_t stats;
+
+  line_slot_t *slots;
+  size_t nslots;
+
+  /* writer side: finished slots are gathered here, one fwrite per TOK_OUT_FLUSH */
+  outbuf_t wout;
+
+  /* monotonic line counters; slot index = counter % nslots */
+  size_t n_read;
+  size_t n_taken;
+  int eof;
+  int failed;
+
+  pthread_mutex_t mu;
+  pthread_cond_t cv_work; /* a slot became READY, or eof */
+  pthread_cond_t cv_done; /* a slot became DONE */
+} tok_pool_t;
+
+static void *tok_worker_main(void *arg) {
+  tok_pool_t *p = (tok_pool_t *)arg;
+  tok_ctx_t tc;
+  tok_ctx_init(&tc, p->max_n_cp);
+  tc.cache = p->cache;
+  tc.track_off = (p->fmt == OUTPUT_SPANS);
+
+  for (;;) {
+    pthread_mutex_lock(&p->mu);
+    while (p->n_taken == p->n_read && !p->eof) pthread_cond_wait(&p->cv_work, &p->mu);
+    if (p->n_taken == p->n_read) {
+      pthread_mutex_unlock(&p->mu);
+      break;
+    }
+    line_slot_t *s = &p->slots[p->n_taken % p->nslots];
+    p->n_taken++;
+    pthread_mutex_unlock(&p->mu);
+
+    s->out.len = 0;
+    const uint8_t *inp = NULL;
+    size_t inlen = 0;
+    int ok = prepare_input(&tc, (const uint8_t *)s->line, s->len,
+                           p->lossless_ws, 0, p->normalize, p->fallback_cp,
+                           &inp, &inlen);
+    uint32_t seed = s->seed;
+    if (ok) {
+      (void)tokenize_reps(p->mb, inp, inlen, &tc, &s->out,
+                          p->fmt, p->mode, p->nbest, p->temperature, p->reps, &seed);
+    }
 
-    /* print tokens */
-    for (size_t i = 0; i + 1 < b_count; i++) {
-      uint16_t s = (*b_bytes)[i];
-      uint16_t e = (*b_bytes)[i + 1];
-      if (e > len) e = (uint16_t)len;
-      if (s > e) s = e;
-      fwrite(utf8 + s, 1, (size_t)(e - s), stdout);
-      if (i + 2 < b_count) fputc(' ', stdout);
+    pthread_mutex_lock(&p->mu);
+    s->state = SLOT_DONE;
+    if (!ok) p->failed = 1;
+    pthread_cond_signal(&p->cv_done);
+    pthread_mutex_unlock(&p->mu);
+  }
+
+  npycrf_stats_t st;
+  tok_ctx_stats(&tc, &st);
+  pthread_mutex_lock(&p->mu);
+  npycrf_stats_add(&p->stats, &st);
+  pthread_mutex_unlock(&p->mu);
+
+  tok_ctx_free(&tc);
+  return NULL;
+}
+
+/* write DONE slots in order; call with p->mu held */
+static void tok_pool_drain_locked(tok_pool_t *p, size_t *n_written) {
+  while (*n_written < p->n_read) {
+    line_slot_t *s = &p->slots[*n_written % p->nslots];
+    if (s->state != SLOT_DONE) break;
+    /* the slot belongs to the writer until it is marked FREE */
+    pthread_mutex_unlock(&p->mu);
+    if (!outbuf_put(&p->wout, s->out.p, s->out.len)) {
+      outbuf_flush(&p->wout, stdout);
+      outbuf_flush(&s->out, stdout);
     }
-    fputc('\n', stdout);
+    s->out.len = 0;
+    if (p->wout.len >= TOK_OUT_FLUSH) outbuf_flush(&p->wout, stdout);
+    pthread_mutex_lock(&p->mu);
+    s->state = SLOT_FREE;
+    (*n_written)++;
+  }
+}
 
-    *max_n_cp_inout = max_n_cp;
-    return 1;
+static int tokenize_stdin_threaded(const mmjp_loaded_model_t *mb, unsigned threads,
+                                   line_reader_t *lr, size_t max_line_bytes, int lossless_ws,
+                                   int normalize, uint32_t fallback_cp,
+                                   output_fmt_t fmt, decode_mode_t mode, uint16_t nbest,
+                                   double temperature, uint32_t seed,
+                                   unsigned reps, size_t max_n_cp, mmjp_cache_t *cache,
+                                   npycrf_stats_t *stats_out) {
+  tok_pool_t p;
+  memset(&p, 0, sizeof(p));
+  p.mb = mb;
+  p.lossless_ws = lossless_ws;
+  p.normalize = normalize;
+  p.fallback_cp = fallback_cp;
+  p.fmt = fmt;
+  p.mode = mode;
+  p.nbest = nbest;
+  p.temperature = temperature;
+  p.reps = reps;
+  p.max_n_cp = max_n_cp;
+  p.cache = cache;
+  p.nslots = (size_t)threads * TOK_SLOTS_PER_THREAD;
+  p.slots = (line_slot_t *)calloc(p.nslots, sizeof(line_slot_t));
+  pthread_t *tids = (pthread_t *)calloc(threads, sizeof(pthread_t));
+  if (!p.slots || !tids) {
+    free(p.slots);
+    free(tids);
+    return 0;
+  }
+  pthread_mutex_init(&p.mu, NULL);
+  pthread_cond_init(&p.cv_work, NULL);
+  pthread_cond_init(&p.cv_done, NULL);
+
+  unsigned started = 0;
+  for (; started < threads; started++) {
+    if (pthread_create(&tids[started], NULL, tok_worker_main, &p) != 0) break;
+  }
+  if (started == 0) {
+    fprintf(stderr, "failed to start worker threads\n");
+    p.failed = 1;
   }
+
+  size_t n_written = 0;
+  int sampling = (mode == MODE_SAMPLE_FFBS || mode == MODE_SAMPLE_NBEST);
+  while (started > 0) {
+    /* wait for a free slot, writing finished lines meanwhile */
+    pthread_mutex_lock(&p.mu);
+    for (;;) {
+      tok_pool_drain_locked(&p, &n_written);
+      if (p.failed || p.n_read - n_written < p.nslots) break;
+      pthread_cond_wait(&p.cv_done, &p.mu);
+    }
+    int stop = p.failed;
+    pthread_mutex_unlock(&p.mu);
+    if (stop) break;
+
+    /* about to wait for input: hand what is finished to stdout first */
+    if (!line_reader_ready(lr)) outbuf_flush(&p.wout, stdout);
+    char *line = NULL;
+    size_t len = 0;
+    if (!line_reader_next(lr, &line, &len, max_line_bytes)) break;
+    if (len == 0) continue;
+
+    line_slot_t *s = &p.slots[p.n_read % p.nslots];
+    if (len + 1u > s->cap) {
+      char *nb = (char *)realloc(s->line, len + 1u);
+      if (!nb) {
+        pthread_mutex_lock(&p.mu);
+        p.failed = 1;
+        pthread_mutex_unlock(&p.mu);
+        break;
+      }
+      s->line = nb;
+      s->cap = len + 1u;
+    }
+    memcpy(s->line, line, len + 1u);
+    s->len = len;
+
+    s->seed = seed;
+    if (sampling) {
+      for (unsigned r = 0; r < reps; r++) (void)xs32(&seed);
+    }
+
+    pthread_mutex_lock(&p.mu);
+    s->state = SLOT_READY;
+    p.n_read++;
+    pthread_cond_signal(&p.cv_work);
+    pthread_mutex_unlock(&p.mu);
+  }
+
+  /* eof: let workers finish, then flush the tail in order */
+  pthread_mutex_lock(&p.mu);
+  p.eof = 1;
+  pthread_cond_broadcast(&p.cv_work);
+  for (;;) {
+    tok_pool_drain_locked(&p, &n_written);
+    if (n_written == p.n_read) break;
+    pthread_cond_wait(&p.cv_done, &p.mu);
+  }
+  pthread_mutex_unlock(&p.mu);
+  outbuf_flush(&p.wout, stdout);
+
+  for (unsigned t = 0; t < started; t++) pthread_join(tids[t], NULL);
+  if (stats_out) npycrf_stats_add(stats_out, &p.stats);
+
+  int ok = !p.failed;
+  for (size_t i = 0; i < p.nslots; i++) {
+    free(p.slots[i].line);
+    free(p.slots[i].out.p);
+  }
+  free(p.slots);
+  free(p.wout.p);
+  free(tids);
+  pthread_cond_destroy(&p.cv_done);
+  pthread_cond_destroy(&p.cv_work);
+  pthread_mutex_destroy(&p.mu);
+  return ok;
+}
+#endif /* MMJP_NO_THREADS */
+
+/* =====================
+ * Server mode (--serve PATH)
+ *
+ *  - the model is loaded once; clients talk to a Unix socket at PATH
+ *    (or the process's stdin/stdout with PATH "-").
+ *  - request:  uint32 LE payload length, uint8 op, payload (one UTF-8 line)
+ *    response: uint32 LE payload length, uint8 status (0 = ok), payload
+ *    ops: SERVE_OP_TEXT / IDS / SPANS give the same bytes as --output FMT
+ *    for that line, SERVE_OP_STATS the server counters as text.
+ *  - requests may be pipelined; each connection answers in request order.
+ *  - per connection a reader thread fills a ring of jobs and a writer
+ *    thread sends finished ones in order; --threads workers (each with its
+ *    own tok_ctx_t, as in the --threads line mode) take jobs from one FIFO
+ *    shared by all connections.
+ * ===================== */
+
+#ifdef TOK_HAVE_SERVE
+
+#define SERVE_OP_TEXT  0u
+#define SERVE_OP_IDS   1u
+#define SERVE_OP_SPANS 2u
+#define SERVE_OP_STATS 3u
+#define SERVE_OP_TOO_LONG 0xFFu  /* internal: payload exceeded --max_line_bytes */
+
+/* in-flight requests per connection (reader blocks beyond this) */
+#define SERVE_SLOTS_PER_CONN 64u
+
+/* latency histogram: bucket i counts requests answered within 2^i microseconds */
+#define SERVE_LAT_BUCKETS 32u
+
+/* on shutdown, clients get this long to read the pending answers */
+#define SERVE_DRAIN_SEC 2
+
+typedef struct serve_conn serve_conn_t;
+
+typedef struct serve_job {
+  serve_conn_t *conn;
+  struct serve_job *next;  /* server FIFO */
+  char *req;
+  size_t cap;
+  size_t len;
+  uint8_t op;
+  uint8_t status;
+  int state;  /* SLOT_FREE / SLOT_READY / SLOT_DONE */
+  double t_recv;
+  outbuf_t out;
+} serve_job_t;
+
+struct serve_conn {
+  int in_fd;
+  int out_fd;
+  serve_job_t jobs[SERVE_SLOTS_PER_CONN];
+  size_t n_read;
+  size_t n_written;
+  int eof;     /* reader is done */
+  int broken;  /* a write failed: read on until EOF, send nothing */
+  int done;    /* writer is done */
+  outbuf_t wout;
+  pthread_t reader;
+  pthread_t writer;
+  pthread_cond_t cv_done;  /* a job became DONE, or eof */
+  pthread_cond_t cv_free;  /* a job slot was freed, or broken */
+  serve_conn_t *next;
+  struct serve *srv;
+};
+
+typedef struct serve {
+  const mmjp_loaded_model_t *mb;
+
+  /* decode options (read-only while running) */
+  int lossless_ws;
+  int normalize;
+  uint32_t fallback_cp;
+  decode_mode_t mode;
+  uint16_t nbest;
+  double temperature;
+  uint32_t seed;
+  unsigned reps;
+  size_t max_n_cp;
+  size_t max_req;
+  mmjp_cache_t *cache;
+
+  /* workers add their decoder counters here on exit */
+  npycrf_stats_t stats;
+
+  serve_job_t *head;  /* READY jobs in arrival order */
+  serve_job_t *tail;
+  int stop;           /* workers exit once the FIFO is empty */
+  serve_conn_t *conns;
+
+  /* server counters (under mu) */
+  uint64_t requests;
+  uint64_t errors;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t connections;
+  uint64_t lat_hist[SERVE_LAT_BUCKETS];
+  double t_start;
+
+  pthread_mutex_t mu;
+  pthread_cond_t cv_work;
+  pthread_cond_t cv_conn_done;  /* a connection's writer is done */
+} serve_t;
+
+static volatile sig_atomic_t g_serve_stop = 0;
+static int g_serve_wake[2] = { -1, -1 };  /* self-pipe: wakes poll() in the accept loop */
+
+static void serve_on_signal(int sig) {
+  (void)sig;
+  g_serve_stop = 1;
+  if (g_serve_wake[1] >= 0) {
+    int e = errno;
+    ssize_t r = write(g_serve_wake[1], "", 1);
+    (void)r;
+    errno = e;
+  }
+}
+
+/* SIGINT/SIGTERM go to the accept loop only: threads are started with them blocked */
+static void serve_block_signals(int block) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  pthread_sigmask(block ? SIG_BLOCK : SIG_UNBLOCK, &set, NULL);
+}
+
+/* 1 = n bytes read, 0 = EOF or error before that */
+static int fd_read_full(int fd, void *buf, size_t n) {
+  uint8_t *p = (uint8_t *)buf;
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return 0;
+    p += r;
+    n -= (size_t)r;
+  }
+  return 1;
+}
+
+static int fd_write_full(int fd, const void *buf, size_t n) {
+  const uint8_t *p = (const uint8_t *)buf;
+  while (n > 0) {
+    ssize_t r = write(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return 0;
+    p += r;
+    n -= (size_t)r;
+  }
+  return 1;
+}
+
+static int serve_lat_bucket(double sec) {
+  double us = sec * 1e6;
+  int b = 0;
+  while (b + 1 < (int)SERVE_LAT_BUCKETS && (double)(1u << b) < us) b++;
+  return b;
+}
+
+/* counters as "name value" lines; latency as "latency_us_le_<2^i> count" up to the last used bucket */
+static int serve_put_stats(serve_t *s, outbuf_t *ob) {
+  pthread_mutex_lock(&s->mu);
+  uint64_t v[5] = {s->requests, s->errors, s->bytes_in, s->bytes_out, s->connections};
+  uint64_t hist[SERVE_LAT_BUCKETS];
+  memcpy(hist, s->lat_hist, sizeof(hist));
+  pthread_mutex_unlock(&s->mu);
+  static const char *const names[5] = {"requests", "errors", "bytes_in", "bytes_out", "connections"};
+
+  char line[96];
+  int ok = 1;
+  for (int i = 0; i < 5 && ok; i++) {
+    int n = snprintf(line, sizeof(line), "%s %llu\n", names[i], (unsigned long long)v[i]);
+    ok = outbuf_put(ob, line, (size_t)n);
+  }
+  int last = -1;
+  for (int b = 0; b < (int)SERVE_LAT_BUCKETS; b++) {
+    if (hist[b]) last = b;
+  }
+  for (int b = 0; b <= last && ok; b++) {
+    int n = snprintf(line, sizeof(line), "latency_us_le_%lu %llu\n", 1ul << b, (unsigned long long)hist[b]);
+    ok = outbuf_put(ob, line, (size_t)n);
+  }
+  if (s->cache && ok) {
+    mmjp_cache_stats_t cs;
+    mmjp_cache_get_stats(s->cache, &cs);
+    int n = snprintf(line, sizeof(line), "cache_hits %llu\ncache_misses %llu\n",
+                     (unsigned long long)cs.hits, (unsigned long long)cs.misses);
+    ok = outbuf_put(ob, line, (size_t)n);
+  }
+  return ok;
+}
+
+static void serve_run_job(serve_t *s, tok_ctx_t *tc, serve_job_t *j) {
+  j->out.len = 0;
+  j->status = 0;
+  const char *err = NULL;
+  if (j->op == SERVE_OP_STATS) {
+    if (!serve_put_stats(s, &j->out)) err = "out of memory";
+  } else if (j->op == SERVE_OP_TEXT || j->op == SERVE_OP_IDS || j->op == SERVE_OP_SPANS) {
+    output_fmt_t fmt = (j->op == SERVE_OP_IDS) ? OUTPUT_IDS : (j->op == SERVE_OP_SPANS) ? OUTPUT_SPANS : OUTPUT_TEXT;
+    const uint8_t *inp = NULL;
+    size_t inlen = 0;
+    uint32_t seed = s->seed;
+    if (j->len == 0) {
+      /* no tokens: an empty line, or a zero-count ids record */
+      if (!((fmt == OUTPUT_IDS) ? outbuf_put_ids(&j->out, NULL, 0) : outbuf_putc(&j->out, '\n'))) err = "out of memory";
+    } else if (!prepare_input(tc, (const uint8_t *)j->req, j->len, s->lossless_ws, 0,
+                              s->normalize, s->fallback_cp, &inp, &inlen) ||
+               !tokenize_reps(s->mb, inp, inlen, tc, &j->out, fmt, s->mode, s->nbest,
+                              s->temperature, s->reps, &seed)) {
+      err = "decode failed";
+    }
+  } else if (j->op == SERVE_OP_TOO_LONG) {
+    err = "request longer than --max_line_bytes";
+  } else {
+    err = "unknown op";
+  }
+  if (err) {
+    j->out.len = 0;
+    j->status = 1;
+    (void)outbuf_put(&j->out, err, strlen(err));
+  }
+}
+
+static void *serve_worker_main(void *arg) {
+  serve_t *s = (serve_t *)arg;
+  tok_ctx_t tc;
+  tok_ctx_init(&tc, s->max_n_cp);
+  tc.cache = s->cache;
+  tc.track_off = 1;  /* any request may ask for spans */
+
+  for (;;) {
+    pthread_mutex_lock(&s->mu);
+    while (!s->head && !s->stop) pthread_cond_wait(&s->cv_work, &s->mu);
+    serve_job_t *j = s->head;
+    if (!j) {
+      pthread_mutex_unlock(&s->mu);
+      break;
+    }
+    s->head = j->next;
+    if (!s->head) s->tail = NULL;
+    pthread_mutex_unlock(&s->mu);
+
+    serve_run_job(s, &tc, j);
+
+    pthread_mutex_lock(&s->mu);
+    j->state = SLOT_DONE;
+    pthread_cond_signal(&j->conn->cv_done);
+    pthread_mutex_unlock(&s->mu);
+  }
+
+  npycrf_stats_t st;
+  tok_ctx_stats(&tc, &st);
+  pthread_mutex_lock(&s->mu);
+  npycrf_stats_add(&s->stats, &st);
+  pthread_mutex_unlock(&s->mu);
+  tok_ctx_free(&tc);
+  return NULL;
+}
+
+static void *serve_conn_reader(void *arg) {
+  serve_conn_t *c = (serve_conn_t *)arg;
+  serve_t *s = c->srv;
+  for (;;) {
+    uint8_t hdr[5];
+    if (!fd_read_full(c->in_fd, hdr, sizeof(hdr))) break;
+    size_t len = (size_t)hdr[0] | ((size_t)hdr[1] << 8) | ((size_t)hdr[2] << 16) | ((size_t)hdr[3] << 24);
+
+    pthread_mutex_lock(&s->mu);
+    while (c->n_read - c->n_written >= SERVE_SLOTS_PER_CONN) pthread_cond_wait(&c->cv_free, &s->mu);
+    pthread_mutex_unlock(&s->mu);
+    serve_job_t *j = &c->jobs[c->n_read % SERVE_SLOTS_PER_CONN];
+
+    j->op = hdr[4];
+    j->len = len;
+    if (len > s->max_req) {
+      /* skip the payload, answer with an error */
+      char skip[4096];
+      size_t left = len;
+      while (left > 0) {
+        size_t n = (left < sizeof(skip)) ? left : sizeof(skip);
+        if (!fd_read_full(c->in_fd, skip, n)) break;
+        left -= n;
+      }
+      if (left > 0) break;
+      j->op = SERVE_OP_TOO_LONG;
+      j->len = 0;
+    } else {
+      if (len + 1u > j->cap) {
+        char *nb = (char *)realloc(j->req, len + 1u);
+        if (!nb) break;
+        j->req = nb;
+        j->cap = len + 1u;
+      }
+      if (len > 0 && !fd_read_full(c->in_fd, j->req, len)) break;
+      j->req[len] = '\0';
+    }
+    j->t_recv = now_sec();
+    j->conn = c;
+    j->next = NULL;
+
+    pthread_mutex_lock(&s->mu);
+    j->state = SLOT_READY;
+    if (s->tail) s->tail->next = j;
+    else s->head = j;
+    s->tail = j;
+    c->n_read++;
+    s->bytes_in += sizeof(hdr) + len;
+    pthread_cond_signal(&s->cv_work);
+    pthread_mutex_unlock(&s->mu);
+  }
+
+  pthread_mutex_lock(&s->mu);
+  c->eof = 1;
+  pthread_cond_signal(&c->cv_done);
+  pthread_mutex_unlock(&s->mu);
+  return NULL;
+}
+
+static void *serve_conn_writer(void *arg) {
+  serve_conn_t *c = (serve_conn_t *)arg;
+  serve_t *s = c->srv;
+  pthread_mutex_lock(&s->mu);
+  for (;;) {
+    /* gather the finished jobs in order, then one write */
+    while (c->n_written < c->n_read) {
+      serve_job_t *j = &c->jobs[c->n_written % SERVE_SLOTS_PER_CONN];
+      if (j->state != SLOT_DONE) break;
+      pthread_mutex_unlock(&s->mu);
+      size_t n = j->out.len;
+      uint8_t hdr[5] = {(uint8_t)(n & 0xFFu), (uint8_t)((n >> 8) & 0xFFu),
+                        (uint8_t)((n >> 16) & 0xFFu), (uint8_t)((n >> 24) & 0xFFu), j->status};
+      if (!c->broken && (!outbuf_put(&c->wout, hdr, sizeof(hdr)) || !outbuf_put(&c->wout, j->out.p, n))) {
+        c->broken = 1;
+      }
+      if (c->wout.len >= TOK_OUT_FLUSH) {
+        if (!c->broken && !fd_write_full(c->out_fd, c->wout.p, c->wout.len)) c->broken = 1;
+        c->wout.len = 0;
+      }
+      double lat = now_sec() - j->t_recv;
+      pthread_mutex_lock(&s->mu);
+      s->requests++;
+      s->errors += (j->status != 0);
+      s->bytes_out += sizeof(hdr) + n;
+      s->lat_hist[serve_lat_bucket(lat)]++;
+      j->state = SLOT_FREE;
+      c->n_written++;
+      pthread_cond_signal(&c->cv_free);
+    }
+    if (c->wout.len > 0) {
+      pthread_mutex_unlock(&s->mu);
+      if (!c->broken && !fd_write_full(c->out_fd, c->wout.p, c->wout.len)) c->broken = 1;
+      c->wout.len = 0;
+      pthread_mutex_lock(&s->mu);
+      continue;
+    }
+    if (c->eof && c->n_written == c->n_read) break;
+    pthread_cond_wait(&c->cv_done, &s->mu);
+  }
+  c->done = 1;
+  pthread_cond_broadcast(&s->cv_conn_done);
+  pthread_mutex_unlock(&s->mu);
+  /* a socket client sees EOF now; the fd itself is closed when the connection is reaped */
+  if (c->in_fd == c->out_fd) shutdown(c->out_fd, SHUT_WR);
+  return NULL;
+}
+
+static serve_conn_t *serve_conn_new(serve_t *s, int in_fd, int out_fd) {
+  serve_conn_t *c = (serve_conn_t *)calloc(1, sizeof(serve_conn_t));
+  if (!c) return NULL;
+  c->in_fd = in_fd;
+  c->out_fd = out_fd;
+  c->srv = s;
+  pthread_cond_init(&c->cv_done, NULL);
+  pthread_cond_init(&c->cv_free, NULL);
+  return c;
+}
+
+static void serve_conn_free(serve_conn_t *c) {
+  for (size_t i = 0; i < SERVE_SLOTS_PER_CONN; i++) {
+    free(c->jobs[i].req);
+    free(c->jobs[i].out.p);
+  }
+  free(c->wout.p);
+  pthread_cond_destroy(&c->cv_done);
+  pthread_cond_destroy(&c->cv_free);
+  free(c);
+}
+
+/* start the reader and writer of a socket connection (0 = failed, c is freed) */
+static int serve_conn_start(serve_t *s, serve_conn_t *c) {
+  serve_block_signals(1);
+  int rc_w = pthread_create(&c->writer, NULL, serve_conn_writer, c);
+  int rc_r = (rc_w == 0) ? pthread_create(&c->reader, NULL, serve_conn_reader, c) : -1;
+  serve_block_signals(0);
+  if (rc_w != 0) {
+    serve_conn_free(c);
+    return 0;
+  }
+  if (rc_r != 0) {
+    pthread_mutex_lock(&s->mu);
+    c->eof = 1;
+    pthread_cond_signal(&c->cv_done);
+    pthread_mutex_unlock(&s->mu);
+    pthread_join(c->writer, NULL);
+    serve_conn_free(c);
+    return 0;
+  }
+  pthread_mutex_lock(&s->mu);
+  c->next = s->conns;
+  s->conns = c;
+  s->connections++;
+  pthread_mutex_unlock(&s->mu);
+  return 1;
+}
+
+/*
+ * stop reading from every connection and give the pending answers
+ * SERVE_DRAIN_SEC; a client that is not reading is then cut off so a writer
+ * blocked on it returns
+ */
+static void serve_drain(serve_t *s) {
+  pthread_mutex_lock(&s->mu);
+  for (serve_conn_t *c = s->conns; c; c = c->next) shutdown(c->in_fd, SHUT_RD);
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += SERVE_DRAIN_SEC;
+  for (;;) {
+    serve_conn_t *c = s->conns;
+    while (c && c->done) c = c->next;
+    if (!c || pthread_cond_timedwait(&s->cv_conn_done, &s->mu, &deadline) == ETIMEDOUT) break;
+  }
+  for (serve_conn_t *c = s->conns; c; c = c->next) {
+    if (!c->done) shutdown(c->in_fd, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&s->mu);
+}
+
+/* join and free connections whose writer has finished (all of them with force) */
+static void serve_reap(serve_t *s, int force) {
+  if (force) serve_drain(s);
+  serve_conn_t **link = &s->conns;
+  for (;;) {
+    pthread_mutex_lock(&s->mu);
+    serve_conn_t *c = *link;
+    int done = c ? c->done : 0;
+    if (c && (done || force)) *link = c->next;
+    pthread_mutex_unlock(&s->mu);
+    if (!c) break;
+    if (!done && !force) {
+      link = &c->next;
+      continue;
+    }
+    pthread_join(c->reader, NULL);
+    pthread_join(c->writer, NULL);
+    close(c->in_fd);
+    serve_conn_free(c);
+  }
+}
+
+static int serve_listen(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "--serve: socket path too long: %s\n", path);
+    return -1;
+  }
+  memcpy(addr.sun_path, path, strlen(path) + 1u);
+
+  /* replace a stale socket, but never another kind of file */
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "--serve: %s exists and is not a socket\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+    fprintf(stderr, "--serve: cannot listen on %s: %s\n", path, strerror(errno));
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void serve_print_stats(serve_t *s) {
+  double sec = now_sec() - s->t_start;
+  fprintf(stderr, "[mmjp_tokenize] serve: %llu requests (%llu errors) from %llu connections in %.2f s\n",
+          (unsigned long long)s->requests, (unsigned long long)s->errors,
+          (unsigned long long)s->connections, sec);
+  for (unsigned b = 0; b < SERVE_LAT_BUCKETS; b++) {
+    if (s->lat_hist[b]) {
+      fprintf(stderr, "  latency <= %8lu us  %llu\n", 1ul << b, (unsigned long long)s->lat_hist[b]);
+    }
+  }
+}
+
+static int tokenize_serve(const mmjp_loaded_model_t *mb, const char *path, unsigned threads,
+                          size_t max_req, int lossless_ws, int normalize, uint32_t fallback_cp,
+                          decode_mode_t mode, uint16_t nbest, double temperature, uint32_t seed,
+                          unsigned reps, size_t max_n_cp, mmjp_cache_t *cache, int show_stats,
+                          npycrf_stats_t *stats_out) {
+  serve_t s;
+  memset(&s, 0, sizeof(s));
+  s.mb = mb;
+  s.lossless_ws = lossless_ws;
+  s.normalize = normalize;
+  s.fallback_cp = fallback_cp;
+  s.mode = mode;
+  s.nbest = nbest;
+  s.temperature = temperature;
+  s.seed = seed;
+  s.reps = reps;
+  s.max_n_cp = max_n_cp;
+  s.max_req = max_req;
+  s.cache = cache;
+  s.t_start = now_sec();
+  pthread_mutex_init(&s.mu, NULL);
+  pthread_cond_init(&s.cv_work, NULL);
+  pthread_cond_init(&s.cv_conn_done, NULL);
+
+  int ok = 1;
+  pthread_t *tids = (pthread_t *)calloc(threads, sizeof(pthread_t));
+  unsigned started = 0;
+  serve_block_signals(1);
+  for (; tids && started < threads; started++) {
+    if (pthread_create(&tids[started], NULL, serve_worker_main, &s) != 0) break;
+  }
+  serve_block_signals(0);
+  if (started == 0) {
+    fprintf(stderr, "failed to start worker threads\n");
+    ok = 0;
+  }
+
+  /* a client that goes away must not kill the server */
+  signal(SIGPIPE, SIG_IGN);
+
+  if (ok && strcmp(path, "-") == 0) {
+    serve_conn_t *c = serve_conn_new(&s, 0, 1);
+    if (c && pthread_create(&c->writer, NULL, serve_conn_writer, c) == 0) {
+      /* the reader runs on this thread */
+      s.connections = 1;
+      (void)serve_conn_reader(c);
+      pthread_join(c->writer, NULL);
+    } else {
+      ok = 0;
+    }
+    if (c) serve_conn_free(c);
+  } else if (ok) {
+    int lfd = serve_listen(path);
+    if (lfd >= 0 && (pipe(g_serve_wake) != 0 || fcntl(g_serve_wake[1], F_SETFL, O_NONBLOCK) != 0)) {
+      fprintf(stderr, "--serve: cannot create the wake-up pipe: %s\n", strerror(errno));
+      close(lfd);
+      unlink(path);
+      lfd = -1;
+    }
+    if (lfd < 0) {
+      ok = 0;
+    } else {
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = serve_on_signal;  /* no SA_RESTART: a blocked accept() returns EINTR */
+      sigemptyset(&sa.sa_mask);
+      sigaction(SIGINT, &sa, NULL);
+      sigaction(SIGTERM, &sa, NULL);
+      fprintf(stderr, "[mmjp_tokenize] serving on %s with %u workers\n", path, started);
+
+      /* a signal between the g_serve_stop check and poll() still wakes it through the pipe */
+      while (!g_serve_stop) {
+        struct pollfd pfd[2];
+        pfd[0].fd = lfd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = g_serve_wake[0];
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, -1) < 0) {
+          if (errno == EINTR) continue;
+          fprintf(stderr, "--serve: poll failed: %s\n", strerror(errno));
+          break;
+        }
+        if (pfd[1].revents) break;
+        if (!pfd[0].revents) continue;
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+          if (errno == EINTR || errno == ECONNABORTED) continue;
+          fprintf(stderr, "--serve: accept failed: %s\n", strerror(errno));
+          break;
+        }
+        serve_reap(&s, 0);
+        serve_conn_t *c = serve_conn_new(&s, fd, fd);
+        if (!c || !serve_conn_start(&s, c)) close(fd);  /* serve_conn_start frees c on failure */
+      }
+      close(lfd);
+      unlink(path);
+      serve_reap(&s, 1);
+      close(g_serve_wake[0]);
+      close(g_serve_wake[1]);
+      g_serve_wake[0] = g_serve_wake[1] = -1;
+    }
+  }
+
+  pthread_mutex_lock(&s.mu);
+  s.stop = 1;
+  pthread_cond_broadcast(&s.cv_work);
+  pthread_mutex_unlock(&s.mu);
+  for (unsigned t = 0; t < started; t++) pthread_join(tids[t], NULL);
+  free(tids);
+
+  if (show_stats) serve_print_stats(&s);
+  if (stats_out) npycrf_stats_add(stats_out, &s.stats);
+  pthread_cond_destroy(&s.cv_work);
+  pthread_cond_destroy(&s.cv_conn_done);
+  pthread_mutex_destroy(&s.mu);
+  return ok;
+}
+#endif /* TOK_HAVE_SERVE */
+
+/* =====================
+ * Streaming read_all mode (--read_all 1, 1-best)
+ *
+ *  - stdin is read in fixed-size chunks, cut at UTF-8 character
+ *    boundaries so lossless encoding / normalization per chunk gives
+ *    the same bytes as on the whole text.
+ *  - npycrf_stream_* commits token boundaries as soon as all Viterbi
+ *    paths agree; only the uncommitted tail of the text is kept.
+ *  - output is identical to the in-memory path (one line, tokens
+ *    separated by spaces) but has no 65,535-codepoint limit.
+ *  - --output ids looks committed tokens up in the vocabulary (the
+ *    stream keeps no span table behind the commit point) and writes a
+ *    single record once the input ends.
+ * ===================== */
+
+#define TOK_STREAM_CHUNK 65536u
+
+/* length of the prefix of buf that does not end in a truncated UTF-8 sequence */
+static size_t utf8_complete_prefix(const uint8_t *buf, size_t n) {
+  size_t back = 0;
+  while (back < 3u && back < n && (buf[n - 1u - back] & 0xC0u) == 0x80u) back++;
+  if (back >= n) return n;
+  uint8_t lead = buf[n - 1u - back];
+  size_t need = 1;
+  if ((lead & 0xE0u) == 0xC0u) need = 2;
+  else if ((lead & 0xF0u) == 0xE0u) need = 3;
+  else if ((lead & 0xF8u) == 0xF0u) need = 4;
+  else if ((lead & 0x80u) != 0) return n;  /* stray byte: let normalize handle it */
+  if (back + 1u < need) return n - 1u - back;
+  return n;
+}
+
+static int tokenize_stdin_stream(const mmjp_loaded_model_t *mb, output_fmt_t fmt, int lossless_ws,
+                                 int normalize, uint32_t fallback_cp, uint32_t window,
+                                 uint64_t *n_in) {
+  npycrf_stream_t st;
+  size_t sbuf_size = npycrf_stream_workbuf_size(mb->m.max_word_len, window);
+  void *sbuf = malloc(sbuf_size);
+  if (!sbuf || npycrf_stream_init(&st, &mb->m, sbuf, sbuf_size, window) != 0) {
+    free(sbuf);
+    return 0;
+  }
+
+  /* feed() stops once fewer than window+1 slots are free; leave room for a chunk of tokens */
+  size_t bcap = (size_t)st.window + 1u + TOK_STREAM_CHUNK;
+  uint64_t *ends = (uint64_t *)malloc(bcap * sizeof(uint64_t));
+  uint8_t *in = (uint8_t *)malloc(TOK_STREAM_CHUNK + 4u);
+
+  /* uncommitted tail of the prepared text; text[0] is at absolute offset text_base */
+  uint8_t *text = NULL;
+  size_t text_len = 0, text_cap = 0;
+  uint64_t text_base = 0;
+
+  tok_ctx_t tc;
+  tok_ctx_init(&tc, 0);
+  outbuf_t ob;
+  memset(&ob, 0, sizeof(ob));
+
+  int ok = (ends && in) ? 1 : 0;
+  int any = 0;
+  size_t n_ids = 0;
+  size_t carry = 0;
+
+  while (ok) {
+    size_t n = fread(in + carry, 1, TOK_STREAM_CHUNK, stdin);
+    if (n_in) *n_in += n;
+    size_t total = carry + n;
+    int eof = (n == 0);
+    size_t complete = eof ? total : utf8_complete_prefix(in, total);
+
+    int fin = 0;
+    if (complete > 0 || eof) {
+      const uint8_t *p = NULL;
+      size_t plen = 0;
+      if (complete > 0 &&
+          !prepare_input(&tc, in, complete, lossless_ws, 1, normalize, fallback_cp, &p, &plen)) {
+        ok = 0;
+        break;
+      }
+
+      if (text_len + plen > text_cap) {
+        size_t nc = text_cap ? text_cap : TOK_STREAM_CHUNK;
+        while (nc < text_len + plen) nc *= 2;
+        uint8_t *nb = (uint8_t *)realloc(text, nc);
+        if (!nb) {
+          ok = 0;
+          break;
+        }
+        text = nb;
+        text_cap = nc;
+      }
+      if (plen > 0) memcpy(text + text_len, p, plen);
+      text_len += plen;
+
+      size_t fed = 0;
+      while (ok) {
+        size_t used = 0, nends = 0;
+        int rc;
+        if (fed < plen) {
+          rc = npycrf_stream_feed(&st, p + fed, plen - fed, &used, ends, bcap, &nends);
+        } else if (eof) {
+          rc = npycrf_stream_finish(&st, ends, bcap, &nends, NULL);
+          fin = 1;
+        } else {
+          break;
+        }
+        if (rc != 0) {
+          fprintf(stderr, "npycrf_stream failed rc=%d\n", rc);
+          ok = 0;
+          break;
+        }
+        fed += used;
+
+        /* print committed tokens */
+        uint64_t prev = text_base;
+        for (size_t i = 0; i < nends && ok && fmt == OUTPUT_IDS; i++) {
+          if (n_ids + 1u > tc.ids_cap) {
+            size_t nc = tc.ids_cap ? tc.ids_cap * 2u : TOK_STREAM_CHUNK;
+            npycrf_id_t *nb = (npycrf_id_t *)realloc(tc.ids, nc * sizeof(npycrf_id_t));
+            if (!nb) {
+              ok = 0;
+              break;
+            }
+            tc.ids = nb;
+            tc.ids_cap = nc;
+          }
+          npycrf_id_t id = NPYCRF_ID_UNK;
+          (void)npycrf_lm_lookup(&mb->m.lm, text + (size_t)(prev - text_base), (size_t)(ends[i] - prev), &id);
+          tc.ids[n_ids++] = id;
+          prev = ends[i];
+        }
+        for (size_t i = 0; i < nends && ok && fmt == OUTPUT_TEXT; i++) {
+          if (any && !outbuf_putc(&ob, ' ')) ok = 0;
+          if (ok && !outbuf_put(&ob, text + (size_t)(prev - text_base), (size_t)(ends[i] - prev))) ok = 0;
+          prev = ends[i];
+          any = 1;
+        }
+        if (prev > text_base) {
+          size_t drop = (size_t)(prev - text_base);
+          memmove(text, text + drop, text_len - drop);
+          text_len -= drop;
+          text_base = prev;
+        }
+        outbuf_flush(&ob, stdout);
+        if (fin) break;
+      }
+    }
+
+    if (eof || fin) break;
+    carry = total - complete;
+    memmove(in, in + complete, carry);
+  }
+
+  if (ok && any) fputc('\n', stdout);
+  if (ok && fmt == OUTPUT_IDS) {
+    ok = outbuf_put_ids(&ob, tc.ids, n_ids);
+    outbuf_flush(&ob, stdout);
+  }
+
+  free(text);
+  free(ob.p);
+  tok_ctx_free(&tc);
+  free(in);
+  free(ends);
+  free(sbuf);
+  return ok;
 }
 
 int main(int argc, char **argv) {
@@ -425,6 +1763,12 @@ int main(int argc, char **argv) {
   size_t max_line_bytes = 16384u;
   int normalize = 1;
   uint32_t fallback_cp = '?';
+  unsigned threads = 1u;
+  output_fmt_t fmt = OUTPUT_TEXT;
+  size_t cache_entries = 0;
+  int throughput = 0;
+  int show_stats = 0;
+  const char *serve_path = NULL;
 
   decode_mode_t mode = MODE_BEST;
   uint16_t nbest = 8;
@@ -436,6 +1780,7 @@ int main(int argc, char **argv) {
   /* lossless options */
   int lossless_ws = -1;  /* -1=auto, 0=off, 1=on */
   int read_all = 0;
+  uint32_t stream_window = 0;  /* 0 = library default */
   int detok_mode = 0;
 
   int argi = 1;
@@ -452,10 +1797,36 @@ int main(int argc, char **argv) {
       const char *fc = argv[++argi];
       /* take first byte as ASCII fallback (recommended: '?') */
       fallback_cp = (uint8_t)fc[0];
+    } else if (strcmp(argv[argi], "--threads") == 0 && argi + 1 < argc) {
+      threads = (unsigned)strtoul(argv[++argi], NULL, 10);
+      if (threads == 0u) threads = 1u;
+      if (threads > 1024u) threads = 1024u;
+    } else if (strcmp(argv[argi], "--output") == 0 && argi + 1 < argc) {
+      const char *v = argv[++argi];
+      if (strcmp(v, "text") == 0) {
+        fmt = OUTPUT_TEXT;
+      } else if (strcmp(v, "ids") == 0) {
+        fmt = OUTPUT_IDS;
+      } else if (strcmp(v, "spans") == 0) {
+        fmt = OUTPUT_SPANS;
+      } else {
+        fprintf(stderr, "unknown --output: %s (expected text, ids or spans)\n", v);
+        return 1;
+      }
+    } else if (strcmp(argv[argi], "--cache") == 0 && argi + 1 < argc) {
+      cache_entries = (size_t)strtoull(argv[++argi], NULL, 10);
+    } else if (strcmp(argv[argi], "--throughput") == 0) {
+      throughput = 1;
+    } else if (strcmp(argv[argi], "--stats") == 0) {
+      show_stats = 1;
+    } else if (strcmp(argv[argi], "--serve") == 0 && argi + 1 < argc) {
+      serve_path = argv[++argi];
     } else if (strcmp(argv[argi], "--lossless_ws") == 0 && argi + 1 < argc) {
       lossless_ws = (int)strtol(argv[++argi], NULL, 10);
     } else if (strcmp(argv[argi], "--read_all") == 0 && argi + 1 < argc) {
       read_all = (int)strtol(argv[++argi], NULL, 10);
+    } else if (strcmp(argv[argi], "--stream_window") == 0 && argi + 1 < argc) {
+      stream_window = (uint32_t)strtoul(argv[++argi], NULL, 10);
     } else if (strcmp(argv[argi], "--detok") == 0) {
       detok_mode = 1;
     } else if (strcmp(argv[argi], "--sample") == 0) {
@@ -488,8 +1859,22 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+#ifdef MMJP_NO_THREADS
+  if (threads > 1u) {
+    fprintf(stderr, "built with MMJP_NO_THREADS: --threads ignored\n");
+    threads = 1u;
+  }
+#endif
+#ifndef TOK_HAVE_SERVE
+  if (serve_path) {
+    fprintf(stderr, "--serve needs a POSIX build with threads\n");
+    return 1;
+  }
+#endif
+
   mmjp_loaded_model_t mb;
-  int rc = mmjp_model_load_bin(model_path, &mb);
+  /* v3 models are mmapped (shared pages across processes); v1/v2 are copied */
+  int rc = mmjp_model_map_bin(model_path, &mb);
   if (rc != 0) {
     fprintf(stderr, "failed to load model rc=%d\n", rc);
     return 1;
@@ -500,164 +1885,142 @@ int main(int argc, char **argv) {
     lossless_ws = (mb.m.flags & NPYCRF_FLAG_LOSSLESS_WS) ? 1 : 0;
   }
 
+  double t_start = now_sec();
+  line_reader_t lr;
+  line_reader_init(&lr, stdin);
+
   /* detokenize mode: read token stream, decode lossless, output original text */
   if (detok_mode) {
     char *line = NULL;
-    size_t cap = 0;
     size_t len = 0;
 
     /* line-by-line detokenization for proper roundtrip */
-    uint8_t *concat_buf = NULL;
-    size_t concat_cap = 0;
+    uint8_t *dec_buf = NULL;
+    size_t dec_cap = 0;
 
-    while (read_line_dynamic(stdin, &line, &cap, &len, max_line_bytes)) {
-      /* split by spaces and concatenate tokens for this line */
+    while (line_reader_next(&lr, &line, &len, max_line_bytes)) {
+      /* drop token separators in place: the tokens of this line, concatenated */
       size_t concat_len = 0;
-      size_t pos = 0;
-      while (pos < len) {
-        /* skip spaces (token separators) */
-        while (pos < len && (line[pos] == ' ' || line[pos] == '\t')) pos++;
-        if (pos >= len) break;
-
-        /* find token end */
-        size_t tok_start = pos;
-        while (pos < len && line[pos] != ' ' && line[pos] != '\t') pos++;
-        size_t tok_len = pos - tok_start;
-
-        /* append to concat buffer */
-        if (concat_len + tok_len + 1 > concat_cap) {
-          size_t new_cap = concat_cap ? concat_cap * 2 : 1024;
-          while (new_cap < concat_len + tok_len + 1) new_cap *= 2;
-          uint8_t *new_buf = (uint8_t *)realloc(concat_buf, new_cap);
-          if (!new_buf) {
-            free(concat_buf);
-            free(line);
-            mmjp_model_free(&mb);
-            return 1;
-          }
-          concat_buf = new_buf;
-          concat_cap = new_cap;
-        }
-        memcpy(concat_buf + concat_len, line + tok_start, tok_len);
-        concat_len += tok_len;
+      for (size_t pos = 0; pos < len; pos++) {
+        if (line[pos] != ' ' && line[pos] != '\t') line[concat_len++] = line[pos];
       }
 
       if (concat_len > 0) {
-        /* decode lossless for this line */
-        size_t dec_len = mmjp_lossless_decode(concat_buf, concat_len, NULL, 0);
-        uint8_t *dec_buf = (uint8_t *)malloc(dec_len + 1);
-        if (dec_buf) {
-          mmjp_lossless_decode(concat_buf, concat_len, dec_buf, dec_len + 1);
-          fwrite(dec_buf, 1, dec_len, stdout);
-          /* only add newline if decoded content doesn't end with newline */
-          if (dec_len == 0 || dec_buf[dec_len - 1] != '\n') {
-            fputc('\n', stdout);
+        /* decoding never grows the text, so one pass into concat_len+1 bytes suffices */
+        if (concat_len + 1 > dec_cap) {
+          uint8_t *nb = (uint8_t *)realloc(dec_buf, concat_len + 1);
+          if (!nb) {
+            free(dec_buf);
+            line_reader_free(&lr);
+            mmjp_model_free(&mb);
+            return 1;
           }
-          free(dec_buf);
+          dec_buf = nb;
+          dec_cap = concat_len + 1;
+        }
+        size_t dec_len = mmjp_lossless_decode((const uint8_t *)line, concat_len, dec_buf, dec_cap);
+        fwrite(dec_buf, 1, dec_len, stdout);
+        /* only add newline if decoded content doesn't end with newline */
+        if (dec_len == 0 || dec_buf[dec_len - 1] != '\n') {
+          fputc('\n', stdout);
         }
       } else {
         /* empty line - output newline to preserve line structure */
         fputc('\n', stdout);
       }
     }
-    free(line);
-    free(concat_buf);
+    free(dec_buf);
 
+    uint64_t in_bytes = lr.n_bytes, in_lines = lr.n_lines;
+    line_reader_free(&lr);
     mmjp_model_free(&mb);
+    if (throughput) print_throughput(in_bytes, in_lines, now_sec() - t_start);
     return 0;
   }
 
-  uint8_t *workbuf = NULL;
-  size_t workcap = 0;
+  mmjp_cache_t cache;
+  if (mmjp_cache_init(&cache, cache_entries, 0, 0) != 0) {
+    fprintf(stderr, "failed to allocate --cache %zu\n", cache_entries);
+    line_reader_free(&lr);
+    mmjp_model_free(&mb);
+    return 1;
+  }
+
+  tok_ctx_t tc;
+  tok_ctx_init(&tc, max_n_cp);
+  if (cache_entries > 0) tc.cache = &cache;
+  tc.track_off = (fmt == OUTPUT_SPANS);
+  outbuf_t ob;
+  memset(&ob, 0, sizeof(ob));
 
-  uint8_t *norm = NULL;
-  size_t norm_cap = 0;
-  npycrf_work_t wk;
-  memset(&wk, 0, sizeof(wk));
-
-  uint16_t *bcp = NULL;
-  size_t bcp_cap = 0;
-  uint16_t *bbytes = NULL;
-  size_t bb_cap = 0;
-
-  /* stochastic/nbest extra buffers */
-  uint8_t *samplebuf = NULL;
-  size_t samplecap = 0;
-  uint8_t *nbestbuf = NULL;
-  size_t nbestcap = 0;
-  uint16_t *bcp_flat = NULL;
-  size_t bcp_flat_cap = 0;
-  size_t *bcount_arr = NULL;
-  size_t bcount_cap = 0;
-  npycrf_score_t *score_arr = NULL;
-  size_t score_cap = 0;
-
-  /* lossless encode buffer */
-  uint8_t *lossless_buf = NULL;
-  size_t lossless_cap = 0;
-
-  /* read_all mode: read all stdin as one text */
+  unsigned reps = 1u;
+  if (mode == MODE_SAMPLE_FFBS || mode == MODE_SAMPLE_NBEST) reps = nsamples;
+
+  int exit_rc = 0;  /* 1 when a run fails after setup (cleanup still runs) */
+
+#ifdef TOK_HAVE_SERVE
+  if (serve_path) {
+    if (!tokenize_serve(&mb, serve_path, threads, max_line_bytes, lossless_ws, normalize,
+                        fallback_cp, mode, nbest, temperature, seed, reps, max_n_cp,
+                        tc.cache, show_stats, &tc.stats)) {
+      fprintf(stderr, "server failed\n");
+      exit_rc = 1;
+    }
+    goto cleanup;
+  }
+#endif
+
+  /* read_all + 1-best: stream stdin through npycrf_stream_* (no length limit) */
+  if (read_all && argi >= argc && mode == MODE_BEST && fmt != OUTPUT_SPANS) {
+    if (!tokenize_stdin_stream(&mb, fmt, lossless_ws, normalize, fallback_cp, stream_window,
+                               &lr.n_bytes)) {
+      fprintf(stderr, "streaming tokenization failed\n");
+      exit_rc = 1;
+    }
+    goto cleanup;
+  }
+
+  /* read_all mode (sampling / n-best): read all stdin as one text */
   if (read_all && argi >= argc) {
     /* read entire stdin */
     uint8_t *all_buf = NULL;
     size_t all_cap = 0;
     size_t all_len = 0;
-    int c;
-    while ((c = fgetc(stdin)) != EOF) {
-      if (all_len + 1 > all_cap) {
-        size_t new_cap = all_cap ? all_cap * 2 : 4096;
+    for (;;) {
+      if (all_cap - all_len < TOK_READ_CHUNK) {
+        size_t new_cap = all_cap ? all_cap * 2 : (size_t)TOK_READ_CHUNK;
         uint8_t *new_buf = (uint8_t *)realloc(all_buf, new_cap);
         if (!new_buf) {
           free(all_buf);
+          mmjp_cache_free(&cache);
+          tok_ctx_free(&tc);
           mmjp_model_free(&mb);
           return 1;
         }
         all_buf = new_buf;
         all_cap = new_cap;
       }
-      all_buf[all_len++] = (uint8_t)c;
+      size_t n = fread(all_buf + all_len, 1, all_cap - all_len, stdin);
+      if (n == 0) break;
+      all_len += n;
     }
+    lr.n_bytes = all_len;
 
     if (all_buf && all_len > 0) {
-      const uint8_t *inp = all_buf;
-      size_t inlen = all_len;
+      const uint8_t *inp = NULL;
+      size_t inlen = 0;
 
       /* lossless encode if enabled (include newlines in read_all mode) */
-      if (lossless_ws > 0) {
-        size_t enc_len = mmjp_lossless_encode(inp, inlen, NULL, 0, 1);
-        if (enc_len + 1 > lossless_cap) {
-          lossless_cap = enc_len + 1;
-          lossless_buf = (uint8_t *)realloc(lossless_buf, lossless_cap);
-        }
-        if (lossless_buf) {
-          mmjp_lossless_encode(inp, inlen, lossless_buf, lossless_cap, 1);
-          inp = lossless_buf;
-          inlen = enc_len;
-        }
-      }
-
-      if (normalize) {
-        size_t nlen = 0;
-        if (!normalize_utf8_canonical(inp, inlen, fallback_cp, &norm, &norm_cap, &nlen)) {
-          fprintf(stderr, "normalize failed\n");
-          free(all_buf);
-          mmjp_model_free(&mb);
-          return 1;
-        }
-        inp = norm;
-        inlen = nlen;
+      if (!prepare_input(&tc, all_buf, all_len, lossless_ws, 1, normalize, fallback_cp, &inp, &inlen)) {
+        free(all_buf);
+        mmjp_cache_free(&cache);
+        tok_ctx_free(&tc);
+        mmjp_model_free(&mb);
+        return 1;
       }
 
-      tokenize_one(&mb, inp, inlen,
-                   &workbuf, &workcap, &wk,
-                   &bcp, &bcp_cap, &bbytes, &bb_cap,
-                   &samplebuf, &samplecap,
-                   &nbestbuf, &nbestcap,
-                   &bcp_flat, &bcp_flat_cap,
-                   &bcount_arr, &bcount_cap,
-                   &score_arr, &score_cap,
-                   mode, nbest, temperature, &seed,
-                   &max_n_cp);
+      tokenize_one(&mb, inp, inlen, &tc, &ob, fmt, mode, nbest, temperature, 1u, &seed);
+      outbuf_flush(&ob, stdout);
     }
     free(all_buf);
     goto cleanup;
@@ -669,6 +2032,8 @@ int main(int argc, char **argv) {
     for (int i = argi; i < argc; i++) total += strlen(argv[i]) + 1;
     char *line = (char *)malloc(total + 1);
     if (!line) {
+      mmjp_cache_free(&cache);
+      tok_ctx_free(&tc);
       mmjp_model_free(&mb);
       return 1;
     }
@@ -677,110 +2042,73 @@ int main(int argc, char **argv) {
       strcat(line, argv[i]);
       if (i + 1 < argc) strcat(line, " ");
     }
-    const uint8_t *inp = (const uint8_t *)line;
-    size_t inlen = strlen(line);
+    const uint8_t *inp = NULL;
+    size_t inlen = 0;
 
     /* lossless encode if enabled */
-    if (lossless_ws > 0) {
-      size_t enc_len = mmjp_lossless_encode(inp, inlen, NULL, 0, 0);
-      if (enc_len + 1 > lossless_cap) {
-        lossless_cap = enc_len + 1;
-        lossless_buf = (uint8_t *)realloc(lossless_buf, lossless_cap);
-      }
-      if (lossless_buf) {
-        mmjp_lossless_encode(inp, inlen, lossless_buf, lossless_cap, 0);
-        inp = lossless_buf;
-        inlen = enc_len;
-      }
-    }
-
-    if (normalize) {
-      size_t nlen = 0;
-      if (!normalize_utf8_canonical(inp, inlen, fallback_cp, &norm, &norm_cap, &nlen)) {
-        fprintf(stderr, "normalize failed\n");
-        free(line);
-        mmjp_model_free(&mb);
-        return 1;
-      }
-      inp = norm;
-      inlen = nlen;
-    }
-    unsigned reps = 1u;
-    if (mode == MODE_SAMPLE_FFBS || mode == MODE_SAMPLE_NBEST) reps = nsamples;
-    for (unsigned r = 0; r < reps; r++) {
-      tokenize_one(&mb, inp, inlen,
-                   &workbuf, &workcap, &wk,
-                   &bcp, &bcp_cap, &bbytes, &bb_cap,
-                   &samplebuf, &samplecap,
-                   &nbestbuf, &nbestcap,
-                   &bcp_flat, &bcp_flat_cap,
-                   &bcount_arr, &bcount_cap,
-                   &score_arr, &score_cap,
-                   mode, nbest, temperature, &seed,
-                   &max_n_cp);
+    if (!prepare_input(&tc, (const uint8_t *)line, strlen(line), lossless_ws, 0, normalize, fallback_cp, &inp, &inlen)) {
+      free(line);
+      mmjp_cache_free(&cache);
+      tok_ctx_free(&tc);
+      mmjp_model_free(&mb);
+      return 1;
     }
+    (void)tokenize_reps(&mb, inp, inlen, &tc, &ob, fmt, mode, nbest, temperature, reps, &seed);
+    outbuf_flush(&ob, stdout);
     free(line);
+#ifndef MMJP_NO_THREADS
+  } else if (threads > 1u) {
+    if (!tokenize_stdin_threaded(&mb, threads, &lr, max_line_bytes, lossless_ws,
+                                 normalize, fallback_cp, fmt, mode, nbest,
+                                 temperature, seed, reps, max_n_cp,
+                                 tc.cache, &tc.stats)) {
+      fprintf(stderr, "threaded tokenization failed\n");
+      exit_rc = 1;
+    }
+#endif
   } else {
     char *line = NULL;
-    size_t cap = 0;
     size_t len = 0;
-    while (read_line_dynamic(stdin, &line, &cap, &len, max_line_bytes)) {
+    for (;;) {
+      /* one fwrite per TOK_OUT_FLUSH bytes, or before waiting for more input */
+      if (ob.len >= TOK_OUT_FLUSH || !line_reader_ready(&lr)) outbuf_flush(&ob, stdout);
+      if (!line_reader_next(&lr, &line, &len, max_line_bytes)) break;
       if (len == 0) continue;
-      const uint8_t *inp = (const uint8_t *)line;
-      size_t inlen = len;
+      const uint8_t *inp = NULL;
+      size_t inlen = 0;
 
       /* lossless encode if enabled */
-      if (lossless_ws > 0) {
-        size_t enc_len = mmjp_lossless_encode(inp, inlen, NULL, 0, 0);
-        if (enc_len + 1 > lossless_cap) {
-          lossless_cap = enc_len + 1;
-          lossless_buf = (uint8_t *)realloc(lossless_buf, lossless_cap);
-        }
-        if (lossless_buf) {
-          mmjp_lossless_encode(inp, inlen, lossless_buf, lossless_cap, 0);
-          inp = lossless_buf;
-          inlen = enc_len;
-        }
-      }
-
-      if (normalize) {
-        size_t nlen = 0;
-        if (!normalize_utf8_canonical(inp, inlen, fallback_cp, &norm, &norm_cap, &nlen)) {
-          fprintf(stderr, "normalize failed\n");
-          break;
-        }
-        inp = norm;
-        inlen = nlen;
-      }
-      unsigned reps = 1u;
-      if (mode == MODE_SAMPLE_FFBS || mode == MODE_SAMPLE_NBEST) reps = nsamples;
-      for (unsigned r = 0; r < reps; r++) {
-        tokenize_one(&mb, inp, inlen,
-                     &workbuf, &workcap, &wk,
-                     &bcp, &bcp_cap, &bbytes, &bb_cap,
-                     &samplebuf, &samplecap,
-                     &nbestbuf, &nbestcap,
-                     &bcp_flat, &bcp_flat_cap,
-                     &bcount_arr, &bcount_cap,
-                     &score_arr, &score_cap,
-                     mode, nbest, temperature, &seed,
-                     &max_n_cp);
+      if (!prepare_input(&tc, (const uint8_t *)line, len, lossless_ws, 0, normalize, fallback_cp, &inp, &inlen)) {
+        fprintf(stderr, "tokenization failed\n");
+        exit_rc = 1;
+        break;
       }
+      (void)tokenize_reps(&mb, inp, inlen, &tc, &ob, fmt, mode, nbest, temperature, reps, &seed);
     }
-    free(line);
+    outbuf_flush(&ob, stdout);
   }
 
 cleanup:
-  free(workbuf);
-  free(norm);
-  free(bcp);
-  free(bbytes);
-  free(samplebuf);
-  free(nbestbuf);
-  free(bcp_flat);
-  free(bcount_arr);
-  free(score_arr);
-  free(lossless_buf);
+  if (cache_entries > 0) {
+    mmjp_cache_stats_t cs;
+    mmjp_cache_get_stats(&cache, &cs);
+    fprintf(stderr, "[mmjp_tokenize] cache: hits=%llu misses=%llu entries=%zu evictions=%llu\n",
+            (unsigned long long)cs.hits, (unsigned long long)cs.misses, cs.entries,
+            (unsigned long long)cs.evictions);
+  }
+  if (show_stats) {
+    npycrf_stats_t st;
+    tok_ctx_stats(&tc, &st);
+    print_stats(&st);
+  }
+  if (throughput) {
+    fflush(stdout);
+    print_throughput(lr.n_bytes, lr.n_lines, now_sec() - t_start);
+  }
+  line_reader_free(&lr);
+  mmjp_cache_free(&cache);
+  tok_ctx_free(&tc);
+  free(ob.p);
   mmjp_model_free(&mb);
-  return 0;
+  return exit_rc;
 }
@@ -10,11 +10,27 @@
  *  - 品詞推定なし、未知語強い
  */
 
+#if !defined(_WIN32) && !defined(MMJP_NO_MMAP) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* mmap/fstat under -std=c99 */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
+#if !defined(_WIN32) && !defined(MMJP_NO_MMAP)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MMJP_HAVE_MMAP 1
+#endif
+
+#ifndef MMJP_NO_THREADS
+#include <pthread.h>
+#endif
+
 #include "../suffix_array/sa_utf8.h"
 #include "../unilm_mdl/unilm_mdl.h"
 #include "../npycrf_lite/npycrf_lite.h"
@@ -278,11 +294,106 @@ static int u32set_contains(const u32set_t *s, uint32_t key) {
 }
 
 /* =====================
- *  file line iterator for UniLM
+ *  corpus image + line index
+ *  - コーパスは一度だけ mmap（使えない環境では一括読み込み）し、
+ *    行頭オフセットの索引を作る。以降のパス（文字数え、候補サンプル、
+ *    EM の各反復、擬似ラベル生成）はすべてこの像から読み、ファイルは読み直さない。
+ *  - 索引は1行 8 バイト。行番号で直接引けるので、行範囲ごとの分担にも使える。
+ * ===================== */
+
+typedef struct {
+  const uint8_t *data;
+  size_t len;
+  size_t *line_off; /* [n_lines+1] 行 i は [line_off[i], line_off[i+1]-1)（末尾の '\n' を除く） */
+  size_t n_lines;
+  void *mapped;     /* mmap した場合 */
+  uint8_t *owned;   /* 読み込んだ場合 */
+} corpus_map_t;
+
+static void corpus_map_close(corpus_map_t *cm) {
+  if (!cm) return;
+#ifdef MMJP_HAVE_MMAP
+  if (cm->mapped) munmap(cm->mapped, cm->len);
+#endif
+  free(cm->owned);
+  free(cm->line_off);
+  memset(cm, 0, sizeof(*cm));
+}
+
+static int corpus_map_open(const char *path, corpus_map_t *cm) {
+  if (!path || !cm) return 0;
+  memset(cm, 0, sizeof(*cm));
+#ifdef MMJP_HAVE_MMAP
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (addr != MAP_FAILED) {
+#ifdef POSIX_MADV_SEQUENTIAL
+        (void)posix_madvise(addr, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+        cm->mapped = addr;
+        cm->data = (const uint8_t *)addr;
+        cm->len = (size_t)st.st_size;
+      }
+    }
+    close(fd);
+  }
+#endif
+  if (!cm->data) {
+    /* mmap なし（または空ファイル）: 一括読み込み */
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    size_t cap = 1u << 20;
+    cm->owned = (uint8_t *)malloc(cap);
+    for (;;) {
+      if (!cm->owned) {
+        fclose(f);
+        corpus_map_close(cm);
+        return 0;
+      }
+      cm->len += fread(cm->owned + cm->len, 1, cap - cm->len, f);
+      if (cm->len < cap) break;
+      cap *= 2;
+      uint8_t *nb = (uint8_t *)realloc(cm->owned, cap);
+      if (!nb) free(cm->owned);
+      cm->owned = nb;
+    }
+    fclose(f);
+    cm->data = cm->owned;
+  }
+
+  /* 行頭索引 */
+  size_t n = 0;
+  for (const uint8_t *p = cm->data, *e = cm->data + cm->len; p < e; n++) {
+    const uint8_t *nl = (const uint8_t *)memchr(p, '\n', (size_t)(e - p));
+    p = nl ? nl + 1 : e;
+  }
+  cm->line_off = (size_t *)malloc((n + 1u) * sizeof(size_t));
+  if (!cm->line_off) {
+    corpus_map_close(cm);
+    return 0;
+  }
+  size_t i = 0;
+  for (const uint8_t *p = cm->data, *e = cm->data + cm->len; p < e; i++) {
+    cm->line_off[i] = (size_t)(p - cm->data);
+    const uint8_t *nl = (const uint8_t *)memchr(p, '\n', (size_t)(e - p));
+    p = nl ? nl + 1 : e;
+  }
+  /* 最終行に '\n' がなくても同じ式で終端が求まるように +1 */
+  cm->line_off[n] = cm->len + ((cm->len > 0 && cm->data[cm->len - 1] != '\n') ? 1u : 0u);
+  cm->n_lines = n;
+  return 1;
+}
+
+/* =====================
+ *  corpus line iterator for UniLM
  * ===================== */
 
 typedef struct {
-  FILE *f;
+  const corpus_map_t *cm;
+  size_t line; /* 次に読む行番号 */
   uint8_t *buf;
   size_t cap;
   size_t len;
@@ -316,37 +427,35 @@ typedef struct {
 } file_iter_t;
 
 static int file_iter_reset(file_iter_t *it) {
-  if (!it || !it->f) return 0;
-  fseek(it->f, 0, SEEK_SET);
+  if (!it || !it->cm) return 0;
+  it->line = 0;
   return 1;
 }
 
 static int file_iter_readline(file_iter_t *it) {
-  if (!it || !it->f) return -1;
+  if (!it || !it->cm) return -1;
   it->len = 0;
   it->last_cp = 0;
-  int c;
-  while ((c = fgetc(it->f)) != EOF) {
-    if (c == '\n') break;
-    if (it->max_line_bytes > 0 && it->len >= it->max_line_bytes) {
-      /* discard until end of line */
-      while (c != EOF && c != '\n') c = fgetc(it->f);
-      it->len = 0;
-      it->stat_skipped_long_bytes++;
-      /* スキップした「1行」として扱い、呼び出し側で空行として捨てる */
-      it->mapped_len = 0;
-      return 1;
-    }
-    if (it->len + 1 > it->cap) {
-      size_t newcap = it->cap ? it->cap * 2 : 256;
-      uint8_t *nb = (uint8_t *)realloc(it->buf, newcap);
-      if (!nb) return -2;
-      it->buf = nb;
-      it->cap = newcap;
-    }
-    it->buf[it->len++] = (uint8_t)c;
+  if (it->line >= it->cm->n_lines) return 0; /* end */
+  size_t off = it->cm->line_off[it->line];
+  size_t n = it->cm->line_off[it->line + 1] - 1u - off;
+  it->line++;
+  if (it->max_line_bytes > 0 && n > it->max_line_bytes) {
+    it->stat_skipped_long_bytes++;
+    /* スキップした「1行」として扱い、呼び出し側で空行として捨てる */
+    it->mapped_len = 0;
+    return 1;
   }
-  if (c == EOF && it->len == 0) return 0; /* end */
+  if (n + 1 > it->cap) {
+    size_t newcap = it->cap ? it->cap * 2 : 256;
+    while (newcap < n + 1) newcap *= 2;
+    uint8_t *nb = (uint8_t *)realloc(it->buf, newcap);
+    if (!nb) return -2;
+    it->buf = nb;
+    it->cap = newcap;
+  }
+  memcpy(it->buf, it->cm->data + off, n);
+  it->len = n;
 
   /* trim CR */
   while (it->len > 0 && (it->buf[it->len - 1] == '\r' || it->buf[it->len - 1] == ' ' || it->buf[it->len - 1] == '\t')) {
@@ -1021,40 +1130,72 @@ typedef struct {
   uint16_t n;   /* length */
 } crf_sent_t;
 
+/*
+ * 文の cls / y はすべて1本のアリーナに [cls n][y n] の順で詰める（文ごとの malloc なし）。
+ * 追加中はアリーナが再確保で動くので、s[i].cls / s[i].y は crf_dataset_finish() で確定する。
+ */
 typedef struct {
   crf_sent_t *s;
   size_t n;
   size_t cap;
   size_t total_pos;
+  uint8_t *arena;   /* [2*total_pos] */
+  size_t arena_cap;
 } crf_dataset_t;
 
 static void crf_dataset_free(crf_dataset_t *ds) {
   if (!ds) return;
-  for (size_t i = 0; i < ds->n; i++) {
-    free(ds->s[i].cls);
-    free(ds->s[i].y);
-  }
   free(ds->s);
+  free(ds->arena);
   memset(ds, 0, sizeof(*ds));
 }
 
-static int crf_dataset_push(crf_dataset_t *ds, uint8_t *cls, uint8_t *y, uint16_t n) {
-  if (!ds || !cls || !y || n == 0) return 0;
+/* n 文字分の領域（cls=[0,n), y=[n,2n)）を末尾に確保して文を登録。ポインタは次の alloc まで有効 */
+static uint8_t *crf_dataset_alloc(crf_dataset_t *ds, uint16_t n) {
+  if (!ds || n == 0) return NULL;
   if (ds->n + 1 > ds->cap) {
     size_t nc = ds->cap ? ds->cap * 2 : 256;
     crf_sent_t *ns = (crf_sent_t *)realloc(ds->s, nc * sizeof(crf_sent_t));
-    if (!ns) return 0;
+    if (!ns) return NULL;
     ds->s = ns;
     ds->cap = nc;
   }
-  ds->s[ds->n].cls = cls;
-  ds->s[ds->n].y = y;
+  size_t used = 2u * ds->total_pos;
+  if (used + 2u * n > ds->arena_cap) {
+    size_t nc = ds->arena_cap ? ds->arena_cap * 2 : 65536u;
+    while (nc < used + 2u * n) nc *= 2;
+    uint8_t *na = (uint8_t *)realloc(ds->arena, nc);
+    if (!na) return NULL;
+    ds->arena = na;
+    ds->arena_cap = nc;
+  }
+  ds->s[ds->n].cls = NULL;
+  ds->s[ds->n].y = NULL;
   ds->s[ds->n].n = n;
   ds->n++;
   ds->total_pos += n;
+  return ds->arena + used;
+}
+
+static int crf_dataset_push(crf_dataset_t *ds, const uint8_t *cls, const uint8_t *y, uint16_t n) {
+  if (!cls || !y) return 0;
+  uint8_t *p = crf_dataset_alloc(ds, n);
+  if (!p) return 0;
+  memcpy(p, cls, n);
+  memcpy(p + n, y, n);
   return 1;
 }
 
+/* アリーナ内の位置を s[i].cls / s[i].y に書く（追加が終わったら一度呼ぶ） */
+static void crf_dataset_finish(crf_dataset_t *ds) {
+  size_t off = 0;
+  for (size_t i = 0; i < ds->n; i++) {
+    ds->s[i].cls = ds->arena + off;
+    ds->s[i].y = ds->arena + off + ds->s[i].n;
+    off += 2u * ds->s[i].n;
+  }
+}
+
 /* segmented line format: tokens separated by spaces/tabs.
  * Example: "東京 都 に 住んで い ます" (space-separated).
  */
@@ -1139,14 +1280,14 @@ static int crf_parse_segmented_line(const uint8_t *line, size_t len,
 static int crf_dataset_load(const char *path, size_t max_line_bytes, size_t max_sentence_cp, crf_dataset_t *out) {
   if (!path || !out) return 0;
   memset(out, 0, sizeof(*out));
-  FILE *f = fopen(path, "rb");
-  if (!f) {
+  corpus_map_t cm;
+  if (!corpus_map_open(path, &cm)) {
     fprintf(stderr, "[mmjp_train] CRF supervised: cannot open %s\n", path);
     return 0;
   }
   file_iter_t it;
   memset(&it, 0, sizeof(it));
-  it.f = f;
+  it.cm = &cm;
   it.max_line_bytes = max_line_bytes;
   it.max_sentence_cp = max_sentence_cp;
   it.skip_long_cp = 1;
@@ -1159,7 +1300,7 @@ static int crf_dataset_load(const char *path, size_t max_line_bytes, size_t max_
     if (rc < 0) {
       fprintf(stderr, "[mmjp_train] CRF supervised: readline failed rc=%d\n", rc);
       crf_dataset_free(out);
-      fclose(f);
+      corpus_map_close(&cm);
       free(it.buf);
       free(it.mapped);
       return 0;
@@ -1171,116 +1312,140 @@ static int crf_dataset_load(const char *path, size_t max_line_bytes, size_t max_
     if (!crf_parse_segmented_line(it.buf, it.len, &cls, &y, &n, max_sentence_cp)) {
       continue; /* skip invalid/too long */
     }
-    if (!crf_dataset_push(out, cls, y, n)) {
-      free(cls);
-      free(y);
+    int pushed = crf_dataset_push(out, cls, y, n);
+    free(cls);
+    free(y);
+    if (!pushed) {
       crf_dataset_free(out);
-      fclose(f);
+      corpus_map_close(&cm);
       free(it.buf);
       free(it.mapped);
       return 0;
     }
   }
 
-  fclose(f);
+  corpus_map_close(&cm);
   free(it.buf);
   free(it.mapped);
+  crf_dataset_finish(out);
   return 1;
 }
 
-/*
- * 教師なしCRFデータ生成（LM-only Viterbi で擬似ラベルを作成）
- */
-static int crf_dataset_from_lm_viterbi(const char *corpus_path,
-                                       size_t max_line_bytes,
-                                       size_t max_sentence_cp,
-                                       const unilm_model_t *um,
-                                       unilm_workspace_t *wk,
-                                       int max_piece_len_cp,
-                                       size_t limit_sentences,
-                                       crf_dataset_t *out) {
-  if (!corpus_path || !um || !wk || !out) return 0;
-  memset(out, 0, sizeof(*out));
+/* =====================
+ *  教師なしCRFデータ生成（LM-only Viterbi で擬似ラベルを作成）
+ *  - コーパスを CRF_LABEL_BLOCK_LINES 行のブロックに分け、空いたスレッドが次の
+ *    ブロックを取る。スレッドごとに unilm_workspace_t を持ち、ブロックごとの
+ *    データセット（アリーナ）に書く。
+ *  - 最後にブロック順で連結し、先頭から limit 文で打ち切るので、結果は
+ *    スレッド数に依存しない。先頭から連続して終わったブロックの文数が
+ *    limit に達した時点で、新しいブロックは配らない。
+ * ===================== */
 
-  FILE *f = fopen(corpus_path, "rb");
-  if (!f) {
-    fprintf(stderr, "[crf_unsup] cannot open %s\n", corpus_path);
-    return 0;
-  }
+#define CRF_LABEL_BLOCK_LINES 1024u
 
-  file_iter_t it;
-  memset(&it, 0, sizeof(it));
-  it.f = f;
-  it.max_line_bytes = max_line_bytes;
-  it.max_sentence_cp = max_sentence_cp;
-  it.skip_long_cp = 1;
-  it.keep_chars = NULL;
-  it.fallback_cp = (uint32_t)'?';
+typedef struct {
+  crf_dataset_t ds;
+  size_t n_read;
+  size_t n_ok;
+  size_t n_err;
+  int done;
+} crf_label_block_t;
 
-  /* Viterbi output buffer */
-  size_t ids_cap = max_sentence_cp;
-  uint32_t *ids = (uint32_t *)malloc(ids_cap * sizeof(uint32_t));
-  if (!ids) {
-    fclose(f);
-    return 0;
-  }
+typedef struct {
+  const corpus_map_t *cm;
+  const unilm_model_t *um;
+  int max_piece_len_cp;
+  size_t max_line_bytes;
+  size_t max_sentence_cp;
+  size_t limit;
+
+  crf_label_block_t *blk; /* [n_blk] */
+  size_t n_blk;
+  size_t next_blk;   /* 次に配るブロック */
+  size_t prefix_blk; /* [0, prefix_blk) は終了済み */
+  size_t prefix_sent;
+  int stop;
+  int failed;
+#ifndef MMJP_NO_THREADS
+  pthread_mutex_t mu;
+#endif
+} crf_label_job_t;
 
-  size_t n_sent = 0;
-  size_t n_read = 0;
-  size_t n_viterbi_ok = 0;
-  size_t n_viterbi_err = 0;
-  while (n_sent < limit_sentences) {
-    int r = file_iter_readline(&it);
-    if (r == 0) break;
-    if (r < 0) {
-      fprintf(stderr, "[crf_unsup] readline failed rc=%d\n", r);
-      break;
+typedef struct {
+  crf_label_job_t *job;
+  unilm_workspace_t *wk;
+  unilm_workspace_t own_wk;
+  int own;
+} crf_label_worker_t;
+
+/* 1文にラベルを付けて ds に追加。1=追加, 0=対象外, -1=確保失敗 */
+static int crf_label_sentence(const crf_label_job_t *job, unilm_workspace_t *wk,
+                              uint32_t *ids, const uint8_t *s, size_t sl,
+                              crf_label_block_t *b) {
+  /* Count codepoints first */
+  size_t n_cp = 0;
+  for (size_t pos = 0; pos < sl; ) {
+    uint32_t cp = 0;
+    size_t adv = 0;
+    if (!utf8_decode1(s, sl, pos, &cp, &adv)) {
+      pos++;
+      continue;
     }
-    if (it.len == 0) continue;
-    n_read++;
+    n_cp++;
+    pos += adv;
+  }
+  if (n_cp == 0 || n_cp > job->max_sentence_cp) return 0;
+
+  /* Run LM-only Viterbi */
+  const unilm_model_t *um = job->um;
+  size_t out_n = 0;
+  int rc = unilm_viterbi_tokenize(um, s, sl, job->max_piece_len_cp, wk, ids, job->max_sentence_cp, &out_n);
+  int use_char_fallback = (rc != UNILM_OK || out_n == 0);
+  if (use_char_fallback) {
+    b->n_err++;
+  } else {
+    b->n_ok++;
+  }
 
-    const uint8_t *s = it.buf;
-    size_t sl = it.len;
+  uint8_t *cls = crf_dataset_alloc(&b->ds, (uint16_t)n_cp);
+  if (!cls) return -1;
+  uint8_t *y = cls + n_cp;
 
-    /* Count codepoints first */
-    size_t n_cp = 0;
-    for (size_t pos = 0; pos < sl; ) {
+  if (use_char_fallback) {
+    /* Fallback: character-level tokenization (all chars are boundaries) */
+    memset(y, 1, n_cp);  /* all boundaries */
+    size_t byte_pos = 0;
+    size_t cp_idx = 0;
+    while (byte_pos < sl && cp_idx < n_cp) {
       uint32_t cp = 0;
       size_t adv = 0;
-      if (!utf8_decode1(s, sl, pos, &cp, &adv)) {
-        pos++;
+      if (!utf8_decode1(s, sl, byte_pos, &cp, &adv)) {
+        byte_pos++;
         continue;
       }
-      n_cp++;
-      pos += adv;
-    }
-    if (n_cp == 0 || n_cp > max_sentence_cp) continue;
-
-    /* Run LM-only Viterbi */
-    size_t out_n = 0;
-    int rc = unilm_viterbi_tokenize(um, s, sl, max_piece_len_cp, wk, ids, ids_cap, &out_n);
-    int use_char_fallback = (rc != UNILM_OK || out_n == 0);
-    if (use_char_fallback) {
-      n_viterbi_err++;
-    } else {
-      n_viterbi_ok++;
-    }
-
-    /* Allocate cls and y */
-    uint8_t *cls = (uint8_t *)malloc(n_cp);
-    uint8_t *y = (uint8_t *)malloc(n_cp);
-    if (!cls || !y) {
-      free(cls);
-      free(y);
-      continue;
+      cls[cp_idx] = npycrf_char_class_cp(NULL, cp);
+      cp_idx++;
+      byte_pos += adv;
     }
-
-    if (use_char_fallback) {
-      /* Fallback: character-level tokenization (all chars are boundaries) */
-      memset(y, 1, n_cp);  /* all boundaries */
-      size_t byte_pos = 0;
-      size_t cp_idx = 0;
-      while (byte_pos < sl && cp_idx < n_cp) {
+  } else {
+    /* Build boundary array from Viterbi output */
+    memset(y, 0, n_cp);
+    size_t cp_idx = 0;
+    size_t piece_idx = 0;
+    size_t byte_pos = 0;
+
+    while (byte_pos < sl && cp_idx < n_cp && piece_idx < out_n) {
+      /* Get current piece length */
+      size_t piece_bytes = 0;
+      const uint8_t *piece_str = unilm_model_piece_bytes(um, ids[piece_idx], &piece_bytes);
+      (void)piece_str;
+
+      /* Mark boundary at start of this piece */
+      y[cp_idx] = 1;
+
+      /* Consume codepoints for this piece */
+      size_t consumed_bytes = 0;
+      while (consumed_bytes < piece_bytes && byte_pos < sl && cp_idx < n_cp) {
         uint32_t cp = 0;
         size_t adv = 0;
         if (!utf8_decode1(s, sl, byte_pos, &cp, &adv)) {
@@ -1290,73 +1455,221 @@ static int crf_dataset_from_lm_viterbi(const char *corpus_path,
         cls[cp_idx] = npycrf_char_class_cp(NULL, cp);
         cp_idx++;
         byte_pos += adv;
+        consumed_bytes += adv;
       }
-    } else {
-      /* Build boundary array from Viterbi output */
-      memset(y, 0, n_cp);
-      size_t cp_idx = 0;
-      size_t piece_idx = 0;
-      size_t byte_pos = 0;
-
-      while (byte_pos < sl && cp_idx < n_cp && piece_idx < out_n) {
-        /* Get current piece length */
-        size_t piece_bytes = 0;
-        const uint8_t *piece_str = unilm_model_piece_bytes(um, ids[piece_idx], &piece_bytes);
-        (void)piece_str;
-
-        /* Mark boundary at start of this piece */
-        y[cp_idx] = 1;
-
-        /* Consume codepoints for this piece */
-        size_t consumed_bytes = 0;
-        while (consumed_bytes < piece_bytes && byte_pos < sl && cp_idx < n_cp) {
-          uint32_t cp = 0;
-          size_t adv = 0;
-          if (!utf8_decode1(s, sl, byte_pos, &cp, &adv)) {
-            byte_pos++;
-            continue;
-          }
-          cls[cp_idx] = npycrf_char_class_cp(NULL, cp);
-          cp_idx++;
-          byte_pos += adv;
-          consumed_bytes += adv;
-        }
-        piece_idx++;
-      }
+      piece_idx++;
+    }
 
-      /* Fill remaining cls if any */
-      while (byte_pos < sl && cp_idx < n_cp) {
-        uint32_t cp = 0;
-        size_t adv = 0;
-        if (!utf8_decode1(s, sl, byte_pos, &cp, &adv)) {
-          byte_pos++;
-          continue;
-        }
-        cls[cp_idx] = npycrf_char_class_cp(NULL, cp);
-        y[cp_idx] = 1;  /* mark as boundary */
-        cp_idx++;
-        byte_pos += adv;
+    /* Fill remaining cls if any */
+    while (byte_pos < sl && cp_idx < n_cp) {
+      uint32_t cp = 0;
+      size_t adv = 0;
+      if (!utf8_decode1(s, sl, byte_pos, &cp, &adv)) {
+        byte_pos++;
+        continue;
       }
+      cls[cp_idx] = npycrf_char_class_cp(NULL, cp);
+      y[cp_idx] = 1;  /* mark as boundary */
+      cp_idx++;
+      byte_pos += adv;
     }
+  }
 
-    /* Enforce y[0] = 1 */
-    if (n_cp > 0) y[0] = 1;
+  /* Enforce y[0] = 1 */
+  y[0] = 1;
+  return 1;
+}
 
-    if (!crf_dataset_push(out, cls, y, (uint16_t)n_cp)) {
-      free(cls);
-      free(y);
-      continue;
+/* ブロック bi の行を順にラベル付け（ブロック内でも limit 文で止める） */
+static int crf_label_block(crf_label_job_t *job, unilm_workspace_t *wk, uint32_t *ids,
+                           file_iter_t *it, size_t bi) {
+  crf_label_block_t *b = &job->blk[bi];
+  size_t end = (bi + 1u) * CRF_LABEL_BLOCK_LINES;
+  if (end > job->cm->n_lines) end = job->cm->n_lines;
+  it->line = bi * CRF_LABEL_BLOCK_LINES;
+  while (it->line < end && b->ds.n < job->limit) {
+    int r = file_iter_readline(it);
+    if (r == 0) break;
+    if (r < 0) {
+      fprintf(stderr, "[crf_unsup] readline failed rc=%d\n", r);
+      return 0;
     }
-    n_sent++;
+    if (it->len == 0) continue;
+    b->n_read++;
+    if (crf_label_sentence(job, wk, ids, it->buf, it->len, b) < 0) return 0;
+  }
+  return 1;
+}
+
+#ifndef MMJP_NO_THREADS
+#define CRF_LABEL_LOCK(j) pthread_mutex_lock(&(j)->mu)
+#define CRF_LABEL_UNLOCK(j) pthread_mutex_unlock(&(j)->mu)
+#else
+#define CRF_LABEL_LOCK(j) ((void)0)
+#define CRF_LABEL_UNLOCK(j) ((void)0)
+#endif
+
+static void crf_label_run(crf_label_worker_t *w) {
+  crf_label_job_t *job = w->job;
+  file_iter_t it;
+  memset(&it, 0, sizeof(it));
+  it.cm = job->cm;
+  it.max_line_bytes = job->max_line_bytes;
+  it.max_sentence_cp = job->max_sentence_cp;
+  it.skip_long_cp = 1;
+  it.keep_chars = NULL;
+  it.fallback_cp = (uint32_t)'?';
+
+  /* Viterbi output buffer */
+  uint32_t *ids = (uint32_t *)malloc(job->max_sentence_cp * sizeof(uint32_t));
+  int ok = (ids != NULL);
+
+  while (ok) {
+    CRF_LABEL_LOCK(job);
+    size_t bi = job->next_blk;
+    int more = !job->stop && !job->failed && bi < job->n_blk;
+    if (more) job->next_blk++;
+    CRF_LABEL_UNLOCK(job);
+    if (!more) break;
+
+    ok = crf_label_block(job, w->wk, ids, &it, bi);
+
+    CRF_LABEL_LOCK(job);
+    job->blk[bi].done = 1;
+    while (job->prefix_blk < job->n_blk && job->blk[job->prefix_blk].done) {
+      job->prefix_sent += job->blk[job->prefix_blk].ds.n;
+      job->prefix_blk++;
+    }
+    if (job->prefix_sent >= job->limit) job->stop = 1;
+    if (!ok) job->failed = 1;
+    CRF_LABEL_UNLOCK(job);
   }
 
   free(ids);
-  fclose(f);
   free(it.buf);
   free(it.mapped);
+}
+
+#ifndef MMJP_NO_THREADS
+static void *crf_label_thread(void *arg) {
+  crf_label_run((crf_label_worker_t *)arg);
+  return NULL;
+}
+#endif
+
+static int crf_dataset_from_lm_viterbi(const corpus_map_t *cm,
+                                       size_t max_line_bytes,
+                                       size_t max_sentence_cp,
+                                       const unilm_model_t *um,
+                                       unilm_workspace_t *wk,
+                                       int max_piece_len_cp,
+                                       size_t limit_sentences,
+                                       int threads,
+                                       crf_dataset_t *out) {
+  if (!cm || !um || !wk || !out) return 0;
+  memset(out, 0, sizeof(*out));
+
+  crf_label_job_t job;
+  memset(&job, 0, sizeof(job));
+  job.cm = cm;
+  job.um = um;
+  job.max_piece_len_cp = max_piece_len_cp;
+  job.max_line_bytes = max_line_bytes;
+  job.max_sentence_cp = max_sentence_cp;
+  job.limit = limit_sentences;
+  job.n_blk = (cm->n_lines + CRF_LABEL_BLOCK_LINES - 1u) / CRF_LABEL_BLOCK_LINES;
+  if (max_sentence_cp == 0 || limit_sentences == 0 || job.n_blk == 0) return 0;
+  job.blk = (crf_label_block_t *)calloc(job.n_blk, sizeof(crf_label_block_t));
+  if (!job.blk) return 0;
+
+#ifdef MMJP_NO_THREADS
+  threads = 1;
+#endif
+  if (threads < 1) threads = 1;
+  if ((size_t)threads > job.n_blk) threads = (int)job.n_blk;
+  crf_label_worker_t *w = (crf_label_worker_t *)calloc((size_t)threads, sizeof(crf_label_worker_t));
+  if (!w) {
+    free(job.blk);
+    return 0;
+  }
+  /* worker 0 は呼び出し側の workspace を使う */
+  int nw = 0;
+  for (; nw < threads; nw++) {
+    w[nw].job = &job;
+    if (nw == 0) {
+      w[nw].wk = wk;
+      continue;
+    }
+    if (unilm_workspace_init_dynamic(&w[nw].own_wk, max_sentence_cp, um->vocab_size, 0) != UNILM_OK) break;
+    w[nw].own = 1;
+    w[nw].wk = &w[nw].own_wk;
+  }
+
+#ifndef MMJP_NO_THREADS
+  pthread_mutex_init(&job.mu, NULL);
+  pthread_t *tids = (pthread_t *)calloc((size_t)nw, sizeof(pthread_t));
+  int *started = (int *)calloc((size_t)nw, sizeof(int));
+  for (int t = 1; t < nw && tids && started; t++) {
+    started[t] = (pthread_create(&tids[t], NULL, crf_label_thread, &w[t]) == 0);
+  }
+  crf_label_run(&w[0]);
+  for (int t = 1; t < nw && tids && started; t++) {
+    if (started[t]) pthread_join(tids[t], NULL);
+  }
+  free(tids);
+  free(started);
+  pthread_mutex_destroy(&job.mu);
+#else
+  crf_label_run(&w[0]);
+#endif
+  for (int t = 1; t < nw; t++) {
+    if (w[t].own) unilm_workspace_free(&w[t].own_wk);
+  }
+  free(w);
+
+  /* ブロック順に連結（先頭から limit 文） */
+  size_t n_read = 0, n_viterbi_ok = 0, n_viterbi_err = 0;
+  size_t n_sent = 0, n_pos = 0, n_used = 0;
+  for (; n_used < job.prefix_blk && n_sent < limit_sentences; n_used++) {
+    const crf_label_block_t *b = &job.blk[n_used];
+    n_read += b->n_read;
+    n_viterbi_ok += b->n_ok;
+    n_viterbi_err += b->n_err;
+    for (size_t i = 0; i < b->ds.n && n_sent < limit_sentences; i++) {
+      n_sent++;
+      n_pos += b->ds.s[i].n;
+    }
+  }
+  int ok = !job.failed;
+  if (ok && n_sent > 0) {
+    out->s = (crf_sent_t *)malloc(n_sent * sizeof(crf_sent_t));
+    out->arena = (uint8_t *)malloc(2u * n_pos);
+    ok = (out->s && out->arena);
+    if (ok) {
+      out->cap = n_sent;
+      out->arena_cap = 2u * n_pos;
+      for (size_t k = 0; k < n_used; k++) {
+        const crf_dataset_t *bd = &job.blk[k].ds;
+        size_t take = (bd->n < n_sent - out->n) ? bd->n : n_sent - out->n;
+        size_t bytes = 0;
+        for (size_t i = 0; i < take; i++) bytes += 2u * bd->s[i].n;
+        memcpy(out->s + out->n, bd->s, take * sizeof(crf_sent_t));
+        memcpy(out->arena + 2u * out->total_pos, bd->arena, bytes);
+        out->n += take;
+        out->total_pos += bytes / 2u;
+      }
+      crf_dataset_finish(out);
+    }
+  }
+  for (size_t k = 0; k < job.n_blk; k++) crf_dataset_free(&job.blk[k].ds);
+  free(job.blk);
+  if (!ok) {
+    crf_dataset_free(out);
+    return 0;
+  }
 
-  fprintf(stderr, "[crf_unsup] read=%zu viterbi_ok=%zu viterbi_err=%zu pushed=%zu\n",
-          n_read, n_viterbi_ok, n_viterbi_err, out->n);
+  fprintf(stderr, "[crf_unsup] read=%zu viterbi_ok=%zu viterbi_err=%zu pushed=%zu threads=%d\n",
+          n_read, n_viterbi_ok, n_viterbi_err, out->n, nw);
   return out->n > 0 ? 1 : 0;
 }
 
@@ -1430,294 +1743,260 @@ static void crf_add_feat_grad(const crf_table_t *tbl, double *grad_feat,
   if (idx >= 0) grad_feat[(size_t)idx] += coeff;
 }
 
-/* 2-label linear-chain CRF training for boundary labels.
+/* =====================
+ * CRF objective / gradient (shared by SGD/AdaGrad and L-BFGS)
+ *
+ *  - emission scores come from a dense table over (label, prev, cur, next)
+ *    classes, rebuilt from the weights once per evaluation (the same idea as
+ *    npycrf_crf_compile_emit() at inference). Feature gradients are gathered
+ *    per class triple and scattered to the features once per evaluation.
+ *  - sentences are cut into shards of CRF_SHARD_SENT. Each round runs up to
+ *    --threads shards in parallel (one gradient buffer per thread) and adds
+ *    the partial sums in shard order, so the result does not depend on
+ *    --threads.
+ *
+ * 2-label linear-chain CRF for boundary labels.
  *
  * y[i] = 1 (start) or 0 (internal).
  * Constraints:
  *   - y[0] = 1
  *   - implicit EOS label is 1 (adds a final transition y[n-1] -> 1)
- */
-static int crf_train_supervised(const crf_dataset_t *ds,
-                                const crf_table_t *tbl,
-                                double *feat_w,
-                                double *trans00, double *trans01, double *trans10, double *trans11,
-                                int epochs,
-                                double lr,
-                                double l2) {
-  if (!ds || ds->n == 0 || !tbl || !feat_w || !trans00 || !trans01 || !trans10 || !trans11) return 0;
-  if (epochs <= 0) epochs = 1;
-  if (lr <= 0) lr = 0.05;
-  if (l2 < 0) l2 = 0.0;
+ * ===================== */
 
-  const size_t nfeat = (size_t)tbl->n;
-  double *grad_feat = (double *)calloc(nfeat, sizeof(double));
-  if (!grad_feat) return 0;
+#ifndef CRF_SHARD_SENT
+#define CRF_SHARD_SENT 512u
+#endif
 
-  for (int ep = 0; ep < epochs; ep++) {
-    memset(grad_feat, 0, nfeat * sizeof(double));
-    double g_t00 = 0.0, g_t01 = 0.0, g_t10 = 0.0, g_t11 = 0.0;
-    double total_ll = 0.0;
+#define CRF_MAX_THREADS 256
+#define CRF_N_TMPL 5u /* feature templates per (label, position), see crf_emit_score_one */
 
-    for (size_t si = 0; si < ds->n; si++) {
-      const crf_sent_t *s = &ds->s[si];
-      uint16_t n = s->n;
-      if (n == 0) continue;
-
-      /* emission scores */
-      double *e0 = (double *)malloc((size_t)n * sizeof(double));
-      double *e1 = (double *)malloc((size_t)n * sizeof(double));
-      if (!e0 || !e1) {
-        free(e0);
-        free(e1);
-        free(grad_feat);
-        return 0;
-      }
-      for (uint16_t i = 0; i < n; i++) {
-        uint8_t prev_c = (i == 0) ? MMJP_CC_BOS : s->cls[i - 1];
-        uint8_t cur_c = s->cls[i];
-        uint8_t next_c = (i + 1 == n) ? MMJP_CC_EOS : s->cls[i + 1];
-        e0[i] = crf_emit_score_one(tbl, feat_w, 0, prev_c, cur_c, next_c);
-        e1[i] = crf_emit_score_one(tbl, feat_w, 1, prev_c, cur_c, next_c);
-      }
+typedef struct crf_obj crf_obj_t;
 
-      /* forward (log-space) */
-      double *a0 = (double *)malloc((size_t)n * sizeof(double));
-      double *a1 = (double *)malloc((size_t)n * sizeof(double));
-      double *b0 = (double *)malloc((size_t)n * sizeof(double));
-      double *b1 = (double *)malloc((size_t)n * sizeof(double));
-      if (!a0 || !a1 || !b0 || !b1) {
-        free(e0);
-        free(e1);
-        free(a0);
-        free(a1);
-        free(b0);
-        free(b1);
-        free(grad_feat);
-        return 0;
-      }
+typedef struct {
+  crf_obj_t *obj;
+  const uint32_t *order; /* sentence order (NULL = dataset order) */
+  size_t lo, hi;         /* range in the order */
 
-      a0[0] = -INFINITY;
-      a1[0] = e1[0]; /* y0 fixed to 1; bos_to1 is constant -> omitted */
-      for (uint16_t i = 1; i < n; i++) {
-        /* NOTE: MMJP の CRF 遷移は (label: word-start=1, inside=0)
-         *   0->0: trans00
-         *   1->0: trans01
-         *   0->1: trans10
-         *   1->1: trans11
-         */
-        a0[i] = e0[i] + logsumexp2(a0[i - 1] + (*trans00), a1[i - 1] + (*trans01));
-        a1[i] = e1[i] + logsumexp2(a0[i - 1] + (*trans10), a1[i - 1] + (*trans11));
-      }
-      double logZ = logsumexp2(a0[n - 1] + (*trans10), a1[n - 1] + (*trans11)); /* EOS label fixed to 1 */
-
-      /* backward */
-      b0[n - 1] = (*trans10);
-      b1[n - 1] = (*trans11);
-      for (int i = (int)n - 2; i >= 0; i--) {
-        b0[i] = logsumexp2((*trans00) + e0[i + 1] + b0[i + 1], (*trans10) + e1[i + 1] + b1[i + 1]);
-        b1[i] = logsumexp2((*trans01) + e0[i + 1] + b0[i + 1], (*trans11) + e1[i + 1] + b1[i + 1]);
-      }
+  /* workspace (max sentence length) */
+  double *e0, *e1, *a0, *a1, *b0, *b1;
+  uint32_t *tri; /* dense class-triple index per position */
 
-      /* empirical score */
-      double st = e1[0];
-      for (uint16_t i = 1; i < n; i++) {
-        uint8_t yp = s->y[i - 1];
-        uint8_t yc = s->y[i];
-        if (yp == 0 && yc == 0) st += (*trans00);
-        else if (yp == 0 && yc == 1) st += (*trans10);
-        else if (yp == 1 && yc == 0) st += (*trans01);
-        else st += (*trans11);
-        st += (yc ? e1[i] : e0[i]);
-      }
-      /* final transition to EOS=1 */
-      if (s->y[n - 1] == 0) st += (*trans10);
-      else st += (*trans11);
-
-      total_ll += (st - logZ);
-
-      /* gradients: transitions */
-      /* expected transition counts */
-      double exp_t00 = 0.0, exp_t01 = 0.0, exp_t10 = 0.0, exp_t11 = 0.0;
-      for (uint16_t i = 1; i < n; i++) {
-        /* pair marginals */
-        double p00 = exp(a0[i - 1] + (*trans00) + e0[i] + b0[i] - logZ);
-        double p01 = exp(a0[i - 1] + (*trans10) + e1[i] + b1[i] - logZ);
-        double p10 = exp(a1[i - 1] + (*trans01) + e0[i] + b0[i] - logZ);
-        double p11 = exp(a1[i - 1] + (*trans11) + e1[i] + b1[i] - logZ);
-        exp_t00 += p00;
-        exp_t10 += p01; /* 0->1 */
-        exp_t01 += p10; /* 1->0 */
-        exp_t11 += p11;
-      }
-      /* final transition to EOS=1 */
-      exp_t10 += exp(a0[n - 1] + (*trans10) - logZ);
-      exp_t11 += exp(a1[n - 1] + (*trans11) - logZ);
-
-      /* empirical transition counts */
-      double emp_t00 = 0.0, emp_t01 = 0.0, emp_t10 = 0.0, emp_t11 = 0.0;
-      for (uint16_t i = 1; i < n; i++) {
-        uint8_t yp = s->y[i - 1];
-        uint8_t yc = s->y[i];
-        if (yp == 0 && yc == 0) emp_t00 += 1.0;
-        else if (yp == 0 && yc == 1) emp_t10 += 1.0;
-        else if (yp == 1 && yc == 0) emp_t01 += 1.0;
-        else emp_t11 += 1.0;
-      }
-      if (s->y[n - 1] == 0) emp_t10 += 1.0;
-      else emp_t11 += 1.0;
+  /* partial sums */
+  double *g_emit; /* [2*d3] per label/triple (dense) or [nfeat] */
+  double g_trans[4];
+  double ll;
+  size_t pos;
+} crf_shard_t;
 
-      g_t00 += (emp_t00 - exp_t00);
-      g_t01 += (emp_t01 - exp_t01);
-      g_t10 += (emp_t10 - exp_t10);
-      g_t11 += (emp_t11 - exp_t11);
+struct crf_obj {
+  const crf_dataset_t *ds;
+  const crf_table_t *tbl;
+  size_t nfeat;
+  uint16_t max_n;
+  int threads;
+
+  /* dense emission table; ncls == 0 falls back to the binary search per position */
+  uint8_t ncls;
+  size_t d3;
+  int32_t *feat_idx; /* [2*d3][CRF_N_TMPL] feature index, -1 = none */
+  double *emit;      /* [2*d3] emission score under the current weights */
+
+  /* current parameters */
+  const double *w;
+  double t00, t01, t10, t11;
+
+  crf_shard_t *sh; /* [threads] */
+  size_t g_emit_len;
+  double *g_emit; /* shard-ordered sum of crf_shard_t.g_emit */
+};
+
+static int crf_dense_cls(uint8_t c, uint8_t ncls) {
+  if (c < ncls) return (int)c;
+  if (c == MMJP_CC_BOS) return (int)ncls;
+  if (c == MMJP_CC_EOS) return (int)ncls + 1;
+  return -1;
+}
 
-      /* gradients: features */
-      for (uint16_t i = 0; i < n; i++) {
-        uint8_t prev_c = (i == 0) ? MMJP_CC_BOS : s->cls[i - 1];
-        uint8_t cur_c = s->cls[i];
-        uint8_t next_c = (i + 1 == n) ? MMJP_CC_EOS : s->cls[i + 1];
-        /* empirical */
-        crf_add_feat_grad(tbl, grad_feat, 1.0, s->y[i], prev_c, cur_c, next_c);
-        /* expected */
-        double p0 = exp(a0[i] + b0[i] - logZ);
-        double p1 = exp(a1[i] + b1[i] - logZ);
-        crf_add_feat_grad(tbl, grad_feat, -p0, 0, prev_c, cur_c, next_c);
-        crf_add_feat_grad(tbl, grad_feat, -p1, 1, prev_c, cur_c, next_c);
-      }
+static uint8_t crf_dense_cls_inv(size_t k, uint8_t ncls) {
+  if (k < (size_t)ncls) return (uint8_t)k;
+  return (k == (size_t)ncls) ? MMJP_CC_BOS : MMJP_CC_EOS;
+}
 
-      free(e0);
-      free(e1);
-      free(a0);
-      free(a1);
-      free(b0);
-      free(b1);
+static void crf_obj_free(crf_obj_t *o) {
+  if (!o) return;
+  if (o->sh) {
+    for (int t = 0; t < o->threads; t++) {
+      crf_shard_t *sh = &o->sh[t];
+      free(sh->e0); free(sh->e1); free(sh->a0); free(sh->a1); free(sh->b0); free(sh->b1);
+      free(sh->tri);
+      free(sh->g_emit);
     }
+  }
+  free(o->sh);
+  free(o->feat_idx);
+  free(o->emit);
+  free(o->g_emit);
+  memset(o, 0, sizeof(*o));
+}
 
-    /* L2 */
-    if (l2 > 0) {
-      g_t00 -= l2 * (*trans00);
-      g_t01 -= l2 * (*trans01);
-      g_t10 -= l2 * (*trans10);
-      g_t11 -= l2 * (*trans11);
-      for (size_t i = 0; i < nfeat; i++) grad_feat[i] -= l2 * feat_w[i];
+static int crf_obj_init(crf_obj_t *o, const crf_dataset_t *ds, const crf_table_t *tbl, int threads) {
+  memset(o, 0, sizeof(*o));
+  if (!ds || ds->n == 0 || !tbl) return 0;
+  o->ds = ds;
+  o->tbl = tbl;
+  o->nfeat = (size_t)tbl->n;
+  if (threads < 1) threads = 1;
+  if (threads > CRF_MAX_THREADS) threads = CRF_MAX_THREADS;
+#ifdef MMJP_NO_THREADS
+  threads = 1;
+#endif
+  o->threads = threads;
+
+  /* max sentence length and the classes that occur (BOS/EOS only as context) */
+  unsigned max_cls = 0;
+  for (size_t i = 0; i < ds->n; i++) {
+    const crf_sent_t *s = &ds->s[i];
+    if (s->n > o->max_n) o->max_n = s->n;
+    for (uint16_t j = 0; j < s->n; j++) {
+      if (s->cls[j] != MMJP_CC_BOS && s->cls[j] != MMJP_CC_EOS && s->cls[j] >= max_cls) max_cls = s->cls[j] + 1u;
     }
-
-    /* update (average by total positions for stability) */
-    double scale = (ds->total_pos > 0) ? (1.0 / (double)ds->total_pos) : 1.0;
-    double step = lr * scale;
-    *trans00 += step * g_t00;
-    *trans01 += step * g_t01;
-    *trans10 += step * g_t10;
-    *trans11 += step * g_t11;
-    for (size_t i = 0; i < nfeat; i++) feat_w[i] += step * grad_feat[i];
-
-    printf("[mmjp_train] CRF supervised ep=%d/%d ll=%.3f (trans00=%.3f trans01=%.3f trans10=%.3f trans11=%.3f)\n",
-           ep + 1, epochs, total_ll, *trans00, *trans01, *trans10, *trans11);
   }
+  if (o->max_n == 0) return 0;
+
+  if (max_cls > 0 && max_cls <= NPYCRF_EMIT_NCLS_MAX) {
+    o->ncls = (uint8_t)max_cls;
+    size_t d = (size_t)o->ncls + 2u;
+    o->d3 = d * d * d;
+    o->feat_idx = (int32_t *)malloc(2u * o->d3 * CRF_N_TMPL * sizeof(int32_t));
+    o->emit = (double *)malloc(2u * o->d3 * sizeof(double));
+    if (!o->feat_idx || !o->emit) {
+      crf_obj_free(o);
+      return 0;
+    }
+    for (size_t k = 0; k < 2u * o->d3; k++) {
+      uint8_t label = (uint8_t)(k / o->d3);
+      size_t tri = k % o->d3;
+      uint8_t prev_c = crf_dense_cls_inv(tri / (d * d), o->ncls);
+      uint8_t cur_c = crf_dense_cls_inv((tri / d) % d, o->ncls);
+      uint8_t next_c = crf_dense_cls_inv(tri % d, o->ncls);
+      /* same templates (and summation order) as crf_emit_score_one */
+      int32_t *fi = o->feat_idx + k * CRF_N_TMPL;
+      fi[0] = crf_table_find_idx(tbl, npycrf_feat_key(0, label, cur_c, 0));
+      fi[1] = crf_table_find_idx(tbl, npycrf_feat_key(1, label, prev_c, 0));
+      fi[2] = crf_table_find_idx(tbl, npycrf_feat_key(2, label, next_c, 0));
+      fi[3] = crf_table_find_idx(tbl, npycrf_feat_key(3, label, prev_c, cur_c));
+      fi[4] = crf_table_find_idx(tbl, npycrf_feat_key(4, label, cur_c, next_c));
+    }
+  }
+  o->g_emit_len = o->ncls ? 2u * o->d3 : o->nfeat;
 
-  free(grad_feat);
+  o->g_emit = (double *)malloc((o->g_emit_len ? o->g_emit_len : 1u) * sizeof(double));
+  o->sh = (crf_shard_t *)calloc((size_t)threads, sizeof(crf_shard_t));
+  if (!o->g_emit || !o->sh) {
+    crf_obj_free(o);
+    return 0;
+  }
+  size_t mn = (size_t)o->max_n;
+  for (int t = 0; t < threads; t++) {
+    crf_shard_t *sh = &o->sh[t];
+    sh->obj = o;
+    sh->e0 = (double *)malloc(mn * sizeof(double));
+    sh->e1 = (double *)malloc(mn * sizeof(double));
+    sh->a0 = (double *)malloc(mn * sizeof(double));
+    sh->a1 = (double *)malloc(mn * sizeof(double));
+    sh->b0 = (double *)malloc(mn * sizeof(double));
+    sh->b1 = (double *)malloc(mn * sizeof(double));
+    sh->tri = (uint32_t *)malloc(mn * sizeof(uint32_t));
+    sh->g_emit = (double *)malloc((o->g_emit_len ? o->g_emit_len : 1u) * sizeof(double));
+    if (!sh->e0 || !sh->e1 || !sh->a0 || !sh->a1 || !sh->b0 || !sh->b1 || !sh->tri || !sh->g_emit) {
+      crf_obj_free(o);
+      return 0;
+    }
+  }
   return 1;
 }
 
-/* =====================
- * CRF supervised training (L-BFGS)
- * ===================== */
-
-/* L-BFGS implementation (no external deps). Suitable for small supervised datasets. */
-
-static double vec_dot(const double *a, const double *b, size_t n) {
-  double s = 0.0;
-  for (size_t i = 0; i < n; i++) s += a[i] * b[i];
-  return s;
+/* set x = [feat_w..., trans00, trans01, trans10, trans11] and rebuild the dense emissions */
+static void crf_obj_set_params(crf_obj_t *o, const double *x) {
+  o->w = x;
+  o->t00 = x[o->nfeat + 0];
+  o->t01 = x[o->nfeat + 1];
+  o->t10 = x[o->nfeat + 2];
+  o->t11 = x[o->nfeat + 3];
+  if (!o->ncls) return;
+  for (size_t k = 0; k < 2u * o->d3; k++) {
+    const int32_t *fi = o->feat_idx + k * CRF_N_TMPL;
+    double s = 0.0;
+    for (unsigned t = 0; t < CRF_N_TMPL; t++) {
+      if (fi[t] >= 0) s += x[(size_t)fi[t]];
+    }
+    o->emit[k] = s;
+  }
 }
 
-static double vec_norm2(const double *a, size_t n) {
-  return sqrt(vec_dot(a, a, n));
-}
-
-static void vec_copy(double *dst, const double *src, size_t n) {
-  memcpy(dst, src, n * sizeof(double));
-}
-
-static void vec_axpy(double *y, double a, const double *x, size_t n) {
-  for (size_t i = 0; i < n; i++) y[i] += a * x[i];
-}
-
-static void vec_scale(double *x, double a, size_t n) {
-  for (size_t i = 0; i < n; i++) x[i] *= a;
-}
-
-typedef struct {
-  const crf_dataset_t *ds;
-  const crf_table_t *tbl;
-  size_t nfeat;
-  double l2;
-
-  /* reusable workspace (max sentence length) */
-  uint16_t max_n;
-  double *e0, *e1, *a0, *a1, *b0, *b1;
-
-  /* last evaluation (unscaled) */
-  double last_ll;
-  double last_pen;
-} crf_eval_ctx_t;
-
-static double crf_eval_obj_grad_min(const double *x, double *g, void *vctx) {
-  crf_eval_ctx_t *ctx = (crf_eval_ctx_t *)vctx;
-  const crf_dataset_t *ds = ctx->ds;
-  const crf_table_t *tbl = ctx->tbl;
-  const size_t nfeat = ctx->nfeat;
-
-  const double *feat_w = x;
-  double trans00 = x[nfeat + 0];
-  double trans01 = x[nfeat + 1];
-  double trans10 = x[nfeat + 2];
-  double trans11 = x[nfeat + 3];
-
-  /* g will temporarily hold gradient of maximization objective:
-   *   J = ll - (l2/2)||w||^2
-   * then converted to minimization grad of f = -J / total_pos.
-   */
-  memset(g, 0, (nfeat + 4u) * sizeof(double));
-
-  double total_ll = 0.0;
-
-  for (size_t si = 0; si < ds->n; si++) {
-    const crf_sent_t *s = &ds->s[si];
+/* forward-backward over one shard; log-likelihood and its gradient go into the shard sums */
+static void crf_shard_run(crf_shard_t *sh) {
+  const crf_obj_t *o = sh->obj;
+  const crf_dataset_t *ds = o->ds;
+  const double trans00 = o->t00, trans01 = o->t01, trans10 = o->t10, trans11 = o->t11;
+  const size_t d = (size_t)o->ncls + 2u;
+  const size_t d3 = o->d3;
+  double *e0 = sh->e0, *e1 = sh->e1, *a0 = sh->a0, *a1 = sh->a1, *b0 = sh->b0, *b1 = sh->b1;
+  double *g = sh->g_emit;
+
+  memset(g, 0, o->g_emit_len * sizeof(double));
+  sh->g_trans[0] = sh->g_trans[1] = sh->g_trans[2] = sh->g_trans[3] = 0.0;
+  sh->ll = 0.0;
+  sh->pos = 0;
+
+  for (size_t r = sh->lo; r < sh->hi; r++) {
+    const crf_sent_t *s = &ds->s[sh->order ? (size_t)sh->order[r] : r];
     uint16_t n = s->n;
     if (n == 0) continue;
-    if (n > ctx->max_n) n = ctx->max_n;
+    sh->pos += n;
 
     /* emission scores */
     for (uint16_t i = 0; i < n; i++) {
       uint8_t prev_c = (i == 0) ? MMJP_CC_BOS : s->cls[i - 1];
       uint8_t cur_c = s->cls[i];
       uint8_t next_c = (i + 1 == n) ? MMJP_CC_EOS : s->cls[i + 1];
-      ctx->e0[i] = crf_emit_score_one(tbl, feat_w, 0, prev_c, cur_c, next_c);
-      ctx->e1[i] = crf_emit_score_one(tbl, feat_w, 1, prev_c, cur_c, next_c);
+      if (o->ncls) {
+        size_t tri = ((size_t)crf_dense_cls(prev_c, o->ncls) * d + (size_t)crf_dense_cls(cur_c, o->ncls)) * d +
+                     (size_t)crf_dense_cls(next_c, o->ncls);
+        sh->tri[i] = (uint32_t)tri;
+        e0[i] = o->emit[tri];
+        e1[i] = o->emit[d3 + tri];
+      } else {
+        e0[i] = crf_emit_score_one(o->tbl, o->w, 0, prev_c, cur_c, next_c);
+        e1[i] = crf_emit_score_one(o->tbl, o->w, 1, prev_c, cur_c, next_c);
+      }
     }
 
     /* forward (log-space) */
-    ctx->a0[0] = -INFINITY;
-    ctx->a1[0] = ctx->e1[0]; /* y0 fixed to 1; bos_to1 is constant -> omitted */
+    a0[0] = -INFINITY;
+    a1[0] = e1[0]; /* y0 fixed to 1; bos_to1 is constant -> omitted */
     for (uint16_t i = 1; i < n; i++) {
-      ctx->a0[i] = ctx->e0[i] + logsumexp2(ctx->a0[i - 1] + trans00, ctx->a1[i - 1] + trans01);
-      ctx->a1[i] = ctx->e1[i] + logsumexp2(ctx->a0[i - 1] + trans10, ctx->a1[i - 1] + trans11);
+      /* NOTE: MMJP の CRF 遷移は (label: word-start=1, inside=0)
+       *   0->0: trans00
+       *   1->0: trans01
+       *   0->1: trans10
+       *   1->1: trans11
+       */
+      a0[i] = e0[i] + logsumexp2(a0[i - 1] + trans00, a1[i - 1] + trans01);
+      a1[i] = e1[i] + logsumexp2(a0[i - 1] + trans10, a1[i - 1] + trans11);
     }
-    double logZ = logsumexp2(ctx->a0[n - 1] + trans10, ctx->a1[n - 1] + trans11); /* EOS label fixed to 1 */
+    double logZ = logsumexp2(a0[n - 1] + trans10, a1[n - 1] + trans11); /* EOS label fixed to 1 */
 
     /* backward */
-    ctx->b0[n - 1] = trans10;
-    ctx->b1[n - 1] = trans11;
+    b0[n - 1] = trans10;
+    b1[n - 1] = trans11;
     for (int i = (int)n - 2; i >= 0; i--) {
-      ctx->b0[i] = logsumexp2(trans00 + ctx->e0[i + 1] + ctx->b0[i + 1],
-                              trans10 + ctx->e1[i + 1] + ctx->b1[i + 1]);
-      ctx->b1[i] = logsumexp2(trans01 + ctx->e0[i + 1] + ctx->b0[i + 1],
-                              trans11 + ctx->e1[i + 1] + ctx->b1[i + 1]);
+      b0[i] = logsumexp2(trans00 + e0[i + 1] + b0[i + 1], trans10 + e1[i + 1] + b1[i + 1]);
+      b1[i] = logsumexp2(trans01 + e0[i + 1] + b0[i + 1], trans11 + e1[i + 1] + b1[i + 1]);
     }
 
     /* empirical score */
-    double st = ctx->e1[0];
+    double st = e1[0];
     for (uint16_t i = 1; i < n; i++) {
       uint8_t yp = s->y[i - 1];
       uint8_t yc = s->y[i];
@@ -1725,29 +2004,30 @@ static double crf_eval_obj_grad_min(const double *x, double *g, void *vctx) {
       else if (yp == 0 && yc == 1) st += trans10;
       else if (yp == 1 && yc == 0) st += trans01;
       else st += trans11;
-      st += (yc ? ctx->e1[i] : ctx->e0[i]);
+      st += (yc ? e1[i] : e0[i]);
     }
     /* final transition to EOS=1 */
     if (s->y[n - 1] == 0) st += trans10;
     else st += trans11;
 
-    total_ll += (st - logZ);
+    sh->ll += (st - logZ);
 
     /* expected transition counts */
     double exp_t00 = 0.0, exp_t01 = 0.0, exp_t10 = 0.0, exp_t11 = 0.0;
     for (uint16_t i = 1; i < n; i++) {
-      double p00 = exp(ctx->a0[i - 1] + trans00 + ctx->e0[i] + ctx->b0[i] - logZ);
-      double p01 = exp(ctx->a0[i - 1] + trans10 + ctx->e1[i] + ctx->b1[i] - logZ);
-      double p10 = exp(ctx->a1[i - 1] + trans01 + ctx->e0[i] + ctx->b0[i] - logZ);
-      double p11 = exp(ctx->a1[i - 1] + trans11 + ctx->e1[i] + ctx->b1[i] - logZ);
+      /* pair marginals */
+      double p00 = exp(a0[i - 1] + trans00 + e0[i] + b0[i] - logZ);
+      double p01 = exp(a0[i - 1] + trans10 + e1[i] + b1[i] - logZ);
+      double p10 = exp(a1[i - 1] + trans01 + e0[i] + b0[i] - logZ);
+      double p11 = exp(a1[i - 1] + trans11 + e1[i] + b1[i] - logZ);
       exp_t00 += p00;
       exp_t10 += p01; /* 0->1 */
       exp_t01 += p10; /* 1->0 */
       exp_t11 += p11;
     }
     /* final transition to EOS=1 */
-    exp_t10 += exp(ctx->a0[n - 1] + trans10 - logZ);
-    exp_t11 += exp(ctx->a1[n - 1] + trans11 - logZ);
+    exp_t10 += exp(a0[n - 1] + trans10 - logZ);
+    exp_t11 += exp(a1[n - 1] + trans11 - logZ);
 
     /* empirical transition counts */
     double emp_t00 = 0.0, emp_t01 = 0.0, emp_t10 = 0.0, emp_t11 = 0.0;
@@ -1762,28 +2042,273 @@ static double crf_eval_obj_grad_min(const double *x, double *g, void *vctx) {
     if (s->y[n - 1] == 0) emp_t10 += 1.0;
     else emp_t11 += 1.0;
 
-    g[nfeat + 0] += (emp_t00 - exp_t00);
-    g[nfeat + 1] += (emp_t01 - exp_t01);
-    g[nfeat + 2] += (emp_t10 - exp_t10);
-    g[nfeat + 3] += (emp_t11 - exp_t11);
+    sh->g_trans[0] += (emp_t00 - exp_t00);
+    sh->g_trans[1] += (emp_t01 - exp_t01);
+    sh->g_trans[2] += (emp_t10 - exp_t10);
+    sh->g_trans[3] += (emp_t11 - exp_t11);
 
-    /* gradients: features */
+    /* gradients: features (empirical - expected) */
     for (uint16_t i = 0; i < n; i++) {
-      uint8_t prev_c = (i == 0) ? MMJP_CC_BOS : s->cls[i - 1];
-      uint8_t cur_c = s->cls[i];
-      uint8_t next_c = (i + 1 == n) ? MMJP_CC_EOS : s->cls[i + 1];
+      double p0 = exp(a0[i] + b0[i] - logZ);
+      double p1 = exp(a1[i] + b1[i] - logZ);
+      if (o->ncls) {
+        size_t tri = (size_t)sh->tri[i];
+        g[(s->y[i] ? d3 : 0u) + tri] += 1.0;
+        g[tri] -= p0;
+        g[d3 + tri] -= p1;
+      } else {
+        uint8_t prev_c = (i == 0) ? MMJP_CC_BOS : s->cls[i - 1];
+        uint8_t cur_c = s->cls[i];
+        uint8_t next_c = (i + 1 == n) ? MMJP_CC_EOS : s->cls[i + 1];
+        crf_add_feat_grad(o->tbl, g, 1.0, s->y[i], prev_c, cur_c, next_c);
+        crf_add_feat_grad(o->tbl, g, -p0, 0, prev_c, cur_c, next_c);
+        crf_add_feat_grad(o->tbl, g, -p1, 1, prev_c, cur_c, next_c);
+      }
+    }
+  }
+}
+
+#ifndef MMJP_NO_THREADS
+static void *crf_shard_thread(void *arg) {
+  crf_shard_run((crf_shard_t *)arg);
+  return NULL;
+}
+#endif
+
+/*
+ * Log-likelihood of order[lo..hi) (dataset order if order == NULL) under the
+ * parameters of the last crf_obj_set_params(), and its gradient (maximization
+ * form, no L2) into g[nfeat+4]. *out_pos receives the number of positions.
+ */
+static double crf_obj_accumulate(crf_obj_t *o, const uint32_t *order, size_t lo, size_t hi,
+                                 double *g, size_t *out_pos) {
+  memset(o->g_emit, 0, o->g_emit_len * sizeof(double));
+  double g_trans[4] = {0.0, 0.0, 0.0, 0.0};
+  double ll = 0.0;
+  size_t pos = 0;
+
+  size_t base = lo;
+  while (base < hi) {
+    int k = 0;
+    for (; k < o->threads && base < hi; k++) {
+      crf_shard_t *sh = &o->sh[k];
+      sh->order = order;
+      sh->lo = base;
+      sh->hi = (hi - base > CRF_SHARD_SENT) ? base + CRF_SHARD_SENT : hi;
+      base = sh->hi;
+    }
+
+#ifndef MMJP_NO_THREADS
+    pthread_t tids[CRF_MAX_THREADS];
+    int started[CRF_MAX_THREADS];
+    for (int t = 1; t < k; t++) started[t] = (pthread_create(&tids[t], NULL, crf_shard_thread, &o->sh[t]) == 0);
+    crf_shard_run(&o->sh[0]);
+    for (int t = 1; t < k; t++) {
+      if (started[t]) pthread_join(tids[t], NULL);
+      else crf_shard_run(&o->sh[t]);
+    }
+#else
+    for (int t = 0; t < k; t++) crf_shard_run(&o->sh[t]);
+#endif
+
+    /* reduce in shard order */
+    for (int t = 0; t < k; t++) {
+      const crf_shard_t *sh = &o->sh[t];
+      ll += sh->ll;
+      pos += sh->pos;
+      for (int j = 0; j < 4; j++) g_trans[j] += sh->g_trans[j];
+      for (size_t i = 0; i < o->g_emit_len; i++) o->g_emit[i] += sh->g_emit[i];
+    }
+  }
+
+  /* scatter per-triple gradients to the features */
+  if (o->ncls) {
+    memset(g, 0, o->nfeat * sizeof(double));
+    for (size_t k = 0; k < 2u * o->d3; k++) {
+      double c = o->g_emit[k];
+      if (c == 0.0) continue;
+      const int32_t *fi = o->feat_idx + k * CRF_N_TMPL;
+      for (unsigned t = 0; t < CRF_N_TMPL; t++) {
+        if (fi[t] >= 0) g[(size_t)fi[t]] += c;
+      }
+    }
+  } else {
+    memcpy(g, o->g_emit, o->nfeat * sizeof(double));
+  }
+  for (int j = 0; j < 4; j++) g[o->nfeat + (size_t)j] = g_trans[j];
+
+  if (out_pos) *out_pos = pos;
+  return ll;
+}
+
+/*
+ * SGD / AdaGrad on the same objective.
+ *
+ * batch == 0 (or >= sentences): one full-batch step per epoch.
+ * Otherwise mini-batches of `batch` sentences in a shuffled order (fixed seed),
+ * L2 scaled by the batch's share of the positions.
+ */
+static int crf_train_supervised(const crf_dataset_t *ds,
+                                const crf_table_t *tbl,
+                                double *feat_w,
+                                double *trans00, double *trans01, double *trans10, double *trans11,
+                                int epochs,
+                                double lr,
+                                double l2,
+                                int adagrad,
+                                size_t batch,
+                                int threads) {
+  if (!ds || ds->n == 0 || !tbl || !feat_w || !trans00 || !trans01 || !trans10 || !trans11) return 0;
+  if (epochs <= 0) epochs = 1;
+  if (lr <= 0) lr = 0.05;
+  if (l2 < 0) l2 = 0.0;
+  if (batch == 0 || batch > ds->n) batch = ds->n;
+
+  crf_obj_t o;
+  if (!crf_obj_init(&o, ds, tbl, threads)) return 0;
+
+  const size_t nfeat = o.nfeat;
+  const size_t dim = nfeat + 4u;
+  double *x = (double *)malloc(dim * sizeof(double));
+  double *g = (double *)malloc(dim * sizeof(double));
+  double *h = adagrad ? (double *)calloc(dim, sizeof(double)) : NULL;
+  uint32_t *order = (batch < ds->n) ? (uint32_t *)malloc(ds->n * sizeof(uint32_t)) : NULL;
+  if (!x || !g || (adagrad && !h) || (batch < ds->n && !order)) {
+    free(x);
+    free(g);
+    free(h);
+    free(order);
+    crf_obj_free(&o);
+    return 0;
+  }
+  memcpy(x, feat_w, nfeat * sizeof(double));
+  x[nfeat + 0] = *trans00;
+  x[nfeat + 1] = *trans01;
+  x[nfeat + 2] = *trans10;
+  x[nfeat + 3] = *trans11;
+  if (order) {
+    for (size_t i = 0; i < ds->n; i++) order[i] = (uint32_t)i;
+  }
+
+  printf("[mmjp_train] CRF supervised (%s): epochs=%d batch=%zu lr=%.3g l2=%.2g threads=%d\n",
+         adagrad ? "adagrad" : "sgd", epochs, batch, lr, l2, o.threads);
+
+  uint32_t rng = 2463534242u;
+  for (int ep = 0; ep < epochs; ep++) {
+    if (order) {
+      for (size_t i = ds->n - 1u; i > 0; i--) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        size_t j = (size_t)(rng % (uint32_t)(i + 1u));
+        uint32_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+      }
+    }
 
-      /* empirical */
-      crf_add_feat_grad(tbl, g, 1.0, s->y[i], prev_c, cur_c, next_c);
+    double total_ll = 0.0;
+    for (size_t lo = 0; lo < ds->n; lo += batch) {
+      size_t hi = (ds->n - lo > batch) ? lo + batch : ds->n;
+      size_t pos = 0;
+      crf_obj_set_params(&o, x);
+      total_ll += crf_obj_accumulate(&o, order, lo, hi, g, &pos);
+      if (pos == 0) continue;
+
+      /* L2 */
+      if (l2 > 0) {
+        double share = (ds->total_pos > 0) ? ((double)pos / (double)ds->total_pos) : 1.0;
+        for (size_t i = 0; i < dim; i++) g[i] -= l2 * share * x[i];
+      }
 
-      /* expected */
-      double p0 = exp(ctx->a0[i] + ctx->b0[i] - logZ);
-      double p1 = exp(ctx->a1[i] + ctx->b1[i] - logZ);
-      crf_add_feat_grad(tbl, g, -p0, 0, prev_c, cur_c, next_c);
-      crf_add_feat_grad(tbl, g, -p1, 1, prev_c, cur_c, next_c);
+      /* update (average by positions for stability) */
+      double scale = 1.0 / (double)pos;
+      if (adagrad) {
+        for (size_t i = 0; i < dim; i++) {
+          double u = g[i] * scale;
+          h[i] += u * u;
+          if (h[i] > 0) x[i] += lr * u / sqrt(h[i]);
+        }
+      } else {
+        double step = lr * scale;
+        for (size_t i = 0; i < dim; i++) x[i] += step * g[i];
+      }
     }
+
+    printf("[mmjp_train] CRF supervised ep=%d/%d ll=%.3f (trans00=%.3f trans01=%.3f trans10=%.3f trans11=%.3f)\n",
+           ep + 1, epochs, total_ll, x[nfeat + 0], x[nfeat + 1], x[nfeat + 2], x[nfeat + 3]);
   }
 
+  memcpy(feat_w, x, nfeat * sizeof(double));
+  *trans00 = x[nfeat + 0];
+  *trans01 = x[nfeat + 1];
+  *trans10 = x[nfeat + 2];
+  *trans11 = x[nfeat + 3];
+
+  free(x);
+  free(g);
+  free(h);
+  free(order);
+  crf_obj_free(&o);
+  return 1;
+}
+
+/* =====================
+ * CRF supervised training (L-BFGS)
+ * ===================== */
+
+/* L-BFGS implementation (no external deps). Suitable for small supervised datasets. */
+
+static double vec_dot(const double *a, const double *b, size_t n) {
+  double s = 0.0;
+  for (size_t i = 0; i < n; i++) s += a[i] * b[i];
+  return s;
+}
+
+static double vec_norm2(const double *a, size_t n) {
+  return sqrt(vec_dot(a, a, n));
+}
+
+static void vec_copy(double *dst, const double *src, size_t n) {
+  memcpy(dst, src, n * sizeof(double));
+}
+
+static void vec_axpy(double *y, double a, const double *x, size_t n) {
+  for (size_t i = 0; i < n; i++) y[i] += a * x[i];
+}
+
+static void vec_scale(double *x, double a, size_t n) {
+  for (size_t i = 0; i < n; i++) x[i] *= a;
+}
+
+typedef struct {
+  crf_obj_t *obj;
+  double l2;
+
+  /* last evaluation (unscaled) */
+  double last_ll;
+  double last_pen;
+} crf_eval_ctx_t;
+
+static double crf_eval_obj_grad_min(const double *x, double *g, void *vctx) {
+  crf_eval_ctx_t *ctx = (crf_eval_ctx_t *)vctx;
+  crf_obj_t *o = ctx->obj;
+  const crf_dataset_t *ds = o->ds;
+  const size_t nfeat = o->nfeat;
+
+  const double *feat_w = x;
+  double trans00 = x[nfeat + 0];
+  double trans01 = x[nfeat + 1];
+  double trans10 = x[nfeat + 2];
+  double trans11 = x[nfeat + 3];
+
+  /* g will temporarily hold gradient of maximization objective:
+   *   J = ll - (l2/2)||w||^2
+   * then converted to minimization grad of f = -J / total_pos.
+   */
+  crf_obj_set_params(o, x);
+  double total_ll = crf_obj_accumulate(o, NULL, 0, ds->n, g, NULL);
+
   /* L2 (on maximization objective J) */
   double w2 = 0.0;
   if (ctx->l2 > 0) {
@@ -1991,42 +2516,24 @@ static int crf_train_supervised_lbfgs(const crf_dataset_t *ds,
                                       int max_iter,
                                       double l2,
                                       int m_hist,
-                                      double tol) {
+                                      double tol,
+                                      int threads) {
   if (!ds || ds->n == 0 || !tbl || !feat_w || !trans00 || !trans01 || !trans10 || !trans11) return 0;
 
-  size_t nfeat = (size_t)tbl->n;
-  size_t dim = nfeat + 4u;
+  crf_obj_t obj;
+  if (!crf_obj_init(&obj, ds, tbl, threads)) return 0;
 
-  /* determine max sentence length for reusable workspace */
-  uint16_t max_n = 0;
-  for (size_t i = 0; i < ds->n; i++) {
-    if (ds->s[i].n > max_n) max_n = ds->s[i].n;
-  }
-  if (max_n == 0) return 0;
+  size_t nfeat = obj.nfeat;
+  size_t dim = nfeat + 4u;
 
   crf_eval_ctx_t ctx;
   memset(&ctx, 0, sizeof(ctx));
-  ctx.ds = ds;
-  ctx.tbl = tbl;
-  ctx.nfeat = nfeat;
+  ctx.obj = &obj;
   ctx.l2 = l2;
-  ctx.max_n = max_n;
-
-  ctx.e0 = (double *)malloc((size_t)max_n * sizeof(double));
-  ctx.e1 = (double *)malloc((size_t)max_n * sizeof(double));
-  ctx.a0 = (double *)malloc((size_t)max_n * sizeof(double));
-  ctx.a1 = (double *)malloc((size_t)max_n * sizeof(double));
-  ctx.b0 = (double *)malloc((size_t)max_n * sizeof(double));
-  ctx.b1 = (double *)malloc((size_t)max_n * sizeof(double));
-
-  if (!ctx.e0 || !ctx.e1 || !ctx.a0 || !ctx.a1 || !ctx.b0 || !ctx.b1) {
-    free(ctx.e0); free(ctx.e1); free(ctx.a0); free(ctx.a1); free(ctx.b0); free(ctx.b1);
-    return 0;
-  }
 
   double *x = (double *)malloc(dim * sizeof(double));
   if (!x) {
-    free(ctx.e0); free(ctx.e1); free(ctx.a0); free(ctx.a1); free(ctx.b0); free(ctx.b1);
+    crf_obj_free(&obj);
     return 0;
   }
   for (size_t i = 0; i < nfeat; i++) x[i] = feat_w[i];
@@ -2035,8 +2542,8 @@ static int crf_train_supervised_lbfgs(const crf_dataset_t *ds,
   x[nfeat + 2] = *trans10;
   x[nfeat + 3] = *trans11;
 
-  printf("[mmjp_train] CRF supervised (lbfgs): iter=%d m=%d tol=%.2g l2=%.2g\n",
-         max_iter, m_hist, tol, l2);
+  printf("[mmjp_train] CRF supervised (lbfgs): iter=%d m=%d tol=%.2g l2=%.2g threads=%d\n",
+         max_iter, m_hist, tol, l2, obj.threads);
 
   int ok = lbfgs_minimize(x, dim, max_iter, m_hist, tol, 20, crf_eval_obj_grad_min, &ctx);
 
@@ -2050,10 +2557,23 @@ static int crf_train_supervised_lbfgs(const crf_dataset_t *ds,
          *trans00, *trans01, *trans10, *trans11);
 
   free(x);
-  free(ctx.e0); free(ctx.e1); free(ctx.a0); free(ctx.a1); free(ctx.b0); free(ctx.b1);
+  crf_obj_free(&obj);
   return ok;
 }
 
+/* --crf_opt sgd|adagrad|lbfgs */
+static int crf_train_dispatch(const crf_dataset_t *ds, const crf_table_t *tbl, double *feat_w,
+                              double *trans00, double *trans01, double *trans10, double *trans11,
+                              const char *opt, int epochs, double lr, double l2, size_t batch,
+                              int m_hist, double tol, int threads) {
+  if (opt && (strcmp(opt, "sgd") == 0 || strcmp(opt, "adagrad") == 0)) {
+    return crf_train_supervised(ds, tbl, feat_w, trans00, trans01, trans10, trans11,
+                                epochs, lr, l2, strcmp(opt, "adagrad") == 0, batch, threads);
+  }
+  return crf_train_supervised_lbfgs(ds, tbl, feat_w, trans00, trans01, trans10, trans11,
+                                    epochs, l2, m_hist, tol, threads);
+}
+
 /* =====================
  * Candidate extraction via suffix array
  * ===================== */
@@ -2068,11 +2588,247 @@ static int mmjp_bytes_contains(const char *s, size_t len, const uint8_t *pat, si
 
 
 
+/* one open run of equal n-codepoint prefixes in SA order */
+typedef struct {
+  size_t first;      /* SA index where the run starts */
+  uint32_t count;
+  uint16_t len_bytes; /* 0 = no open run */
+} ngram_run_t;
+
+/* codepoint width as sa_utf8_copy_prefix_n() steps it (SA_BUILD_DEFAULT) */
+static size_t ngram_cp_bytes(const uint8_t *s, size_t remaining) {
+  uint8_t b = s[0];
+  size_t n = (b < 0x80u) ? 1u : ((b & 0xE0u) == 0xC0u) ? 2u : ((b & 0xF0u) == 0xE0u) ? 3u : ((b & 0xF8u) == 0xF0u) ? 4u : 1u;
+  return (n > remaining) ? 1u : n;
+}
+
+static int ngram_run_flush(cand_heap_t *heap, const ngram_run_t *r, const uint8_t *text,
+                           const sa_idx_t *sa, int ncp, uint32_t min_count,
+                           const uint8_t *fb, size_t fb_len) {
+  if (r->len_bytes == 0 || r->count < min_count) return 1;
+  const char *s = (const char *)text + sa[r->first];
+  size_t w = r->len_bytes;
+  if (!is_good_piece_bytes(s, w)) return 1;
+  if (fb && fb_len > 0 && mmjp_bytes_contains(s, w, fb, fb_len)) return 1;
+  if (utf8_count_cp((const uint8_t *)s, w) < (size_t)ncp) return 1;
+  return heap_push_topk(heap, r->count, s, (uint16_t)w, (uint16_t)ncp);
+}
+
+/* =====================
+ *  suffix-array / candidate cache (--sa_cache)
+ *  - 候補抽出のサンプルが同じなら接尾辞配列は同じなので、ファイルに保存して
+ *    次回以降は mmap してそのまま使う（SA-IS の構築を省く）。
+ *  - 候補の抽出条件（max_piece_len, cand_total, min_count, fallback）も同じなら
+ *    候補リストも保存したものを使い、LCP 計算と n-gram 走査も省く。
+ *  - レイアウト（ホストのバイト順、整列済み）:
+ *      [0,128)   ヘッダ（sa_cache_hdr_t）
+ *      [128, )   SA: sa_idx_t [n_starts]
+ *      cand_off  候補: { u32 count, u16 len_bytes, u16 len_cp } [cand_n] + 文字列を連結
+ *  - 別のマシンで作ったファイル（バイト順・sa_idx_t の幅が違う）やサンプルが
+ *    変わったファイルはヘッダで、範囲外を指す SA は読み込み時の検査で弾いて作り直す。
+ *    候補部だけが読めないときは SA を使って候補を数え直す。
+ * ===================== */
+
+#define SA_CACHE_MAGIC "MMJPSAC1"
+#define SA_CACHE_HDR_SIZE 128u
+
+typedef struct {
+  char magic[8];
+  uint32_t endian;       /* 0x01020304 */
+  uint32_t idx_size;     /* sizeof(sa_idx_t) */
+  uint64_t text_len;
+  uint64_t text_hash;    /* FNV-1a */
+  uint64_t n_starts;
+  uint32_t build_flags;
+  /* 候補の抽出条件 */
+  uint32_t max_piece_len_cp;
+  uint64_t cand_total;
+  uint32_t min_count;
+  uint8_t fb[4];
+  uint64_t cand_n;       /* 0 = 候補なし（SA のみ） */
+  uint64_t cand_off;
+  uint64_t cand_bytes;
+} sa_cache_hdr_t;
+
+typedef struct {
+  const uint8_t *data;
+  size_t len;
+  void *mapped;    /* mmap した場合 */
+  uint8_t *owned;  /* 読み込んだ場合 */
+} sa_cache_file_t;
+
+static uint64_t sa_cache_hash(const uint8_t *p, size_t n) {
+  uint64_t h = 1469598103934665603ull;
+  for (size_t i = 0; i < n; i++) {
+    h ^= (uint64_t)p[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+static void sa_cache_close(sa_cache_file_t *f) {
+  if (!f) return;
+#ifdef MMJP_HAVE_MMAP
+  if (f->mapped) munmap(f->mapped, f->len);
+#endif
+  free(f->owned);
+  memset(f, 0, sizeof(*f));
+}
+
+static int sa_cache_open(const char *path, sa_cache_file_t *f) {
+  memset(f, 0, sizeof(*f));
+#ifdef MMJP_HAVE_MMAP
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)SA_CACHE_HDR_SIZE) {
+    void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr != MAP_FAILED) {
+      f->mapped = addr;
+      f->data = (const uint8_t *)addr;
+      f->len = (size_t)st.st_size;
+    }
+  }
+  close(fd);
+  return f->data != NULL;
+#else
+  FILE *fp = fopen(path, "rb");
+  if (!fp) return 0;
+  if (fseek(fp, 0, SEEK_END) == 0) {
+    long n = ftell(fp);
+    if (n >= (long)SA_CACHE_HDR_SIZE && fseek(fp, 0, SEEK_SET) == 0) {
+      f->owned = (uint8_t *)malloc((size_t)n);
+      if (f->owned && fread(f->owned, 1, (size_t)n, fp) == (size_t)n) {
+        f->data = f->owned;
+        f->len = (size_t)n;
+      }
+    }
+  }
+  fclose(fp);
+  if (!f->data) sa_cache_close(f);
+  return f->data != NULL;
+#endif
+}
+
+/* 一時ファイルに書いてから rename（読み込み中の mmap はそのまま有効） */
+static int sa_cache_save(const char *path, const sa_cache_hdr_t *key, const sa_idx_t *sa,
+                         const cand_t *cands, size_t cands_n) {
+  size_t plen = strlen(path);
+  char *tmp = (char *)malloc(plen + 5u);
+  if (!tmp) return 0;
+  memcpy(tmp, path, plen);
+  memcpy(tmp + plen, ".tmp", 5u);
+
+  sa_cache_hdr_t h = *key;
+  size_t sa_end = SA_CACHE_HDR_SIZE + (size_t)h.n_starts * sizeof(sa_idx_t);
+  h.cand_n = cands_n;
+  h.cand_off = (sa_end + 7u) & ~(size_t)7u;
+  h.cand_bytes = 0;
+  for (size_t i = 0; i < cands_n; i++) h.cand_bytes += cands[i].len_bytes;
+
+  uint8_t hdr[SA_CACHE_HDR_SIZE];
+  memset(hdr, 0, sizeof(hdr));
+  memcpy(hdr, &h, sizeof(h));
+  static const uint8_t zero[8] = { 0 };
+
+  FILE *fp = fopen(tmp, "wb");
+  int ok = (fp != NULL);
+  if (ok) ok = (fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr));
+  if (ok) ok = (fwrite(sa, sizeof(sa_idx_t), (size_t)h.n_starts, fp) == (size_t)h.n_starts);
+  if (ok && h.cand_off > sa_end) ok = (fwrite(zero, 1, (size_t)h.cand_off - sa_end, fp) == (size_t)h.cand_off - sa_end);
+  for (size_t i = 0; ok && i < cands_n; i++) {
+    uint8_t rec[8];
+    memcpy(rec, &cands[i].count, 4);
+    memcpy(rec + 4, &cands[i].len_bytes, 2);
+    memcpy(rec + 6, &cands[i].len_cp, 2);
+    ok = (fwrite(rec, 1, sizeof(rec), fp) == sizeof(rec));
+  }
+  for (size_t i = 0; ok && i < cands_n; i++) {
+    ok = (fwrite(cands[i].s, 1, cands[i].len_bytes, fp) == cands[i].len_bytes);
+  }
+  if (fp && fclose(fp) != 0) ok = 0;
+  if (ok) ok = (rename(tmp, path) == 0);
+  if (!ok) remove(tmp);
+  free(tmp);
+  return ok;
+}
+
+/*
+ * キャッシュの検証
+ *  - ヘッダに加えて SA の各要素が本文の範囲内にあることを一度だけ確かめる
+ *    （途中で切れた・壊れたファイルを mmap のまま使わないため）。
+ * @return 0=使えない, 1=SA のみ一致（*out_sa を設定）, 2=候補も一致
+ */
+static int sa_cache_match(const sa_cache_file_t *f, const sa_cache_hdr_t *key, const sa_idx_t **out_sa) {
+  sa_cache_hdr_t h;
+  memcpy(&h, f->data, sizeof(h));
+  if (memcmp(h.magic, SA_CACHE_MAGIC, 8) != 0 || h.endian != key->endian || h.idx_size != key->idx_size) return 0;
+  if (h.text_len != key->text_len || h.text_hash != key->text_hash || h.build_flags != key->build_flags) return 0;
+  if (h.n_starts == 0 || h.n_starts != key->n_starts ||
+      h.n_starts > (f->len - SA_CACHE_HDR_SIZE) / sizeof(sa_idx_t)) {
+    return 0;
+  }
+  const sa_idx_t *sa = (const sa_idx_t *)(const void *)(f->data + SA_CACHE_HDR_SIZE);
+  for (size_t i = 0; i < (size_t)h.n_starts; i++) {
+    if ((uint64_t)sa[i] >= h.text_len) return 0;
+  }
+  *out_sa = sa;
+
+  if (h.cand_n == 0 || h.max_piece_len_cp != key->max_piece_len_cp || h.cand_total != key->cand_total ||
+      h.min_count != key->min_count || memcmp(h.fb, key->fb, 4) != 0) {
+    return 1;
+  }
+  if (h.cand_off > f->len || h.cand_n > (f->len - h.cand_off) / 8u ||
+      h.cand_bytes > f->len - h.cand_off - h.cand_n * 8u) {
+    return 1;
+  }
+  return 2;
+}
+
+static int sa_cache_load_cands(const sa_cache_file_t *f, cand_t **out_cands, size_t *out_n) {
+  sa_cache_hdr_t h;
+  memcpy(&h, f->data, sizeof(h));
+  const uint8_t *rec = f->data + h.cand_off;
+  const uint8_t *str = rec + h.cand_n * 8u;
+  size_t left = (size_t)h.cand_bytes;
+  cand_t *a = (cand_t *)calloc((size_t)h.cand_n, sizeof(cand_t));
+  if (!a) return 0;
+  for (size_t i = 0; i < (size_t)h.cand_n; i++) {
+    memcpy(&a[i].count, rec + 8u * i, 4);
+    memcpy(&a[i].len_bytes, rec + 8u * i + 4u, 2);
+    memcpy(&a[i].len_cp, rec + 8u * i + 6u, 2);
+    a[i].s = (a[i].len_bytes <= left) ? (char *)malloc((size_t)a[i].len_bytes + 1u) : NULL;
+    if (!a[i].s) {
+      for (size_t j = 0; j < i; j++) cand_free(&a[j]);
+      free(a);
+      return 0;
+    }
+    memcpy(a[i].s, str, a[i].len_bytes);
+    a[i].s[a[i].len_bytes] = 0;
+    str += a[i].len_bytes;
+    left -= a[i].len_bytes;
+  }
+  *out_cands = a;
+  *out_n = (size_t)h.cand_n;
+  return 1;
+}
+
+/*
+ * Frequent n-grams (2..max_piece_len_cp codepoints) from one pass over the
+ * suffix array: suffixes sharing an n-codepoint prefix are contiguous, so a
+ * run continues while the LCP with the previous suffix covers the prefix.
+ * Heaps see the same runs in the same order as a per-n scan would.
+ *
+ * With sa_cache, the suffix array (and, when the extraction settings match,
+ * the candidate list) is reused from that file and the file is refreshed.
+ */
 static int collect_top_ngrams(const uint8_t *text, size_t text_len,
                              int max_piece_len_cp,
                              size_t cand_total,
                              uint32_t min_count,
                              const uint8_t *fb, size_t fb_len,
+                             int threads,
+                             const char *sa_cache,
                              cand_t **out_cands,
                              size_t *out_n) {
   if (!text || text_len == 0 || !out_cands || !out_n) return 0;
@@ -2093,22 +2849,67 @@ static int collect_top_ngrams(const uint8_t *text, size_t text_len,
     return 0;
   }
 
-  const size_t sa_bytes = starts * sizeof(sa_idx_t);
-  fprintf(stderr, "[mmjp_train] suffix-array: starts=%zu (%.1f MB), flags=0x%X\n",
-          starts, (double)sa_bytes / (1024.0 * 1024.0), (unsigned)build_flags);
-
-  sa_idx_t *sa = (sa_idx_t *)malloc(sa_bytes);
-  if (!sa) {
-    fprintf(stderr, "[mmjp_train] suffix-array: oom for sa (%zu bytes)\n", sa_bytes);
-    return 0;
+  sa_cache_hdr_t key;
+  memset(&key, 0, sizeof(key));
+  sa_cache_file_t cf;
+  memset(&cf, 0, sizeof(cf));
+  int cache_state = 0;
+  const sa_idx_t *sa = NULL;
+  sa_idx_t *sa_buf = NULL;
+  if (sa_cache) {
+    memcpy(key.magic, SA_CACHE_MAGIC, 8);
+    key.endian = 0x01020304u;
+    key.idx_size = (uint32_t)sizeof(sa_idx_t);
+    key.text_len = text_len;
+    key.text_hash = sa_cache_hash(text, text_len);
+    key.build_flags = build_flags;
+    key.max_piece_len_cp = (uint32_t)max_piece_len_cp;
+    key.cand_total = cand_total;
+    key.min_count = min_count;
+    if (fb) memcpy(key.fb, fb, (fb_len < 4u) ? fb_len : 4u);
+    key.n_starts = starts;
+    if (sa_cache_open(sa_cache, &cf)) cache_state = sa_cache_match(&cf, &key, &sa);
+    if (cache_state == 2) {
+      if (sa_cache_load_cands(&cf, out_cands, out_n)) {
+        sa_cache_close(&cf);
+        fprintf(stderr, "[mmjp_train] sa_cache: reused suffix array and %zu candidates from %s\n", *out_n, sa_cache);
+        return 1;
+      }
+      /* 候補部が読めない: SA だけ使って候補を数え直し、ファイルも書き直す */
+      fprintf(stderr, "[mmjp_train] sa_cache: candidate list in %s is unreadable, recounting\n", sa_cache);
+      cache_state = 1;
+    }
   }
-  size_t built = sa_utf8_build(sa, starts, text, text_len, build_flags);
-  if (built == 0) {
-    fprintf(stderr, "[mmjp_train] suffix-array: build failed. Hint: compile suffix_array with -DSA_SORT_DYNAMIC_STACK=1 or increase SA_SORT_STACK_MAX, or reduce --sample_bytes.\n");
-    free(sa);
-    return 0;
+
+  if (cache_state == 1) {
+    sa_cache_hdr_t h;
+    memcpy(&h, cf.data, sizeof(h));
+    starts = (size_t)h.n_starts;
+    fprintf(stderr, "[mmjp_train] sa_cache: reused suffix array (starts=%zu) from %s\n", starts, sa_cache);
+  } else {
+    /* SA-IS sorts every character, so give it room to work in place */
+    size_t sa_cap = sa_utf8_build_work_cap(text, text_len);
+    if (sa_cap < starts) sa_cap = starts;
+    const size_t sa_bytes = sa_cap * sizeof(sa_idx_t);
+    fprintf(stderr, "[mmjp_train] suffix-array: starts=%zu (%.1f MB), flags=0x%X\n",
+            starts, (double)sa_bytes / (1024.0 * 1024.0), (unsigned)build_flags);
+
+    sa_buf = (sa_idx_t *)malloc(sa_bytes);
+    if (!sa_buf) {
+      fprintf(stderr, "[mmjp_train] suffix-array: oom for sa (%zu bytes)\n", sa_bytes);
+      sa_cache_close(&cf);
+      return 0;
+    }
+    size_t built = sa_utf8_build(sa_buf, sa_cap, text, text_len, build_flags);
+    if (built == 0) {
+      fprintf(stderr, "[mmjp_train] suffix-array: build failed. The corpus sample has malformed UTF-8, so the radix-sort fallback was used and it ran out of stack. Increase SA_SORT_STACK_MAX or reduce --sample_bytes.\n");
+      free(sa_buf);
+      sa_cache_close(&cf);
+      return 0;
+    }
+    starts = built;
+    sa = sa_buf;
   }
-  starts = built;
 
   int n_min = 2;
   int n_max = (max_piece_len_cp > 1) ? max_piece_len_cp : 2;
@@ -2116,75 +2917,93 @@ static int collect_top_ngrams(const uint8_t *text, size_t text_len,
   size_t per_len = (cand_total > 0 && n_len > 0) ? (cand_total / (size_t)n_len) : 0;
   if (per_len < 512) per_len = 512;
 
-  cand_t *all = NULL;
-  size_t all_n = 0, all_cap = 0;
+  /* prefixes longer than this are never candidates (same bound as the old copy buffer) */
+  enum { NGRAM_MAX_BYTES = 127 };
+
+  uint8_t *lcp = (uint8_t *)malloc(starts);
+  cand_heap_t *heaps = (cand_heap_t *)calloc((size_t)n_len, sizeof(cand_heap_t));
+  ngram_run_t *runs = (ngram_run_t *)calloc((size_t)n_len, sizeof(ngram_run_t));
+  uint16_t *plen = (uint16_t *)calloc((size_t)n_len, sizeof(uint16_t));
+  int ok = (lcp && heaps && runs && plen);
+  for (int k = 0; ok && k < n_len; k++) ok = heap_init(&heaps[k], per_len);
+  if (ok) {
+    sa_utf8_view_t view = sa_utf8_view(text, text_len, sa, starts);
+    ok = (sa_utf8_build_lcp(&view, lcp, starts, NGRAM_MAX_BYTES, (unsigned)threads) == starts);
+  }
 
-  char last[128];
-  char cur[128];
+  for (size_t i = 0; ok && i < starts; i++) {
+    /* byte length of the n-codepoint prefix for every n (0 = not available) */
+    size_t pos = sa[i];
+    size_t w = 0;
+    for (int ncp = 1; ncp <= n_max; ncp++) {
+      size_t adv = (pos + w < text_len) ? ngram_cp_bytes(text + pos + w, text_len - pos - w) : 0;
+      if (adv == 0 || w + adv > NGRAM_MAX_BYTES) {
+        for (int k = ncp; k <= n_max; k++) {
+          if (k >= n_min) plen[k - n_min] = 0;
+        }
+        break;
+      }
+      w += adv;
+      if (ncp >= n_min) plen[ncp - n_min] = (uint16_t)w;
+    }
 
-  for (int ncp = n_min; ncp <= n_max; ncp++) {
-    cand_heap_t heap;
-    if (!heap_init(&heap, per_len)) {
-      free(sa);
-      return 0;
-    }
-    last[0] = '\0';
-    uint32_t run = 0;
-
-    for (size_t i = 0; i < starts; i++) {
-      size_t start_pos = sa[i];
-      size_t w = sa_utf8_copy_prefix_n(text, text_len, start_pos, (size_t)ncp, cur, sizeof(cur), SA_BUILD_DEFAULT);
-      if (w == 0) continue;
-      if (!is_good_piece_bytes(cur, w)) continue;
-      if (fb && fb_len > 0 && mmjp_bytes_contains(cur, w, fb, fb_len)) continue;
-      if (utf8_count_cp((const uint8_t *)cur, w) < (size_t)ncp) continue;
-
-      if (run == 0) {
-        memcpy(last, cur, w + 1);
-        run = 1;
+    for (int k = 0; k < n_len; k++) {
+      ngram_run_t *r = &runs[k];
+      const uint16_t pl = plen[k];
+      if (pl != 0 && r->len_bytes == pl && i > 0 && lcp[i] >= pl) {
+        r->count++;
         continue;
       }
-      if (strcmp(cur, last) == 0) {
-        run++;
-      } else {
-        if (run >= min_count) {
-          size_t blen = strlen(last);
-          (void)heap_push_topk(&heap, run, last, (uint16_t)blen, (uint16_t)ncp);
-        }
-        /* restart */
-        memcpy(last, cur, w + 1);
-        run = 1;
+      if (!ngram_run_flush(&heaps[k], r, text, sa, n_min + k, min_count, fb, fb_len)) {
+        ok = 0;
+        break;
       }
+      r->first = i;
+      r->count = (pl != 0) ? 1u : 0u;
+      r->len_bytes = pl;
     }
-    if (run >= min_count && last[0] != '\0') {
-      size_t blen = strlen(last);
-      (void)heap_push_topk(&heap, run, last, (uint16_t)blen, (uint16_t)ncp);
-    }
+  }
+  for (int k = 0; ok && k < n_len; k++) {
+    ok = ngram_run_flush(&heaps[k], &runs[k], text, sa, n_min + k, min_count, fb, fb_len);
+  }
 
-    /* move heap entries to all */
-    if (heap.n > 0) {
-      if (all_n + heap.n > all_cap) {
+  free(lcp);
+  free(runs);
+  free(plen);
+
+  /* move heap entries to all */
+  cand_t *all = NULL;
+  size_t all_n = 0, all_cap = 0;
+  for (int k = 0; heaps && k < n_len; k++) {
+    cand_heap_t *heap = &heaps[k];
+    if (ok && heap->n > 0) {
+      if (all_n + heap->n > all_cap) {
         size_t nc = all_cap ? all_cap * 2 : 4096;
-        while (nc < all_n + heap.n) nc *= 2;
+        while (nc < all_n + heap->n) nc *= 2;
         cand_t *na = (cand_t *)realloc(all, nc * sizeof(cand_t));
         if (!na) {
-          heap_free(&heap);
-          free(sa);
-          return 0;
+          ok = 0;
+        } else {
+          all = na;
+          all_cap = nc;
         }
-        all = na;
-        all_cap = nc;
       }
-      for (size_t i = 0; i < heap.n; i++) {
-        all[all_n++] = heap.a[i];
+      for (size_t i = 0; ok && i < heap->n; i++) {
+        all[all_n++] = heap->a[i];
         /* ownership transferred */
-        heap.a[i].s = NULL;
+        heap->a[i].s = NULL;
       }
     }
-    heap_free(&heap);
+    heap_free(heap);
+  }
+  free(heaps);
+  if (!ok) {
+    for (size_t i = 0; i < all_n; i++) cand_free(&all[i]);
+    free(all);
+    free(sa_buf);
+    sa_cache_close(&cf);
+    return 0;
   }
-
-  free(sa);
 
   /* sort all and keep top cand_total */
   qsort(all, all_n, sizeof(cand_t), cmp_cand_desc);
@@ -2193,6 +3012,15 @@ static int collect_top_ngrams(const uint8_t *text, size_t text_len,
     all_n = cand_total;
   }
 
+  if (sa_cache) {
+    key.n_starts = starts;
+    if (!sa_cache_save(sa_cache, &key, sa, all, all_n)) {
+      fprintf(stderr, "[mmjp_train] sa_cache: failed to write %s\n", sa_cache);
+    }
+  }
+  free(sa_buf);
+  sa_cache_close(&cf);
+
   *out_cands = all;
   *out_n = all_n;
   return 1;
@@ -2375,6 +3203,603 @@ static int parse_cc_ranges(const char *path, npycrf_cc_range_t **out_ranges, uin
   return 0;
 }
 
+/* =====================
+ * Codepoint-keyed double-array trie (--trie cp)
+ *
+ * The byte trie spends one transition per UTF-8 byte (3 for kana/kanji).
+ * Here every kept piece is remapped to a sequence of alphabet codes, one per
+ * codepoint, ranked by probability-weighted frequency so the common
+ * characters get the small codes and their slots stay close to the parent's
+ * base. Code 0 is the terminal marker and the terminal node stores
+ * -(id + 1) in BASE, exactly like npycrf_da_set_term_value(), so the
+ * decoder's terminal lookup and npycrf_lm_build_term_index() are unchanged.
+ *
+ * The array is built in one static pass over the keys sorted by code
+ * sequence (BFS order, first-fit BASE search over a free-slot finder)
+ * instead of the incremental insert/relocate of double_array_trie.c, whose
+ * per-node child scan is sized for a 256-symbol alphabet.
+ * ===================== */
+
+typedef struct {
+  uint32_t cp;
+  double w;
+} cpw_t;
+
+static int cmp_cpw_cp(const void *a, const void *b) {
+  const cpw_t *x = (const cpw_t *)a;
+  const cpw_t *y = (const cpw_t *)b;
+  return (x->cp > y->cp) - (x->cp < y->cp);
+}
+
+static int cmp_cpw_desc(const void *a, const void *b) {
+  const cpw_t *x = (const cpw_t *)a;
+  const cpw_t *y = (const cpw_t *)b;
+  if (x->w < y->w) return 1;
+  if (x->w > y->w) return -1;
+  return (x->cp > y->cp) - (x->cp < y->cp);
+}
+
+/* piece code sequences: codes[off[k] .. off[k+1]) */
+typedef struct {
+  uint16_t *codes;
+  size_t *off;
+  uint16_t *id;
+} cpkeys_t;
+
+static const cpkeys_t *g_cpkeys = NULL;
+
+static int cmp_cpkey(const void *a, const void *b) {
+  size_t ka = *(const size_t *)a, kb = *(const size_t *)b;
+  const uint16_t *pa = g_cpkeys->codes + g_cpkeys->off[ka];
+  const uint16_t *pb = g_cpkeys->codes + g_cpkeys->off[kb];
+  size_t la = g_cpkeys->off[ka + 1] - g_cpkeys->off[ka];
+  size_t lb = g_cpkeys->off[kb + 1] - g_cpkeys->off[kb];
+  size_t n = (la < lb) ? la : lb;
+  for (size_t i = 0; i < n; i++) {
+    if (pa[i] != pb[i]) return (pa[i] < pb[i]) ? -1 : 1;
+  }
+  return (la > lb) - (la < lb);
+}
+
+/* growable BASE/CHECK plus a union-find "next free slot" array */
+typedef struct {
+  da_index_t *base;
+  da_index_t *check;
+  size_t *nfree;
+  size_t cap;
+  size_t used;  /* highest occupied slot + 1 */
+} cpda_t;
+
+static int cpda_reserve(cpda_t *d, size_t need) {
+  if (need <= d->cap) return 1;
+  size_t nc = d->cap ? d->cap : 1024u;
+  while (nc < need) nc *= 2u;
+  da_index_t *nb = (da_index_t *)realloc(d->base, nc * sizeof(da_index_t));
+  if (!nb) return 0;
+  d->base = nb;
+  da_index_t *nk = (da_index_t *)realloc(d->check, nc * sizeof(da_index_t));
+  if (!nk) return 0;
+  d->check = nk;
+  size_t *nf = (size_t *)realloc(d->nfree, (nc + 1u) * sizeof(size_t));
+  if (!nf) return 0;
+  d->nfree = nf;
+  for (size_t i = d->cap; i < nc; i++) {
+    d->base[i] = 0;
+    d->check[i] = 0;
+    d->nfree[i] = i;
+  }
+  d->nfree[nc] = nc;  /* sentinel: always "free", grows on demand */
+  d->cap = nc;
+  return 1;
+}
+
+/* smallest free slot >= i (may be == cap, i.e. beyond the current array) */
+static size_t cpda_find_free(cpda_t *d, size_t i) {
+  if (i >= d->cap) return i;
+  size_t r = i;
+  while (r < d->cap && d->nfree[r] != r) r = d->nfree[r];
+  while (i < d->cap && d->nfree[i] != i) {  /* path compression */
+    size_t nx = d->nfree[i];
+    d->nfree[i] = r;
+    i = nx;
+  }
+  return r;
+}
+
+static void cpda_occupy(cpda_t *d, size_t slot, da_index_t parent) {
+  d->check[slot] = parent;
+  d->nfree[slot] = slot + 1u;
+  if (slot + 1u > d->used) d->used = slot + 1u;
+}
+
+/* BFS work item: node slot + key range [lo, hi) sharing the first `depth` codes */
+typedef struct {
+  da_index_t node;
+  size_t lo, hi;
+  size_t depth;
+} cpda_item_t;
+
+static uint16_t cpkey_code_at(const cpkeys_t *k, size_t key, size_t depth) {
+  size_t len = k->off[key + 1] - k->off[key];
+  return (depth < len) ? k->codes[k->off[key] + depth] : 0u;
+}
+
+/*
+ * Build the codepoint trie for the kept pieces.
+ *
+ * out_da receives malloc'd base/check (dynamic, freed by da_trie_free),
+ * out_map the cp_page + cp_code table (npycrf_cp_map_count(*out_npages) u16).
+ * Returns 0 on success.
+ */
+static int cptrie_build(const unilm_model_t *um, const uint8_t *keep, const uint16_t *map,
+                        da_trie_t *out_da, uint16_t **out_map, uint32_t *out_npages) {
+  int rc = 1;
+  cpkeys_t k;
+  memset(&k, 0, sizeof(k));
+  cpw_t *occ = NULL;
+  size_t *order = NULL;
+  uint16_t *cpmap = NULL;
+  cpda_t d;
+  memset(&d, 0, sizeof(d));
+  cpda_item_t *queue = NULL;
+  uint16_t *child = NULL;
+
+  /* 1) decode kept pieces into codepoints, and their occurrence weights */
+  size_t nkeys = 0, ncp = 0;
+  for (uint32_t id = 0; id < (uint32_t)um->vocab_size; id++) {
+    if (!keep[id]) continue;
+    size_t blen = 0;
+    const uint8_t *b = unilm_model_piece_bytes(um, id, &blen);
+    if (!b || blen == 0) continue;
+    nkeys++;
+    ncp += utf8_count_cp(b, blen);
+  }
+  k.codes = (uint16_t *)malloc((ncp + 1u) * sizeof(uint16_t));
+  k.off = (size_t *)malloc((nkeys + 1u) * sizeof(size_t));
+  k.id = (uint16_t *)malloc((nkeys + 1u) * sizeof(uint16_t));
+  occ = (cpw_t *)malloc((ncp + 1u) * sizeof(cpw_t));
+  order = (size_t *)malloc((nkeys + 1u) * sizeof(size_t));
+  if (!k.codes || !k.off || !k.id || !occ || !order) goto done;
+
+  uint32_t *cps = (uint32_t *)malloc((ncp + 1u) * sizeof(uint32_t));
+  if (!cps) goto done;
+  size_t nk = 0, nc = 0;
+  for (uint32_t id = 0; id < (uint32_t)um->vocab_size; id++) {
+    if (!keep[id]) continue;
+    size_t blen = 0;
+    const uint8_t *b = unilm_model_piece_bytes(um, id, &blen);
+    if (!b || blen == 0) continue;
+    double w = exp((double)um->logp[id]);
+    k.off[nk] = nc;
+    k.id[nk] = map[id];
+    for (size_t pos = 0; pos < blen;) {
+      uint32_t cp = 0;
+      size_t adv = 0;
+      /* same stopping rule as utf8_count_cp() so the totals match */
+      if (!utf8_decode1(b, blen, pos, &cp, &adv) || adv == 0 || nc >= ncp) break;
+      cps[nc] = cp;
+      occ[nc].cp = cp;
+      occ[nc].w = w;
+      nc++;
+      pos += adv;
+    }
+    nk++;
+  }
+  k.off[nk] = nc;
+
+  /* 2) alphabet ranked by weight: code 1 = most frequent */
+  qsort(occ, nc, sizeof(cpw_t), cmp_cpw_cp);
+  size_t na = 0;
+  for (size_t i = 0; i < nc; i++) {
+    if (na > 0 && occ[na - 1].cp == occ[i].cp) {
+      occ[na - 1].w += occ[i].w;
+    } else {
+      occ[na++] = occ[i];
+    }
+  }
+  if (na >= 0xFFFFu) {
+    fprintf(stderr, "[mmjp_train] --trie cp: alphabet too large (%zu)\n", na);
+    free(cps);
+    goto done;
+  }
+  qsort(occ, na, sizeof(cpw_t), cmp_cpw_desc);
+
+  uint16_t page_of[NPYCRF_CP_PAGES];
+  memset(page_of, 0, sizeof(page_of));
+  uint32_t npages = 0;
+  for (size_t a = 0; a < na; a++) {
+    uint32_t pg = occ[a].cp >> 8;
+    if (pg < NPYCRF_CP_PAGES && page_of[pg] == 0) page_of[pg] = (uint16_t)++npages;
+  }
+  cpmap = (uint16_t *)calloc(npycrf_cp_map_count(npages), sizeof(uint16_t));
+  if (!cpmap) {
+    free(cps);
+    goto done;
+  }
+  memcpy(cpmap, page_of, sizeof(page_of));
+  uint16_t *cp_code = cpmap + NPYCRF_CP_PAGES;
+  for (size_t a = 0; a < na; a++) {
+    uint32_t cp = occ[a].cp;
+    cp_code[((size_t)page_of[cp >> 8] << 8) | (cp & 0xFFu)] = (uint16_t)(a + 1u);
+  }
+  for (size_t i = 0; i < nc; i++) {
+    k.codes[i] = cp_code[((size_t)page_of[cps[i] >> 8] << 8) | (cps[i] & 0xFFu)];
+  }
+  free(cps);
+
+  /* 3) sort keys by code sequence (a prefix sorts before its extensions) */
+  for (size_t i = 0; i < nk; i++) order[i] = i;
+  g_cpkeys = &k;
+  qsort(order, nk, sizeof(size_t), cmp_cpkey);
+  g_cpkeys = NULL;
+
+  /* 4) BFS construction */
+  if (!cpda_reserve(&d, (size_t)na + 2u)) goto done;
+  d.nfree[0] = 1;  /* slot 0 is never used */
+  d.base[1] = 1;
+  cpda_occupy(&d, 1, 1);  /* root, as in da_trie_clear() */
+
+  child = (uint16_t *)malloc((na + 2u) * sizeof(uint16_t));
+  size_t qcap = nk + 16u, qh = 0, qt = 0;
+  queue = (cpda_item_t *)malloc(qcap * sizeof(cpda_item_t));
+  if (!child || !queue) goto done;
+  queue[qt++] = (cpda_item_t){ 1, 0, nk, 0 };
+
+  while (qh < qt) {
+    cpda_item_t it = queue[qh++];
+
+    /* distinct child codes in order (terminal 0 first) */
+    size_t nch = 0;
+    for (size_t i = it.lo; i < it.hi; i++) {
+      uint16_t c = cpkey_code_at(&k, order[i], it.depth);
+      if (nch == 0 || child[nch - 1] != c) child[nch++] = c;
+    }
+    if (nch == 0) continue;
+
+    /* first-fit BASE: child[0] lands on a free slot, then verify the rest */
+    size_t c0 = child[0];
+    size_t f = cpda_find_free(&d, c0 + 1u);
+    size_t b = 0;
+    for (;;) {
+      b = f - c0;
+      if (!cpda_reserve(&d, b + (size_t)child[nch - 1] + 1u)) goto done;
+      size_t j = 1;
+      for (; j < nch; j++) {
+        size_t s = b + (size_t)child[j];
+        if (d.check[s] != 0) break;
+      }
+      if (j == nch) break;
+      f = cpda_find_free(&d, f + 1u);
+    }
+    if (b > 0x7FFFFFFFu) goto done;
+    d.base[it.node] = (da_index_t)b;
+    for (size_t j = 0; j < nch; j++) cpda_occupy(&d, b + (size_t)child[j], it.node);
+
+    /* terminal value / enqueue children */
+    size_t i = it.lo;
+    for (size_t j = 0; j < nch; j++) {
+      size_t lo = i;
+      while (i < it.hi && cpkey_code_at(&k, order[i], it.depth) == child[j]) i++;
+      da_index_t slot = (da_index_t)(b + (size_t)child[j]);
+      if (child[j] == 0) {
+        d.base[slot] = (da_index_t)(-(int32_t)k.id[order[i - 1]] - 1);
+        continue;
+      }
+      if (qt >= qcap) {
+        qcap *= 2u;
+        cpda_item_t *nq = (cpda_item_t *)realloc(queue, qcap * sizeof(cpda_item_t));
+        if (!nq) goto done;
+        queue = nq;
+      }
+      queue[qt++] = (cpda_item_t){ slot, lo, i, it.depth + 1u };
+    }
+  }
+
+  memset(out_da, 0, sizeof(*out_da));
+  out_da->base = d.base;
+  out_da->check = d.check;
+  out_da->capacity = d.used;
+  out_da->dynamic = 1;
+  d.base = NULL;
+  d.check = NULL;
+  *out_map = cpmap;
+  *out_npages = npages;
+  cpmap = NULL;
+  printf("[mmjp_train] cp trie: alphabet=%zu pages=%u keys=%zu da_cap=%zu\n", na, npages, nk, out_da->capacity);
+  rc = 0;
+
+done:
+  free(k.codes);
+  free(k.off);
+  free(k.id);
+  free(occ);
+  free(order);
+  free(cpmap);
+  free(d.base);
+  free(d.check);
+  free(d.nfree);
+  free(queue);
+  free(child);
+  return rc;
+}
+
+/* =====================
+ * 初期モデル（必須文字 + 候補）の構築
+ *  - keep_chars: fallback と ASCII printable に、頻度順の文字 arr を char_vocab まで足す。
+ *  - その写像で切り出したサンプルから候補を抽出し、辞書順トライの um0 を作る。
+ *  - 成功で 1（fit->keep_chars は keep_chars を指す）。失敗時は確保したものを解放して 0。
+ * ===================== */
+
+/* mandatory single chars が target_vocab を食い尽くさないように char_vocab を抑える */
+static size_t effective_char_vocab(size_t target_vocab, size_t char_vocab) {
+  if (target_vocab > 0 && char_vocab >= target_vocab) {
+    char_vocab = (target_vocab >= 512) ? (target_vocab / 2) : (target_vocab - 1);
+  }
+  if (char_vocab < 256) char_vocab = 256;
+  return char_vocab;
+}
+
+static void initial_model_free(u32set_t *keep_chars, cand_t *cands, size_t cands_n, unilm_model_t *um0) {
+  unilm_model_free(um0);
+  for (size_t i = 0; i < cands_n; i++) cand_free(&cands[i]);
+  free(cands);
+  u32set_free(keep_chars);
+}
+
+static int build_initial_model(file_iter_t *fit, const cpair_t *arr, size_t arr_n, size_t char_vocab,
+                               uint32_t fallback_cp, size_t sample_bytes, int max_piece_len_cp,
+                               size_t cand_total, uint32_t min_count, int threads,
+                               const char *sa_cache_path, u32set_t *keep_chars,
+                               cand_t **out_cands, size_t *out_cands_n, unilm_model_t *um0) {
+  int ok = 0;
+  uint8_t *sample = NULL;
+  cand_t *cands = NULL;
+  size_t cands_n = 0;
+
+  memset(keep_chars, 0, sizeof(*keep_chars));
+  memset(um0, 0, sizeof(*um0));
+  *out_cands = NULL;
+  *out_cands_n = 0;
+
+  /* --- build keep_chars set --- */
+  if (!u32set_init(keep_chars, 1u << 14)) {
+    fprintf(stderr, "oom keep_chars\n");
+    return 0;
+  }
+  (void)u32set_insert(keep_chars, fallback_cp);
+  /* ASCII printable は常に保持（ログ/デバッグ/数値などで役立つ） */
+  for (uint32_t cp = 0x20; cp <= 0x7E; cp++) (void)u32set_insert(keep_chars, cp);
+
+  size_t added = keep_chars->size;
+  for (size_t i = 0; i < arr_n && added < char_vocab; i++) {
+    if (u32set_contains(keep_chars, arr[i].cp)) continue;
+    if (u32set_insert(keep_chars, arr[i].cp)) added++;
+  }
+
+  printf("[mmjp_train] keep_chars=%zu (char_vocab=%zu, fallback=%u)\n", keep_chars->size, char_vocab, fallback_cp);
+
+  /* enable mapping for subsequent passes */
+  fit->keep_chars = keep_chars;
+  fit->fallback_cp = fallback_cp;
+  fit->stat_skipped_long_bytes = 0;
+  fit->stat_skipped_long_cp = 0;
+
+  /* --- candidate extraction (mapped sample) --- */
+  file_iter_reset(fit);
+  size_t sample_cap = sample_bytes + 1024u;
+  size_t sample_len = 0;
+  sample = (uint8_t *)malloc(sample_cap);
+  if (!sample) {
+    fprintf(stderr, "oom sample\n");
+    goto done;
+  }
+  while (sample_len + 1 < sample_bytes) {
+    int r = file_iter_readline(fit);
+    if (r < 0) {
+      fprintf(stderr, "read error during sample\n");
+      goto done;
+    }
+    if (r == 0) break;
+    if (fit->len == 0) continue;
+    const uint8_t *src = (fit->mapped_len > 0) ? fit->mapped : fit->buf;
+    size_t slen = (fit->mapped_len > 0) ? fit->mapped_len : fit->len;
+    if (sample_len + slen + 2 > sample_cap) {
+      size_t nc = sample_cap * 2;
+      while (nc < sample_len + slen + 2) nc *= 2;
+      uint8_t *nb = (uint8_t *)realloc(sample, nc);
+      if (!nb) {
+        fprintf(stderr, "oom sample grow\n");
+        goto done;
+      }
+      sample = nb;
+      sample_cap = nc;
+    }
+    memcpy(&sample[sample_len], src, slen);
+    sample_len += slen;
+    sample[sample_len++] = '\n';
+    if (sample_len >= sample_bytes) break;
+  }
+  sample[sample_len] = 0;
+
+  printf("[mmjp_train] candidate sample bytes=%zu (mapped)\n", sample_len);
+
+  {
+    uint8_t fb[4];
+    size_t fb_len = utf8_encode1(fallback_cp, fb);
+    if (!collect_top_ngrams(sample, sample_len, max_piece_len_cp, cand_total, min_count, fb, fb_len, threads,
+                            sa_cache_path, &cands, &cands_n)) {
+      fprintf(stderr, "candidate extraction failed\n");
+      goto done;
+    }
+  }
+  printf("[mmjp_train] candidates=%zu\n", cands_n);
+
+  free(sample);
+  sample = NULL;
+
+  /* --- init unilm model --- */
+  size_t mandatory_count = keep_chars->size;
+  size_t vocab_cap = mandatory_count + cands_n + 16;
+
+  size_t str_cap = 1024;
+  for (size_t i = 0; i < keep_chars->cap; i++) {
+    if (keep_chars->k[i] == 0) continue;
+    uint8_t tmp[4];
+    str_cap += utf8_encode1(keep_chars->k[i], tmp);
+  }
+  for (size_t i = 0; i < cands_n; i++) str_cap += cands[i].len_bytes;
+  str_cap += 1024;
+
+  size_t da_cap = 256;
+  while (da_cap < str_cap * 2 + 512) da_cap <<= 1;
+
+  if (unilm_model_init_dynamic(um0, vocab_cap, str_cap, da_cap) != UNILM_OK) {
+    fprintf(stderr, "unilm_model_init_dynamic failed\n");
+    goto done;
+  }
+
+  /* add mandatory single codepoints */
+  size_t added_single = 0;
+  for (size_t i = 0; i < keep_chars->cap; i++) {
+    uint32_t cp = keep_chars->k[i];
+    if (cp == 0) continue;
+    uint8_t tmp[4];
+    size_t blen = utf8_encode1(cp, tmp);
+    if (unilm_model_add_piece(um0, tmp, blen, UNILM_PIECE_MANDATORY) < 0) {
+      fprintf(stderr, "add piece failed (single)\n");
+      /* continue */
+    } else {
+      added_single++;
+    }
+  }
+  printf("[mmjp_train] mandatory singles added=%zu\n", added_single);
+
+  /* add candidates */
+  size_t added_cand = 0;
+  for (size_t i = 0; i < cands_n; i++) {
+    if (unilm_model_add_piece(um0, (const uint8_t *)cands[i].s, cands[i].len_bytes, 0) < 0) {
+      /* ignore */
+    } else {
+      added_cand++;
+    }
+  }
+  printf("[mmjp_train] candidates added=%zu (requested=%zu)\n", added_cand, cands_n);
+
+  /*
+   * 重要:
+   *  - keep_chars はハッシュ順で追加されるため、トライ挿入順がランダムになりがち。
+   *  - 大きい語彙では挿入順による衝突/再配置が増え、まれに NOCOVER の原因になる。
+   *  - ここで一度、語彙を辞書順でトライに積み直して安定化する。
+   */
+  {
+    int rc = unilm_model_rebuild_trie_sorted(um0);
+    if (rc != UNILM_OK) {
+      fprintf(stderr, "unilm_model_rebuild_trie_sorted failed rc=%d\n", rc);
+      goto done;
+    }
+  }
+  ok = 1;
+
+done:
+  free(sample);
+  if (!ok) {
+    fit->keep_chars = NULL;
+    initial_model_free(keep_chars, cands, cands_n, um0);
+    return 0;
+  }
+  *out_cands = cands;
+  *out_cands_n = cands_n;
+  return 1;
+}
+
+/* =====================
+ * --sweep: several configurations in one process
+ *  - 書式: "key=v1,v2,...;key=..."（key: vocab, mdl_lambda0, mdl_lambda_len, lambda0）
+ *  - 指定した値の直積を順に学習する。指定しない key はコマンドラインの値。
+ *  - コーパスの走査と教師あり CRF の学習は全構成で共有し、UniLM の EM・枝刈り、
+ *    教師なし CRF、保存を構成ごとに行う。
+ *  - 文字集合と候補抽出（と --sa_cache）は vocab から決まる char_vocab ごとに作り直す
+ *    （vocab が最も外側なので同じ char_vocab の構成は連続する）。
+ * ===================== */
+
+#define SWEEP_MAX_POINTS 4096u
+#define SWEEP_MAX_VALUES 64u
+
+typedef struct {
+  size_t vocab;
+  double mdl_lambda0;
+  double mdl_lambda_len;
+  double lambda0;
+} sweep_point_t;
+
+/* spec が NULL なら base の 1 点 */
+static int sweep_parse(const char *spec, const sweep_point_t *base, sweep_point_t **out, size_t *out_n) {
+  double vals[4][SWEEP_MAX_VALUES];
+  size_t nv[4] = { 0, 0, 0, 0 };
+  static const char *const keys[4] = { "vocab", "mdl_lambda0", "mdl_lambda_len", "lambda0" };
+
+  for (const char *p = spec; p && *p; ) {
+    const char *end = strchr(p, ';');
+    if (!end) end = p + strlen(p);
+    const char *eq = memchr(p, '=', (size_t)(end - p));
+    if (!eq) return 0;
+    int k = -1;
+    for (int j = 0; j < 4; j++) {
+      if (strlen(keys[j]) == (size_t)(eq - p) && memcmp(keys[j], p, (size_t)(eq - p)) == 0) k = j;
+    }
+    if (k < 0 || nv[k] > 0) return 0;
+    for (const char *v = eq + 1; v < end; ) {
+      char *e = NULL;
+      double d = strtod(v, &e);
+      if (e == v || e > end || nv[k] >= SWEEP_MAX_VALUES) return 0;
+      if (k == 0 && !(d >= 0.0 && d == floor(d))) return 0;
+      vals[k][nv[k]++] = d;
+      v = e;
+      if (v < end && *v == ',') v++;
+      else if (v < end) return 0;
+    }
+    if (nv[k] == 0) return 0;
+    p = (*end == ';') ? end + 1 : end;
+  }
+
+  size_t n = 1;
+  for (int j = 0; j < 4; j++) {
+    if (nv[j] == 0) {
+      vals[j][0] = (j == 0) ? (double)base->vocab : (j == 1) ? base->mdl_lambda0
+                 : (j == 2) ? base->mdl_lambda_len : base->lambda0;
+      nv[j] = 1;
+    }
+    n *= nv[j];
+    if (n > SWEEP_MAX_POINTS) return 0;
+  }
+  sweep_point_t *a = (sweep_point_t *)malloc(n * sizeof(sweep_point_t));
+  if (!a) return 0;
+  size_t i = 0;
+  for (size_t a0 = 0; a0 < nv[0]; a0++)
+    for (size_t a1 = 0; a1 < nv[1]; a1++)
+      for (size_t a2 = 0; a2 < nv[2]; a2++)
+        for (size_t a3 = 0; a3 < nv[3]; a3++, i++) {
+          a[i].vocab = (size_t)vals[0][a0];
+          a[i].mdl_lambda0 = vals[1][a1];
+          a[i].mdl_lambda_len = vals[2][a2];
+          a[i].lambda0 = vals[3][a3];
+        }
+  *out = a;
+  *out_n = n;
+  return 1;
+}
+
+/* out が "m.bin" なら構成 i は "m.<i>.bin"、i == (size_t)-1 はサマリー "m.sweep.tsv" */
+static char *sweep_out_path(const char *out, size_t i) {
+  size_t n = strlen(out);
+  if (n >= 4 && strcmp(out + n - 4, ".bin") == 0) n -= 4;
+  char *p = (char *)malloc(n + 32u);
+  if (!p) return NULL;
+  if (i == (size_t)-1) snprintf(p, n + 32u, "%.*s.sweep.tsv", (int)n, out);
+  else snprintf(p, n + 32u, "%.*s.%zu.bin", (int)n, out, i);
+  return p;
+}
+
 /* =====================
  * CLI
  * ===================== */
@@ -2401,12 +3826,27 @@ static void usage(const char *prog) {
           "  --lambda0 X            lambda0 for npycrf decode (default: 1.0)\n"
           "  --mdl_lambda0 X        MDL lambda0 (default: 0.0)\n"
           "  --mdl_lambda_len X     MDL lambda_len (default: 0.15)\n"
+          "  --prune_shrink X       prune in rounds keeping this fraction of pieces per round,\n"
+          "                         scored by the loss of their best alternative split\n"
+          "                         (e.g. 0.75; default: 0 = one-shot MDL pruning)\n"
+          "  --threads N            worker threads for the EM E-step, suffix-array LCP,\n"
+          "                         CRF pseudo-labeling and CRF training (default: 1)\n"
+          "  --fixed_reduce 0|1     sum E-step counts in a fixed shard order so the model\n"
+          "                         does not depend on --threads (default: 0)\n"
+          "  --sa_cache PATH        keep the candidate suffix array and n-gram list in PATH\n"
+          "                         (mmap-ed and reused while the sample and settings match)\n"
+          "  --sweep SPEC           train every combination in one process, sharing corpus scan,\n"
+          "                         candidates and supervised CRF weights, e.g.\n"
+          "                         \"vocab=4000,8000;mdl_lambda_len=0.1,0.15;lambda0=0.5,1\"\n"
+          "                         (keys: vocab, mdl_lambda0, mdl_lambda_len, lambda0);\n"
+          "                         models go to OUT.<i>.bin and a summary to OUT.sweep.tsv\n"
           "\nCRF options (no hard-coded weights):\n"
           "  --crf_config PATH      override CRF weights from config file\n"
           "  --crf_supervised PATH  train CRF weights from segmented corpus (space-separated tokens)\n"
           "  --crf_epochs N         supervised CRF epochs/iters (default: 20)\n"
-          "  --crf_opt sgd|lbfgs     supervised optimizer (default: lbfgs)\n"
-          "  --crf_lr X             supervised CRF learning rate (SGD only, default: 0.05)\n"
+          "  --crf_opt sgd|adagrad|lbfgs  supervised optimizer (default: lbfgs)\n"
+          "  --crf_lr X             supervised CRF learning rate (SGD/AdaGrad, default: 0.05)\n"
+          "  --crf_batch N          SGD/AdaGrad mini-batch sentences, 0=full batch (default: 0)\n"
           "  --crf_l2 X             supervised CRF L2 regularization (default: 1e-4)\n"
           "  --crf_lbfgs_m N         L-BFGS history size (default: 8)\n"
           "  --crf_tol X             L-BFGS gradient-norm tolerance (default: 1e-4)\n"
@@ -2420,6 +3860,11 @@ static void usage(const char *prog) {
           "  --cc_mode MODE          character class mode: compat|ascii|utf8len|ranges (default: compat)\n"
           "  --cc_ranges FILE        ranges file for --cc_mode ranges (format: start end class_id per line)\n"
           "  --cc_fallback MODE      fallback mode for ranges: ascii|utf8len (default: utf8len)\n"
+          "\nOutput:\n"
+          "  --model_version 2|3|4   model.bin format; 3 is mmap-able, 4 is compact\n"
+          "                          (int16 trie, 8-bit logp, delta-coded bigram keys; default: 3)\n"
+          "  --trie byte|cp          dictionary trie keyed on UTF-8 bytes or on codepoints\n"
+          "                          (one transition per character, needs --model_version 3|4; default: byte)\n"
           "\n",
           prog);
 }
@@ -2451,6 +3896,7 @@ int main(int argc, char **argv) {
 
   double mdl_lambda0 = 0.0;
   double mdl_lambda_len = 0.15;
+  double prune_shrink = 0.0;
 
   /* CRF weights (optional)
    *  - --crf_config: override transitions/feature weights without recompiling
@@ -2463,6 +3909,7 @@ int main(int argc, char **argv) {
   int crf_lbfgs_m = 8;
   double crf_tol = 1e-4;
   double crf_lr = 0.05;
+  size_t crf_batch = 0;
   double crf_l2 = 1e-4;
 
   /* unsupervised CRF training */
@@ -2478,6 +3925,18 @@ int main(int argc, char **argv) {
   const char *cc_ranges_path = NULL;
   const char *cc_fallback_str = "utf8len";
 
+  /* output format */
+  uint32_t model_version = MMJP_MODEL_VERSION;
+  int trie_cp = 0;
+
+  /* EM parallelism */
+  int threads = 1;
+  int fixed_reduce = 0;
+
+  /* reuse across runs / several configurations per run */
+  const char *sa_cache_path = NULL;
+  const char *sweep_spec = NULL;
+
   for (int i = 1; i < argc; i++) {
     if (arg_eq(argv[i], "--corpus") && i + 1 < argc) {
       corpus_path = argv[++i];
@@ -2523,6 +3982,12 @@ int main(int argc, char **argv) {
       unk_per_cp = atof(argv[++i]);
     } else if (arg_eq(argv[i], "--lambda0") && i + 1 < argc) {
       lambda0 = atof(argv[++i]);
+    } else if (arg_eq(argv[i], "--prune_shrink") && i + 1 < argc) {
+      prune_shrink = atof(argv[++i]);
+      if (!(prune_shrink >= 0.0 && prune_shrink < 1.0)) {
+        fprintf(stderr, "--prune_shrink must be in [0, 1)\n");
+        return 2;
+      }
     } else if (arg_eq(argv[i], "--mdl_lambda0") && i + 1 < argc) {
       mdl_lambda0 = atof(argv[++i]);
     } else if (arg_eq(argv[i], "--mdl_lambda_len") && i + 1 < argc) {
@@ -2541,6 +4006,8 @@ int main(int argc, char **argv) {
       crf_tol = strtod(argv[++i], NULL);
     } else if (arg_eq(argv[i], "--crf_lr") && i + 1 < argc) {
       crf_lr = atof(argv[++i]);
+    } else if (arg_eq(argv[i], "--crf_batch") && i + 1 < argc) {
+      crf_batch = (size_t)strtoull(argv[++i], NULL, 10);
     } else if (arg_eq(argv[i], "--crf_l2") && i + 1 < argc) {
       crf_l2 = atof(argv[++i]);
     } else if (arg_eq(argv[i], "--crf_unsupervised") && i + 1 < argc) {
@@ -2557,6 +4024,32 @@ int main(int argc, char **argv) {
       cc_ranges_path = argv[++i];
     } else if (arg_eq(argv[i], "--cc_fallback") && i + 1 < argc) {
       cc_fallback_str = argv[++i];
+    } else if (arg_eq(argv[i], "--threads") && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+      if (threads < 1) threads = 1;
+    } else if (arg_eq(argv[i], "--fixed_reduce") && i + 1 < argc) {
+      fixed_reduce = atoi(argv[++i]) ? 1 : 0;
+    } else if (arg_eq(argv[i], "--sa_cache") && i + 1 < argc) {
+      sa_cache_path = argv[++i];
+    } else if (arg_eq(argv[i], "--sweep") && i + 1 < argc) {
+      sweep_spec = argv[++i];
+    } else if (arg_eq(argv[i], "--model_version") && i + 1 < argc) {
+      model_version = (uint32_t)strtoul(argv[++i], NULL, 10);
+      if (model_version != MMJP_MODEL_VERSION_V2 && model_version != MMJP_MODEL_VERSION_V3 &&
+          model_version != MMJP_MODEL_VERSION_V4) {
+        fprintf(stderr, "--model_version must be 2, 3 or 4\n");
+        return 2;
+      }
+    } else if (arg_eq(argv[i], "--trie") && i + 1 < argc) {
+      const char *v = argv[++i];
+      if (arg_eq(v, "cp")) {
+        trie_cp = 1;
+      } else if (arg_eq(v, "byte")) {
+        trie_cp = 0;
+      } else {
+        fprintf(stderr, "--trie must be byte or cp\n");
+        return 2;
+      }
     } else if (arg_eq(argv[i], "--help") || arg_eq(argv[i], "-h")) {
       usage(argv[0]);
       return 0;
@@ -2571,6 +4064,18 @@ int main(int argc, char **argv) {
     usage(argv[0]);
     return 2;
   }
+  if (trie_cp && model_version == MMJP_MODEL_VERSION_V2) {
+    fprintf(stderr, "--trie cp requires --model_version 3 or 4\n");
+    return 2;
+  }
+
+  sweep_point_t base_pt = { target_vocab, mdl_lambda0, mdl_lambda_len, lambda0 };
+  sweep_point_t *pts = NULL;
+  size_t n_pts = 0;
+  if (!sweep_parse(sweep_spec, &base_pt, &pts, &n_pts)) {
+    fprintf(stderr, "bad --sweep (expected e.g. \"vocab=4000,8000;mdl_lambda_len=0.1,0.15;lambda0=0.5,1\")\n");
+    return 2;
+  }
 
   printf("[mmjp_train] corpus=%s\n", corpus_path);
   printf("[mmjp_train] target_vocab=%zu max_piece_len_cp=%d iters=%d\n", target_vocab, max_piece_len_cp, iters);
@@ -2580,21 +4085,23 @@ int main(int argc, char **argv) {
   }
 
   /* --- pass 1: count codepoints (for coverage character set) --- */
-  FILE *fc = fopen(corpus_path, "rb");
-  if (!fc) {
+  corpus_map_t cmap;
+  if (!corpus_map_open(corpus_path, &cmap)) {
     fprintf(stderr, "failed to open corpus\n");
     return 1;
   }
+  printf("[mmjp_train] corpus bytes=%zu lines=%zu (%s)\n", cmap.len, cmap.n_lines,
+         cmap.mapped ? "mmap" : "read");
   u32cnt_t cpmap;
   if (!u32cnt_init(&cpmap, 1u << 16)) {
     fprintf(stderr, "oom\n");
-    fclose(fc);
+    corpus_map_close(&cmap);
     return 1;
   }
 
   file_iter_t fit;
   memset(&fit, 0, sizeof(fit));
-  fit.f = fc;
+  fit.cm = &cmap;
   fit.max_line_bytes = max_line_bytes;
   fit.max_sentence_cp = max_sentence_cp;
   fit.skip_long_cp = skip_long_cp;
@@ -2608,7 +4115,7 @@ int main(int argc, char **argv) {
     if (r < 0) {
       fprintf(stderr, "read error\n");
       u32cnt_free(&cpmap);
-      fclose(fc);
+      corpus_map_close(&cmap);
       free(fit.buf);
       free(fit.mapped);
       return 1;
@@ -2633,32 +4140,12 @@ int main(int argc, char **argv) {
 
   printf("[mmjp_train] scanned %zu lines, unique codepoints=%zu\n", n_lines, cpmap.size);
 
-  /* --- build keep_chars set --- */
-  if (target_vocab > 0 && char_vocab >= target_vocab) {
-    /* mandatory single chars が target_vocab を食い尽くさないように */
-    char_vocab = (target_vocab >= 512) ? (target_vocab / 2) : (target_vocab - 1);
-  }
-  if (char_vocab < 256) char_vocab = 256;
-
-  u32set_t keep_chars;
-  if (!u32set_init(&keep_chars, 1u << 14)) {
-    fprintf(stderr, "oom keep_chars\n");
-    u32cnt_free(&cpmap);
-    fclose(fc);
-    free(fit.buf);
-    free(fit.mapped);
-    return 1;
-  }
-  (void)u32set_insert(&keep_chars, fallback_cp);
-  /* ASCII printable は常に保持（ログ/デバッグ/数値などで役立つ） */
-  for (uint32_t cp = 0x20; cp <= 0x7E; cp++) (void)u32set_insert(&keep_chars, cp);
-
-  cpair_t *arr = (cpair_t *)malloc(cpmap.size * sizeof(cpair_t));
+  /* --- codepoints by frequency (keep_chars の元) --- */
+  cpair_t *arr = (cpair_t *)malloc((cpmap.size + 1u) * sizeof(cpair_t));
   if (!arr) {
     fprintf(stderr, "oom arr\n");
-    u32set_free(&keep_chars);
     u32cnt_free(&cpmap);
-    fclose(fc);
+    corpus_map_close(&cmap);
     free(fit.buf);
     free(fit.mapped);
     return 1;
@@ -2674,615 +4161,579 @@ int main(int argc, char **argv) {
     arr_n++;
   }
   qsort(arr, arr_n, sizeof(cpair_t), cmp_cpair_desc);
-
-  size_t added = keep_chars.size;
-  for (size_t i = 0; i < arr_n && added < char_vocab; i++) {
-    if (u32set_contains(&keep_chars, arr[i].cp)) continue;
-    if (u32set_insert(&keep_chars, arr[i].cp)) added++;
-  }
-  free(arr);
   u32cnt_free(&cpmap);
 
-  printf("[mmjp_train] keep_chars=%zu (char_vocab=%zu, fallback=%u)\n", keep_chars.size, char_vocab, fallback_cp);
-
-  /* enable mapping for subsequent passes */
-  fit.keep_chars = &keep_chars;
-  fit.fallback_cp = fallback_cp;
-  fit.stat_skipped_long_bytes = 0;
-  fit.stat_skipped_long_cp = 0;
-
-  /* --- candidate extraction (mapped sample) --- */
-  file_iter_reset(&fit);
-  uint8_t *sample = (uint8_t *)malloc(sample_bytes + 1024u);
-  if (!sample) {
-    fprintf(stderr, "oom sample\n");
-    u32set_free(&keep_chars);
-    fclose(fc);
-    free(fit.buf);
-    free(fit.mapped);
-    return 1;
-  }
-  size_t sample_cap = sample_bytes + 1024u;
-  size_t sample_len = 0;
-  while (sample_len + 1 < sample_bytes) {
-    int r = file_iter_readline(&fit);
-    if (r < 0) {
-      fprintf(stderr, "read error during sample\n");
-      free(sample);
-      u32set_free(&keep_chars);
-      fclose(fc);
-      free(fit.buf);
-      free(fit.mapped);
+  /* 初期モデル（keep_chars・候補・um0）は構成ループで char_vocab が変わるたびに作る */
+  u32set_t keep_chars;
+  memset(&keep_chars, 0, sizeof(keep_chars));
+  cand_t *cands = NULL;
+  size_t cands_n = 0;
+  unilm_model_t um0;
+  memset(&um0, 0, sizeof(um0));
+  size_t um0_char_vocab = 0; /* 0: 未構築 */
+
+  /* --- per configuration: UniLM training, export, CRF, save --- */
+  FILE *sweep_tsv = NULL;
+  if (n_pts > 1) {
+    char *tsv_path = sweep_out_path(out_path, (size_t)-1);
+    sweep_tsv = tsv_path ? fopen(tsv_path, "w") : NULL;
+    if (!sweep_tsv) {
+      fprintf(stderr, "cannot write sweep summary %s\n", tsv_path ? tsv_path : out_path);
+      free(tsv_path);
       return 1;
     }
-    if (r == 0) break;
-    if (fit.len == 0) continue;
-    const uint8_t *src = (fit.mapped_len > 0) ? fit.mapped : fit.buf;
-    size_t slen = (fit.mapped_len > 0) ? fit.mapped_len : fit.len;
-    if (sample_len + slen + 2 > sample_cap) {
-      size_t nc = sample_cap * 2;
-      while (nc < sample_len + slen + 2) nc *= 2;
-      uint8_t *nb = (uint8_t *)realloc(sample, nc);
-      if (!nb) {
-        fprintf(stderr, "oom sample grow\n");
-        free(sample);
-        u32set_free(&keep_chars);
-        fclose(fc);
+    printf("[mmjp_train] sweep: %zu configurations, summary -> %s\n", n_pts, tsv_path);
+    free(tsv_path);
+    fprintf(sweep_tsv, "index\tvocab\tmdl_lambda0\tmdl_lambda_len\tlambda0\tloglik\texport_vocab\tmodel\n");
+  }
+  /* 教師あり CRF は語彙に依存しないので、最初の構成で学習した重みを使い回す */
+  double *sup_w = NULL;
+  double sup_trans[4] = { 0.0, 0.0, 0.0, 0.0 };
+  int sup_done = 0;
+  int all_rc = 0;
+
+  for (size_t pi = 0; pi < n_pts; pi++) {
+    const sweep_point_t *pt = &pts[pi];
+    target_vocab = pt->vocab;
+    mdl_lambda0 = pt->mdl_lambda0;
+    mdl_lambda_len = pt->mdl_lambda_len;
+    lambda0 = pt->lambda0;
+    char *model_path_buf = (n_pts > 1) ? sweep_out_path(out_path, pi) : NULL;
+    const char *model_path = model_path_buf ? model_path_buf : out_path;
+    if (n_pts > 1) {
+      printf("[mmjp_train] sweep %zu/%zu: vocab=%zu mdl_lambda0=%g mdl_lambda_len=%g lambda0=%g\n",
+             pi + 1, n_pts, target_vocab, mdl_lambda0, mdl_lambda_len, lambda0);
+    }
+    double last_loglik = 0.0;
+
+    /* 初期モデル（必須文字 + 候補、辞書順トライ）は char_vocab が同じ構成で共有する */
+    size_t cv = effective_char_vocab(target_vocab, char_vocab);
+    if (cv != um0_char_vocab) {
+      initial_model_free(&keep_chars, cands, cands_n, &um0);
+      cands = NULL;
+      cands_n = 0;
+      um0_char_vocab = 0;
+      if (!build_initial_model(&fit, arr, arr_n, cv, fallback_cp, sample_bytes, max_piece_len_cp, cand_total,
+                               min_count, threads, sa_cache_path, &keep_chars, &cands, &cands_n, &um0)) {
+        free(arr);
+        corpus_map_close(&cmap);
         free(fit.buf);
         free(fit.mapped);
         return 1;
       }
-      sample = nb;
-      sample_cap = nc;
+      um0_char_vocab = cv;
+    }
+    /* 同じ初期モデルを使う最後の構成にはコピーせずに渡す */
+    unilm_model_t um;
+    if (pi + 1 == n_pts || effective_char_vocab(pts[pi + 1].vocab, char_vocab) != cv) {
+      um = um0;
+      memset(&um0, 0, sizeof(um0));
+    } else if (unilm_model_copy(&um, &um0) != UNILM_OK) {
+      fprintf(stderr, "unilm_model_copy failed\n");
+      return 1;
     }
-    memcpy(&sample[sample_len], src, slen);
-    sample_len += slen;
-    sample[sample_len++] = '\n';
-    if (sample_len >= sample_bytes) break;
-  }
-  sample[sample_len] = 0;
-
-  printf("[mmjp_train] candidate sample bytes=%zu (mapped)\n", sample_len);
 
-  cand_t *cands = NULL;
-  size_t cands_n = 0;
-  {
-    uint8_t fb[4];
-    size_t fb_len = utf8_encode1(fallback_cp, fb);
-    if (!collect_top_ngrams(sample, sample_len, max_piece_len_cp, cand_total, min_count, fb, fb_len, &cands, &cands_n)) {
-      fprintf(stderr, "candidate extraction failed\n");
-      free(sample);
-      u32set_free(&keep_chars);
-      fclose(fc);
+    /* --- UniLM training (EM+MDL) --- */
+    unilm_train_config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.num_iters = iters;
+    cfg.max_piece_len_cp = max_piece_len_cp;
+    cfg.smoothing = (unilm_real_t)0.1;
+    cfg.mdl_lambda0 = (unilm_real_t)mdl_lambda0;
+    cfg.mdl_lambda_len = (unilm_real_t)mdl_lambda_len;
+    cfg.target_vocab_size = target_vocab;
+    cfg.prune_each_iter = 1;
+    cfg.min_prob = (unilm_real_t)1e-12;
+    cfg.num_threads = threads;
+    cfg.fixed_reduce = fixed_reduce;
+    cfg.prune_shrink = (unilm_real_t)prune_shrink;
+
+    unilm_workspace_t wk;
+    memset(&wk, 0, sizeof(wk));
+    /* 段階的枝刈りは 1 ラウンド目に非必須ピースの prune_shrink 割合を残すので語彙全体分 */
+    size_t heap_cap = (cfg.target_vocab_size > 0 && !(cfg.prune_shrink > 0)) ? cfg.target_vocab_size : um.vocab_size;
+    if (unilm_workspace_init_dynamic(&wk, max_sentence_cp, um.vocab_size, heap_cap) != UNILM_OK) {
+      fprintf(stderr, "workspace init failed\n");
+      unilm_model_free(&um);
+      corpus_map_close(&cmap);
       free(fit.buf);
-      free(fit.mapped);
       return 1;
     }
-  }
-  printf("[mmjp_train] candidates=%zu\n", cands_n);
 
-  free(sample);
-
-  /* --- init unilm model --- */
-  size_t mandatory_count = keep_chars.size;
-  size_t vocab_cap = mandatory_count + cands_n + 16;
-
-  size_t str_cap = 1024;
-  for (size_t i = 0; i < keep_chars.cap; i++) {
-    if (keep_chars.k[i] == 0) continue;
-    uint8_t tmp[4];
-    str_cap += utf8_encode1(keep_chars.k[i], tmp);
-  }
-  for (size_t i = 0; i < cands_n; i++) str_cap += cands[i].len_bytes;
-  str_cap += 1024;
-
-  size_t da_cap = 256;
-  while (da_cap < str_cap * 2 + 512) da_cap <<= 1;
+    unilm_real_t *counts = (unilm_real_t *)calloc(um.vocab_size, sizeof(unilm_real_t));
+    if (!counts) {
+      fprintf(stderr, "oom counts\n");
+      unilm_workspace_free(&wk);
+      unilm_model_free(&um);
+      corpus_map_close(&cmap);
+      free(fit.buf);
+      return 1;
+    }
 
-  unilm_model_t um;
-  if (unilm_model_init_dynamic(&um, vocab_cap, str_cap, da_cap) != UNILM_OK) {
-    fprintf(stderr, "unilm_model_init_dynamic failed\n");
-    for (size_t i = 0; i < cands_n; i++) cand_free(&cands[i]);
-    free(cands);
-    u32set_free(&keep_chars);
-    fclose(fc);
-    free(fit.buf);
-    free(fit.mapped);
-    return 1;
-  }
+    /* corpus iterator */
+    unilm_corpus_iter_t it;
+    it.next = file_corpus_next;
+    it.reset = file_corpus_reset;
+    it.user = &fit;
+
+    /* initialize logp uniform */
+    {
+      unilm_real_t lp = (unilm_real_t)(-log((double)um.vocab_size));
+      for (size_t i = 0; i < um.vocab_size; i++) um.logp[i] = lp;
+      (void)unilm_model_normalize(&um, cfg.min_prob);
+    }
 
-  /* add mandatory single codepoints */
-  size_t added_single = 0;
-  for (size_t i = 0; i < keep_chars.cap; i++) {
-    uint32_t cp = keep_chars.k[i];
-    if (cp == 0) continue;
-    uint8_t tmp[4];
-    size_t blen = utf8_encode1(cp, tmp);
-    if (unilm_model_add_piece(&um, tmp, blen, UNILM_PIECE_MANDATORY) < 0) {
-      fprintf(stderr, "add piece failed (single)\n");
-      /* continue */
-    } else {
-      added_single++;
+    /* 事前にカバレッジ（NOCOVER）を軽くチェックして、落ちる場合は原因を表示 */
+    if (precheck_lines > 0) {
+      printf("[mmjp_train] precheck coverage (first %zu sentences)\n", precheck_lines);
+      fit.stat_skipped_long_bytes = 0;
+      fit.stat_skipped_long_cp = 0;
+      size_t out_cap = max_sentence_cp + 8u;
+      int prc = mmjp_locate_first_nocover(&um, &fit, &wk, max_piece_len_cp, out_cap, precheck_lines);
+      if (prc != 0) {
+        fprintf(stderr, "precheck failed (NOCOVER or error) rc=%d\n", prc);
+        free(counts);
+        unilm_workspace_free(&wk);
+        unilm_model_free(&um);
+        u32set_free(&keep_chars);
+        corpus_map_close(&cmap);
+        free(fit.buf);
+        free(fit.mapped);
+        return 1;
+      }
+      if (it.reset) it.reset(it.user);
     }
-  }
-  printf("[mmjp_train] mandatory singles added=%zu\n", added_single);
 
-  /* add candidates */
-  size_t added_cand = 0;
-  for (size_t i = 0; i < cands_n; i++) {
-    if (unilm_model_add_piece(&um, (const uint8_t *)cands[i].s, cands[i].len_bytes, 0) < 0) {
-      /* ignore */
-    } else {
-      added_cand++;
+    printf("[mmjp_train] EM+MDL start (vocab=%zu threads=%d%s)\n", um.vocab_size, threads,
+           fixed_reduce ? " fixed_reduce" : "");
+    for (int iter = 0; iter < cfg.num_iters; iter++) {
+      if (it.reset) it.reset(it.user);
+      unilm_em_stats_t st;
+      memset(&st, 0, sizeof(st));
+      fit.stat_skipped_long_bytes = 0;
+      fit.stat_skipped_long_cp = 0;
+      int rc2 = unilm_em_e_step(&um, &it, &cfg, &wk, counts, &st);
+      if (rc2 != UNILM_OK) {
+        fprintf(stderr, "E-step failed rc=%d\n", rc2);
+        if (rc2 == UNILM_ERR_NOCOVER) {
+          size_t out_cap = max_sentence_cp + 8u;
+          (void)mmjp_locate_first_nocover(&um, &fit, &wk, max_piece_len_cp, out_cap, 0);
+        }
+        free(counts);
+        unilm_workspace_free(&wk);
+        unilm_model_free(&um);
+        u32set_free(&keep_chars);
+        corpus_map_close(&cmap);
+        free(fit.buf);
+        free(fit.mapped);
+        return 1;
+      }
+      rc2 = unilm_em_m_step(&um, &cfg, counts);
+      if (rc2 != UNILM_OK) {
+        fprintf(stderr, "M-step failed rc=%d\n", rc2);
+        free(counts);
+        unilm_workspace_free(&wk);
+        unilm_model_free(&um);
+        corpus_map_close(&cmap);
+        free(fit.buf);
+        return 1;
+      }
+      int newV = (cfg.prune_shrink > 0) ? unilm_prune_incremental(&um, &cfg, &wk, counts)
+                                        : unilm_prune_mdl(&um, &cfg, &wk, counts);
+      if (newV < 0) {
+        fprintf(stderr, "prune failed rc=%d\n", newV);
+        free(counts);
+        unilm_workspace_free(&wk);
+        unilm_model_free(&um);
+        corpus_map_close(&cmap);
+        free(fit.buf);
+        return 1;
+      }
+      printf("  iter %d: loglik=%.3f n_sent=%.0f n_tok_exp=%.1f vocab=%d (skipped_bytes=%zu skipped_cp=%zu)\n",
+             iter + 1, (double)st.loglik, (double)st.n_sent, (double)st.n_tokens_exp, newV,
+             fit.stat_skipped_long_bytes, fit.stat_skipped_long_cp);
+      last_loglik = (double)st.loglik;
     }
-  }
-  printf("[mmjp_train] candidates added=%zu (requested=%zu)\n", added_cand, cands_n);
 
-  for (size_t i = 0; i < cands_n; i++) cand_free(&cands[i]);
-  free(cands);
-  /* keep_chars は学習コーパスのマッピングに使うので、ここでは free しない */
+    printf("[mmjp_train] UniLM done. vocab=%zu\n", um.vocab_size);
 
-  /*
-   * 重要:
-   *  - keep_chars はハッシュ順で追加されるため、トライ挿入順がランダムになりがち。
-   *  - 大きい語彙では挿入順による衝突/再配置が増え、まれに NOCOVER の原因になる。
-   *  - ここで一度、語彙を辞書順でトライに積み直して安定化する。
-   */
-  {
-    int rc = unilm_model_rebuild_trie_sorted(&um);
-    if (rc != UNILM_OK) {
-      fprintf(stderr, "unilm_model_rebuild_trie_sorted failed rc=%d\n", rc);
+    /* --- export selection --- */
+    /* keep all multi-char, plus selected singles */
+    uint8_t *keep = (uint8_t *)calloc(um.vocab_size, 1);
+    if (!keep) {
+      fprintf(stderr, "oom keep\n");
+      free(counts);
+      unilm_workspace_free(&wk);
       unilm_model_free(&um);
-      u32set_free(&keep_chars);
-      fclose(fc);
+      corpus_map_close(&cmap);
       free(fit.buf);
-      free(fit.mapped);
       return 1;
     }
-  }
 
-  /* --- UniLM training (EM+MDL) --- */
-  unilm_train_config_t cfg;
-  memset(&cfg, 0, sizeof(cfg));
-  cfg.num_iters = iters;
-  cfg.max_piece_len_cp = max_piece_len_cp;
-  cfg.smoothing = (unilm_real_t)0.1;
-  cfg.mdl_lambda0 = (unilm_real_t)mdl_lambda0;
-  cfg.mdl_lambda_len = (unilm_real_t)mdl_lambda_len;
-  cfg.target_vocab_size = target_vocab;
-  cfg.prune_each_iter = 1;
-  cfg.min_prob = (unilm_real_t)1e-12;
-
-  unilm_workspace_t wk;
-  memset(&wk, 0, sizeof(wk));
-  size_t heap_cap = (cfg.target_vocab_size > 0) ? cfg.target_vocab_size : um.vocab_size;
-  if (unilm_workspace_init_dynamic(&wk, max_sentence_cp, um.vocab_size, heap_cap) != UNILM_OK) {
-    fprintf(stderr, "workspace init failed\n");
-    unilm_model_free(&um);
-    fclose(fc);
-    free(fit.buf);
-    return 1;
-  }
+    /* always keep multi-char */
+    size_t multi_keep = 0;
+    size_t single_total = 0;
+    idscore_t *single = (idscore_t *)malloc(um.vocab_size * sizeof(idscore_t));
+    if (!single) {
+      fprintf(stderr, "oom single\n");
+      free(keep);
+      free(counts);
+      unilm_workspace_free(&wk);
+      unilm_model_free(&um);
+      corpus_map_close(&cmap);
+      free(fit.buf);
+      return 1;
+    }
 
-  unilm_real_t *counts = (unilm_real_t *)calloc(um.vocab_size, sizeof(unilm_real_t));
-  if (!counts) {
-    fprintf(stderr, "oom counts\n");
-    unilm_workspace_free(&wk);
-    unilm_model_free(&um);
-    fclose(fc);
-    free(fit.buf);
-    return 1;
-  }
+    for (uint32_t id = 0; id < (uint32_t)um.vocab_size; id++) {
+      unilm_piece_t *p = &um.pieces[id];
+      if (p->len_cp >= 2) {
+        keep[id] = 1;
+        multi_keep++;
+      } else {
+        /* single */
+        double prob = exp((double)um.logp[id]);
+        single[single_total].id = id;
+        single[single_total].p = prob;
+        single_total++;
+      }
+    }
 
-  /* corpus iterator */
-  unilm_corpus_iter_t it;
-  it.next = file_corpus_next;
-  it.reset = file_corpus_reset;
-  it.user = &fit;
+    qsort(single, single_total, sizeof(idscore_t), cmp_idscore_desc);
+    size_t keep_singles = 0;
+    for (size_t i = 0; i < single_total && keep_singles < keep_single_top; i++) {
+      uint32_t id = single[i].id;
+      keep[id] = 1;
+      keep_singles++;
+    }
 
-  /* initialize logp uniform */
-  {
-    unilm_real_t lp = (unilm_real_t)(-log((double)um.vocab_size));
-    for (size_t i = 0; i < um.vocab_size; i++) um.logp[i] = lp;
-    (void)unilm_model_normalize(&um, cfg.min_prob);
-  }
-
-  /* 事前にカバレッジ（NOCOVER）を軽くチェックして、落ちる場合は原因を表示 */
-  if (precheck_lines > 0) {
-    printf("[mmjp_train] precheck coverage (first %zu sentences)\n", precheck_lines);
-    fit.stat_skipped_long_bytes = 0;
-    fit.stat_skipped_long_cp = 0;
-    size_t out_cap = max_sentence_cp + 8u;
-    int prc = mmjp_locate_first_nocover(&um, &fit, &wk, max_piece_len_cp, out_cap, precheck_lines);
-    if (prc != 0) {
-      fprintf(stderr, "precheck failed (NOCOVER or error) rc=%d\n", prc);
+    free(single);
+    printf("[mmjp_train] export keep: multi=%zu singles_top=%zu -> total_keep=~%zu\n", multi_keep, keep_singles, multi_keep + keep_singles);
+
+    /* build npycrf trie and logp_uni */
+    da_trie_t da;
+    if (da_trie_init_dynamic(&da, 1024) != DA_OK) {
+      fprintf(stderr, "da init failed\n");
+      free(keep);
       free(counts);
       unilm_workspace_free(&wk);
       unilm_model_free(&um);
-      u32set_free(&keep_chars);
-      fclose(fc);
+      corpus_map_close(&cmap);
       free(fit.buf);
-      free(fit.mapped);
       return 1;
     }
-    if (it.reset) it.reset(it.user);
-  }
-
-  printf("[mmjp_train] EM+MDL start (vocab=%zu)\n", um.vocab_size);
-  for (int iter = 0; iter < cfg.num_iters; iter++) {
-    if (it.reset) it.reset(it.user);
-    unilm_em_stats_t st;
-    memset(&st, 0, sizeof(st));
-    fit.stat_skipped_long_bytes = 0;
-    fit.stat_skipped_long_cp = 0;
-    int rc2 = unilm_em_e_step(&um, &it, &cfg, &wk, counts, &st);
-    if (rc2 != UNILM_OK) {
-      fprintf(stderr, "E-step failed rc=%d\n", rc2);
-      if (rc2 == UNILM_ERR_NOCOVER) {
-        size_t out_cap = max_sentence_cp + 8u;
-        (void)mmjp_locate_first_nocover(&um, &fit, &wk, max_piece_len_cp, out_cap, 0);
-      }
+
+    /* map unilm id -> new id */
+    uint16_t *map = (uint16_t *)malloc(um.vocab_size * sizeof(uint16_t));
+    if (!map) {
+      fprintf(stderr, "oom map\n");
+      da_trie_free(&da);
+      free(keep);
       free(counts);
       unilm_workspace_free(&wk);
       unilm_model_free(&um);
-      u32set_free(&keep_chars);
-      fclose(fc);
+      corpus_map_close(&cmap);
       free(fit.buf);
-      free(fit.mapped);
       return 1;
     }
-    rc2 = unilm_em_m_step(&um, &cfg, counts);
-    if (rc2 != UNILM_OK) {
-      fprintf(stderr, "M-step failed rc=%d\n", rc2);
+    for (size_t i = 0; i < um.vocab_size; i++) map[i] = 0xFFFFu;
+
+    size_t export_vocab = 0;
+    for (uint32_t id = 0; id < (uint32_t)um.vocab_size; id++) {
+      if (!keep[id]) continue;
+      map[id] = (uint16_t)export_vocab;
+      export_vocab++;
+    }
+    if (export_vocab > 0xFFFEu) {
+      fprintf(stderr, "export vocab too large\n");
+      free(map);
+      da_trie_free(&da);
+      free(keep);
       free(counts);
       unilm_workspace_free(&wk);
       unilm_model_free(&um);
-      fclose(fc);
+      corpus_map_close(&cmap);
       free(fit.buf);
       return 1;
     }
-    int newV = unilm_prune_mdl(&um, &cfg, &wk, counts);
-    if (newV < 0) {
-      fprintf(stderr, "prune failed rc=%d\n", newV);
+
+    int16_t *logp_uni = (int16_t *)malloc(export_vocab * sizeof(int16_t));
+    if (!logp_uni) {
+      fprintf(stderr, "oom logp_uni\n");
+      free(map);
+      da_trie_free(&da);
+      free(keep);
       free(counts);
       unilm_workspace_free(&wk);
       unilm_model_free(&um);
-      fclose(fc);
+      corpus_map_close(&cmap);
       free(fit.buf);
       return 1;
     }
-    printf("  iter %d: loglik=%.3f n_sent=%.0f n_tok_exp=%.1f vocab=%d (skipped_bytes=%zu skipped_cp=%zu)\n",
-           iter + 1, (double)st.loglik, (double)st.n_sent, (double)st.n_tokens_exp, newV,
-           fit.stat_skipped_long_bytes, fit.stat_skipped_long_cp);
-  }
-
-  printf("[mmjp_train] UniLM done. vocab=%zu\n", um.vocab_size);
 
-  /* --- export selection --- */
-  /* keep all multi-char, plus selected singles */
-  uint8_t *keep = (uint8_t *)calloc(um.vocab_size, 1);
-  if (!keep) {
-    fprintf(stderr, "oom keep\n");
-    free(counts);
-    unilm_workspace_free(&wk);
-    unilm_model_free(&um);
-    fclose(fc);
-    free(fit.buf);
-    return 1;
-  }
-
-  /* always keep multi-char */
-  size_t multi_keep = 0;
-  size_t single_total = 0;
-  idscore_t *single = (idscore_t *)malloc(um.vocab_size * sizeof(idscore_t));
-  if (!single) {
-    fprintf(stderr, "oom single\n");
-    free(keep);
-    free(counts);
-    unilm_workspace_free(&wk);
-    unilm_model_free(&um);
-    fclose(fc);
-    free(fit.buf);
-    return 1;
-  }
-
-  for (uint32_t id = 0; id < (uint32_t)um.vocab_size; id++) {
-    unilm_piece_t *p = &um.pieces[id];
-    if (p->len_cp >= 2) {
-      keep[id] = 1;
-      multi_keep++;
-    } else {
-      /* single */
-      double prob = exp((double)um.logp[id]);
-      single[single_total].id = id;
-      single[single_total].p = prob;
-      single_total++;
+    /* insert pieces into trie */
+    uint16_t *cp_map = NULL;
+    uint32_t cp_npages = 0;
+    if (trie_cp) {
+      da_trie_free(&da);
+      if (cptrie_build(&um, keep, map, &da, &cp_map, &cp_npages) != 0) {
+        fprintf(stderr, "cp trie build failed\n");
+        free(logp_uni);
+        free(map);
+        free(keep);
+        free(counts);
+        unilm_workspace_free(&wk);
+        unilm_model_free(&um);
+        corpus_map_close(&cmap);
+        free(fit.buf);
+        return 1;
+      }
+    }
+    for (uint32_t id = 0; id < (uint32_t)um.vocab_size; id++) {
+      if (!keep[id]) continue;
+      size_t blen = 0;
+      const uint8_t *b = unilm_model_piece_bytes(&um, id, &blen);
+      if (!b || blen == 0) continue;
+      uint16_t nid = map[id];
+      if (!trie_cp) (void)npycrf_da_set_term_value(&da, b, blen, nid);
+      logp_uni[nid] = q88_from_double((double)um.logp[id]);
     }
-  }
-
-  qsort(single, single_total, sizeof(idscore_t), cmp_idscore_desc);
-  size_t keep_singles = 0;
-  for (size_t i = 0; i < single_total && keep_singles < keep_single_top; i++) {
-    uint32_t id = single[i].id;
-    keep[id] = 1;
-    keep_singles++;
-  }
-
-  free(single);
-  printf("[mmjp_train] export keep: multi=%zu singles_top=%zu -> total_keep=~%zu\n", multi_keep, keep_singles, multi_keep + keep_singles);
-
-  /* build npycrf trie and logp_uni */
-  da_trie_t da;
-  if (da_trie_init_dynamic(&da, 1024) != DA_OK) {
-    fprintf(stderr, "da init failed\n");
-    free(keep);
-    free(counts);
-    unilm_workspace_free(&wk);
-    unilm_model_free(&um);
-    fclose(fc);
-    free(fit.buf);
-    return 1;
-  }
-
-  /* map unilm id -> new id */
-  uint16_t *map = (uint16_t *)malloc(um.vocab_size * sizeof(uint16_t));
-  if (!map) {
-    fprintf(stderr, "oom map\n");
-    da_trie_free(&da);
-    free(keep);
-    free(counts);
-    unilm_workspace_free(&wk);
-    unilm_model_free(&um);
-    fclose(fc);
-    free(fit.buf);
-    return 1;
-  }
-  for (size_t i = 0; i < um.vocab_size; i++) map[i] = 0xFFFFu;
-
-  size_t export_vocab = 0;
-  for (uint32_t id = 0; id < (uint32_t)um.vocab_size; id++) {
-    if (!keep[id]) continue;
-    map[id] = (uint16_t)export_vocab;
-    export_vocab++;
-  }
-  if (export_vocab > 0xFFFEu) {
-    fprintf(stderr, "export vocab too large\n");
-    free(map);
-    da_trie_free(&da);
-    free(keep);
-    free(counts);
-    unilm_workspace_free(&wk);
-    unilm_model_free(&um);
-    fclose(fc);
-    free(fit.buf);
-    return 1;
-  }
-
-  int16_t *logp_uni = (int16_t *)malloc(export_vocab * sizeof(int16_t));
-  if (!logp_uni) {
-    fprintf(stderr, "oom logp_uni\n");
-    free(map);
-    da_trie_free(&da);
-    free(keep);
-    free(counts);
-    unilm_workspace_free(&wk);
-    unilm_model_free(&um);
-    fclose(fc);
-    free(fit.buf);
-    return 1;
-  }
-
-  /* insert pieces into trie */
-  for (uint32_t id = 0; id < (uint32_t)um.vocab_size; id++) {
-    if (!keep[id]) continue;
-    size_t blen = 0;
-    const uint8_t *b = unilm_model_piece_bytes(&um, id, &blen);
-    if (!b || blen == 0) continue;
-    uint16_t nid = map[id];
-    (void)npycrf_da_set_term_value(&da, b, blen, nid);
-    logp_uni[nid] = q88_from_double((double)um.logp[id]);
-  }
 
-  /* finalize npycrf model struct */
-  crf_table_t crf;
-  if (!crf_table_build_ja_basic(&crf)) {
-    fprintf(stderr, "crf preset build failed\n");
-    free(logp_uni);
-    free(map);
-    da_trie_free(&da);
-    free(keep);
-    free(counts);
-    unilm_workspace_free(&wk);
-    unilm_model_free(&um);
-    fclose(fc);
-    free(fit.buf);
-    return 1;
-  }
+    /* finalize npycrf model struct */
+    crf_table_t crf;
+    if (!crf_table_build_ja_basic(&crf)) {
+      fprintf(stderr, "crf preset build failed\n");
+      free(logp_uni);
+      free(cp_map);
+      free(map);
+      da_trie_free(&da);
+      free(keep);
+      free(counts);
+      unilm_workspace_free(&wk);
+      unilm_model_free(&um);
+      corpus_map_close(&cmap);
+      free(fit.buf);
+      return 1;
+    }
 
-  /* --- CRF weights (defaults -> optional config -> optional supervised) --- */
-  double trans00 = 0.2;
-  double trans01 = -0.4;
-  double trans10 = 0.0;
-  double trans11 = -0.6;
-  double bos_to1 = 0.5;
-  double *feat_w_d = (double *)malloc((size_t)crf.n * sizeof(double));
-  if (!feat_w_d) {
-    fprintf(stderr, "oom (feat_w_d)\n");
-    crf_table_free(&crf);
-    free(logp_uni);
-    free(map);
-    da_trie_free(&da);
-    free(keep);
-    free(counts);
-    unilm_workspace_free(&wk);
-    unilm_model_free(&um);
-    fclose(fc);
-    free(fit.buf);
-    return 1;
-  }
-  for (uint16_t i = 0; i < crf.n; i++) feat_w_d[i] = q88_to_double(crf.w[i]);
+    /* --- CRF weights (defaults -> optional config -> optional supervised) --- */
+    double trans00 = 0.2;
+    double trans01 = -0.4;
+    double trans10 = 0.0;
+    double trans11 = -0.6;
+    double bos_to1 = 0.5;
+    double *feat_w_d = (double *)malloc((size_t)crf.n * sizeof(double));
+    if (!feat_w_d) {
+      fprintf(stderr, "oom (feat_w_d)\n");
+      crf_table_free(&crf);
+      free(logp_uni);
+      free(cp_map);
+      free(map);
+      da_trie_free(&da);
+      free(keep);
+      free(counts);
+      unilm_workspace_free(&wk);
+      unilm_model_free(&um);
+      corpus_map_close(&cmap);
+      free(fit.buf);
+      return 1;
+    }
+    for (uint16_t i = 0; i < crf.n; i++) feat_w_d[i] = q88_to_double(crf.w[i]);
 
-  if (crf_config_path) {
-    printf("[mmjp_train] CRF config: %s\n", crf_config_path);
-    (void)crf_apply_config_file(crf_config_path, &trans00, &trans01, &trans10, &trans11, &bos_to1, &crf, feat_w_d);
-  }
+    if (crf_config_path) {
+      printf("[mmjp_train] CRF config: %s\n", crf_config_path);
+      (void)crf_apply_config_file(crf_config_path, &trans00, &trans01, &trans10, &trans11, &bos_to1, &crf, feat_w_d);
+    }
 
-  if (crf_supervised_path) {
-    printf("[mmjp_train] CRF supervised: %s\n", crf_supervised_path);
-    crf_dataset_t ds;
-    if (!crf_dataset_load(crf_supervised_path, max_line_bytes, max_sentence_cp, &ds) || ds.n == 0) {
-      fprintf(stderr, "[mmjp_train] CRF supervised: no usable sentences\n");
-    } else {
-      printf("[mmjp_train] CRF supervised: sentences=%zu total_pos=%zu\n", ds.n, ds.total_pos);
-            if (crf_opt && strcmp(crf_opt, "sgd") == 0) {
-        (void)crf_train_supervised(&ds, &crf, feat_w_d, &trans00, &trans01, &trans10, &trans11, crf_epochs, crf_lr, crf_l2);
+    if (crf_supervised_path && sup_done) {
+      if (sup_w) {
+        printf("[mmjp_train] CRF supervised: reusing weights from the first configuration\n");
+        memcpy(feat_w_d, sup_w, (size_t)crf.n * sizeof(double));
+        trans00 = sup_trans[0];
+        trans01 = sup_trans[1];
+        trans10 = sup_trans[2];
+        trans11 = sup_trans[3];
+      }
+    } else if (crf_supervised_path) {
+      printf("[mmjp_train] CRF supervised: %s\n", crf_supervised_path);
+      crf_dataset_t ds;
+      if (!crf_dataset_load(crf_supervised_path, max_line_bytes, max_sentence_cp, &ds) || ds.n == 0) {
+        fprintf(stderr, "[mmjp_train] CRF supervised: no usable sentences\n");
       } else {
-        (void)crf_train_supervised_lbfgs(&ds, &crf, feat_w_d, &trans00, &trans01, &trans10, &trans11, crf_epochs, crf_l2, crf_lbfgs_m, crf_tol);
+        printf("[mmjp_train] CRF supervised: sentences=%zu total_pos=%zu\n", ds.n, ds.total_pos);
+        (void)crf_train_dispatch(&ds, &crf, feat_w_d, &trans00, &trans01, &trans10, &trans11,
+                                 crf_opt, crf_epochs, crf_lr, crf_l2, crf_batch, crf_lbfgs_m, crf_tol, threads);
+        if (n_pts > 1) {
+          sup_w = (double *)malloc((size_t)crf.n * sizeof(double));
+          if (sup_w) memcpy(sup_w, feat_w_d, (size_t)crf.n * sizeof(double));
+          sup_trans[0] = trans00;
+          sup_trans[1] = trans01;
+          sup_trans[2] = trans10;
+          sup_trans[3] = trans11;
+        }
       }
+      crf_dataset_free(&ds);
+      sup_done = (sup_w != NULL);
     }
-    crf_dataset_free(&ds);
-  }
 
-  /* Unsupervised CRF training (pseudo-labels from LM Viterbi) */
-  if (crf_unsupervised) {
-    printf("[mmjp_train] CRF unsupervised: pseudo-label = LM-only (CRF disabled)\n");
-    printf("[mmjp_train] CRF unsupervised: lambda0=%.4f (for final model, not used in pseudo-label generation)\n", lambda0);
-    printf("[mmjp_train] CRF unsupervised: generating pseudo-labels...\n");
-    crf_dataset_t ds;
-    if (!crf_dataset_from_lm_viterbi(corpus_path, max_line_bytes, max_sentence_cp,
-                                     &um, &wk, max_piece_len_cp,
-                                     crf_unsup_sentences, &ds) || ds.n == 0) {
-      fprintf(stderr, "[mmjp_train] CRF unsupervised: no usable sentences\n");
-    } else {
-      printf("[mmjp_train] CRF unsupervised: sentences=%zu total_pos=%zu\n", ds.n, ds.total_pos);
-      if (crf_opt && strcmp(crf_opt, "sgd") == 0) {
-        (void)crf_train_supervised(&ds, &crf, feat_w_d, &trans00, &trans01, &trans10, &trans11, crf_epochs, crf_lr, crf_l2);
+    /* Unsupervised CRF training (pseudo-labels from LM Viterbi) */
+    if (crf_unsupervised) {
+      printf("[mmjp_train] CRF unsupervised: pseudo-label = LM-only (CRF disabled)\n");
+      printf("[mmjp_train] CRF unsupervised: lambda0=%.4f (for final model, not used in pseudo-label generation)\n", lambda0);
+      printf("[mmjp_train] CRF unsupervised: generating pseudo-labels...\n");
+      crf_dataset_t ds;
+      if (!crf_dataset_from_lm_viterbi(&cmap, max_line_bytes, max_sentence_cp,
+                                       &um, &wk, max_piece_len_cp,
+                                       crf_unsup_sentences, threads, &ds) || ds.n == 0) {
+        fprintf(stderr, "[mmjp_train] CRF unsupervised: no usable sentences\n");
       } else {
-        (void)crf_train_supervised_lbfgs(&ds, &crf, feat_w_d, &trans00, &trans01, &trans10, &trans11, crf_epochs, crf_l2, crf_lbfgs_m, crf_tol);
+        printf("[mmjp_train] CRF unsupervised: sentences=%zu total_pos=%zu\n", ds.n, ds.total_pos);
+        (void)crf_train_dispatch(&ds, &crf, feat_w_d, &trans00, &trans01, &trans10, &trans11,
+                                 crf_opt, crf_epochs, crf_lr, crf_l2, crf_batch, crf_lbfgs_m, crf_tol, threads);
       }
+      crf_dataset_free(&ds);
     }
-    crf_dataset_free(&ds);
-  }
-
-  /* quantize back to Q8.8 */
-  for (uint16_t i = 0; i < crf.n; i++) crf.w[i] = q88_from_double(feat_w_d[i]);
-  free(feat_w_d);
-
-  npycrf_model_t nm;
-  memset(&nm, 0, sizeof(nm));
-  nm.max_word_len = (uint16_t)max_piece_len_cp;
-
-  nm.lm.trie.base = da.base;
-  nm.lm.trie.check = da.check;
-  nm.lm.trie.capacity = da.capacity;
-  nm.lm.logp_uni = logp_uni;
-  nm.lm.vocab_size = (uint32_t)export_vocab;
-  nm.lm.bigram_key = NULL;
-  nm.lm.logp_bi = NULL;
-  nm.lm.bigram_size = 0;
-  nm.lm.unk_base = q88_from_double(unk_base);
-  nm.lm.unk_per_cp = q88_from_double(unk_per_cp);
-  nm.lambda0 = q88_from_double(lambda0);
-
-  nm.crf.trans00 = q88_from_double(trans00);
-  nm.crf.trans01 = q88_from_double(trans01);
-  nm.crf.trans10 = q88_from_double(trans10);
-  nm.crf.trans11 = q88_from_double(trans11);
-  nm.crf.bos_to1 = q88_from_double(bos_to1);
-  nm.crf.feat_key = crf.k;
-  nm.crf.feat_w = crf.w;
-  nm.crf.feat_count = crf.n;
-
-  /* Set model flags */
-  if (lossless_ws) {
-    nm.flags |= NPYCRF_FLAG_LOSSLESS_WS;
-  }
-
-  /* cc settings */
-  npycrf_cc_range_t *cc_ranges = NULL;
-  uint32_t cc_range_count = 0;
-  npycrf_cc_mode_t cc_mode = NPYCRF_CC_MODE_COMPAT;
-  npycrf_cc_mode_t cc_fallback = NPYCRF_CC_MODE_UTF8LEN;
-
-  /* parse cc_mode string */
-  if (strcmp(cc_mode_str, "compat") == 0) {
-    cc_mode = NPYCRF_CC_MODE_COMPAT;
-  } else if (strcmp(cc_mode_str, "ascii") == 0) {
-    cc_mode = NPYCRF_CC_MODE_ASCII;
-  } else if (strcmp(cc_mode_str, "utf8len") == 0) {
-    cc_mode = NPYCRF_CC_MODE_UTF8LEN;
-  } else if (strcmp(cc_mode_str, "ranges") == 0) {
-    cc_mode = NPYCRF_CC_MODE_RANGES;
-  } else {
-    fprintf(stderr, "[mmjp_train] unknown cc_mode: %s (expected: compat|ascii|utf8len|ranges)\n", cc_mode_str);
-    return 1;
-  }
 
-  /* parse cc_fallback string */
-  if (strcmp(cc_fallback_str, "ascii") == 0) {
-    cc_fallback = NPYCRF_CC_MODE_ASCII;
-  } else if (strcmp(cc_fallback_str, "utf8len") == 0) {
-    cc_fallback = NPYCRF_CC_MODE_UTF8LEN;
-  } else {
-    fprintf(stderr, "[mmjp_train] unknown cc_fallback: %s (expected: ascii|utf8len)\n", cc_fallback_str);
-    return 1;
-  }
+    /* quantize back to Q8.8 */
+    for (uint16_t i = 0; i < crf.n; i++) crf.w[i] = q88_from_double(feat_w_d[i]);
+    free(feat_w_d);
+
+    npycrf_model_t nm;
+    memset(&nm, 0, sizeof(nm));
+    nm.max_word_len = (uint16_t)max_piece_len_cp;
+
+    nm.lm.trie.base = da.base;
+    nm.lm.trie.check = da.check;
+    nm.lm.trie.capacity = da.capacity;
+    nm.lm.logp_uni = logp_uni;
+    nm.lm.vocab_size = (uint32_t)export_vocab;
+    nm.lm.bigram_key = NULL;
+    nm.lm.logp_bi = NULL;
+    nm.lm.bigram_size = 0;
+    nm.lm.unk_base = q88_from_double(unk_base);
+    nm.lm.unk_per_cp = q88_from_double(unk_per_cp);
+    nm.lambda0 = q88_from_double(lambda0);
+
+    nm.crf.trans00 = q88_from_double(trans00);
+    nm.crf.trans01 = q88_from_double(trans01);
+    nm.crf.trans10 = q88_from_double(trans10);
+    nm.crf.trans11 = q88_from_double(trans11);
+    nm.crf.bos_to1 = q88_from_double(bos_to1);
+    nm.crf.feat_key = crf.k;
+    nm.crf.feat_w = crf.w;
+    nm.crf.feat_count = crf.n;
+
+    /* Set model flags */
+    if (lossless_ws) {
+      nm.flags |= NPYCRF_FLAG_LOSSLESS_WS;
+    }
+    if (cp_map) {
+      nm.flags |= NPYCRF_FLAG_TRIE_CP;
+      nm.lm.cp_page = cp_map;
+      nm.lm.cp_code = cp_map + NPYCRF_CP_PAGES;
+      nm.lm.cp_npages = cp_npages;
+    }
 
-  /* load cc_ranges file if needed */
-  if (cc_mode == NPYCRF_CC_MODE_RANGES) {
-    if (!cc_ranges_path) {
-      fprintf(stderr, "[mmjp_train] --cc_mode ranges requires --cc_ranges FILE\n");
+    /* cc settings */
+    npycrf_cc_range_t *cc_ranges = NULL;
+    uint32_t cc_range_count = 0;
+    npycrf_cc_mode_t cc_mode = NPYCRF_CC_MODE_COMPAT;
+    npycrf_cc_mode_t cc_fallback = NPYCRF_CC_MODE_UTF8LEN;
+
+    /* parse cc_mode string */
+    if (strcmp(cc_mode_str, "compat") == 0) {
+      cc_mode = NPYCRF_CC_MODE_COMPAT;
+    } else if (strcmp(cc_mode_str, "ascii") == 0) {
+      cc_mode = NPYCRF_CC_MODE_ASCII;
+    } else if (strcmp(cc_mode_str, "utf8len") == 0) {
+      cc_mode = NPYCRF_CC_MODE_UTF8LEN;
+    } else if (strcmp(cc_mode_str, "ranges") == 0) {
+      cc_mode = NPYCRF_CC_MODE_RANGES;
+    } else {
+      fprintf(stderr, "[mmjp_train] unknown cc_mode: %s (expected: compat|ascii|utf8len|ranges)\n", cc_mode_str);
       return 1;
     }
-    if (parse_cc_ranges(cc_ranges_path, &cc_ranges, &cc_range_count) != 0) {
+
+    /* parse cc_fallback string */
+    if (strcmp(cc_fallback_str, "ascii") == 0) {
+      cc_fallback = NPYCRF_CC_MODE_ASCII;
+    } else if (strcmp(cc_fallback_str, "utf8len") == 0) {
+      cc_fallback = NPYCRF_CC_MODE_UTF8LEN;
+    } else {
+      fprintf(stderr, "[mmjp_train] unknown cc_fallback: %s (expected: ascii|utf8len)\n", cc_fallback_str);
       return 1;
     }
-  }
 
-  nm.cc.mode = cc_mode;
-  nm.cc.fallback = cc_fallback;
-  nm.cc.ranges = cc_ranges;
-  nm.cc.range_count = cc_range_count;
+    /* load cc_ranges file if needed */
+    if (cc_mode == NPYCRF_CC_MODE_RANGES) {
+      if (!cc_ranges_path) {
+        fprintf(stderr, "[mmjp_train] --cc_mode ranges requires --cc_ranges FILE\n");
+        return 1;
+      }
+      if (parse_cc_ranges(cc_ranges_path, &cc_ranges, &cc_range_count) != 0) {
+        return 1;
+      }
+    }
+
+    nm.cc.mode = cc_mode;
+    nm.cc.fallback = cc_fallback;
+    nm.cc.ranges = cc_ranges;
+    nm.cc.range_count = cc_range_count;
+
+    /* Set cc mode flags */
+    if (cc_mode == NPYCRF_CC_MODE_ASCII) {
+      nm.flags |= NPYCRF_FLAG_CC_ASCII;
+    } else if (cc_mode == NPYCRF_CC_MODE_UTF8LEN) {
+      nm.flags |= NPYCRF_FLAG_CC_UTF8LEN;
+    } else if (cc_mode == NPYCRF_CC_MODE_RANGES) {
+      nm.flags |= NPYCRF_FLAG_CC_RANGES;
+    } else if (cc_mode == NPYCRF_CC_MODE_COMPAT) {
+      nm.flags |= NPYCRF_FLAG_CC_COMPAT;
+    }
 
-  /* Set cc mode flags */
-  if (cc_mode == NPYCRF_CC_MODE_ASCII) {
-    nm.flags |= NPYCRF_FLAG_CC_ASCII;
-  } else if (cc_mode == NPYCRF_CC_MODE_UTF8LEN) {
-    nm.flags |= NPYCRF_FLAG_CC_UTF8LEN;
-  } else if (cc_mode == NPYCRF_CC_MODE_RANGES) {
-    nm.flags |= NPYCRF_FLAG_CC_RANGES;
-  } else if (cc_mode == NPYCRF_CC_MODE_COMPAT) {
-    nm.flags |= NPYCRF_FLAG_CC_COMPAT;
-  }
+    if (cc_mode != NPYCRF_CC_MODE_COMPAT) {
+      printf("[mmjp_train] cc_mode=%s cc_fallback=%s cc_range_count=%u\n",
+             cc_mode_str, cc_fallback_str, cc_range_count);
+    }
 
-  if (cc_mode != NPYCRF_CC_MODE_COMPAT) {
-    printf("[mmjp_train] cc_mode=%s cc_fallback=%s cc_range_count=%u\n",
-           cc_mode_str, cc_fallback_str, cc_range_count);
-  }
+    /* --- save model --- */
+    printf("[mmjp_train] saving model (v%u): vocab=%zu da_cap=%zu feat=%u -> %s\n", model_version, export_vocab, da.capacity, crf.n, model_path);
+    int s_rc = mmjp_model_save_bin_version(model_path, &nm, model_version);
+    if (s_rc != 0) {
+      fprintf(stderr, "save failed rc=%d\n", s_rc);
+      /* continue to free */
+      all_rc = 1;
+    } else {
+      printf("[mmjp_train] done.\n");
+    }
+    if (sweep_tsv) {
+      fprintf(sweep_tsv, "%zu\t%zu\t%g\t%g\t%g\t%.3f\t%zu\t%s\n", pi, pt->vocab, pt->mdl_lambda0,
+              pt->mdl_lambda_len, pt->lambda0, last_loglik, export_vocab, s_rc == 0 ? model_path : "-");
+      fflush(sweep_tsv);
+    }
 
-  /* --- save model --- */
-  printf("[mmjp_train] saving model: vocab=%zu da_cap=%zu feat=%u -> %s\n", export_vocab, da.capacity, crf.n, out_path);
-  int s_rc = mmjp_model_save_bin(out_path, &nm);
-  if (s_rc != 0) {
-    fprintf(stderr, "save failed rc=%d\n", s_rc);
-    /* continue to free */
-  } else {
-    printf("[mmjp_train] done.\n");
+    /* --- cleanup (this configuration) --- */
+    crf_table_free(&crf);
+    free(logp_uni);
+    free(map);
+    da_trie_free(&da);
+    free(keep);
+    free(counts);
+    unilm_workspace_free(&wk);
+    unilm_model_free(&um);
+    free(cc_ranges);
+    free(cp_map);
+    free(model_path_buf);
   }
 
   /* --- cleanup --- */
-  crf_table_free(&crf);
-  free(logp_uni);
-  free(map);
-  da_trie_free(&da);
-  free(keep);
-  free(counts);
-  unilm_workspace_free(&wk);
-  unilm_model_free(&um);
-  fclose(fc);
+  if (sweep_tsv) fclose(sweep_tsv);
+  free(pts);
+  free(sup_w);
+  initial_model_free(&keep_chars, cands, cands_n, &um0);
+  free(arr);
+  corpus_map_close(&cmap);
   free(fit.buf);
   free(fit.mapped);
-  u32set_free(&keep_chars);
-  free(cc_ranges);
-  return (s_rc == 0) ? 0 : 1;
+  return all_rc;
 }
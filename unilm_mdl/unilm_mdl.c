@@ -13,6 +13,15 @@
 #include <stdlib.h>
 #endif
 
+/* スレッドはヒープ確保が前提（シャード毎のワークスペース・カウント） */
+#if defined(UNILM_NO_MALLOC) && !defined(UNILM_NO_THREADS)
+#define UNILM_NO_THREADS
+#endif
+
+#ifndef UNILM_NO_THREADS
+#include <pthread.h>
+#endif
+
 /* ダブル配列トライのルートノードインデックス */
 #define UNILM_DA_ROOT 1
 
@@ -192,6 +201,24 @@ int unilm_model_init_dynamic(unilm_model_t *m,
   return unilm_model_clear(m);
 }
 
+/* src と同じ容量で dst を動的に確保し、語彙・logp・トライを丸ごと複製 */
+int unilm_model_copy(unilm_model_t *dst, const unilm_model_t *src) {
+  if (!dst || !unilm_model_is_init(src)) return UNILM_ERR_BADARG;
+  int rc = unilm_model_init_dynamic(dst, src->vocab_cap, src->strbuf_cap, src->trie.capacity);
+  if (rc != UNILM_OK) return rc;
+
+  memcpy(dst->strbuf, src->strbuf, src->strbuf_len);
+  memcpy(dst->pieces, src->pieces, src->vocab_size * sizeof(unilm_piece_t));
+  memcpy(dst->logp, src->logp, src->vocab_size * sizeof(unilm_real_t));
+  dst->strbuf_len = src->strbuf_len;
+  dst->vocab_size = src->vocab_size;
+
+  memcpy(dst->trie.base, src->trie.base, src->trie.capacity * sizeof(da_index_t));
+  memcpy(dst->trie.check, src->trie.check, src->trie.capacity * sizeof(da_index_t));
+  dst->trie.free_hint = src->trie.free_hint;
+  return UNILM_OK;
+}
+
 #else
 
 int unilm_model_init_dynamic(unilm_model_t *m,
@@ -202,6 +229,11 @@ int unilm_model_init_dynamic(unilm_model_t *m,
   return UNILM_ERR_NOMEM;
 }
 
+int unilm_model_copy(unilm_model_t *dst, const unilm_model_t *src) {
+  (void)dst; (void)src;
+  return UNILM_ERR_NOMEM;
+}
+
 #endif
 
 /* 静的バッファでモデルを初期化 */
@@ -611,6 +643,239 @@ static int unilm_forward_backward_sentence(const unilm_model_t *m,
   return UNILM_OK;
 }
 
+/* ---------------- シャード並列 E ステップ ---------------- */
+
+#ifndef UNILM_NO_MALLOC
+
+/* スレッド数の上限（不正な設定値で大量に確保しないため） */
+#define UNILM_EM_MAX_THREADS 256u
+
+/* 実際に使うスレッド数 */
+static size_t unilm_em_num_threads(const unilm_train_config_t *cfg) {
+#ifdef UNILM_NO_THREADS
+  (void)cfg;
+  return 1u;
+#else
+  if (cfg->num_threads <= 1) return 1u;
+  if ((unsigned)cfg->num_threads > UNILM_EM_MAX_THREADS) return UNILM_EM_MAX_THREADS;
+  return (size_t)cfg->num_threads;
+#endif
+}
+
+/* 1 シャード（バッファ上の連続した文 [b, e)）の担当分 */
+typedef struct {
+  const unilm_model_t *m;
+  int max_piece_len_cp;
+  unilm_workspace_t *wk;
+  unilm_real_t *counts;
+  const uint8_t *arena;
+  const size_t *sent_off;  /* 文 i は arena[sent_off[i] .. sent_off[i+1]) */
+  size_t b, e;
+  unilm_real_t sum_logZ;
+  unilm_real_t sum_tok;
+  size_t n_sent;
+  int rc;
+} unilm_em_shard_t;
+
+static void unilm_em_run_shard(unilm_em_shard_t *sh) {
+  for (size_t i = sh->b; i < sh->e; i++) {
+    unilm_real_t logZ = 0;
+    unilm_real_t tok = 0;
+    const uint8_t *s = sh->arena + sh->sent_off[i];
+    size_t sl = sh->sent_off[i + 1u] - sh->sent_off[i];
+    int rc = unilm_forward_backward_sentence(sh->m, s, sl, sh->max_piece_len_cp, sh->wk, sh->counts, &logZ, &tok);
+    if (rc != UNILM_OK) {
+      sh->rc = rc;
+      return;
+    }
+    sh->sum_logZ += logZ;
+    sh->sum_tok += tok;
+    sh->n_sent++;
+  }
+}
+
+#ifndef UNILM_NO_THREADS
+static void *unilm_em_shard_thread(void *arg) {
+  unilm_em_run_shard((unilm_em_shard_t *)arg);
+  return NULL;
+}
+#endif
+
+/* シャード 0 は呼び出しスレッドで、残りはワーカースレッドで処理 */
+static void unilm_em_run_round(unilm_em_shard_t *sh, size_t nsh) {
+#ifndef UNILM_NO_THREADS
+  pthread_t tid[UNILM_EM_MAX_THREADS];
+  uint8_t started[UNILM_EM_MAX_THREADS];
+  for (size_t t = 1; t < nsh; t++) {
+    started[t] = (uint8_t)(pthread_create(&tid[t], NULL, unilm_em_shard_thread, &sh[t]) == 0);
+  }
+  unilm_em_run_shard(&sh[0]);
+  for (size_t t = 1; t < nsh; t++) {
+    if (started[t]) pthread_join(tid[t], NULL);
+    else unilm_em_run_shard(&sh[t]); /* 生成失敗: 結果は同じなのでその場で処理 */
+  }
+#else
+  for (size_t t = 0; t < nsh; t++) unilm_em_run_shard(&sh[t]);
+#endif
+}
+
+/*
+ * イテレータから最大 T*UNILM_EM_SHARD_SENT 文をバッファへコピーし、T シャードで処理する。
+ *  - fixed_reduce=0: 各スレッドはバイト数でほぼ均等な連続区間を担当し、
+ *                    自分のカウントに全ラウンド分を累積。最後にスレッド順に加算。
+ *  - fixed_reduce=1: シャード境界は文番号 k*UNILM_EM_SHARD_SENT に固定。
+ *                    ラウンド毎にシャードのカウントをシャード順に加算する。
+ */
+static int unilm_em_e_step_sharded(const unilm_model_t *m,
+                                   const unilm_corpus_iter_t *it,
+                                   const unilm_train_config_t *cfg,
+                                   unilm_workspace_t *wk,
+                                   unilm_real_t *counts,
+                                   unilm_em_stats_t *out_stats) {
+  const size_t V = m->vocab_size;
+  const size_t T = unilm_em_num_threads(cfg);
+  const size_t K = (UNILM_EM_SHARD_SENT > 0u) ? (size_t)UNILM_EM_SHARD_SENT : 1u;
+  const int fixed = (cfg->fixed_reduce != 0);
+  const size_t round_cap = T * K;
+  size_t max_cp = (wk->cp_off_cap < wk->dp_cap) ? wk->cp_off_cap : wk->dp_cap;
+  max_cp = (max_cp > 1u) ? max_cp - 1u : 1u;
+
+  int rc = UNILM_OK;
+  unilm_em_shard_t *sh = (unilm_em_shard_t *)calloc(T, sizeof(*sh));
+  unilm_workspace_t *twk = (unilm_workspace_t *)calloc(T, sizeof(*twk));
+  unilm_real_t **tcounts = (unilm_real_t **)calloc(T, sizeof(*tcounts));
+  size_t *sent_off = (size_t *)malloc((round_cap + 1u) * sizeof(size_t));
+  uint8_t *arena = NULL;
+  size_t arena_cap = 0;
+  if (!sh || !twk || !tcounts || !sent_off) { rc = UNILM_ERR_NOMEM; goto done; }
+
+  for (size_t t = 0; t < T; t++) {
+    if (t == 0 && !fixed) {
+      tcounts[t] = counts;
+    } else {
+      tcounts[t] = (unilm_real_t *)calloc(V, sizeof(unilm_real_t));
+      if (!tcounts[t]) { rc = UNILM_ERR_NOMEM; goto done; }
+    }
+    if (t > 0) {
+      rc = unilm_workspace_init_dynamic(&twk[t], max_cp, 1u, 0u);
+      if (rc != UNILM_OK) goto done;
+    }
+    sh[t].m = m;
+    sh[t].max_piece_len_cp = cfg->max_piece_len_cp;
+    sh[t].wk = (t == 0) ? wk : &twk[t];
+    sh[t].counts = tcounts[t];
+    sh[t].sent_off = sent_off;
+  }
+
+  unilm_real_t sum_logZ = 0;
+  unilm_real_t sum_tok = 0;
+  size_t n_sent = 0;
+
+  for (int eof = 0; !eof;) {
+    /* 1 ラウンド分の文をコピー（イテレータのバッファは次の next() で上書きされ得る） */
+    size_t n = 0;
+    sent_off[0] = 0;
+    while (n < round_cap) {
+      const uint8_t *s = NULL;
+      size_t sl = 0;
+      int r = it->next(it->user, &s, &sl);
+      if (r == 0) { eof = 1; break; }
+      if (r < 0) { rc = UNILM_ERR_IO; goto done; }
+      if (!s || sl == 0) continue;
+      size_t used = sent_off[n];
+      if (used + sl > arena_cap) {
+        size_t nc = arena_cap ? arena_cap : 65536u;
+        while (nc < used + sl) nc *= 2u;
+        uint8_t *na = (uint8_t *)realloc(arena, nc);
+        if (!na) { rc = UNILM_ERR_NOMEM; goto done; }
+        arena = na;
+        arena_cap = nc;
+      }
+      memcpy(arena + used, s, sl);
+      sent_off[++n] = used + sl;
+    }
+    if (n == 0) break;
+
+    size_t nsh = 0;
+    if (fixed) {
+      nsh = (n + K - 1u) / K;
+      for (size_t t = 0; t < nsh; t++) {
+        sh[t].b = t * K;
+        sh[t].e = (t * K + K < n) ? t * K + K : n;
+        sh[t].sum_logZ = 0;
+        sh[t].sum_tok = 0;
+        sh[t].n_sent = 0;
+        for (size_t v = 0; v < V; v++) tcounts[t][v] = (unilm_real_t)0;
+      }
+    } else {
+      /* バイト数で按分（文長のばらつきに対する負荷分散） */
+      size_t total = sent_off[n];
+      size_t e = 0;
+      nsh = T;
+      for (size_t t = 0; t < T; t++) {
+        size_t target = (size_t)(((double)total * (double)(t + 1u)) / (double)T);
+        size_t b = e;
+        if (t + 1u == T) e = n;
+        else while (e < n && sent_off[e + 1u] <= target) e++;
+        sh[t].b = b;
+        sh[t].e = e;
+      }
+    }
+    for (size_t t = 0; t < nsh; t++) sh[t].arena = arena;
+
+    unilm_em_run_round(sh, nsh);
+    for (size_t t = 0; t < nsh; t++) {
+      if (sh[t].rc != UNILM_OK) { rc = sh[t].rc; goto done; }
+    }
+
+    if (fixed) {
+      for (size_t t = 0; t < nsh; t++) {
+        const unilm_real_t *c = tcounts[t];
+        for (size_t v = 0; v < V; v++) counts[v] += c[v];
+        sum_logZ += sh[t].sum_logZ;
+        sum_tok += sh[t].sum_tok;
+        n_sent += sh[t].n_sent;
+      }
+    }
+  }
+
+  if (!fixed) {
+    for (size_t t = 0; t < T; t++) {
+      if (t > 0) {
+        const unilm_real_t *c = tcounts[t];
+        for (size_t v = 0; v < V; v++) counts[v] += c[v];
+      }
+      sum_logZ += sh[t].sum_logZ;
+      sum_tok += sh[t].sum_tok;
+      n_sent += sh[t].n_sent;
+    }
+  }
+
+  if (out_stats) {
+    out_stats->loglik = sum_logZ;
+    out_stats->n_sent = (unilm_real_t)n_sent;
+    out_stats->n_tokens_exp = sum_tok;
+  }
+
+done:
+  if (tcounts) {
+    for (size_t t = 0; t < T; t++) {
+      if (tcounts[t] != counts) free(tcounts[t]);
+    }
+  }
+  if (twk) {
+    for (size_t t = 1; t < T; t++) unilm_workspace_free(&twk[t]);
+  }
+  free(tcounts);
+  free(twk);
+  free(sh);
+  free(sent_off);
+  free(arena);
+  return rc;
+}
+
+#endif /* UNILM_NO_MALLOC */
+
 /* E ステップ */
 int unilm_em_e_step(const unilm_model_t *m,
                     const unilm_corpus_iter_t *it,
@@ -627,6 +892,12 @@ int unilm_em_e_step(const unilm_model_t *m,
 
   if (it->reset) it->reset(it->user);
 
+#ifndef UNILM_NO_MALLOC
+  if (unilm_em_num_threads(cfg) > 1u || cfg->fixed_reduce) {
+    return unilm_em_e_step_sharded(m, it, cfg, wk, counts, out_stats);
+  }
+#endif
+
   unilm_real_t sum_logZ = 0;
   unilm_real_t sum_tok = 0;
   size_t n_sent = 0;
@@ -746,6 +1017,43 @@ static void heap_sift_down(uint32_t *idx, unilm_real_t *score, size_t n, size_t
   }
 }
 
+/*
+ * keep[i] != 0 のピースだけを残して語彙をインプレースで詰め、新しい ID でトライを再構築する。
+ * counts が非 NULL なら同じように詰める。sorted が非ゼロならトライは辞書順に挿入する
+ * （残すピースが多いと ID 順の挿入は再配置が増えて遅い）。新しい語彙サイズまたは < 0 を返す。
+ */
+static int unilm_prune_compact(unilm_model_t *m, const uint8_t *keep, unilm_real_t *counts,
+                               int sorted) {
+  /* 文字列はプールに残り、オフセットは有効なまま */
+  size_t V = m->vocab_size;
+  size_t newV = 0;
+  for (uint32_t i = 0; i < (uint32_t)V; i++) {
+    if (keep[i]) {
+      if (newV != i) {
+        m->pieces[newV] = m->pieces[i];
+        m->logp[newV] = m->logp[i];
+        if (counts) counts[newV] = counts[i];
+      }
+      newV++;
+    }
+  }
+  m->vocab_size = newV;
+
+  if (sorted) {
+    int rc = unilm_model_rebuild_trie_sorted(m);
+    return (rc != UNILM_OK) ? rc : (int)newV;
+  }
+  if (da_trie_clear(&m->trie) != DA_OK) return UNILM_ERR_INTERNAL;
+  for (uint32_t id = 0; id < (uint32_t)newV; id++) {
+    size_t blen = 0;
+    const uint8_t *b = unilm_model_piece_bytes(m, id, &blen);
+    if (!b || blen == 0) return UNILM_ERR_INTERNAL;
+    if (da_trie_add_bytes(&m->trie, b, blen) != DA_OK) return UNILM_ERR_FULL;
+    if (unilm_da_set_term_id(&m->trie, b, blen, id) != UNILM_OK) return UNILM_ERR_INTERNAL;
+  }
+  return (int)newV;
+}
+
 /* MDL 枝刈り */
 int unilm_prune_mdl(unilm_model_t *m,
                     const unilm_train_config_t *cfg,
@@ -835,32 +1143,169 @@ int unilm_prune_mdl(unilm_model_t *m,
     }
   }
 
-  /* 語彙をインプレースで圧縮（文字列はプールに残り、オフセットは有効なまま） */
-  size_t newV = 0;
-  for (uint32_t i = 0; i < (uint32_t)V; i++) {
-    if (wk->keep[i]) {
-      if (newV != i) {
-        m->pieces[newV] = m->pieces[i];
-        m->logp[newV] = m->logp[i];
+  int newV = unilm_prune_compact(m, wk->keep, NULL, 0);
+  if (newV < 0) return newV;
+  /* 確率の合計が 1 になることを保証（重複が移動した可能性あり） */
+  (void)unilm_model_normalize(m, cfg->min_prob);
+  return newV;
+}
+
+/*
+ * ピース id の文字列を、id 自身と allow[j] == 0 のピース（allow が NULL なら id のみ）を
+ * 使わずにビタビ分割したコスト sum(-log p)。分割できなければ INFINITY。
+ * 成功時は wk->bp_prev / wk->bp_piece に経路が残り、*out_M にコードポイント数を返す。
+ */
+static unilm_real_t unilm_piece_alt_cost(const unilm_model_t *m, uint32_t id,
+                                         const uint8_t *allow, int max_piece_len_cp,
+                                         unilm_workspace_t *wk, size_t *out_M) {
+  size_t len = 0;
+  const uint8_t *s = unilm_model_piece_bytes(m, id, &len);
+  if (!s || len == 0) return (unilm_real_t)INFINITY;
+
+  size_t M = 0;
+  if (unilm_build_cp_offsets(s, len, wk->cp_off, wk->cp_off_cap, &M) != UNILM_OK) {
+    return (unilm_real_t)INFINITY;
+  }
+  if (M + 1u > wk->dp_cap || M + 1u > wk->bp_cap) return (unilm_real_t)INFINITY;
+
+  for (size_t i = 0; i <= M; i++) wk->alpha[i] = (unilm_real_t)INFINITY;
+  wk->alpha[0] = (unilm_real_t)0;
+
+  for (size_t i = 0; i < M; i++) {
+    unilm_real_t ai = wk->alpha[i];
+    if (!isfinite((double)ai)) continue;
+
+    UNILM_FOR_EACH_MATCH(m, s, wk->cp_off, M, i, max_piece_len_cp, {
+      if (__pid != id && (!allow || allow[__pid])) {
+        unilm_real_t cand = ai - m->logp[__pid];
+        if (cand < wk->alpha[__end_pos]) {
+          wk->alpha[__end_pos] = cand;
+          wk->bp_prev[__end_pos] = (int32_t)i;
+          wk->bp_piece[__end_pos] = (int32_t)__pid;
+        }
       }
-      newV++;
+    });
+  }
+
+  if (out_M) *out_M = M;
+  return wk->alpha[M];
+}
+
+/* 枝刈り: 1 ラウンド分 */
+static int unilm_prune_round(unilm_model_t *m,
+                             const unilm_train_config_t *cfg,
+                             unilm_workspace_t *wk,
+                             unilm_real_t *counts) {
+  size_t V = m->vocab_size;
+  memset(wk->keep, 0, V);
+
+  size_t mandatory = 0;
+  for (uint32_t i = 0; i < (uint32_t)V; i++) {
+    if (unilm_piece_is_mandatory(m, i)) {
+      wk->keep[i] = 1;
+      mandatory++;
     }
   }
+  size_t n = V - mandatory;
+  if (n == 0) return 0;
 
-  /* 新しい ID でトライを再構築 */
-  if (da_trie_clear(&m->trie) != DA_OK) return UNILM_ERR_INTERNAL;
-  for (uint32_t id = 0; id < (uint32_t)newV; id++) {
-    size_t blen = 0;
-    const uint8_t *b = unilm_model_piece_bytes(m, id, &blen);
-    if (!b || blen == 0) return UNILM_ERR_INTERNAL;
-    if (da_trie_add_bytes(&m->trie, b, blen) != DA_OK) return UNILM_ERR_FULL;
-    if (unilm_da_set_term_id(&m->trie, b, blen, id) != UNILM_OK) return UNILM_ERR_INTERNAL;
+  int want_size_limit = (cfg->target_vocab_size > 0);
+  size_t K = 0;
+  if (want_size_limit) {
+    K = (cfg->target_vocab_size > mandatory) ? cfg->target_vocab_size - mandatory : 0;
+    if (n <= K) return 0;
   }
 
-  m->vocab_size = newV;
-  /* 確率の合計が 1 になることを保証（重複が移動した可能性あり） */
-  (void)unilm_model_normalize(m, cfg->min_prob);
-  return (int)newV;
+  size_t nkeep = (size_t)ceil((double)cfg->prune_shrink * (double)n);
+  if (nkeep < K) nkeep = K;
+  if (nkeep >= n) nkeep = n - 1u;
+  if (nkeep > wk->heap_cap) return UNILM_ERR_RANGE;
+
+  unilm_real_t lambda0 = cfg->mdl_lambda0;
+  unilm_real_t lambdalen = cfg->mdl_lambda_len;
+  size_t heap_n = 0;
+
+  for (uint32_t i = 0; i < (uint32_t)V; i++) {
+    if (wk->keep[i]) continue;
+
+    unilm_real_t c = counts[i];
+    if (!(c > 0)) c = (unilm_real_t)0;
+    unilm_real_t alt = unilm_piece_alt_cost(m, i, NULL, cfg->max_piece_len_cp, wk, NULL);
+    unilm_real_t self = -(m->logp[i]);
+    if (!isfinite((double)alt) || !isfinite((double)self)) {
+      /* 代わりの分割がなければ落とせない */
+      wk->keep[i] = 1;
+      continue;
+    }
+
+    const unilm_piece_t *p = &m->pieces[i];
+    unilm_real_t score = (alt - self) * c - (lambda0 + lambdalen * (unilm_real_t)p->len_cp);
+
+    /* 上位 nkeep をヒープで選ぶ。サイズ制限なしなら、あふれても score > 0 は残す */
+    uint32_t out = i;
+    unilm_real_t out_score = score;
+    if (heap_n < nkeep) {
+      wk->heap_idx[heap_n] = i;
+      wk->heap_score[heap_n] = score;
+      heap_sift_up(wk->heap_idx, wk->heap_score, heap_n);
+      heap_n++;
+      continue;
+    }
+    if (nkeep > 0 && score > wk->heap_score[0]) {
+      out = wk->heap_idx[0];
+      out_score = wk->heap_score[0];
+      wk->heap_idx[0] = i;
+      wk->heap_score[0] = score;
+      heap_sift_down(wk->heap_idx, wk->heap_score, heap_n, 0);
+    }
+    if (!want_size_limit && out_score > 0) wk->keep[out] = 1;
+  }
+  for (size_t j = 0; j < heap_n; j++) wk->keep[wk->heap_idx[j]] = 1;
+
+  /* 落としたピースの期待カウントを、残る語彙での最良分割へ移す */
+  size_t removed = 0;
+  for (uint32_t i = 0; i < (uint32_t)V; i++) {
+    if (wk->keep[i]) continue;
+    removed++;
+    unilm_real_t c = counts[i];
+    if (!(c > 0)) continue;
+    size_t M = 0;
+    unilm_real_t alt = unilm_piece_alt_cost(m, i, wk->keep, cfg->max_piece_len_cp, wk, &M);
+    if (!isfinite((double)alt)) continue;
+    for (size_t pos = M; pos > 0; pos = (size_t)wk->bp_prev[pos]) {
+      counts[wk->bp_piece[pos]] += c;
+    }
+  }
+  if (removed == 0) return 0;
+
+  int newV = unilm_prune_compact(m, wk->keep, counts, 1);
+  if (newV < 0) return newV;
+  int rc = unilm_em_m_step(m, cfg, counts);
+  if (rc != UNILM_OK) return rc;
+  return (int)removed;
+}
+
+/* 段階的枝刈り */
+int unilm_prune_incremental(unilm_model_t *m,
+                            const unilm_train_config_t *cfg,
+                            unilm_workspace_t *wk,
+                            unilm_real_t *counts) {
+  if (!m || !cfg || !wk || !counts) return UNILM_ERR_BADARG;
+  if (m->vocab_size == 0) return UNILM_ERR_BADARG;
+  if (!(cfg->prune_shrink > 0 && cfg->prune_shrink < 1)) return UNILM_ERR_BADARG;
+  if (!wk->keep || wk->keep_cap < m->vocab_size) return UNILM_ERR_RANGE;
+
+  /* 枝刈りが要求されていなければそのまま保持 */
+  if (cfg->target_vocab_size == 0 && !(cfg->mdl_lambda0 > 0 || cfg->mdl_lambda_len > 0)) {
+    return (int)m->vocab_size;
+  }
+
+  for (int round = 0; round < UNILM_PRUNE_MAX_ROUNDS; round++) {
+    int rc = unilm_prune_round(m, cfg, wk, counts);
+    if (rc < 0) return rc;
+    if (rc == 0) break;
+  }
+  return (int)m->vocab_size;
 }
 
 /* ---------------- 完全学習ループ ---------------- */
@@ -897,7 +1342,8 @@ int unilm_train_em_mdl(unilm_model_t *m,
     if (rc != UNILM_OK) return rc;
 
     if (cfg->prune_each_iter) {
-      rc = unilm_prune_mdl(m, cfg, wk, counts);
+      rc = (cfg->prune_shrink > 0) ? unilm_prune_incremental(m, cfg, wk, counts)
+                                   : unilm_prune_mdl(m, cfg, wk, counts);
       if (rc < 0) return rc;
     }
   }
@@ -132,6 +132,12 @@ int unilm_model_init_static(unilm_model_t *m,
 /* 内部バッファを解放（動的モードのみ） */
 void unilm_model_free(unilm_model_t *m);
 
+/*
+ * モデルを複製。dst は src と同じ容量で動的に確保される（src は静的でもよい）。
+ * 同じ初期語彙から設定違いの学習を何度も行う場合に、ピース追加とトライ構築を省ける。
+ */
+int unilm_model_copy(unilm_model_t *dst, const unilm_model_t *src);
+
 /* モデルをクリア（バッファは保持） */
 int unilm_model_clear(unilm_model_t *m);
 
@@ -205,6 +211,16 @@ void unilm_workspace_free(unilm_workspace_t *wk);
 
 /* ---------------- 学習 ---------------- */
 
+/* 並列 E ステップのシャードあたり文数（集計順固定時のシャード境界にもなる） */
+#ifndef UNILM_EM_SHARD_SENT
+#define UNILM_EM_SHARD_SENT 1024u
+#endif
+
+/* unilm_prune_incremental() の 1 回の呼び出しで行う縮小ラウンド数の上限 */
+#ifndef UNILM_PRUNE_MAX_ROUNDS
+#define UNILM_PRUNE_MAX_ROUNDS 64
+#endif
+
 /* 学習設定 */
 typedef struct {
   int num_iters;             /* EM 反復回数 */
@@ -223,6 +239,29 @@ typedef struct {
 
   /* log(0) を避けるための数値フロア（例: 1e-12） */
   unilm_real_t min_prob;
+
+  /*
+   * E ステップの並列数（0/1 = 従来どおり呼び出しスレッドのみ）。
+   * > 1 の場合、コーパスを UNILM_EM_SHARD_SENT 文ずつのシャードに分けて
+   * スレッド毎のワークスペース・カウントで処理し、最後に集計する。
+   * UNILM_NO_THREADS / UNILM_NO_MALLOC ビルドでは無視される。
+   */
+  int num_threads;
+
+  /*
+   * 非ゼロ: 集計順を固定する。シャード境界を文番号で固定し、シャード順に
+   * 加算するため、結果はスレッド数に依存しない（num_threads=1 でも同一）。
+   * 0: スレッド毎に連続区間を担当し、最後にスレッド順に加算する
+   *    （同じスレッド数なら再現するが、スレッド数が変わると丸め誤差が変わる）。
+   */
+  int fixed_reduce;
+
+  /*
+   * 0 < prune_shrink < 1 の場合、枝刈りは unilm_prune_incremental() で行う
+   * （1 ラウンドで非必須ピースの prune_shrink 割合を残す。例: 0.75）。
+   * 0 の場合は unilm_prune_mdl() で一度に枝刈りする（従来どおり）。
+   */
+  unilm_real_t prune_shrink;
 } unilm_train_config_t;
 
 /* EM 統計 */
@@ -232,7 +271,12 @@ typedef struct {
   unilm_real_t n_tokens_exp;  /* 期待トークン数 */
 } unilm_em_stats_t;
 
-/* E ステップ: 期待カウント + 対数尤度。counts サイズ >= model->vocab_size（内部でクリア） */
+/*
+ * E ステップ: 期待カウント + 対数尤度。counts サイズ >= model->vocab_size（内部でクリア）
+ * cfg->num_threads > 1 または cfg->fixed_reduce の場合は文をバッファにコピーして
+ * シャード単位で処理する（イテレータが返すポインタは次の next() まで有効であればよい）。
+ * wk はスレッド 0 が使用し、他スレッド分は wk と同じ容量で内部確保する。
+ */
 int unilm_em_e_step(const unilm_model_t *m,
                     const unilm_corpus_iter_t *it,
                     const unilm_train_config_t *cfg,
@@ -251,6 +295,31 @@ int unilm_prune_mdl(unilm_model_t *m,
                     unilm_workspace_t *wk,
                     const unilm_real_t *counts);
 
+/*
+ * 段階的枝刈り（SentencePiece 方式の削除損失）
+ *
+ * 非必須ピースごとに、そのピースを使わない最良分割（自身以外の語彙でのビタビ分割）
+ * との差から削除時の尤度損失を見積もる:
+ *   score = counts[i] * (alt_cost - (-logp[i])) - (lambda0 + lambda_len * len_cp)
+ * スコアの低いものから落とし、1 ラウンドでは非必須ピースの cfg->prune_shrink 割合
+ * （target_vocab_size 未満にはしない）を残す。target_vocab_size = 0 の場合は
+ * score <= 0 のピースを同じ割合の範囲で落とす。
+ *
+ * ラウンドの間はコーパスを読み直さない: 落としたピースの期待カウントを、
+ * 残った語彙での最良分割の各ピースへ移し、そのカウントで M ステップを行う。
+ * トライの再構築はラウンドごとに 1 回。目標に達するか、落とすものがなくなるか、
+ * UNILM_PRUNE_MAX_ROUNDS ラウンドで終わる。
+ *
+ * counts は新しい ID に詰めて更新される（呼び出し後は counts[0..戻り値) が有効）。
+ * wk->heap_cap は非必須ピース数の prune_shrink 倍以上が必要。
+ *
+ * @return 新しい語彙サイズ（>= 0）または < 0 のエラー
+ */
+int unilm_prune_incremental(unilm_model_t *m,
+                            const unilm_train_config_t *cfg,
+                            unilm_workspace_t *wk,
+                            unilm_real_t *counts);
+
 /* 完全ループ (E+M+オプション枝刈り) */
 int unilm_train_em_mdl(unilm_model_t *m,
                        const unilm_corpus_iter_t *it,